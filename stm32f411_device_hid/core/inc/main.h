@@ -13,6 +13,9 @@
 #include "clock.h"
 #include "isr.h"
 #include "usb.h"
+#include "usb_hid.h"
+#include "usb_kbd.h"
+#include "usb_vendor_bench.h"
 
 
 int main(void);
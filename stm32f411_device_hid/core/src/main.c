@@ -21,12 +21,21 @@ main(void)
     initialise_monitor_handles();
     clock_init();
     usb_driver_t usb_driver = {0};
-    usb_init_t usb_init_data = { .vbus_sensing = true };
+    usb_init_t usb_init_data = { .vbus_sensing = true,
+                                 .deferred_processing = true };
+    usb_kbd_init();
     usb_init(&usb_driver, &usb_init_data);
+#ifdef USB_VENDOR_BENCH
+    usb_vendor_bench_init(&usb_driver);
+#endif
     
     for(;;)
     {
-
+        usb_poll();
+        usb_kbd_task();
+#ifdef USB_VENDOR_BENCH
+        usb_vendor_bench_task();
+#endif
     }
 
     return 0;
@@ -57,6 +57,8 @@
 #include <sys/time.h>
 #include <sys/times.h>
 
+#include "usb_cdc.h"
+
 /* Variables */
 //#undef errno
 extern int errno;
@@ -104,16 +106,19 @@ __attribute__((weak)) int _read(int file, char *ptr, int len)
 return len;
 }
 
+/* stdout and stderr go to the CDC console. What does not fit in its ring is
+ * dropped and counted there, reporting it as written keeps newlib from
+ * flagging the stream as failed. */
 __attribute__((weak)) int _write(int file, char *ptr, int len)
 {
-    int DataIdx;
-
-    for (DataIdx = 0; DataIdx < len; DataIdx++)
+    if ((file == 1) || (file == 2))
     {
-        __io_putchar(*ptr++);
-        //ITM_SendChar(*ptr++);
+        (void)usb_cdc_write((const uint8_t *)ptr, (uint32_t)len);
+        return len;
     }
-    return len;
+
+    errno = EBADF;
+    return -1;
 }
 
 int _close(int file)
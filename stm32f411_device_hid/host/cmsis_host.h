@@ -0,0 +1,160 @@
+/** @file cmsis_host.h
+ *
+ * @brief Host stand-in for cmsis_gcc.h, force included into host builds of
+ *        the driver.
+ *
+ * The device and core headers of the cmsis submodules are used as they
+ * are, only the compiler layer is replaced: cmsis_gcc.h is ARM assembly,
+ * its include guard is taken here so cmsis_compiler.h skips it. Interrupt
+ * masking and the exception number work on variables that the simulator
+ * (otg_sim.c) keeps, barriers are compiler barriers and the rest is
+ * written out in C.
+ */
+
+#ifndef CMSIS_HOST_H
+#define CMSIS_HOST_H
+
+#include <stdint.h>
+
+#define __CMSIS_GCC_H
+
+#define __ASM                       __asm
+#define __INLINE                    inline
+#define __STATIC_INLINE             static inline
+#define __STATIC_FORCEINLINE        __attribute__((always_inline)) static inline
+#define __NO_RETURN                 __attribute__((__noreturn__))
+#define __USED                      __attribute__((used))
+#define __WEAK                      __attribute__((weak))
+#define __PACKED                    __attribute__((packed, aligned(1)))
+#define __PACKED_STRUCT             struct __attribute__((packed, aligned(1)))
+#define __PACKED_UNION              union __attribute__((packed, aligned(1)))
+#define __ALIGNED(x)                __attribute__((aligned(x)))
+#define __RESTRICT                  __restrict
+#define __COMPILER_BARRIER()        __asm volatile("" ::: "memory")
+
+struct __attribute__((packed)) T_UINT16_WRITE { uint16_t v; };
+struct __attribute__((packed)) T_UINT16_READ { uint16_t v; };
+struct __attribute__((packed)) T_UINT32_WRITE { uint32_t v; };
+struct __attribute__((packed)) T_UINT32_READ { uint32_t v; };
+struct __attribute__((packed)) T_UINT32 { uint32_t v; };
+
+#define __UNALIGNED_UINT32(x)           (((struct T_UINT32 *)(x))->v)
+#define __UNALIGNED_UINT16_WRITE(a, v)  ((void)((((struct T_UINT16_WRITE *)(void *)(a))->v) = (v)))
+#define __UNALIGNED_UINT16_READ(a)      (((const struct T_UINT16_READ *)(const void *)(a))->v)
+#define __UNALIGNED_UINT32_WRITE(a, v)  ((void)((((struct T_UINT32_WRITE *)(void *)(a))->v) = (v)))
+#define __UNALIGNED_UINT32_READ(a)      (((const struct T_UINT32_READ *)(const void *)(a))->v)
+
+/* Core state, owned by the simulator */
+extern volatile uint32_t cmsis_host_primask;
+extern volatile uint32_t cmsis_host_ipsr;
+extern volatile uint32_t cmsis_host_basepri;
+extern volatile uint32_t cmsis_host_faultmask;
+extern volatile uint32_t cmsis_host_control;
+
+
+/*##########################################################################*/
+/*#                          CORE REGISTER ACCESS                          #*/
+/*##########################################################################*/
+
+__STATIC_FORCEINLINE void __enable_irq(void) { __COMPILER_BARRIER(); cmsis_host_primask = 0U; }
+__STATIC_FORCEINLINE void __disable_irq(void) { cmsis_host_primask = 1U; __COMPILER_BARRIER(); }
+__STATIC_FORCEINLINE uint32_t __get_PRIMASK(void) { return cmsis_host_primask; }
+__STATIC_FORCEINLINE void __set_PRIMASK(uint32_t priMask) { __COMPILER_BARRIER(); cmsis_host_primask = priMask & 1U; __COMPILER_BARRIER(); }
+__STATIC_FORCEINLINE void __enable_fault_irq(void) { cmsis_host_faultmask = 0U; }
+__STATIC_FORCEINLINE void __disable_fault_irq(void) { cmsis_host_faultmask = 1U; }
+__STATIC_FORCEINLINE uint32_t __get_FAULTMASK(void) { return cmsis_host_faultmask; }
+__STATIC_FORCEINLINE void __set_FAULTMASK(uint32_t faultMask) { cmsis_host_faultmask = faultMask & 1U; }
+__STATIC_FORCEINLINE uint32_t __get_BASEPRI(void) { return cmsis_host_basepri; }
+__STATIC_FORCEINLINE void __set_BASEPRI(uint32_t basePri) { cmsis_host_basepri = basePri & 0xFFU; }
+
+__STATIC_FORCEINLINE void
+__set_BASEPRI_MAX(uint32_t basePri)
+{
+    basePri &= 0xFFU;
+    if ((basePri != 0U) && ((cmsis_host_basepri == 0U) || (basePri < cmsis_host_basepri)))
+    {
+        cmsis_host_basepri = basePri;
+    }
+}
+
+__STATIC_FORCEINLINE uint32_t __get_IPSR(void) { return cmsis_host_ipsr; }
+__STATIC_FORCEINLINE uint32_t __get_xPSR(void) { return cmsis_host_ipsr; }
+__STATIC_FORCEINLINE uint32_t __get_APSR(void) { return 0U; }
+__STATIC_FORCEINLINE uint32_t __get_CONTROL(void) { return cmsis_host_control; }
+__STATIC_FORCEINLINE void __set_CONTROL(uint32_t control) { cmsis_host_control = control; }
+
+/* There is no separate stack to point at, the frame address will do */
+__STATIC_FORCEINLINE uint32_t __get_MSP(void) { return (uint32_t)(uintptr_t)__builtin_frame_address(0); }
+__STATIC_FORCEINLINE uint32_t __get_PSP(void) { return (uint32_t)(uintptr_t)__builtin_frame_address(0); }
+__STATIC_FORCEINLINE void __set_MSP(uint32_t topOfMainStack) { (void)topOfMainStack; }
+__STATIC_FORCEINLINE void __set_PSP(uint32_t topOfProcStack) { (void)topOfProcStack; }
+__STATIC_FORCEINLINE uint32_t __get_FPSCR(void) { return 0U; }
+__STATIC_FORCEINLINE void __set_FPSCR(uint32_t fpscr) { (void)fpscr; }
+
+
+/*##########################################################################*/
+/*#                              INSTRUCTIONS                              #*/
+/*##########################################################################*/
+
+#define __NOP()         __asm volatile("nop")
+#define __WFI()         __COMPILER_BARRIER()
+#define __WFE()         __COMPILER_BARRIER()
+#define __SEV()         __COMPILER_BARRIER()
+#define __ISB()         __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define __DSB()         __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define __DMB()         __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define __BKPT(value)   __builtin_trap()
+#define __CLREX()       __COMPILER_BARRIER()
+
+__STATIC_FORCEINLINE uint32_t __REV(uint32_t value) { return __builtin_bswap32(value); }
+__STATIC_FORCEINLINE uint32_t __REV16(uint32_t value) { return ((value & 0xFF00FF00U) >> 8) | ((value & 0x00FF00FFU) << 8); }
+__STATIC_FORCEINLINE int16_t __REVSH(int16_t value) { return (int16_t)__builtin_bswap16((uint16_t)value); }
+__STATIC_FORCEINLINE uint32_t __ROR(uint32_t op1, uint32_t op2) { op2 %= 32U; return (op2 == 0U) ? op1 : ((op1 >> op2) | (op1 << (32U - op2))); }
+__STATIC_FORCEINLINE uint8_t __CLZ(uint32_t value) { return (value == 0U) ? 32U : (uint8_t)__builtin_clz(value); }
+
+__STATIC_FORCEINLINE uint32_t
+__RBIT(uint32_t value)
+{
+    uint32_t result = 0U;
+
+    for (uint32_t bit = 0U; bit < 32U; bit++)
+    {
+        result = (result << 1) | ((value >> bit) & 1U);
+    }
+    return result;
+}
+
+__STATIC_FORCEINLINE int32_t
+__SSAT(int32_t val, uint32_t sat)
+{
+    if ((sat >= 1U) && (sat <= 32U))
+    {
+        const int32_t max = (int32_t)((1U << (sat - 1U)) - 1U);
+        const int32_t min = -1 - max;
+        return (val > max) ? max : ((val < min) ? min : val);
+    }
+    return val;
+}
+
+__STATIC_FORCEINLINE uint32_t
+__USAT(int32_t val, uint32_t sat)
+{
+    if (sat <= 31U)
+    {
+        const uint32_t max = ((1U << sat) - 1U);
+        return (val > (int32_t)max) ? max : ((val < 0) ? 0U : (uint32_t)val);
+    }
+    return (uint32_t)val;
+}
+
+/* Exclusive accesses always succeed, there is only one core */
+__STATIC_FORCEINLINE uint8_t __LDREXB(volatile uint8_t *addr) { return *addr; }
+__STATIC_FORCEINLINE uint16_t __LDREXH(volatile uint16_t *addr) { return *addr; }
+__STATIC_FORCEINLINE uint32_t __LDREXW(volatile uint32_t *addr) { return *addr; }
+__STATIC_FORCEINLINE uint32_t __STREXB(uint8_t value, volatile uint8_t *addr) { *addr = value; return 0U; }
+__STATIC_FORCEINLINE uint32_t __STREXH(uint16_t value, volatile uint16_t *addr) { *addr = value; return 0U; }
+__STATIC_FORCEINLINE uint32_t __STREXW(uint32_t value, volatile uint32_t *addr) { *addr = value; return 0U; }
+
+#endif /* CMSIS_HOST_H */
+
+/*** end of file ***/
\ No newline at end of file
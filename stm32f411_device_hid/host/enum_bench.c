@@ -0,0 +1,773 @@
+/** @file enum_bench.c
+ *
+ * @brief Scripted enumeration and class traffic against the host build of
+ *        the driver, with the cost of every interrupt.
+ *
+ * The driver sources are built for the host and run on the OTG_FS model
+ * (otg_sim.c) driven by the virtual host (vhost.c). The script is what a
+ * Linux host does on plug in: reset, device descriptor at address 0,
+ * reset, SET_ADDRESS, descriptors and strings, SET_CONFIGURATION and the
+ * class requests of each function, then keyboard reports and console data
+ * both ways. Every response is checked against the generated descriptor
+ * constants, a request nobody handles has to STALL.
+ *
+ * Costs are instructions and OTG register accesses of the host build, not
+ * Cortex-M4 cycles: they track how much work the driver does, which is
+ * what changes when it regresses. -w writes them as "name value" lines,
+ * -c compares against such a file and fails on anything more than the
+ * tolerance above it, so a build server can gate on it. -d writes the
+ * transaction capture of the last run the way it is dumped from the
+ * target, for tools/usb_capture_pcap.py. Built with REG_COUNT=1 it also
+ * lists the accesses of every OTG register as counted by usb_reg.h.
+ */
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "usb.h"
+#include "usb_internal.h"
+#include "usb_desc_gen.h"
+#include "usb_kbd.h"
+#include "usb_hid.h"
+#include "usb_cdc.h"
+#include "usb_stream.h"
+#include "usb_capture.h"
+#include "usb_reg.h"
+#include "vhost.h"
+
+#define DEVICE_ADDRESS      (5U)
+#define LANGID_EN_US        (0x0409U)
+#define DEFAULT_RUNS        (3U)
+#define DEFAULT_TOLERANCE   (2U)    /* Percent */
+#define MAX_METRICS         (64U)
+#define KBD_KEYS            (8U)
+#define KBD_POLLS           (3U)    /* Polls between two key changes */
+#define CONSOLE_BYTES       (300U)
+#define STREAM_PACKET       (64U)
+#define BUSY_BYTES          (1024U)
+#define BUSY_ROUNDS         (16U)   /* Main loop stalls before giving up */
+
+#define CHECK(cond_, ...)   check((cond_), __LINE__, __VA_ARGS__)
+
+/**
+ * @brief A reported number, what -w writes and -c compares.
+ */
+typedef struct metric_s
+{
+    char name[48];
+    uint64_t value;
+} metric_t;
+
+static void bench_init(void);
+static void enumerate(void);
+static void keyboard_traffic(void);
+static void console_traffic(void);
+static void busy_loop_traffic(void);
+static uint32_t endpoint_interval(const uint8_t *p_config, uint32_t len, uint8_t ep_addr);
+static void kbd_step(void);
+static void console_write(void);
+static void console_read(void);
+static void busy_write(void);
+static void busy_read(void);
+
+static void check(bool ok, int line, const char *p_fmt, ...) __attribute__((format(printf, 3, 4)));
+static void print_costs(const char *p_title, const vhost_stats_t *p_stats);
+static void print_reg_stats(void);
+static void add_metric(const char *p_name, uint64_t value);
+static void add_costs(const char *p_prefix, const vhost_stats_t *p_stats);
+static bool write_metrics(const char *p_path);
+static bool check_metrics(const char *p_path, uint32_t tolerance);
+static bool write_capture(const char *p_path);
+
+static usb_driver_t usb_driver;
+static uint8_t address;
+static uint32_t failures;
+static metric_t metrics[MAX_METRICS];
+static uint32_t metric_count;
+static uint32_t kbd_interval;
+static uint8_t kbd_usage;
+static bool kbd_pressed;
+static uint8_t console_tx[CONSOLE_BYTES];
+static uint8_t console_rx[CONSOLE_BYTES];
+static uint32_t console_rx_len;
+static uint8_t busy_tx[BUSY_BYTES];
+static uint8_t busy_in[BUSY_BYTES];
+static uint8_t busy_out[BUSY_BYTES];
+static uint32_t busy_out_len;
+
+
+/*##########################################################################*/
+/*#                                  MAIN                                  #*/
+/*##########################################################################*/
+
+int
+main(int argc, char **argv)
+{
+    const char *p_write = NULL;
+    const char *p_check = NULL;
+    const char *p_dump = NULL;
+    uint32_t runs = DEFAULT_RUNS;
+    uint32_t tolerance = DEFAULT_TOLERANCE;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:w:c:t:d:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'n':
+                runs = (uint32_t)strtoul(optarg, NULL, 0);
+                break;
+            case 'w':
+                p_write = optarg;
+                break;
+            case 'c':
+                p_check = optarg;
+                break;
+            case 't':
+                tolerance = (uint32_t)strtoul(optarg, NULL, 0);
+                break;
+            case 'd':
+                p_dump = optarg;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-n enumerations] [-w baseline] [-c baseline] [-t percent] [-d capture]\n",
+                        argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (runs == 0U)
+    {
+        runs = 1U;
+    }
+
+    vhost_init();
+    vhost_run(bench_init);
+    add_metric("init.instructions", vhost_get_stats()->task.instructions);
+
+    // The first enumeration is also the one after power up, the ones after
+    // it start from a configured device. All of them have to cost the same.
+    vhost_cost_t first = { 0 };
+    vhost_cost_t worst = { 0 };
+    vhost_stats_t enum_stats = { 0 };
+    for (uint32_t run = 0; run < runs; run++)
+    {
+        vhost_cost_t total;
+
+        vhost_clear_stats();
+        usb_reg_stats_clear();
+        enumerate();
+        enum_stats = *vhost_get_stats();
+        vhost_cost_total(&enum_stats, &total);
+        if (run == 0U)
+        {
+            first = total;
+        }
+        if (total.instructions > worst.instructions)
+        {
+            worst = total;
+        }
+    }
+    CHECK(worst.instructions == first.instructions,
+          "enumerations differ in cost: %llu and %llu instructions",
+          (unsigned long long)first.instructions, (unsigned long long)worst.instructions);
+
+    printf("Enumeration, %u runs\n", (unsigned)runs);
+    printf("  %llu instructions, %llu register reads, %llu writes, %u interrupts, "
+           "longest interrupt %llu instructions\n",
+           (unsigned long long)worst.instructions, (unsigned long long)worst.reads,
+           (unsigned long long)worst.writes, (unsigned)worst.calls,
+           (unsigned long long)worst.max_instructions);
+    printf("  %u transactions, %u NAKed\n",
+           (unsigned)enum_stats.transactions, (unsigned)enum_stats.naks);
+    print_costs("Enumeration, last run", &enum_stats);
+    add_metric("enum.instructions", worst.instructions);
+    add_metric("enum.reads", worst.reads);
+    add_metric("enum.writes", worst.writes);
+    add_metric("enum.interrupts", worst.calls);
+    add_metric("enum.isr_max", worst.max_instructions);
+    add_costs("enum", &enum_stats);
+    print_reg_stats();
+
+    vhost_clear_stats();
+    usb_reg_stats_clear();
+    keyboard_traffic();
+    console_traffic();
+    busy_loop_traffic();
+    vhost_stats_t class_stats = *vhost_get_stats();
+    vhost_cost_t class_total;
+    vhost_cost_total(&class_stats, &class_total);
+    print_costs("Class traffic", &class_stats);
+    printf("  %u keyboard reports, %u built in SOF, %u polls missed\n",
+           (unsigned)usb_hid_get_stats()->sent, (unsigned)usb_hid_get_stats()->sof_builds,
+           (unsigned)usb_hid_get_stats()->sof_missed);
+    add_metric("class.instructions", class_total.instructions);
+    add_metric("class.reads", class_total.reads);
+    add_metric("class.writes", class_total.writes);
+    add_costs("class", &class_stats);
+    print_reg_stats();
+
+    const otg_sim_errors_t *p_errors = otg_sim_get_errors();
+    CHECK((p_errors->tx_overflow | p_errors->rx_underflow | p_errors->rx_unread |
+           p_errors->setup_lost | p_errors->bad_packet) == 0U,
+          "core model errors: tx_overflow %u rx_underflow %u rx_unread %u setup_lost %u bad_packet %u",
+          p_errors->tx_overflow, p_errors->rx_underflow, p_errors->rx_unread,
+          p_errors->setup_lost, p_errors->bad_packet);
+    CHECK(enum_stats.storms + class_stats.storms == 0U, "interrupt storms");
+
+    if ((p_dump != NULL) && !write_capture(p_dump))
+    {
+        failures++;
+    }
+    if ((p_write != NULL) && !write_metrics(p_write))
+    {
+        failures++;
+    }
+    if ((p_check != NULL) && !check_metrics(p_check, tolerance))
+    {
+        failures++;
+    }
+
+    printf("%s\n", (failures == 0U) ? "PASS" : "FAIL");
+    return (failures == 0U) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+void
+on_assert__(char const * const file_, int line_)
+{
+    fprintf(stderr, "assertion failed: %s:%d\n", file_, line_);
+    exit(EXIT_FAILURE);
+}
+
+
+/*##########################################################################*/
+/*#                                 SCRIPT                                 #*/
+/*##########################################################################*/
+
+/**
+ * @brief What main.c does before its loop.
+ */
+static void
+bench_init(void)
+{
+    usb_init_t init = { .vbus_sensing = true, .deferred_processing = true };
+
+    usb_kbd_init();
+    usb_init(&usb_driver, &init);
+}
+
+static void
+enumerate(void)
+{
+    uint8_t device[18];
+    uint8_t buf[256];
+    uint32_t len;
+    vhost_result_t result;
+
+    address = 0;
+    vhost_set_ep0_mps(64U);
+    vhost_reset();
+
+    result = vhost_control(address, 0x80, 0x06, 0x0100, 0, 64, buf, &len);
+    CHECK((result == VHOST_OK) && (len == 18U) && (buf[0] == 18U) && (buf[1] == 0x01U),
+          "GET_DESCRIPTOR(device) at address 0: %s, %u bytes", vhost_result_name(result), len);
+    CHECK(buf[7] == USB_DESC_EP0_MAX_PACKET, "bMaxPacketSize0 %u", buf[7]);
+    memcpy(device, buf, sizeof(device));
+    vhost_set_ep0_mps(device[7]);
+
+    vhost_reset();
+    result = vhost_control(address, 0x00, 0x05, DEVICE_ADDRESS, 0, 0, NULL, NULL);
+    CHECK(result == VHOST_OK, "SET_ADDRESS: %s", vhost_result_name(result));
+    address = DEVICE_ADDRESS;
+
+    result = vhost_control(address, 0x80, 0x06, 0x0100, 0, 18, buf, &len);
+    CHECK((result == VHOST_OK) && (len == 18U) && (memcmp(buf, device, 18U) == 0),
+          "GET_DESCRIPTOR(device): %s, %u bytes", vhost_result_name(result), len);
+
+    result = vhost_control(address, 0x80, 0x06, 0x0200, 0, 9, buf, &len);
+    uint32_t total = (uint32_t)buf[2] | ((uint32_t)buf[3] << 8);
+    CHECK((result == VHOST_OK) && (len == 9U) && (total == USB_DESC_CONFIGURATION_LEN),
+          "GET_DESCRIPTOR(configuration, 9): %s, wTotalLength %u", vhost_result_name(result), total);
+    result = vhost_control(address, 0x80, 0x06, 0x0200, 0, 255, buf, &len);
+    CHECK((result == VHOST_OK) && (len == USB_DESC_CONFIGURATION_LEN),
+          "GET_DESCRIPTOR(configuration): %s, %u bytes", vhost_result_name(result), len);
+    kbd_interval = endpoint_interval(buf, len, USB_DESC_EP_KEYBOARD_IN);
+    CHECK(kbd_interval != 0U, "no keyboard endpoint in the configuration descriptor");
+
+    result = vhost_control(address, 0x80, 0x06, 0x0300, 0, 255, buf, &len);
+    CHECK((result == VHOST_OK) && (len == 4U) &&
+          ((buf[2] | (buf[3] << 8)) == LANGID_EN_US),
+          "GET_DESCRIPTOR(string 0): %s, %u bytes", vhost_result_name(result), len);
+    for (uint32_t field = 14; field <= 16U; field++)
+    {
+        uint8_t index = device[field];
+        if (index == 0U)
+        {
+            continue;
+        }
+        result = vhost_control(address, 0x80, 0x06, 0x0300 | index, LANGID_EN_US, 255, buf, &len);
+        CHECK((result == VHOST_OK) && (len >= 2U) && (buf[0] == len) && (buf[1] == 0x03U),
+              "GET_DESCRIPTOR(string %u): %s, %u bytes", index, vhost_result_name(result), len);
+        if (index == USB_DESC_STRING_SERIAL)
+        {
+            CHECK(len == USB_DESC_SERIAL_LEN, "serial number is %u bytes", len);
+        }
+    }
+
+    // Full speed only, a high speed capable host still asks
+    result = vhost_control(address, 0x80, 0x06, 0x0600, 0, 10, buf, &len);
+    CHECK(result == VHOST_STALL, "GET_DESCRIPTOR(device qualifier): %s", vhost_result_name(result));
+
+    result = vhost_control(address, 0x00, 0x09, USB_DESC_CONFIGURATION_VALUE, 0, 0, NULL, NULL);
+    CHECK(result == VHOST_OK, "SET_CONFIGURATION: %s", vhost_result_name(result));
+    result = vhost_control(address, 0x80, 0x08, 0, 0, 1, buf, &len);
+    CHECK((result == VHOST_OK) && (len == 1U) && (buf[0] == USB_DESC_CONFIGURATION_VALUE),
+          "GET_CONFIGURATION: %s", vhost_result_name(result));
+
+    result = vhost_control(address, 0x21, 0x0A, 0, USB_DESC_INTERFACE_KEYBOARD, 0, NULL, NULL);
+    CHECK(result == VHOST_OK, "SET_IDLE: %s", vhost_result_name(result));
+    result = vhost_control(address, 0x81, 0x06, 0x2200, USB_DESC_INTERFACE_KEYBOARD,
+                           USB_DESC_REPORT_KEYBOARD_LEN + 64U, buf, &len);
+    CHECK((result == VHOST_OK) && (len == USB_DESC_REPORT_KEYBOARD_LEN),
+          "GET_DESCRIPTOR(report): %s, %u bytes", vhost_result_name(result), len);
+    result = vhost_control(address, 0xA1, 0x01, USB_HID_REPORT_TYPE_INPUT << 8,
+                           USB_DESC_INTERFACE_KEYBOARD, 64, buf, &len);
+    CHECK((result == VHOST_OK) && (len == USB_KBD_NKRO_REPORT_SIZE),
+          "GET_REPORT(input): %s, %u bytes", vhost_result_name(result), len);
+
+#ifdef USB_DESC_INTERFACE_CDC_COMM
+    uint8_t line_coding[7] = { 0x00, 0xC2, 0x01, 0x00, 0, 0, 8 };   /* 115200 8N1 */
+    result = vhost_control(address, 0x21, 0x20, 0, USB_DESC_INTERFACE_CDC_COMM,
+                           sizeof(line_coding), line_coding, NULL);
+    CHECK(result == VHOST_OK, "SET_LINE_CODING: %s", vhost_result_name(result));
+    result = vhost_control(address, 0xA1, 0x21, 0, USB_DESC_INTERFACE_CDC_COMM, 7, buf, &len);
+    CHECK((result == VHOST_OK) && (len == 7U) && (memcmp(buf, line_coding, 7U) == 0),
+          "GET_LINE_CODING: %s, %u bytes", vhost_result_name(result), len);
+    result = vhost_control(address, 0x21, 0x22, 0x0003, USB_DESC_INTERFACE_CDC_COMM, 0, NULL, NULL);
+    CHECK((result == VHOST_OK) && usb_cdc_connected(),
+          "SET_CONTROL_LINE_STATE: %s", vhost_result_name(result));
+#endif
+
+    // Nobody handles this one
+    result = vhost_control(address, 0xC0, 0x55, 0, 0, 4, buf, &len);
+    CHECK(result == VHOST_STALL, "unknown vendor request: %s", vhost_result_name(result));
+}
+
+/**
+ * @brief Press and release keys one at a time while the host polls the
+ *        keyboard endpoint every bInterval frames, like a host does once
+ *        the device is configured. The first changes go out through
+ *        usb_kbd_task, the later ones through the SOF scheduler once it
+ *        has learned the polls.
+ */
+static void
+keyboard_traffic(void)
+{
+    uint8_t ep_num = USB_DESC_EP_KEYBOARD_IN & 0x0FU;
+    uint8_t report[64];
+    uint8_t last[64] = { 0 };
+    uint32_t last_len = 0;
+    uint32_t frame = 0;
+
+    for (uint32_t change = 0; change < (2U * KBD_KEYS); change++)
+    {
+        bool seen = false;
+
+        kbd_usage = (uint8_t)(0x04U + (change / 2U));   /* Keys a to h */
+        kbd_pressed = ((change & 1U) == 0U);
+        vhost_run(kbd_step);
+
+        for (uint32_t polls = 0; polls < KBD_POLLS; frame++)
+        {
+            uint32_t len;
+
+            vhost_sof();
+            if ((frame % kbd_interval) != 0U)
+            {
+                vhost_run(usb_kbd_task);
+                continue;
+            }
+            polls++;
+            if (!seen && (vhost_in_try(address, ep_num, report, &len) == VHOST_OK))
+            {
+                seen = (len != last_len) || (memcmp(report, last, len) != 0);
+                memcpy(last, report, len);
+                last_len = len;
+            }
+            vhost_run(usb_kbd_task);
+        }
+        CHECK(seen, "key %02X %s not reported", kbd_usage, kbd_pressed ? "press" : "release");
+    }
+}
+
+/**
+ * @brief Console output read by the host, then data from the host read
+ *        by the application.
+ */
+static void
+console_traffic(void)
+{
+#ifdef USB_DESC_INTERFACE_CDC_COMM
+    uint8_t ep_in = USB_DESC_EP_STREAM_IN & 0x0FU;
+    uint8_t ep_out = USB_DESC_EP_STREAM_OUT & 0x0FU;
+    uint8_t packet[STREAM_PACKET];
+    uint32_t received = 0;
+
+    for (uint32_t i = 0; i < CONSOLE_BYTES; i++)
+    {
+        console_tx[i] = (uint8_t)(i * 7U + 1U);
+    }
+    vhost_run(console_write);
+    for (uint32_t tries = 0; (tries < VHOST_NAK_LIMIT) && (received < CONSOLE_BYTES); tries++)
+    {
+        uint32_t len;
+        if (vhost_in_try(address, ep_in, packet, &len) == VHOST_OK)
+        {
+            CHECK((received + len) <= CONSOLE_BYTES, "console sent too much");
+            memcpy(&console_rx[received], packet, MIN(len, CONSOLE_BYTES - received));
+            received += len;
+        }
+    }
+    CHECK((received == CONSOLE_BYTES) && (memcmp(console_rx, console_tx, CONSOLE_BYTES) == 0),
+          "console IN: %u of %u bytes", received, CONSOLE_BYTES);
+
+    uint32_t sent = 0;
+    while (sent < CONSOLE_BYTES)
+    {
+        uint32_t len = MIN(STREAM_PACKET, CONSOLE_BYTES - sent);
+        vhost_result_t result = vhost_out(address, ep_out, &console_tx[sent], len);
+        if (result != VHOST_OK)
+        {
+            CHECK(false, "console OUT at %u: %s", sent, vhost_result_name(result));
+            break;
+        }
+        sent += len;
+    }
+    memset(console_rx, 0, sizeof(console_rx));
+    console_rx_len = 0;
+    vhost_run(console_read);
+    CHECK((console_rx_len == sent) && (memcmp(console_rx, console_tx, sent) == 0),
+          "console OUT: read %u of %u bytes", console_rx_len, sent);
+#endif
+}
+
+/**
+ * @brief Console data both ways while the main loop is stuck and does not
+ *        get to usb_poll. Each round the host fills the armed OUT block,
+ *        reads IN until the FIFO is empty and sends two SETUPs, the first
+ *        one abandoned, before the main loop catches up. That is more
+ *        interrupts than the event queue has entries, none of them may be
+ *        lost and the request answered has to be the second one.
+ */
+static void
+busy_loop_traffic(void)
+{
+#ifdef USB_DESC_INTERFACE_CDC_COMM
+    static const uint8_t get_status[8] = { 0x80, 0x00, 0, 0, 0, 0, 2, 0 };
+    static const uint8_t get_device[8] = { 0x80, 0x06, 0x00, 0x01, 0, 0, 18, 0 };
+    uint8_t ep_in = USB_DESC_EP_STREAM_IN & 0x0FU;
+    uint8_t ep_out = USB_DESC_EP_STREAM_OUT & 0x0FU;
+    uint8_t packet[STREAM_PACKET];
+    uint32_t sent = 0;
+    uint32_t received = 0;
+    uint32_t len;
+    vhost_result_t result;
+
+    for (uint32_t i = 0; i < BUSY_BYTES; i++)
+    {
+        busy_tx[i] = (uint8_t)(i * 13U + 5U);
+    }
+    vhost_run(busy_write);
+    for (uint32_t round = 0; (round < BUSY_ROUNDS) && ((sent < BUSY_BYTES) || (received < BUSY_BYTES)); round++)
+    {
+        vhost_hold_poll(true);
+        while ((sent < BUSY_BYTES) &&
+               (vhost_out_try(address, ep_out, &busy_tx[sent], STREAM_PACKET) == VHOST_OK))
+        {
+            sent += STREAM_PACKET;
+        }
+        while ((received < BUSY_BYTES) && (vhost_in_try(address, ep_in, packet, &len) == VHOST_OK))
+        {
+            CHECK((received + len) <= BUSY_BYTES, "busy loop: console sent too much");
+            memcpy(&busy_in[received], packet, MIN(len, BUSY_BYTES - received));
+            received += len;
+        }
+        CHECK((otg_sim_setup(address, get_status) == OTG_SIM_ACK) &&
+              (otg_sim_setup(address, get_device) == OTG_SIM_ACK), "busy loop: SETUP not taken");
+        vhost_service();
+        vhost_hold_poll(false);
+        vhost_service();
+
+        result = vhost_in(address, 0, packet, &len);
+        CHECK((result == VHOST_OK) && (len == 18U) && (packet[1] == 0x01U),
+              "busy loop: GET_DESCRIPTOR(device): %s, %u bytes", vhost_result_name(result), len);
+        result = vhost_out(address, 0, NULL, 0);
+        CHECK(result == VHOST_OK, "busy loop: status stage: %s", vhost_result_name(result));
+    }
+
+    CHECK((received == BUSY_BYTES) && (memcmp(busy_in, busy_tx, BUSY_BYTES) == 0),
+          "busy loop: console IN %u of %u bytes", received, BUSY_BYTES);
+    busy_out_len = 0;
+    vhost_run(busy_read);
+    CHECK((sent == BUSY_BYTES) && (busy_out_len == sent) && (memcmp(busy_out, busy_tx, sent) == 0),
+          "busy loop: console OUT sent %u, read %u of %u bytes", sent, busy_out_len, BUSY_BYTES);
+    CHECK(usb_driver.event_queue.dropped == 0U, "busy loop: %u events dropped",
+          (unsigned)usb_driver.event_queue.dropped);
+#endif
+}
+
+/**
+ * @brief bInterval of an endpoint in a configuration descriptor, 0 if the
+ *        endpoint is not there.
+ */
+static uint32_t
+endpoint_interval(const uint8_t *p_config, uint32_t len, uint8_t ep_addr)
+{
+    uint32_t pos = 0;
+
+    while (((pos + 2U) <= len) && (p_config[pos] >= 2U))
+    {
+        if ((p_config[pos + 1U] == 0x05U) && ((pos + 7U) <= len) && (p_config[pos + 2U] == ep_addr))
+        {
+            return p_config[pos + 6U];
+        }
+        pos += p_config[pos];
+    }
+    return 0;
+}
+
+static void
+kbd_step(void)
+{
+    usb_kbd_set_key(kbd_usage, kbd_pressed);
+    usb_kbd_task();
+}
+
+static void
+console_write(void)
+{
+    (void)usb_cdc_write(console_tx, CONSOLE_BYTES);
+}
+
+static void
+console_read(void)
+{
+    uint32_t len;
+
+    while ((len = usb_stream_read(&console_rx[console_rx_len], CONSOLE_BYTES - console_rx_len)) != 0U)
+    {
+        console_rx_len += len;
+    }
+}
+
+static void
+busy_write(void)
+{
+    (void)usb_cdc_write(busy_tx, BUSY_BYTES);
+}
+
+static void
+busy_read(void)
+{
+    uint32_t len;
+
+    while ((len = usb_stream_read(&busy_out[busy_out_len], BUSY_BYTES - busy_out_len)) != 0U)
+    {
+        busy_out_len += len;
+    }
+}
+
+
+/*##########################################################################*/
+/*#                                REPORTING                               #*/
+/*##########################################################################*/
+
+static void
+check(bool ok, int line, const char *p_fmt, ...)
+{
+    va_list args;
+
+    if (ok)
+    {
+        return;
+    }
+    failures++;
+    fprintf(stderr, "enum_bench.c:%d: ", line);
+    va_start(args, p_fmt);
+    vfprintf(stderr, p_fmt, args);
+    va_end(args);
+    fputc('\n', stderr);
+}
+
+static void
+print_costs(const char *p_title, const vhost_stats_t *p_stats)
+{
+    char name[64];
+
+    printf("\n%s\n", p_title);
+    printf("  %-24s %7s %10s %10s %10s %10s\n",
+           "", "calls", "instr avg", "instr max", "reads avg", "writes avg");
+    for (uint32_t kind = 0; kind < p_stats->isr_kinds; kind++)
+    {
+        const vhost_cost_t *p_cost = &p_stats->isr[kind].cost;
+        printf("  isr %-20s %7u %10llu %10llu %10.1f %10.1f\n",
+               vhost_sources_name(p_stats->isr[kind].sources, name, sizeof(name)),
+               (unsigned)p_cost->calls,
+               (unsigned long long)(p_cost->instructions / p_cost->calls),
+               (unsigned long long)p_cost->max_instructions,
+               (double)p_cost->reads / p_cost->calls, (double)p_cost->writes / p_cost->calls);
+    }
+
+    const vhost_cost_t *p_others[] = { &p_stats->poll, &p_stats->task };
+    const char *p_names[] = { "usb_poll", "thread" };
+    for (uint32_t other = 0; other < 2U; other++)
+    {
+        const vhost_cost_t *p_cost = p_others[other];
+        if (p_cost->calls == 0U)
+        {
+            continue;
+        }
+        printf("  %-24s %7u %10llu %10llu %10.1f %10.1f\n", p_names[other],
+               (unsigned)p_cost->calls,
+               (unsigned long long)(p_cost->instructions / p_cost->calls),
+               (unsigned long long)p_cost->max_instructions,
+               (double)p_cost->reads / p_cost->calls, (double)p_cost->writes / p_cost->calls);
+    }
+}
+
+/**
+ * @brief Accesses per register since usb_reg_stats_clear, when counted.
+ */
+static void
+print_reg_stats(void)
+{
+#if USB_REG_COUNT_ENABLE
+    printf("\n  %-24s %7s %7s\n", "register", "reads", "writes");
+    for (uint32_t reg = 0; reg < USB_REG_COUNT; reg++)
+    {
+        if ((usb_reg_stats.reads[reg] | usb_reg_stats.writes[reg]) != 0U)
+        {
+            printf("  %-24s %7u %7u\n", usb_reg_names[reg],
+                   (unsigned)usb_reg_stats.reads[reg], (unsigned)usb_reg_stats.writes[reg]);
+        }
+    }
+#endif
+}
+
+static void
+add_metric(const char *p_name, uint64_t value)
+{
+    if (metric_count < MAX_METRICS)
+    {
+        snprintf(metrics[metric_count].name, sizeof(metrics[metric_count].name), "%s", p_name);
+        metrics[metric_count].value = value;
+        metric_count++;
+    }
+}
+
+/**
+ * @brief Worst interrupt entry per source and the worst usb_poll call.
+ */
+static void
+add_costs(const char *p_prefix, const vhost_stats_t *p_stats)
+{
+    char sources[40];
+    char name[48];
+
+    for (uint32_t kind = 0; kind < p_stats->isr_kinds; kind++)
+    {
+        snprintf(name, sizeof(name), "%s.isr.%s", p_prefix,
+                 vhost_sources_name(p_stats->isr[kind].sources, sources, sizeof(sources)));
+        add_metric(name, p_stats->isr[kind].cost.max_instructions);
+    }
+    snprintf(name, sizeof(name), "%s.poll_max", p_prefix);
+    add_metric(name, p_stats->poll.max_instructions);
+}
+
+static bool
+write_metrics(const char *p_path)
+{
+    FILE *p_file = fopen(p_path, "w");
+
+    if (p_file == NULL)
+    {
+        perror(p_path);
+        return false;
+    }
+    for (uint32_t metric = 0; metric < metric_count; metric++)
+    {
+        fprintf(p_file, "%s %llu\n", metrics[metric].name, (unsigned long long)metrics[metric].value);
+    }
+    fclose(p_file);
+    return true;
+}
+
+/**
+ * @brief Compare with a baseline written by -w.
+ *        Only growth beyond the tolerance fails, metrics missing on either
+ *        side are reported.
+ */
+static bool
+check_metrics(const char *p_path, uint32_t tolerance)
+{
+    FILE *p_file = fopen(p_path, "r");
+    char name[48];
+    unsigned long long base;
+    bool ok = true;
+
+    if (p_file == NULL)
+    {
+        perror(p_path);
+        return false;
+    }
+
+    printf("\nAgainst %s (+%u%% allowed)\n", p_path, (unsigned)tolerance);
+    while (fscanf(p_file, "%47s %llu", name, &base) == 2)
+    {
+        uint32_t metric = 0;
+        while ((metric < metric_count) && (strcmp(metrics[metric].name, name) != 0))
+        {
+            metric++;
+        }
+        if (metric == metric_count)
+        {
+            printf("  %-32s %10llu  gone\n", name, base);
+            continue;
+        }
+
+        uint64_t value = metrics[metric].value;
+        bool regressed = (value * 100U) > (base * (100U + tolerance));
+        if (value != base)
+        {
+            printf("  %-32s %10llu -> %llu%s\n", name, base, (unsigned long long)value,
+                   regressed ? "  REGRESSION" : "");
+        }
+        ok = ok && !regressed;
+    }
+    fclose(p_file);
+    return ok;
+}
+
+/**
+ * @brief usb_capture_buf as the target holds it, the layout is the same.
+ */
+static bool
+write_capture(const char *p_path)
+{
+    FILE *p_file = fopen(p_path, "wb");
+
+    if (p_file == NULL)
+    {
+        perror(p_path);
+        return false;
+    }
+    fwrite(&usb_capture_buf, sizeof(usb_capture_buf), 1, p_file);
+    fclose(p_file);
+    return true;
+}
+
+/*** end of file ***/
\ No newline at end of file
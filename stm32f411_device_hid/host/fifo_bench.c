@@ -0,0 +1,336 @@
+/** @file fifo_bench.c
+ *
+ * @brief Host check and cycle benchmark of the USB FIFO copy routines.
+ *
+ * First every size from 1 to 64 bytes at every source/destination alignment
+ * is run through the FIFO model (fifo_sim.h) and compared with a byte-wise
+ * reference, then the real routines are timed against a volatile word that
+ * stands in for the FIFO register. The old EP0 writer (word cast loop and
+ * memcpy tail) is timed as the baseline. Gathered pushes are checked at
+ * every split into header, payload and trailer and timed against staging
+ * the three parts in one buffer first.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "usb_fifo.h"
+#include "fifo_sim.h"
+
+#undef usb_fifo_push
+#undef usb_fifo_push_gather
+#undef usb_fifo_pop
+#undef usb_fifo_discard
+
+void sim_usb_fifo_push(volatile uint32_t *p_fifo, const uint8_t *p_src, uint32_t len);
+void sim_usb_fifo_push_gather(volatile uint32_t *p_fifo, usb_fifo_cursor_t *p_cursor, uint32_t len);
+void sim_usb_fifo_pop(volatile uint32_t *p_fifo, uint8_t *p_dst, uint32_t len);
+
+#define MAX_LEN     (64U)
+#define REPEAT      (2000U)
+#define GUARD       (0xA5U)
+
+fifo_sim_t fifo_sim;
+static volatile uint32_t fifo_reg;
+
+
+/*##########################################################################*/
+/*#                              FIFO MODEL                                #*/
+/*##########################################################################*/
+
+void
+fifo_sim_write(uint32_t word)
+{
+    if (fifo_sim.count < FIFO_SIM_WORDS)
+    {
+        fifo_sim.words[fifo_sim.count] = word;
+    }
+    fifo_sim.count++;
+}
+
+uint32_t
+fifo_sim_read(void)
+{
+    uint32_t word = (fifo_sim.pos < fifo_sim.count) ? fifo_sim.words[fifo_sim.pos] : 0xDEADBEEFU;
+    fifo_sim.pos++;
+    return word;
+}
+
+
+/*##########################################################################*/
+/*#                                 CHECK                                  #*/
+/*##########################################################################*/
+
+static uint32_t check_gather(void);
+
+/**
+ * @brief Compare every size and alignment with the expected word stream.
+ *
+ * @return Number of failures.
+ */
+static uint32_t
+check(void)
+{
+    uint8_t src[MAX_LEN + 8];
+    uint8_t dst[MAX_LEN + 8];
+    uint32_t failures = 0;
+
+    for (uint32_t i = 0; i < sizeof(src); i++)
+    {
+        src[i] = (uint8_t)(i * 7U + 1U);
+    }
+
+    for (uint32_t len = 1; len <= MAX_LEN; len++)
+    {
+        uint32_t words = (len + 3U) / 4U;
+
+        for (uint32_t offset = 0; offset < 4; offset++)
+        {
+            // Push: word stream has to be the bytes in order, zero padded
+            memset(&fifo_sim, 0, sizeof(fifo_sim));
+            sim_usb_fifo_push(&fifo_reg, &src[offset], len);
+
+            uint8_t expected[MAX_LEN + 4] = { 0 };
+            memcpy(expected, &src[offset], len);
+            if ((fifo_sim.count != words) ||
+                memcmp(fifo_sim.words, expected, words * 4U) != 0)
+            {
+                printf("push len=%u offset=%u: bad word stream\n", len, offset);
+                failures++;
+            }
+
+            // Pop: exactly the words needed, nothing outside the buffer
+            memset(&fifo_sim, 0, sizeof(fifo_sim));
+            memcpy(fifo_sim.words, expected, words * 4U);
+            fifo_sim.count = words;
+            memset(dst, GUARD, sizeof(dst));
+            sim_usb_fifo_pop(&fifo_reg, &dst[offset], len);
+
+            bool guard_ok = true;
+            for (uint32_t i = 0; i < sizeof(dst); i++)
+            {
+                if (((i < offset) || (i >= offset + len)) && (dst[i] != GUARD))
+                {
+                    guard_ok = false;
+                }
+            }
+            if ((fifo_sim.pos != words) || !guard_ok ||
+                memcmp(&dst[offset], &src[offset], len) != 0)
+            {
+                printf("pop len=%u offset=%u: bad data\n", len, offset);
+                failures++;
+            }
+        }
+    }
+    return failures + check_gather();
+}
+
+/**
+ * @brief Gathered pushes at every header/payload/trailer split, each part
+ *        in its own buffer at its own alignment. The packet is pushed in
+ *        two calls split at a word boundary, so the cursor has to carry over.
+ *
+ * @return Number of failures.
+ */
+static uint32_t
+check_gather(void)
+{
+    uint8_t src[MAX_LEN];
+    uint8_t part[3][MAX_LEN + 4];
+    uint32_t failures = 0;
+
+    for (uint32_t i = 0; i < sizeof(src); i++)
+    {
+        src[i] = (uint8_t)(i * 7U + 1U);
+    }
+
+    for (uint32_t len = 1; len <= MAX_LEN; len++)
+    {
+        uint32_t words = (len + 3U) / 4U;
+        uint32_t first = (len / 2U) & ~3U;
+        uint8_t expected[MAX_LEN + 4] = { 0 };
+        memcpy(expected, src, len);
+
+        for (uint32_t offset = 0; offset < 4; offset++)
+        {
+            for (uint32_t split1 = 0; split1 <= len; split1++)
+            {
+                for (uint32_t split2 = split1; split2 <= len; split2++)
+                {
+                    uint32_t bounds[4] = { 0, split1, split2, len };
+                    usb_fifo_seg_t segs[3];
+
+                    for (uint32_t k = 0; k < 3; k++)
+                    {
+                        uint8_t *p_part = &part[k][(offset + k) & 3U];
+                        memcpy(p_part, &src[bounds[k]], bounds[k + 1] - bounds[k]);
+                        segs[k].p_data = p_part;
+                        segs[k].len = bounds[k + 1] - bounds[k];
+                    }
+
+                    usb_fifo_cursor_t cursor = { segs, 0 };
+                    memset(&fifo_sim, 0, sizeof(fifo_sim));
+                    sim_usb_fifo_push_gather(&fifo_reg, &cursor, first);
+                    sim_usb_fifo_push_gather(&fifo_reg, &cursor, len - first);
+
+                    if ((fifo_sim.count != words) ||
+                        memcmp(fifo_sim.words, expected, words * 4U) != 0)
+                    {
+                        printf("gather len=%u offset=%u split=%u/%u: bad word stream\n",
+                               len, offset, split1, split2);
+                        failures++;
+                    }
+                }
+            }
+        }
+    }
+    return failures;
+}
+
+
+/*##########################################################################*/
+/*#                               BENCHMARK                                #*/
+/*##########################################################################*/
+
+static inline uint64_t
+cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+/**
+ * @brief The EP0 writer this replaces, kept as the baseline.
+ */
+static void
+legacy_push(volatile uint32_t *p_fifo, const uint8_t *p_src, uint32_t len)
+{
+    for (uint32_t i = 0; i < (len / 4); i ++)
+    {
+        *p_fifo = ((uint32_t *)p_src)[i];
+    }
+    if (len % 4)
+    {
+        uint32_t remaining = 0;
+        memcpy(&remaining, &p_src[len - (len % 4)], len % 4);
+        *p_fifo = remaining;
+    }
+}
+
+/**
+ * @brief Header, payload and trailer for the gather benchmark, the payload
+ *        starting one byte into p_buf like a slice of a byte ring.
+ */
+static void
+split_packet(usb_fifo_seg_t *p_segs, uint8_t *p_buf, uint32_t len)
+{
+    static uint8_t header[4] __attribute__((aligned(4)));
+    static uint8_t trailer[4] __attribute__((aligned(4)));
+    uint32_t header_len = (len < 3U) ? len : 3U;
+    uint32_t trailer_len = ((len - header_len) < 2U) ? (len - header_len) : 2U;
+
+    p_segs[0] = (usb_fifo_seg_t){ header, header_len };
+    p_segs[1] = (usb_fifo_seg_t){ p_buf + 1, len - header_len - trailer_len };
+    p_segs[2] = (usb_fifo_seg_t){ trailer, trailer_len };
+}
+
+/**
+ * @brief What gathering replaces: copy the parts into one buffer, push it.
+ */
+static void
+staged_push(volatile uint32_t *p_fifo, const usb_fifo_seg_t *p_segs, uint32_t len)
+{
+    static uint8_t staging[MAX_LEN] __attribute__((aligned(4)));
+    uint32_t pos = 0;
+
+    for (uint32_t k = 0; k < 3; k++)
+    {
+        memcpy(&staging[pos], p_segs[k].p_data, p_segs[k].len);
+        pos += p_segs[k].len;
+    }
+    usb_fifo_push(p_fifo, staging, len);
+}
+
+typedef enum
+{
+    BENCH_LEGACY,
+    BENCH_PUSH,
+    BENCH_POP,
+    BENCH_STAGED,
+    BENCH_GATHER
+} bench_op_t;
+
+/**
+ * @brief Best of REPEAT runs, in cycles (ns where there is no TSC).
+ */
+static uint64_t
+bench(bench_op_t op, uint8_t *p_buf, uint32_t len)
+{
+    uint64_t best = UINT64_MAX;
+    usb_fifo_seg_t segs[3];
+
+    split_packet(segs, p_buf, len);
+    for (uint32_t r = 0; r < REPEAT; r++)
+    {
+        usb_fifo_cursor_t cursor = { segs, 0 };
+        uint64_t start = cycles();
+        switch (op)
+        {
+            case BENCH_LEGACY: legacy_push(&fifo_reg, p_buf, len);  break;
+            case BENCH_PUSH:   usb_fifo_push(&fifo_reg, p_buf, len); break;
+            case BENCH_POP:    usb_fifo_pop(&fifo_reg, p_buf, len);  break;
+            case BENCH_STAGED: staged_push(&fifo_reg, segs, len);    break;
+            case BENCH_GATHER: usb_fifo_push_gather(&fifo_reg, &cursor, len); break;
+        }
+        uint64_t elapsed = cycles() - start;
+        if (elapsed < best)
+        {
+            best = elapsed;
+        }
+    }
+    return best;
+}
+
+int
+main(void)
+{
+    uint32_t failures = check();
+    printf("check: %u failures over sizes 1-%u, alignments 0-3\n\n", failures, MAX_LEN);
+    if (failures)
+    {
+        return EXIT_FAILURE;
+    }
+
+    static uint8_t buf[MAX_LEN + 8] __attribute__((aligned(4)));
+    uint64_t overhead = bench(BENCH_PUSH, buf, 0);
+
+    printf("%4s %8s %8s %8s %8s %8s %8s %8s\n",
+           "len", "legacy", "push", "push+1", "pop", "pop+1", "staged", "gather");
+    for (uint32_t len = 1; len <= MAX_LEN; len++)
+    {
+        printf("%4u %8llu %8llu %8llu %8llu %8llu %8llu %8llu\n", len,
+               (unsigned long long)(bench(BENCH_LEGACY, buf, len) - overhead),
+               (unsigned long long)(bench(BENCH_PUSH, buf, len) - overhead),
+               (unsigned long long)(bench(BENCH_PUSH, buf + 1, len) - overhead),
+               (unsigned long long)(bench(BENCH_POP, buf, len) - overhead),
+               (unsigned long long)(bench(BENCH_POP, buf + 1, len) - overhead),
+               (unsigned long long)(bench(BENCH_STAGED, buf, len) - overhead),
+               (unsigned long long)(bench(BENCH_GATHER, buf, len) - overhead));
+    }
+    return EXIT_SUCCESS;
+}
+
+/*** end of file ***/
\ No newline at end of file
@@ -0,0 +1,40 @@
+/** @file fifo_sim.h
+ *
+ * @brief FIFO register model for checking usb_fifo.c on the host.
+ *
+ * Force-included when usb_fifo.c is built a second time for the check run.
+ * Every word written is appended to a buffer, reads are served from one, so
+ * the exact word stream a routine produces can be compared. The routines
+ * are renamed so both builds link into the same binary.
+ */
+
+#ifndef FIFO_SIM_H
+#define FIFO_SIM_H
+
+#include <stdint.h>
+
+#define FIFO_SIM_WORDS  (64U)
+
+typedef struct fifo_sim_s
+{
+    uint32_t words[FIFO_SIM_WORDS];
+    uint32_t count;
+    uint32_t pos;
+} fifo_sim_t;
+
+extern fifo_sim_t fifo_sim;
+
+void fifo_sim_write(uint32_t word);
+uint32_t fifo_sim_read(void);
+
+#define USB_FIFO_WRITE(p_fifo_, word_)  ((void)(p_fifo_), fifo_sim_write(word_))
+#define USB_FIFO_READ(p_fifo_)          ((void)(p_fifo_), fifo_sim_read())
+
+#define usb_fifo_push       sim_usb_fifo_push
+#define usb_fifo_push_gather sim_usb_fifo_push_gather
+#define usb_fifo_pop        sim_usb_fifo_pop
+#define usb_fifo_discard    sim_usb_fifo_discard
+
+#endif /* FIFO_SIM_H */
+
+/*** end of file ***/
\ No newline at end of file
@@ -0,0 +1,1132 @@
+/** @file otg_sim.c
+ *
+ * @brief Behavioral model of the OTG_FS device core, see otg_sim.h.
+ *
+ * Only what the driver relies on is modelled: device mode, one RX FIFO
+ * with its status queue, a TX FIFO per IN endpoint, the endpoint enable,
+ * NAK and STALL handshakes, transfer size counting and the interrupt bits
+ * derived from all of it. Data toggles, isochronous transfers, the OTG
+ * and host parts and the timing of the bus are not.
+ *
+ * Register state lives in the shadow mapping where it is plain storage,
+ * the interrupt bits, FIFOs and NAK flags live in sim and are folded into
+ * the value of a register when it is read.
+ */
+
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include "stm32f411xe.h"
+#include "otg_sim.h"
+
+#define OTG_SIZE            (0x40000UL)
+#define PAGE_SIZE_          (0x1000UL)
+#define EFLAGS_TF           (0x100ULL)
+#define PF_WRITE            (0x2ULL)
+
+/* Plain memory behind the other peripherals the driver touches */
+#define PERIPH_BASE_        (0x40000000UL)  /* GPIOA, RCC */
+#define PERIPH_SIZE         (0x30000UL)
+#define SYSTEM_BASE         (0xE0000000UL)  /* DWT, NVIC, SCB, CoreDebug */
+#define SYSTEM_SIZE         (0x100000UL)
+#define UID_PAGE            (UID_BASE & ~(PAGE_SIZE_ - 1U))
+
+#define G(reg_)             offsetof(USB_OTG_GlobalTypeDef, reg_)
+#define D(reg_)             (USB_OTG_DEVICE_BASE + offsetof(USB_OTG_DeviceTypeDef, reg_))
+#define IN_EP(n_, reg_)     (USB_OTG_IN_ENDPOINT_BASE + ((n_) * USB_OTG_EP_REG_SIZE) + \
+                             offsetof(USB_OTG_INEndpointTypeDef, reg_))
+#define OUT_EP(n_, reg_)    (USB_OTG_OUT_ENDPOINT_BASE + ((n_) * USB_OTG_EP_REG_SIZE) + \
+                             offsetof(USB_OTG_OUTEndpointTypeDef, reg_))
+#define REG(off_)           (sim.p_regs[(off_) / 4U])
+
+/* Receive status PKTSTS */
+#define RX_OUT_DATA         (2U)
+#define RX_OUT_COMPLETE     (3U)
+#define RX_SETUP_COMPLETE   (4U)
+#define RX_SETUP_DATA       (6U)
+
+#define RX_ENTRIES          (64U)
+#define RX_ENTRY_WORDS      (16U)   /* 64 byte packets */
+
+/*
+ * GINTSTS bits cleared by writing 1: MMIS, SOF, ESUSP, USBSUSP, USBRST,
+ * ENUMDNE, ISOODRP, EOPF, IISOIXFR, IPXFR, CIDSCHG, DISCINT, SRQINT,
+ * WKUINT. The others are read-only levels.
+ */
+#define GINTSTS_W1C         (0xF030FC0AUL)
+
+/* Endpoint control bits that only act when written */
+#define EPCTL_WRITE_ONLY    (USB_OTG_DIEPCTL_CNAK | USB_OTG_DIEPCTL_SNAK | \
+                             USB_OTG_DIEPCTL_SD0PID_SEVNFRM | USB_OTG_DIEPCTL_SODDFRM | \
+                             USB_OTG_DIEPCTL_EPDIS | USB_OTG_DIEPCTL_NAKSTS)
+#define DCTL_WRITE_ONLY     (USB_OTG_DCTL_SGINAK | USB_OTG_DCTL_CGINAK | \
+                             USB_OTG_DCTL_SGONAK | USB_OTG_DCTL_CGONAK | USB_OTG_DCTL_POPRGDNE)
+
+/**
+ * @brief Entry of the RX FIFO: receive status and its packet.
+ */
+typedef struct rx_entry_s
+{
+    uint32_t status;
+    uint32_t words[RX_ENTRY_WORDS];
+    uint32_t count;
+    uint32_t read;
+} rx_entry_t;
+
+/**
+ * @brief TX FIFO of an IN endpoint, depth comes from its DIEPTXF register.
+ */
+typedef struct tx_fifo_s
+{
+    uint32_t words[OTG_SIM_FIFO_WORDS];
+    uint32_t head;
+    uint32_t count;
+} tx_fifo_t;
+
+/**
+ * @brief Access caught by the fault handler, finished after its step.
+ */
+typedef struct trap_s
+{
+    bool pending;
+    bool write;
+    uint32_t offset;
+    uint32_t before;
+    void *p_page;
+} trap_t;
+
+typedef struct otg_sim_s
+{
+    volatile uint32_t *p_regs;
+    uint32_t gintsts;
+    uint32_t diepint[OTG_SIM_EPS];
+    uint32_t doepint[OTG_SIM_EPS];
+    bool in_nak[OTG_SIM_EPS];
+    bool out_nak[OTG_SIM_EPS];
+    bool global_out_nak;
+    rx_entry_t rx[RX_ENTRIES];
+    uint32_t rx_head;
+    uint32_t rx_count;
+    rx_entry_t rx_current;
+    tx_fifo_t tx[OTG_SIM_EPS];
+    uint32_t frame;
+    bool suspended;
+    uint8_t old_address;
+    bool old_address_valid;
+    trap_t trap;
+    bool stepping;
+    uint64_t steps;
+    uint64_t step_overhead;
+    otg_sim_cost_t cost;
+    otg_sim_errors_t errors;
+} otg_sim_t;
+
+volatile uint32_t cmsis_host_primask;
+volatile uint32_t cmsis_host_ipsr;
+volatile uint32_t cmsis_host_basepri;
+volatile uint32_t cmsis_host_faultmask;
+volatile uint32_t cmsis_host_control;
+
+static otg_sim_t sim;
+
+static void map_memory(void);
+static void on_segv(int sig, siginfo_t *p_info, void *p_context);
+static void on_trap(int sig, siginfo_t *p_info, void *p_context);
+static void step_call(void (*p_fn)(void));
+static void nothing(void);
+
+static uint32_t reg_read(uint32_t offset, bool pop);
+static void reg_write(uint32_t offset, uint32_t value, uint32_t before);
+static uint32_t ep_ctl_write(uint32_t value, bool *p_nak, uint32_t *p_int, uint32_t disabled);
+static void core_reset(void);
+
+static uint32_t gintsts(void);
+static uint32_t daint(void);
+static uint32_t diepint(uint32_t ep_num);
+static uint32_t ep0_mps(uint32_t ctl);
+static uint32_t ep_mps(uint32_t ep_num, bool in);
+static bool addressed(uint8_t addr);
+
+static uint32_t rx_depth(void);
+static uint32_t rx_used(void);
+static bool rx_push(uint32_t ep_num, uint32_t pktsts, const uint8_t *p_data, uint32_t len);
+static uint32_t rx_pop_status(void);
+static uint32_t rx_pop_word(void);
+static void rx_flush(void);
+
+static uint32_t tx_depth(uint32_t ep_num);
+static uint32_t tx_free(uint32_t ep_num);
+static void tx_push(uint32_t ep_num, uint32_t word);
+static uint32_t tx_pop(uint32_t ep_num);
+static void tx_flush(uint32_t fifo_num);
+
+
+/*##########################################################################*/
+/*#                            PUBLIC FUNCTIONS                            #*/
+/*##########################################################################*/
+
+/**
+ * @brief Map the peripherals and install the access traps.
+ *        Has to run before anything touches a register.
+ */
+void
+otg_sim_init(void)
+{
+    struct sigaction action = { 0 };
+
+    map_memory();
+
+    action.sa_flags = SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+    sigaddset(&action.sa_mask, SIGTRAP);
+    action.sa_sigaction = on_segv;
+    sigaction(SIGSEGV, &action, NULL);
+
+    sigemptyset(&action.sa_mask);
+    sigaddset(&action.sa_mask, SIGSEGV);
+    action.sa_sigaction = on_trap;
+    sigaction(SIGTRAP, &action, NULL);
+
+    // Reset values the driver depends on, the rest of the block reads 0
+    REG(G(GRXFSIZ)) = 0x200U;
+    REG(G(DIEPTXF0_HNPTXFSIZ)) = 0x02000200U;
+    REG(D(DCTL)) = USB_OTG_DCTL_SDIS;
+    for (uint32_t ep_num = 0; ep_num < OTG_SIM_EPS; ep_num++)
+    {
+        sim.out_nak[ep_num] = true;
+        sim.in_nak[ep_num] = true;
+    }
+
+    // What a call costs with nothing in it, taken off every measurement
+    otg_sim_cost_t cost = { 0 };
+    otg_sim_call(nothing, false, &cost);
+    sim.step_overhead = cost.instructions;
+}
+
+/**
+ * @brief Run a function single stepped and add what it cost.
+ *
+ * @param isr Run it as the OTG_FS interrupt, __get_IPSR reports the
+ *            exception number meanwhile.
+ */
+void
+otg_sim_call(void (*p_fn)(void), bool isr, otg_sim_cost_t *p_cost)
+{
+    uint32_t ipsr = cmsis_host_ipsr;
+
+    if (isr)
+    {
+        cmsis_host_ipsr = 16U + (uint32_t)OTG_FS_IRQn;
+    }
+    memset(&sim.cost, 0, sizeof(sim.cost));
+    sim.steps = 0;
+    sim.stepping = true;
+    step_call(p_fn);
+    sim.stepping = false;
+    cmsis_host_ipsr = ipsr;
+
+    p_cost->instructions += (sim.steps > sim.step_overhead) ? (sim.steps - sim.step_overhead) : 0U;
+    p_cost->reads += sim.cost.reads;
+    p_cost->writes += sim.cost.writes;
+}
+
+/**
+ * @brief Interrupt sources the core would signal to the CPU right now.
+ *
+ * @return Pending and unmasked GINTSTS bits, 0 while the interrupt is
+ *         disabled in GAHBCFG or the NVIC, or masked by PRIMASK.
+ */
+uint32_t
+otg_sim_irq_pending(void)
+{
+    uint32_t irq = (uint32_t)OTG_FS_IRQn;
+
+    if (!(REG(G(GAHBCFG)) & USB_OTG_GAHBCFG_GINT) ||
+        !(NVIC->ISER[irq >> 5] & (1UL << (irq & 0x1FU))) ||
+        (cmsis_host_primask != 0U))
+    {
+        return 0;
+    }
+    return gintsts() & REG(G(GINTMSK));
+}
+
+/**
+ * @brief Let time pass outside of stepped code.
+ */
+void
+otg_sim_advance(uint32_t cycles)
+{
+    if (DWT->CTRL & DWT_CTRL_CYCCNTENA_Msk)
+    {
+        DWT->CYCCNT += cycles;
+    }
+}
+
+const otg_sim_errors_t *
+otg_sim_get_errors(void)
+{
+    return &sim.errors;
+}
+
+
+/*##########################################################################*/
+/*#                               BUS EVENTS                               #*/
+/*##########################################################################*/
+
+/**
+ * @brief The host drives a bus reset. OUT endpoints NAK until the driver
+ *        enables them again.
+ */
+void
+otg_sim_bus_reset(void)
+{
+    sim.gintsts |= USB_OTG_GINTSTS_USBRST;
+    sim.suspended = false;
+    sim.old_address_valid = false;
+    for (uint32_t ep_num = 0; ep_num < OTG_SIM_EPS; ep_num++)
+    {
+        sim.out_nak[ep_num] = true;
+    }
+}
+
+/**
+ * @brief Speed enumeration at the end of the reset.
+ */
+void
+otg_sim_enum_done(void)
+{
+    sim.gintsts |= USB_OTG_GINTSTS_ENUMDNE;
+}
+
+void
+otg_sim_sof(void)
+{
+    sim.frame = (sim.frame + 1U) & 0x7FFU;
+    sim.gintsts |= USB_OTG_GINTSTS_SOF;
+}
+
+void
+otg_sim_suspend(void)
+{
+    sim.suspended = true;
+    sim.gintsts |= (USB_OTG_GINTSTS_ESUSP | USB_OTG_GINTSTS_USBSUSP);
+}
+
+void
+otg_sim_resume(void)
+{
+    sim.suspended = false;
+    sim.gintsts |= USB_OTG_GINTSTS_WKUINT;
+}
+
+/**
+ * @brief SETUP transaction on EP0.
+ *        Always taken while the RX FIFO has room, clears STALL and leaves
+ *        both directions of EP0 NAKing.
+ */
+otg_sim_handshake_t
+otg_sim_setup(uint8_t addr, const uint8_t *p_setup)
+{
+    if ((REG(D(DCTL)) & USB_OTG_DCTL_SDIS) || !addressed(addr))
+    {
+        return OTG_SIM_TIMEOUT;
+    }
+    if ((rx_depth() - rx_used()) < (1U + 2U + 1U))
+    {
+        sim.errors.setup_lost++;
+        return OTG_SIM_TIMEOUT;
+    }
+
+    (void)rx_push(0, RX_SETUP_DATA, p_setup, 8U);
+    (void)rx_push(0, RX_SETUP_COMPLETE, NULL, 0);
+
+    uint32_t tsiz = REG(OUT_EP(0, DOEPTSIZ));
+    uint32_t stupcnt = (tsiz & USB_OTG_DOEPTSIZ_STUPCNT) >> USB_OTG_DOEPTSIZ_STUPCNT_Pos;
+    if (stupcnt != 0U)
+    {
+        tsiz = (tsiz & ~USB_OTG_DOEPTSIZ_STUPCNT) | ((stupcnt - 1U) << USB_OTG_DOEPTSIZ_STUPCNT_Pos);
+        REG(OUT_EP(0, DOEPTSIZ)) = tsiz;
+    }
+
+    REG(IN_EP(0, DIEPCTL)) &= ~USB_OTG_DIEPCTL_STALL;
+    REG(OUT_EP(0, DOEPCTL)) &= ~USB_OTG_DOEPCTL_STALL;
+    sim.in_nak[0] = true;
+    sim.out_nak[0] = true;
+    if (addr == ((REG(D(DCFG)) & USB_OTG_DCFG_DAD) >> USB_OTG_DCFG_DAD_Pos))
+    {
+        sim.old_address_valid = false;
+    }
+    return OTG_SIM_ACK;
+}
+
+/**
+ * @brief IN transaction.
+ *        Sends the next packet of the enabled transfer once all of it is in
+ *        the TX FIFO, NAKs otherwise.
+ *
+ * @param p_buf Receives the packet, room for the max packet size.
+ * @param p_len Length of the packet.
+ */
+otg_sim_handshake_t
+otg_sim_in(uint8_t addr, uint8_t ep_num, uint8_t *p_buf, uint32_t *p_len)
+{
+    *p_len = 0;
+    if ((REG(D(DCTL)) & USB_OTG_DCTL_SDIS) || !addressed(addr) || (ep_num >= OTG_SIM_EPS))
+    {
+        return OTG_SIM_TIMEOUT;
+    }
+
+    uint32_t ctl = REG(IN_EP(ep_num, DIEPCTL));
+    if ((ep_num != 0U) && !(ctl & USB_OTG_DIEPCTL_USBAEP))
+    {
+        return OTG_SIM_TIMEOUT;
+    }
+    if (ctl & USB_OTG_DIEPCTL_STALL)
+    {
+        return OTG_SIM_STALL;
+    }
+    if (!(ctl & USB_OTG_DIEPCTL_EPENA) || sim.in_nak[ep_num])
+    {
+        return OTG_SIM_NAK;
+    }
+
+    uint32_t tsiz = REG(IN_EP(ep_num, DIEPTSIZ));
+    uint32_t pktcnt = (tsiz & USB_OTG_DIEPTSIZ_PKTCNT) >> USB_OTG_DIEPTSIZ_PKTCNT_Pos;
+    uint32_t xfrsiz = (tsiz & USB_OTG_DIEPTSIZ_XFRSIZ) >> USB_OTG_DIEPTSIZ_XFRSIZ_Pos;
+    uint32_t mps = ep_mps(ep_num, true);
+    uint32_t len = (xfrsiz < mps) ? xfrsiz : mps;
+    uint32_t words = (len + 3U) / 4U;
+
+    if (pktcnt == 0U)
+    {
+        sim.errors.bad_packet++;
+        return OTG_SIM_NAK;
+    }
+    if (sim.tx[ep_num].count < words)
+    {
+        // Underrun, the rest of the packet is not written yet
+        return OTG_SIM_NAK;
+    }
+    if ((len < mps) && (pktcnt > 1U))
+    {
+        // A short packet before the last one ends the transfer early
+        sim.errors.bad_packet++;
+    }
+
+    for (uint32_t word = 0; word < words; word++)
+    {
+        uint32_t value = tx_pop(ep_num);
+        uint32_t bytes = ((len - (word * 4U)) < 4U) ? (len - (word * 4U)) : 4U;
+        memcpy(&p_buf[word * 4U], &value, bytes);
+    }
+    *p_len = len;
+
+    xfrsiz -= len;
+    pktcnt--;
+    REG(IN_EP(ep_num, DIEPTSIZ)) = (tsiz & ~(USB_OTG_DIEPTSIZ_PKTCNT | USB_OTG_DIEPTSIZ_XFRSIZ)) |
+                                   (pktcnt << USB_OTG_DIEPTSIZ_PKTCNT_Pos) |
+                                   (xfrsiz << USB_OTG_DIEPTSIZ_XFRSIZ_Pos);
+    if (pktcnt == 0U)
+    {
+        REG(IN_EP(ep_num, DIEPCTL)) &= ~USB_OTG_DIEPCTL_EPENA;
+        sim.diepint[ep_num] |= USB_OTG_DIEPINT_XFRC;
+        if (ep_num == 0U)
+        {
+            // SET_ADDRESS status stage is over, the new address applies
+            sim.old_address_valid = false;
+        }
+    }
+    return OTG_SIM_ACK;
+}
+
+/**
+ * @brief OUT transaction.
+ *        Takes the packet into the RX FIFO while the endpoint is enabled
+ *        and not NAKing. A short packet or the last one of the transfer size
+ *        completes the transfer and disables the endpoint.
+ */
+otg_sim_handshake_t
+otg_sim_out(uint8_t addr, uint8_t ep_num, const uint8_t *p_data, uint32_t len)
+{
+    if ((REG(D(DCTL)) & USB_OTG_DCTL_SDIS) || !addressed(addr) || (ep_num >= OTG_SIM_EPS))
+    {
+        return OTG_SIM_TIMEOUT;
+    }
+
+    uint32_t ctl = REG(OUT_EP(ep_num, DOEPCTL));
+    uint32_t mps = ep_mps(ep_num, false);
+    if ((ep_num != 0U) && !(ctl & USB_OTG_DOEPCTL_USBAEP))
+    {
+        return OTG_SIM_TIMEOUT;
+    }
+    if (ctl & USB_OTG_DOEPCTL_STALL)
+    {
+        return OTG_SIM_STALL;
+    }
+    if (!(ctl & USB_OTG_DOEPCTL_EPENA) || sim.out_nak[ep_num] || sim.global_out_nak || (len > mps) ||
+        ((rx_depth() - rx_used()) < (1U + ((len + 3U) / 4U) + 1U)))
+    {
+        return OTG_SIM_NAK;
+    }
+
+    (void)rx_push(ep_num, RX_OUT_DATA, p_data, len);
+
+    uint32_t tsiz = REG(OUT_EP(ep_num, DOEPTSIZ));
+    uint32_t pktcnt = (tsiz & USB_OTG_DOEPTSIZ_PKTCNT) >> USB_OTG_DOEPTSIZ_PKTCNT_Pos;
+    uint32_t xfrsiz = (tsiz & USB_OTG_DOEPTSIZ_XFRSIZ) >> USB_OTG_DOEPTSIZ_XFRSIZ_Pos;
+    xfrsiz -= (len < xfrsiz) ? len : xfrsiz;
+    pktcnt -= (pktcnt != 0U) ? 1U : 0U;
+    REG(OUT_EP(ep_num, DOEPTSIZ)) = (tsiz & ~(USB_OTG_DOEPTSIZ_PKTCNT | USB_OTG_DOEPTSIZ_XFRSIZ)) |
+                                    (pktcnt << USB_OTG_DOEPTSIZ_PKTCNT_Pos) |
+                                    (xfrsiz << USB_OTG_DOEPTSIZ_XFRSIZ_Pos);
+
+    if ((pktcnt == 0U) || (len < mps))
+    {
+        (void)rx_push(ep_num, RX_OUT_COMPLETE, NULL, 0);
+        REG(OUT_EP(ep_num, DOEPCTL)) &= ~USB_OTG_DOEPCTL_EPENA;
+        sim.out_nak[ep_num] = true;
+    }
+    return OTG_SIM_ACK;
+}
+
+
+/*##########################################################################*/
+/*#                            ACCESS TRAPPING                             #*/
+/*##########################################################################*/
+
+/**
+ * @brief Map the register block twice: without rights at its address for
+ *        the driver, read/write elsewhere for the model.
+ */
+static void
+map_memory(void)
+{
+    int fd = memfd_create("otg_fs", 0);
+
+    if ((fd < 0) || (ftruncate(fd, OTG_SIZE) != 0))
+    {
+        perror("otg_sim: memfd");
+        exit(EXIT_FAILURE);
+    }
+
+    void *p_otg = mmap((void *)USB_OTG_FS_PERIPH_BASE, OTG_SIZE, PROT_NONE,
+                       MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0);
+    void *p_shadow = mmap(NULL, OTG_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    void *p_periph = mmap((void *)PERIPH_BASE_, PERIPH_SIZE, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+    void *p_system = mmap((void *)SYSTEM_BASE, SYSTEM_SIZE, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+    void *p_uid = mmap((void *)UID_PAGE, PAGE_SIZE_, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+
+    if ((p_otg != (void *)USB_OTG_FS_PERIPH_BASE) || (p_shadow == MAP_FAILED) ||
+        (p_periph != (void *)PERIPH_BASE_) || (p_system != (void *)SYSTEM_BASE) ||
+        (p_uid != (void *)UID_PAGE))
+    {
+        fprintf(stderr, "otg_sim: cannot map the peripheral address space\n");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+    sim.p_regs = p_shadow;
+
+    volatile uint32_t *p_uid_words = (volatile uint32_t *)UID_BASE;
+    p_uid_words[0] = 0x00350041U;
+    p_uid_words[1] = 0x33385111U;
+    p_uid_words[2] = 0x20373630U;
+}
+
+/**
+ * @brief A register access faulted.
+ *        Puts the value a read returns into the shadow, opens the page and
+ *        sets the trap flag so on_trap runs right after the instruction.
+ */
+static void
+on_segv(int sig, siginfo_t *p_info, void *p_context)
+{
+    ucontext_t *p_uc = p_context;
+    uintptr_t addr = (uintptr_t)p_info->si_addr;
+
+    if ((addr < USB_OTG_FS_PERIPH_BASE) || (addr >= (USB_OTG_FS_PERIPH_BASE + OTG_SIZE)) ||
+        sim.trap.pending)
+    {
+        // A real crash, let it happen
+        signal(sig, SIG_DFL);
+        return;
+    }
+
+    uint32_t offset = (uint32_t)(addr - USB_OTG_FS_PERIPH_BASE) & ~3U;
+    bool write = (p_uc->uc_mcontext.gregs[REG_ERR] & PF_WRITE) != 0U;
+
+    // A write can be a read-modify-write instruction, it sees the value
+    // but must not pop anything
+    sim.trap.before = reg_read(offset, !write);
+    REG(offset) = sim.trap.before;
+    if (write)
+    {
+        sim.cost.writes++;
+    }
+    else
+    {
+        sim.cost.reads++;
+    }
+
+    sim.trap.pending = true;
+    sim.trap.write = write;
+    sim.trap.offset = offset;
+    sim.trap.p_page = (void *)(addr & ~(PAGE_SIZE_ - 1U));
+    mprotect(sim.trap.p_page, PAGE_SIZE_, PROT_READ | PROT_WRITE);
+    p_uc->uc_mcontext.gregs[REG_EFL] |= EFLAGS_TF;
+}
+
+/**
+ * @brief One instruction was executed with the trap flag set.
+ *        Completes a trapped write and closes the page again, counts the
+ *        step while measuring.
+ */
+static void
+on_trap(int sig, siginfo_t *p_info, void *p_context)
+{
+    ucontext_t *p_uc = p_context;
+
+    (void)sig;
+    (void)p_info;
+
+    if (sim.trap.pending)
+    {
+        if (sim.trap.write)
+        {
+            reg_write(sim.trap.offset, REG(sim.trap.offset), sim.trap.before);
+        }
+        mprotect(sim.trap.p_page, PAGE_SIZE_, PROT_NONE);
+        sim.trap.pending = false;
+    }
+
+    if (sim.stepping)
+    {
+        sim.steps++;
+        if (DWT->CTRL & DWT_CTRL_CYCCNTENA_Msk)
+        {
+            DWT->CYCCNT++;
+        }
+    }
+    else
+    {
+        p_uc->uc_mcontext.gregs[REG_EFL] &= ~EFLAGS_TF;
+    }
+}
+
+/**
+ * @brief Call a function with the trap flag set.
+ *        Not inlined, so every measurement has the same fixed overhead.
+ */
+static __attribute__((noinline)) void
+step_call(void (*p_fn)(void))
+{
+    __asm volatile("pushfq\n\torq $0x100, (%%rsp)\n\tpopfq" ::: "memory", "cc");
+    p_fn();
+    __asm volatile("pushfq\n\tandq $~0x100, (%%rsp)\n\tpopfq" ::: "memory", "cc");
+}
+
+static __attribute__((noinline)) void
+nothing(void)
+{
+}
+
+
+/*##########################################################################*/
+/*#                           REGISTER SEMANTICS                           #*/
+/*##########################################################################*/
+
+/**
+ * @brief Value of a register as the core presents it.
+ *
+ * @param pop Whether this is a real read, reading GRXSTSP or the FIFO
+ *            window pops.
+ */
+static uint32_t
+reg_read(uint32_t offset, bool pop)
+{
+    if (offset >= USB_OTG_FIFO_BASE)
+    {
+        return pop ? rx_pop_word() : 0U;
+    }
+    if ((offset >= USB_OTG_IN_ENDPOINT_BASE) &&
+        (offset < (USB_OTG_IN_ENDPOINT_BASE + (OTG_SIM_EPS * USB_OTG_EP_REG_SIZE))))
+    {
+        uint32_t ep_num = (offset - USB_OTG_IN_ENDPOINT_BASE) / USB_OTG_EP_REG_SIZE;
+
+        if (offset == IN_EP(ep_num, DIEPCTL))
+        {
+            return REG(offset) | (sim.in_nak[ep_num] ? USB_OTG_DIEPCTL_NAKSTS : 0U);
+        }
+        if (offset == IN_EP(ep_num, DIEPINT))
+        {
+            return diepint(ep_num);
+        }
+        if (offset == IN_EP(ep_num, DTXFSTS))
+        {
+            return tx_free(ep_num);
+        }
+        return REG(offset);
+    }
+    if ((offset >= USB_OTG_OUT_ENDPOINT_BASE) &&
+        (offset < (USB_OTG_OUT_ENDPOINT_BASE + (OTG_SIM_EPS * USB_OTG_EP_REG_SIZE))))
+    {
+        uint32_t ep_num = (offset - USB_OTG_OUT_ENDPOINT_BASE) / USB_OTG_EP_REG_SIZE;
+
+        if (offset == OUT_EP(ep_num, DOEPCTL))
+        {
+            return REG(offset) | (sim.out_nak[ep_num] ? USB_OTG_DOEPCTL_NAKSTS : 0U);
+        }
+        if (offset == OUT_EP(ep_num, DOEPINT))
+        {
+            return sim.doepint[ep_num];
+        }
+        return REG(offset);
+    }
+
+    switch (offset)
+    {
+        case G(GINTSTS):
+            return gintsts();
+        case G(GRSTCTL):
+            return REG(offset) | USB_OTG_GRSTCTL_AHBIDL;
+        case G(GRXSTSR):
+            return (sim.rx_count != 0U) ? sim.rx[sim.rx_head].status : 0U;
+        case G(GRXSTSP):
+            return pop ? rx_pop_status() : ((sim.rx_count != 0U) ? sim.rx[sim.rx_head].status : 0U);
+        case G(CID):
+            return 0x00001200U;
+        case D(DSTS):
+            return ((sim.frame << USB_OTG_DSTS_FNSOF_Pos) & USB_OTG_DSTS_FNSOF) |
+                   (3U << USB_OTG_DSTS_ENUMSPD_Pos) |
+                   (sim.suspended ? USB_OTG_DSTS_SUSPSTS : 0U);
+        case D(DAINT):
+            return daint();
+        default:
+            return REG(offset);
+    }
+}
+
+/**
+ * @brief Apply a write, REG(offset) holds the value written.
+ *
+ * @param before Value the register read before the write.
+ */
+static void
+reg_write(uint32_t offset, uint32_t value, uint32_t before)
+{
+    if (offset >= USB_OTG_FIFO_BASE)
+    {
+        uint32_t fifo_num = (offset / USB_OTG_FIFO_SIZE) - 1U;
+        if (fifo_num < OTG_SIM_EPS)
+        {
+            tx_push(fifo_num, value);
+        }
+        return;
+    }
+    if ((offset >= USB_OTG_IN_ENDPOINT_BASE) &&
+        (offset < (USB_OTG_IN_ENDPOINT_BASE + (OTG_SIM_EPS * USB_OTG_EP_REG_SIZE))))
+    {
+        uint32_t ep_num = (offset - USB_OTG_IN_ENDPOINT_BASE) / USB_OTG_EP_REG_SIZE;
+
+        if (offset == IN_EP(ep_num, DIEPCTL))
+        {
+            REG(offset) = ep_ctl_write(value, &sim.in_nak[ep_num], &sim.diepint[ep_num],
+                                       USB_OTG_DIEPINT_EPDISD);
+        }
+        else if (offset == IN_EP(ep_num, DIEPINT))
+        {
+            sim.diepint[ep_num] &= ~value;
+        }
+        else if (offset == IN_EP(ep_num, DTXFSTS))
+        {
+            REG(offset) = before;
+        }
+        return;
+    }
+    if ((offset >= USB_OTG_OUT_ENDPOINT_BASE) &&
+        (offset < (USB_OTG_OUT_ENDPOINT_BASE + (OTG_SIM_EPS * USB_OTG_EP_REG_SIZE))))
+    {
+        uint32_t ep_num = (offset - USB_OTG_OUT_ENDPOINT_BASE) / USB_OTG_EP_REG_SIZE;
+
+        if (offset == OUT_EP(ep_num, DOEPCTL))
+        {
+            REG(offset) = ep_ctl_write(value, &sim.out_nak[ep_num], &sim.doepint[ep_num],
+                                       USB_OTG_DOEPINT_EPDISD);
+        }
+        else if (offset == OUT_EP(ep_num, DOEPINT))
+        {
+            sim.doepint[ep_num] &= ~value;
+        }
+        return;
+    }
+
+    switch (offset)
+    {
+        case G(GINTSTS):
+            sim.gintsts &= ~(value & GINTSTS_W1C);
+            break;
+        case G(GRSTCTL):
+            if (value & USB_OTG_GRSTCTL_CSRST)
+            {
+                core_reset();
+            }
+            if (value & USB_OTG_GRSTCTL_RXFFLSH)
+            {
+                rx_flush();
+            }
+            if (value & USB_OTG_GRSTCTL_TXFFLSH)
+            {
+                tx_flush((value & USB_OTG_GRSTCTL_TXFNUM) >> USB_OTG_GRSTCTL_TXFNUM_Pos);
+            }
+            REG(offset) = value & USB_OTG_GRSTCTL_TXFNUM;
+            break;
+        case D(DCFG):
+        {
+            uint8_t old_address = (before & USB_OTG_DCFG_DAD) >> USB_OTG_DCFG_DAD_Pos;
+            if ((value ^ before) & USB_OTG_DCFG_DAD)
+            {
+                // The core answers the status stage at the old address
+                sim.old_address = old_address;
+                sim.old_address_valid = true;
+            }
+            break;
+        }
+        case D(DCTL):
+            // Global OUT NAK takes effect at once, the model has no packet
+            // in flight into the RX FIFO
+            if (value & USB_OTG_DCTL_SGONAK)
+            {
+                sim.global_out_nak = true;
+            }
+            if (value & USB_OTG_DCTL_CGONAK)
+            {
+                sim.global_out_nak = false;
+            }
+            REG(offset) = (value & ~(DCTL_WRITE_ONLY | USB_OTG_DCTL_GONSTS)) |
+                          (sim.global_out_nak ? USB_OTG_DCTL_GONSTS : 0U);
+            break;
+        case G(GRXSTSR):
+        case G(GRXSTSP):
+        case G(CID):
+        case D(DSTS):
+        case D(DAINT):
+            REG(offset) = before;
+            break;
+        default:
+            break;
+    }
+}
+
+/**
+ * @brief DIEPCTL/DOEPCTL write: NAK set and clear, disable.
+ *
+ * @return Value the register keeps.
+ */
+static uint32_t
+ep_ctl_write(uint32_t value, bool *p_nak, uint32_t *p_int, uint32_t disabled)
+{
+    if (value & USB_OTG_DIEPCTL_CNAK)
+    {
+        *p_nak = false;
+    }
+    if (value & USB_OTG_DIEPCTL_SNAK)
+    {
+        *p_nak = true;
+    }
+    if ((value & USB_OTG_DIEPCTL_EPDIS) && (value & USB_OTG_DIEPCTL_EPENA))
+    {
+        value &= ~USB_OTG_DIEPCTL_EPENA;
+        *p_int |= disabled;
+    }
+    return value & ~EPCTL_WRITE_ONLY;
+}
+
+/**
+ * @brief CSRST: state machines and FIFOs start over, the registers stay.
+ */
+static void
+core_reset(void)
+{
+    sim.gintsts = 0;
+    sim.global_out_nak = false;
+    memset(sim.diepint, 0, sizeof(sim.diepint));
+    memset(sim.doepint, 0, sizeof(sim.doepint));
+    rx_flush();
+    tx_flush(0x10U);
+}
+
+static uint32_t
+gintsts(void)
+{
+    uint32_t value = sim.gintsts;
+    uint32_t pending = daint() & REG(D(DAINTMSK));
+
+    if (sim.rx_count != 0U)
+    {
+        value |= USB_OTG_GINTSTS_RXFLVL;
+    }
+    if (sim.global_out_nak)
+    {
+        value |= USB_OTG_GINTSTS_BOUTNAKEFF;
+    }
+    if (pending & USB_OTG_DAINT_IEPINT)
+    {
+        value |= USB_OTG_GINTSTS_IEPINT;
+    }
+    if (pending & USB_OTG_DAINT_OEPINT)
+    {
+        value |= USB_OTG_GINTSTS_OEPINT;
+    }
+    return value;
+}
+
+/**
+ * @brief Endpoints with an unmasked interrupt, TXFE is masked per endpoint
+ *        in DIEPEMPMSK.
+ */
+static uint32_t
+daint(void)
+{
+    uint32_t value = 0;
+
+    for (uint32_t ep_num = 0; ep_num < OTG_SIM_EPS; ep_num++)
+    {
+        uint32_t mask = REG(D(DIEPMSK)) & ~USB_OTG_DIEPINT_TXFE;
+        if (REG(D(DIEPEMPMSK)) & (1U << ep_num))
+        {
+            mask |= USB_OTG_DIEPINT_TXFE;
+        }
+        if (diepint(ep_num) & mask)
+        {
+            value |= 1U << (USB_OTG_DAINT_IEPINT_Pos + ep_num);
+        }
+        if (sim.doepint[ep_num] & REG(D(DOEPMSK)))
+        {
+            value |= 1U << (USB_OTG_DAINT_OEPINT_Pos + ep_num);
+        }
+    }
+    return value;
+}
+
+/**
+ * @brief DIEPINT with TXFE as the level of the TX FIFO, half empty or
+ *        completely empty depending on GAHBCFG.TXFELVL.
+ */
+static uint32_t
+diepint(uint32_t ep_num)
+{
+    uint32_t depth = tx_depth(ep_num);
+    uint32_t free = tx_free(ep_num);
+    bool empty = (REG(G(GAHBCFG)) & USB_OTG_GAHBCFG_TXFELVL) ? (free == depth)
+                                                              : ((free * 2U) >= depth);
+
+    return sim.diepint[ep_num] | ((empty && (depth != 0U)) ? USB_OTG_DIEPINT_TXFE : 0U);
+}
+
+/**
+ * @brief EP0 encodes its max packet size in two bits.
+ */
+static uint32_t
+ep0_mps(uint32_t ctl)
+{
+    static const uint32_t sizes[4] = { 64U, 32U, 16U, 8U };
+
+    return sizes[ctl & 0x3U];
+}
+
+static uint32_t
+ep_mps(uint32_t ep_num, bool in)
+{
+    uint32_t ctl = in ? REG(IN_EP(ep_num, DIEPCTL)) : REG(OUT_EP(ep_num, DOEPCTL));
+
+    if (ep_num == 0U)
+    {
+        // OUT EP0 follows the IN side
+        return ep0_mps(REG(IN_EP(0, DIEPCTL)));
+    }
+    return ctl & USB_OTG_DIEPCTL_MPSIZ;
+}
+
+/**
+ * @brief Whether a token is for this device.
+ */
+static bool
+addressed(uint8_t addr)
+{
+    uint8_t address = (REG(D(DCFG)) & USB_OTG_DCFG_DAD) >> USB_OTG_DCFG_DAD_Pos;
+
+    return (addr == address) || (sim.old_address_valid && (addr == sim.old_address));
+}
+
+
+/*##########################################################################*/
+/*#                                 FIFOS                                  #*/
+/*##########################################################################*/
+
+static uint32_t
+rx_depth(void)
+{
+    return REG(G(GRXFSIZ)) & 0xFFFFU;
+}
+
+/**
+ * @brief Words taken in the RX FIFO, including what is left of the packet
+ *        being read.
+ */
+static uint32_t
+rx_used(void)
+{
+    uint32_t used = sim.rx_current.count - sim.rx_current.read;
+
+    for (uint32_t entry = 0; entry < sim.rx_count; entry++)
+    {
+        used += 1U + sim.rx[(sim.rx_head + entry) % RX_ENTRIES].count;
+    }
+    return used;
+}
+
+/**
+ * @brief Queue a receive status and its packet.
+ */
+static bool
+rx_push(uint32_t ep_num, uint32_t pktsts, const uint8_t *p_data, uint32_t len)
+{
+    if (sim.rx_count >= RX_ENTRIES)
+    {
+        return false;
+    }
+
+    rx_entry_t *p_entry = &sim.rx[(sim.rx_head + sim.rx_count) % RX_ENTRIES];
+    memset(p_entry, 0, sizeof(*p_entry));
+    p_entry->status = (ep_num << USB_OTG_GRXSTSP_EPNUM_Pos) |
+                      (len << USB_OTG_GRXSTSP_BCNT_Pos) |
+                      (pktsts << USB_OTG_GRXSTSP_PKTSTS_Pos);
+    p_entry->count = (len + 3U) / 4U;
+    if (len != 0U)
+    {
+        memcpy(p_entry->words, p_data, len);
+    }
+    sim.rx_count++;
+    return true;
+}
+
+/**
+ * @brief GRXSTSP read.
+ *        Completion entries raise their endpoint interrupt as they leave.
+ */
+static uint32_t
+rx_pop_status(void)
+{
+    if (sim.rx_count == 0U)
+    {
+        sim.errors.rx_underflow++;
+        return 0;
+    }
+
+    sim.errors.rx_unread += sim.rx_current.count - sim.rx_current.read;
+    sim.rx_current = sim.rx[sim.rx_head];
+    sim.rx_head = (sim.rx_head + 1U) % RX_ENTRIES;
+    sim.rx_count--;
+
+    uint32_t status = sim.rx_current.status;
+    uint32_t ep_num = (status & USB_OTG_GRXSTSP_EPNUM) >> USB_OTG_GRXSTSP_EPNUM_Pos;
+    switch ((status & USB_OTG_GRXSTSP_PKTSTS) >> USB_OTG_GRXSTSP_PKTSTS_Pos)
+    {
+        case RX_OUT_COMPLETE:
+            sim.doepint[ep_num] |= USB_OTG_DOEPINT_XFRC;
+            break;
+        case RX_SETUP_COMPLETE:
+            sim.doepint[0] |= USB_OTG_DOEPINT_STUP;
+            break;
+        default:
+            break;
+    }
+    return status;
+}
+
+static uint32_t
+rx_pop_word(void)
+{
+    if (sim.rx_current.read >= sim.rx_current.count)
+    {
+        sim.errors.rx_underflow++;
+        return 0;
+    }
+    return sim.rx_current.words[sim.rx_current.read++];
+}
+
+static void
+rx_flush(void)
+{
+    sim.rx_head = 0;
+    sim.rx_count = 0;
+    memset(&sim.rx_current, 0, sizeof(sim.rx_current));
+}
+
+static uint32_t
+tx_depth(uint32_t ep_num)
+{
+    uint32_t fifo_reg = (ep_num == 0U) ? REG(G(DIEPTXF0_HNPTXFSIZ)) : REG(G(DIEPTXF[ep_num - 1U]));
+    uint32_t depth = fifo_reg >> 16;
+
+    return (depth < OTG_SIM_FIFO_WORDS) ? depth : OTG_SIM_FIFO_WORDS;
+}
+
+static uint32_t
+tx_free(uint32_t ep_num)
+{
+    uint32_t depth = tx_depth(ep_num);
+
+    return (sim.tx[ep_num].count < depth) ? (depth - sim.tx[ep_num].count) : 0U;
+}
+
+static void
+tx_push(uint32_t ep_num, uint32_t word)
+{
+    tx_fifo_t *p_fifo = &sim.tx[ep_num];
+
+    if (tx_free(ep_num) == 0U)
+    {
+        sim.errors.tx_overflow++;
+        return;
+    }
+    p_fifo->words[(p_fifo->head + p_fifo->count) % OTG_SIM_FIFO_WORDS] = word;
+    p_fifo->count++;
+}
+
+static uint32_t
+tx_pop(uint32_t ep_num)
+{
+    tx_fifo_t *p_fifo = &sim.tx[ep_num];
+    uint32_t word = p_fifo->words[p_fifo->head];
+
+    p_fifo->head = (p_fifo->head + 1U) % OTG_SIM_FIFO_WORDS;
+    p_fifo->count--;
+    return word;
+}
+
+/**
+ * @brief TXFFLSH, TXFNUM 0x10 flushes all of them.
+ */
+static void
+tx_flush(uint32_t fifo_num)
+{
+    for (uint32_t ep_num = 0; ep_num < OTG_SIM_EPS; ep_num++)
+    {
+        if ((fifo_num == 0x10U) || (fifo_num == ep_num))
+        {
+            sim.tx[ep_num].head = 0;
+            sim.tx[ep_num].count = 0;
+        }
+    }
+}
+
+/*** end of file ***/
\ No newline at end of file
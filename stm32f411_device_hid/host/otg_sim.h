@@ -0,0 +1,87 @@
+/** @file otg_sim.h
+ *
+ * @brief Behavioral model of the OTG_FS device core for host builds of the
+ *        driver.
+ *
+ * The register block is mapped at its real address without access rights,
+ * so the driver runs unmodified: every access faults, the model prepares
+ * the value a read returns (popping GRXSTSP or the RX FIFO, computing
+ * DAINT and DTXFSTS), lets the instruction run on a shadow mapping with
+ * the trap flag set and applies what a write means (write-1-to-clear,
+ * FIFO pushes, self clearing reset bits, CNAK/SNAK/EPDIS) before the next
+ * instruction. The bus side is driven by otg_sim_setup/in/out, one token
+ * each, as a host controller would send them.
+ *
+ * otg_sim_call single steps a function, counting its instructions and
+ * register accesses. DWT->CYCCNT advances by one per stepped instruction,
+ * so the driver's own cycle statistics count host instructions in here.
+ *
+ * x86-64 Linux only.
+ */
+
+#ifndef OTG_SIM_H
+#define OTG_SIM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define OTG_SIM_EPS         (4U)    /* Endpoints per direction */
+#define OTG_SIM_FIFO_WORDS  (320U)  /* 1.25 KB of FIFO RAM */
+
+/**
+ * @brief Handshake the device answered a token with. TIMEOUT is no answer
+ *        at all: wrong address, inactive endpoint, soft disconnect.
+ */
+typedef enum otg_sim_handshake_e
+{
+    OTG_SIM_ACK = 0,
+    OTG_SIM_NAK,
+    OTG_SIM_STALL,
+    OTG_SIM_TIMEOUT
+} otg_sim_handshake_t;
+
+/**
+ * @brief Cost of the code run through otg_sim_call.
+ */
+typedef struct otg_sim_cost_s
+{
+    uint64_t instructions;
+    uint64_t reads;
+    uint64_t writes;
+} otg_sim_cost_t;
+
+/**
+ * @brief Things the driver did that a real core would not have liked.
+ *
+ * tx_overflow counts words written to a full TX FIFO, rx_underflow reads
+ * of an empty RX FIFO, rx_unread words left behind by popping the next
+ * receive status, setup_lost SETUP packets without RX FIFO room and
+ * bad_packet IN packets the transfer size did not describe.
+ */
+typedef struct otg_sim_errors_s
+{
+    uint32_t tx_overflow;
+    uint32_t rx_underflow;
+    uint32_t rx_unread;
+    uint32_t setup_lost;
+    uint32_t bad_packet;
+} otg_sim_errors_t;
+
+void otg_sim_init(void);
+void otg_sim_call(void (*p_fn)(void), bool isr, otg_sim_cost_t *p_cost);
+uint32_t otg_sim_irq_pending(void);
+void otg_sim_advance(uint32_t cycles);
+const otg_sim_errors_t *otg_sim_get_errors(void);
+
+void otg_sim_bus_reset(void);
+void otg_sim_enum_done(void);
+void otg_sim_sof(void);
+void otg_sim_suspend(void);
+void otg_sim_resume(void);
+otg_sim_handshake_t otg_sim_setup(uint8_t addr, const uint8_t *p_setup);
+otg_sim_handshake_t otg_sim_in(uint8_t addr, uint8_t ep_num, uint8_t *p_buf, uint32_t *p_len);
+otg_sim_handshake_t otg_sim_out(uint8_t addr, uint8_t ep_num, const uint8_t *p_data, uint32_t len);
+
+#endif /* OTG_SIM_H */
+
+/*** end of file ***/
\ No newline at end of file
@@ -0,0 +1,609 @@
+/** @file replay.c
+ *
+ * @brief Replays a usbmon capture against the host build of the driver.
+ *
+ * The URBs of one device are sent through the virtual host (vhost.c) in the
+ * order and with the spacing they had in the capture, SOFs included, so a
+ * field report can be reproduced with the host that produced it: Windows,
+ * macOS and Linux all enumerate in their own way. Every transaction is
+ * checked against what the capture says the device answered and charged
+ * with what the driver spent on it.
+ *
+ * What the capture cannot carry is left out: the bus reset is taken from
+ * the hub port reset requests or from the device going back to address 0,
+ * and an interrupt or bulk IN is only polled when the captured URB
+ * completed, a NAK there means the application had nothing to send, which
+ * is not replayed. Gaps longer than -i milliseconds are cut short.
+ */
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "usb.h"
+#include "usb_internal.h"
+#include "usb_kbd.h"
+#include "usbmon.h"
+#include "vhost.h"
+
+#define DEFAULT_MAX_IDLE_MS (1000U)
+#define PACKET_MAX          (64U)
+#define DATA_MAX            (4096U)
+#define FRAME_US            (1000U)
+#define CYCLES_PER_US       (USB_FRAME_CYCLES / FRAME_US)
+#define KINDS_MAX           (64U)
+
+#define EPIPE_              (32)
+#define ENOENT_             (2)
+#define ECONNRESET_         (104)
+#define ESHUTDOWN_          (108)
+
+/**
+ * @brief Cost of one kind of transaction over the replay.
+ */
+typedef struct kind_cost_s
+{
+    char name[40];
+    uint32_t count;
+    uint64_t instructions;
+    uint64_t max_instructions;
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t isr_max;
+} kind_cost_t;
+
+static void bench_init(void);
+static int pick_device(const usbmon_capture_t *p_capture);
+static bool selected(const usbmon_urb_t *p_urb);
+static bool is_port_reset(const usbmon_urb_t *p_urb);
+static uint64_t exec_time(const usbmon_urb_t *p_urb);
+static int compare_urbs(const void *p_a, const void *p_b);
+static void advance_to(uint64_t us);
+static void bring_up(uint8_t addr);
+static void replay(const usbmon_urb_t *p_urb);
+static bool check_data(const usbmon_urb_t *p_urb, const uint8_t *p_data, uint32_t len);
+static const char *urb_name(const usbmon_urb_t *p_urb, char *p_buf, size_t size);
+static void account(const char *p_name, const vhost_cost_t *p_cost);
+static void report(const char *p_fmt, ...) __attribute__((format(printf, 1, 2)));
+
+static usb_driver_t usb_driver;
+static int select_bus = -1;
+static int select_dev = -1;
+static uint32_t max_idle_us = DEFAULT_MAX_IDLE_MS * 1000U;
+static bool compare_data = true;
+static bool quiet;
+
+static bool follow[128];        /* Device addresses of the replayed device */
+static uint8_t address;         /* Its address in the replay */
+static bool reset_pending = true;
+static bool started;
+static uint64_t now_us;
+static uint32_t frame_us;
+static uint64_t skipped_us;
+
+static uint32_t transactions;
+static uint32_t mismatches;
+static uint32_t not_reproduced;
+static vhost_cost_t idle;
+static kind_cost_t kinds[KINDS_MAX];
+static uint32_t kind_count;
+
+
+/*##########################################################################*/
+/*#                                  MAIN                                  #*/
+/*##########################################################################*/
+
+int
+main(int argc, char **argv)
+{
+    usbmon_capture_t capture;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:d:i:Dq")) != -1)
+    {
+        switch (opt)
+        {
+            case 'b':
+                select_bus = atoi(optarg);
+                break;
+            case 'd':
+                select_dev = atoi(optarg);
+                break;
+            case 'i':
+                max_idle_us = (uint32_t)strtoul(optarg, NULL, 0) * 1000U;
+                break;
+            case 'D':
+                compare_data = false;
+                break;
+            case 'q':
+                quiet = true;
+                break;
+            default:
+                optind = argc;
+                break;
+        }
+    }
+    if (optind != (argc - 1))
+    {
+        fprintf(stderr, "usage: %s [-b bus] [-d device] [-i max idle ms] [-D] [-q] capture\n"
+                        "  -d  device number in the capture, default: the one that is\n"
+                        "      enumerated at address 0, else the only one there is\n"
+                        "  -D  do not compare IN data, only lengths and handshakes\n"
+                        "  -q  summary only\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (!usbmon_load(argv[optind], &capture))
+    {
+        return EXIT_FAILURE;
+    }
+
+    if (select_dev < 0)
+    {
+        select_dev = pick_device(&capture);
+        if (select_dev < 0)
+        {
+            usbmon_free(&capture);
+            return EXIT_FAILURE;
+        }
+    }
+    follow[select_dev & 0x7F] = true;
+
+    // Control and OUT transfers happen when they are submitted, IN data
+    // when it is there, which is when the URB completed
+    qsort(capture.p_urbs, capture.count, sizeof(usbmon_urb_t), compare_urbs);
+
+    vhost_init();
+    vhost_run(bench_init);
+
+    for (size_t i = 0; i < capture.count; i++)
+    {
+        const usbmon_urb_t *p_urb = &capture.p_urbs[i];
+
+        if ((select_bus >= 0) && (p_urb->bus != select_bus))
+        {
+            continue;
+        }
+        if (is_port_reset(p_urb))
+        {
+            reset_pending = true;
+            continue;
+        }
+        if (selected(p_urb))
+        {
+            replay(p_urb);
+        }
+    }
+
+    printf("\n%u transactions, %u mismatches, %u IN not reproduced", transactions, mismatches,
+           not_reproduced);
+    if (skipped_us != 0U)
+    {
+        printf(", %.3f s of idle time skipped", (double)skipped_us / 1e6);
+    }
+    printf("\n\n  %-32s %6s %10s %10s %10s %8s %8s\n",
+           "", "count", "instr avg", "instr max", "isr max", "rd avg", "wr avg");
+    for (uint32_t kind = 0; kind < kind_count; kind++)
+    {
+        const kind_cost_t *p_kind = &kinds[kind];
+        printf("  %-32s %6u %10llu %10llu %10llu %8.1f %8.1f\n", p_kind->name, p_kind->count,
+               (unsigned long long)(p_kind->instructions / p_kind->count),
+               (unsigned long long)p_kind->max_instructions, (unsigned long long)p_kind->isr_max,
+               (double)p_kind->reads / p_kind->count, (double)p_kind->writes / p_kind->count);
+    }
+    printf("  %-32s %6u %10llu %10s %10llu %8.1f %8.1f\n", "idle (SOF, usb_poll)", idle.calls,
+           (unsigned long long)((idle.calls != 0U) ? (idle.instructions / idle.calls) : 0U), "",
+           (unsigned long long)idle.max_instructions,
+           (idle.calls != 0U) ? ((double)idle.reads / idle.calls) : 0.0,
+           (idle.calls != 0U) ? ((double)idle.writes / idle.calls) : 0.0);
+
+    usbmon_free(&capture);
+    return ((mismatches == 0U) && (transactions != 0U)) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+void
+on_assert__(char const * const file_, int line_)
+{
+    fprintf(stderr, "assertion failed: %s:%d\n", file_, line_);
+    exit(EXIT_FAILURE);
+}
+
+
+/*##########################################################################*/
+/*#                                 REPLAY                                 #*/
+/*##########################################################################*/
+
+/**
+ * @brief What main.c does before its loop.
+ */
+static void
+bench_init(void)
+{
+    usb_init_t init = { .vbus_sensing = true, .deferred_processing = true };
+
+    usb_kbd_init();
+    usb_init(&usb_driver, &init);
+}
+
+/**
+ * @brief Device to replay when -d is not given: the one a SET_ADDRESS moves
+ *        away from address 0, else the only address in the capture. A
+ *        capture that starts after enumeration, like a device side capture
+ *        whose ring wrapped, has no SET_ADDRESS.
+ *
+ * @return Device address, -1 when it is not clear which one.
+ */
+static int
+pick_device(const usbmon_capture_t *p_capture)
+{
+    bool seen[128] = { false };
+    uint32_t devices = 0;
+    int dev = -1;
+
+    for (size_t i = 0; i < p_capture->count; i++)
+    {
+        const usbmon_urb_t *p_urb = &p_capture->p_urbs[i];
+
+        if ((select_bus >= 0) && (p_urb->bus != select_bus))
+        {
+            continue;
+        }
+        if ((p_urb->dev == 0U) && p_urb->has_setup &&
+            (p_urb->setup[0] == 0x00U) && (p_urb->setup[1] == 0x05U))
+        {
+            return 0;
+        }
+        if (!seen[p_urb->dev & 0x7F])
+        {
+            seen[p_urb->dev & 0x7F] = true;
+            devices++;
+            dev = p_urb->dev & 0x7F;
+        }
+    }
+
+    if (devices == 1U)
+    {
+        return dev;
+    }
+    if (devices == 0U)
+    {
+        fprintf(stderr, "no URBs in the capture%s\n", (select_bus >= 0) ? " on that bus" : "");
+        return -1;
+    }
+    fprintf(stderr, "no SET_ADDRESS in the capture and %u devices in it:", devices);
+    for (uint32_t addr = 0; addr < 128U; addr++)
+    {
+        if (seen[addr])
+        {
+            fprintf(stderr, " %u", addr);
+        }
+    }
+    fprintf(stderr, "\nchoose the one to replay with -d\n");
+    return -1;
+}
+
+/**
+ * @brief URBs of the replayed device. Address 0 is followed until a
+ *        SET_ADDRESS moved the device, the hub talks at its own address.
+ */
+static bool
+selected(const usbmon_urb_t *p_urb)
+{
+    return follow[p_urb->dev & 0x7F] && (p_urb->xfer_type != USBMON_ISO) &&
+           (p_urb->status != -ENOENT_) && (p_urb->status != -ECONNRESET_) &&
+           (p_urb->status != -ESHUTDOWN_) && (p_urb->completed || !(p_urb->ep & 0x80U) ||
+                                              (p_urb->xfer_type == USBMON_CONTROL));
+}
+
+/**
+ * @brief SET_FEATURE(PORT_RESET) to a hub port.
+ */
+static bool
+is_port_reset(const usbmon_urb_t *p_urb)
+{
+    return p_urb->has_setup && (p_urb->setup[0] == 0x23U) && (p_urb->setup[1] == 0x03U) &&
+           (p_urb->setup[2] == 0x04U) && (p_urb->setup[3] == 0x00U);
+}
+
+static uint64_t
+exec_time(const usbmon_urb_t *p_urb)
+{
+    if ((p_urb->xfer_type != USBMON_CONTROL) && (p_urb->ep & 0x80U) && p_urb->completed)
+    {
+        return p_urb->complete_us;
+    }
+    return p_urb->submit_us;
+}
+
+static int
+compare_urbs(const void *p_a, const void *p_b)
+{
+    const usbmon_urb_t *p_urb_a = p_a;
+    const usbmon_urb_t *p_urb_b = p_b;
+    uint64_t a = exec_time(p_urb_a);
+    uint64_t b = exec_time(p_urb_b);
+
+    if (a != b)
+    {
+        return (a < b) ? -1 : 1;
+    }
+    // Keep the capture order, qsort is not stable
+    return (p_urb_a < p_urb_b) ? -1 : ((p_urb_a > p_urb_b) ? 1 : 0);
+}
+
+/**
+ * @brief Let time pass up to a point of the capture, with a SOF at every
+ *        frame boundary. Costs go to idle.
+ */
+static void
+advance_to(uint64_t us)
+{
+    if (!started || (us <= now_us))
+    {
+        now_us = MAX(now_us, us);
+        started = true;
+        return;
+    }
+
+    uint64_t delta = us - now_us;
+    now_us = us;
+    if (delta > max_idle_us)
+    {
+        skipped_us += delta - max_idle_us;
+        delta = max_idle_us;
+    }
+
+    vhost_clear_stats();
+    while ((frame_us + delta) >= FRAME_US)
+    {
+        uint32_t step = FRAME_US - frame_us;
+        otg_sim_advance(step * CYCLES_PER_US);
+        otg_sim_sof();
+        vhost_service();
+        delta -= step;
+        frame_us = 0;
+    }
+    otg_sim_advance((uint32_t)delta * CYCLES_PER_US);
+    frame_us += (uint32_t)delta;
+
+    vhost_cost_t total;
+    vhost_cost_total(vhost_get_stats(), &total);
+    idle.calls += total.calls;
+    idle.instructions += total.instructions;
+    idle.reads += total.reads;
+    idle.writes += total.writes;
+    idle.max_instructions = MAX(idle.max_instructions, total.max_instructions);
+}
+
+/**
+ * @brief A capture that starts after enumeration finds the device
+ *        configured already, get it there without counting the cost.
+ */
+static void
+bring_up(uint8_t addr)
+{
+    vhost_reset();
+    (void)vhost_control(0, 0x00, 0x05, addr, 0, 0, NULL, NULL);
+    (void)vhost_control(addr, 0x00, 0x09, 1, 0, 0, NULL, NULL);
+    address = addr;
+    report("  (capture starts at address %u, device brought up to it and configured)\n", addr);
+}
+
+static void
+replay(const usbmon_urb_t *p_urb)
+{
+    static uint8_t data[DATA_MAX];
+    char name[40];
+    uint32_t len = 0;
+    vhost_result_t result;
+    vhost_result_t expected = (p_urb->status == 0) ? VHOST_OK
+                            : ((p_urb->status == -EPIPE_) ? VHOST_STALL : VHOST_ERROR);
+    bool in = (p_urb->ep & 0x80U) != 0U;
+    uint8_t ep_num = p_urb->ep & 0x0FU;
+
+    advance_to(exec_time(p_urb));
+
+    // Back at address 0 means the device was reset, whether or not the
+    // capture shows the hub request
+    if ((p_urb->dev == 0U) && (address != 0U))
+    {
+        reset_pending = true;
+    }
+    if (reset_pending)
+    {
+        vhost_clear_stats();
+        vhost_reset();
+        address = 0;
+        reset_pending = false;
+    }
+    if ((p_urb->dev != 0U) && (address == 0U))
+    {
+        bring_up(p_urb->dev);
+    }
+
+    vhost_clear_stats();
+    if (p_urb->xfer_type == USBMON_CONTROL)
+    {
+        uint16_t value = (uint16_t)(p_urb->setup[2] | (p_urb->setup[3] << 8));
+        uint16_t index = (uint16_t)(p_urb->setup[4] | (p_urb->setup[5] << 8));
+        uint16_t length = (uint16_t)(p_urb->setup[6] | (p_urb->setup[7] << 8));
+
+        if (!(p_urb->setup[0] & 0x80U))
+        {
+            memset(data, 0, MIN(length, DATA_MAX));
+            memcpy(data, p_urb->p_data, MIN(p_urb->data_len, DATA_MAX));
+        }
+        length = MIN(length, DATA_MAX);
+        result = vhost_control(address, p_urb->setup[0], p_urb->setup[1], value, index, length,
+                               data, &len);
+        if (!(p_urb->setup[0] & 0x80U) && (result == VHOST_OK))
+        {
+            len = length;
+        }
+        if ((result == VHOST_OK) && (p_urb->setup[0] == 0x00U) && (p_urb->setup[1] == 0x05U))
+        {
+            address = value & 0x7FU;
+            follow[address] = true;
+        }
+    }
+    else if (in)
+    {
+        result = vhost_in_try(address, ep_num, data, &len);
+    }
+    else
+    {
+        // Packets of up to 64 bytes, what was not captured is sent as zeros
+        uint32_t total = MIN(p_urb->submit_len, DATA_MAX);
+        uint32_t sent = 0;
+
+        memset(data, 0, total);
+        memcpy(data, p_urb->p_data, MIN(p_urb->data_len, total));
+        do
+        {
+            uint32_t chunk = MIN(total - sent, PACKET_MAX);
+            result = vhost_out(address, ep_num, &data[sent], chunk);
+            sent += chunk;
+        } while ((result == VHOST_OK) && (sent < total));
+        len = sent;
+    }
+
+    vhost_cost_t cost;
+    vhost_cost_total(vhost_get_stats(), &cost);
+    urb_name(p_urb, name, sizeof(name));
+    account(name, &cost);
+    transactions++;
+
+    const char *p_verdict = "";
+    if ((p_urb->xfer_type != USBMON_CONTROL) && in && (result == VHOST_NAK) && (expected == VHOST_OK))
+    {
+        // The application data behind it is not part of the replay
+        not_reproduced++;
+        p_verdict = "  (no data, not reproduced)";
+    }
+    else if ((expected == VHOST_ERROR) ? (result == VHOST_OK) : (result != expected))
+    {
+        mismatches++;
+        p_verdict = "  MISMATCH";
+    }
+    else if ((result == VHOST_OK) && in && ((len != p_urb->length) || !check_data(p_urb, data, len)))
+    {
+        mismatches++;
+        p_verdict = (len != p_urb->length) ? "  MISMATCH length" : "  MISMATCH data";
+    }
+
+    // -q still shows what did not match
+    if (!quiet || (p_verdict[0] != '\0'))
+    {
+        printf("%12.6f  dev %3u  %-32s %-7s %5u B  capture %-5s %5u B %6.0f us  "
+               "%7llu instr %4llu rd %4llu wr  isr max %llu%s\n",
+               (double)exec_time(p_urb) / 1e6, p_urb->dev, name, vhost_result_name(result), len,
+               (p_urb->status == 0) ? "OK" : ((p_urb->status == -EPIPE_) ? "STALL" : "error"),
+               p_urb->length,
+               p_urb->completed ? (double)(p_urb->complete_us - p_urb->submit_us) : 0.0,
+               (unsigned long long)cost.instructions, (unsigned long long)cost.reads,
+               (unsigned long long)cost.writes, (unsigned long long)cost.max_instructions, p_verdict);
+    }
+}
+
+/**
+ * @brief Compare IN data with what was captured of it.
+ */
+static bool
+check_data(const usbmon_urb_t *p_urb, const uint8_t *p_data, uint32_t len)
+{
+    uint32_t captured = MIN(p_urb->data_len, len);
+
+    return !compare_data || (p_urb->p_data == NULL) || (memcmp(p_urb->p_data, p_data, captured) == 0);
+}
+
+/**
+ * @brief Standard requests by name, everything else by type and number.
+ */
+static const char *
+urb_name(const usbmon_urb_t *p_urb, char *p_buf, size_t size)
+{
+    static const char * const requests[] = {
+        "GET_STATUS", "CLEAR_FEATURE", NULL, "SET_FEATURE", NULL, "SET_ADDRESS",
+        "GET_DESCRIPTOR", "SET_DESCRIPTOR", "GET_CONFIGURATION", "SET_CONFIGURATION",
+        "GET_INTERFACE", "SET_INTERFACE", "SYNCH_FRAME"
+    };
+    static const char * const descriptors[] = {
+        NULL, "DEVICE", "CONFIGURATION", "STRING", NULL, NULL, "DEVICE_QUALIFIER",
+        "OTHER_SPEED", NULL, NULL, "DEBUG", "IAD", NULL, NULL, NULL, "BOS"
+    };
+    static const char * const types[] = { "ISO", "INTERRUPT", "CONTROL", "BULK" };
+
+    if (p_urb->xfer_type != USBMON_CONTROL)
+    {
+        snprintf(p_buf, size, "%s %s 0x%02X", types[p_urb->xfer_type & 3U],
+                 (p_urb->ep & 0x80U) ? "IN" : "OUT", p_urb->ep);
+        return p_buf;
+    }
+
+    uint8_t type = (p_urb->setup[0] >> 5) & 3U;
+    uint8_t request = p_urb->setup[1];
+    uint8_t desc = p_urb->setup[3];
+    if ((type == 0U) && (request == 6U) && (desc < 16U) && (descriptors[desc] != NULL))
+    {
+        snprintf(p_buf, size, "GET_DESCRIPTOR(%s)", descriptors[desc]);
+    }
+    else if ((type == 0U) && (request == 6U))
+    {
+        snprintf(p_buf, size, "GET_DESCRIPTOR(0x%02X)", desc);
+    }
+    else if ((type == 0U) && (request < 13U) && (requests[request] != NULL))
+    {
+        snprintf(p_buf, size, "%s", requests[request]);
+    }
+    else
+    {
+        static const char * const classes[] = { "STANDARD", "CLASS", "VENDOR", "RESERVED" };
+        snprintf(p_buf, size, "%s %02X/%02X", classes[type], p_urb->setup[0], request);
+    }
+    return p_buf;
+}
+
+static void
+account(const char *p_name, const vhost_cost_t *p_cost)
+{
+    kind_cost_t *p_kind = NULL;
+
+    for (uint32_t kind = 0; kind < kind_count; kind++)
+    {
+        if (strcmp(kinds[kind].name, p_name) == 0)
+        {
+            p_kind = &kinds[kind];
+            break;
+        }
+    }
+    if (p_kind == NULL)
+    {
+        p_kind = &kinds[(kind_count < KINDS_MAX) ? kind_count++ : (KINDS_MAX - 1U)];
+        snprintf(p_kind->name, sizeof(p_kind->name), "%s", p_name);
+    }
+    p_kind->count++;
+    p_kind->instructions += p_cost->instructions;
+    p_kind->reads += p_cost->reads;
+    p_kind->writes += p_cost->writes;
+    p_kind->max_instructions = MAX(p_kind->max_instructions, p_cost->instructions);
+    p_kind->isr_max = MAX(p_kind->isr_max, p_cost->max_instructions);
+}
+
+static void
+report(const char *p_fmt, ...)
+{
+    va_list args;
+
+    if (quiet)
+    {
+        return;
+    }
+    va_start(args, p_fmt);
+    vprintf(p_fmt, args);
+    va_end(args);
+}
+
+/*** end of file ***/
\ No newline at end of file
@@ -0,0 +1,385 @@
+/** @file usbmon.c
+ *
+ * @brief Reader for Linux usbmon captures, see usbmon.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "usbmon.h"
+
+#define PCAP_MAGIC_US           (0xA1B2C3D4U)
+#define PCAP_MAGIC_NS           (0xA1B23C4DU)
+#define LINKTYPE_USB_LINUX      (189U)
+#define LINKTYPE_USB_LINUX_MMAPPED (220U)
+#define USBMON_HEADER           (48U)
+#define USBMON_HEADER_MMAPPED   (64U)
+#define TEXT_LINE_MAX           (4096U)
+
+static bool load_pcap(FILE *p_file, bool nanoseconds, usbmon_capture_t *p_capture);
+static bool load_text(FILE *p_file, usbmon_capture_t *p_capture);
+static void submit(usbmon_capture_t *p_capture, const usbmon_urb_t *p_urb,
+                   const uint8_t *p_data, uint32_t data_len);
+static void complete(usbmon_capture_t *p_capture, uint64_t tag, uint64_t us, int32_t status,
+                     uint32_t length, const uint8_t *p_data, uint32_t data_len);
+static uint32_t get_u32(const uint8_t *p);
+static uint64_t get_u64(const uint8_t *p);
+
+static uint64_t first_us;
+static bool have_first;
+
+
+/*##########################################################################*/
+/*#                            PUBLIC FUNCTIONS                            #*/
+/*##########################################################################*/
+
+/**
+ * @brief Read a capture, pcap if the file starts with the pcap magic,
+ *        usbmon text otherwise.
+ *
+ * @return false with a message on stderr if the file cannot be used.
+ */
+bool
+usbmon_load(const char *p_path, usbmon_capture_t *p_capture)
+{
+    FILE *p_file = fopen(p_path, "rb");
+    uint8_t magic[4];
+    bool ok;
+
+    memset(p_capture, 0, sizeof(*p_capture));
+    have_first = false;
+    if (p_file == NULL)
+    {
+        perror(p_path);
+        return false;
+    }
+
+    if ((fread(magic, 1, sizeof(magic), p_file) == sizeof(magic)) &&
+        ((get_u32(magic) == PCAP_MAGIC_US) || (get_u32(magic) == PCAP_MAGIC_NS)))
+    {
+        ok = load_pcap(p_file, get_u32(magic) == PCAP_MAGIC_NS, p_capture);
+    }
+    else if (get_u32(magic) == 0x0A0D0D0AU)
+    {
+        fprintf(stderr, "%s: pcapng, save the capture as pcap\n", p_path);
+        ok = false;
+    }
+    else
+    {
+        rewind(p_file);
+        ok = load_text(p_file, p_capture);
+    }
+    fclose(p_file);
+
+    if (ok && (p_capture->count == 0U))
+    {
+        fprintf(stderr, "%s: no URBs\n", p_path);
+        ok = false;
+    }
+    return ok;
+}
+
+void
+usbmon_free(usbmon_capture_t *p_capture)
+{
+    for (size_t i = 0; i < p_capture->count; i++)
+    {
+        free(p_capture->p_urbs[i].p_data);
+    }
+    free(p_capture->p_urbs);
+    memset(p_capture, 0, sizeof(*p_capture));
+}
+
+
+/*##########################################################################*/
+/*#                       STATIC (PRIVATE) FUNCTIONS                       #*/
+/*##########################################################################*/
+
+/**
+ * @brief Little endian pcap with a usbmon link type. The usbmon header is
+ *        in the byte order of the machine that captured, little endian is
+ *        all that is supported.
+ */
+static bool
+load_pcap(FILE *p_file, bool nanoseconds, usbmon_capture_t *p_capture)
+{
+    uint8_t header[20];     /* The rest of the file header after the magic */
+    uint8_t record[16];
+    uint32_t usbmon_len;
+
+    if (fread(header, 1, sizeof(header), p_file) != sizeof(header))
+    {
+        fprintf(stderr, "pcap header truncated\n");
+        return false;
+    }
+
+    switch (get_u32(&header[16]))
+    {
+        case LINKTYPE_USB_LINUX:
+            usbmon_len = USBMON_HEADER;
+            break;
+        case LINKTYPE_USB_LINUX_MMAPPED:
+            usbmon_len = USBMON_HEADER_MMAPPED;
+            break;
+        default:
+            fprintf(stderr, "pcap link type %u is not usbmon\n", (unsigned)get_u32(&header[16]));
+            return false;
+    }
+
+    while (fread(record, 1, sizeof(record), p_file) == sizeof(record))
+    {
+        uint32_t incl_len = get_u32(&record[8]);
+        uint8_t *p_packet = malloc(incl_len + 1U);
+
+        if ((p_packet == NULL) || (fread(p_packet, 1, incl_len, p_file) != incl_len))
+        {
+            free(p_packet);
+            fprintf(stderr, "pcap record truncated\n");
+            return false;
+        }
+        if (incl_len < usbmon_len)
+        {
+            free(p_packet);
+            continue;
+        }
+
+        uint64_t us = (uint64_t)get_u32(&record[0]) * 1000000U +
+                      (nanoseconds ? (get_u32(&record[4]) / 1000U) : get_u32(&record[4]));
+        uint64_t tag = get_u64(&p_packet[0]);
+        char event = (char)p_packet[8];
+        int32_t status = (int32_t)get_u32(&p_packet[28]);
+        uint32_t length = get_u32(&p_packet[32]);
+        uint32_t data_len = get_u32(&p_packet[36]);
+        const uint8_t *p_data = &p_packet[usbmon_len];
+
+        if (data_len > (incl_len - usbmon_len))
+        {
+            data_len = incl_len - usbmon_len;
+        }
+        if (event == 'S')
+        {
+            usbmon_urb_t urb = {
+                .tag = tag,
+                .xfer_type = p_packet[9],
+                .ep = p_packet[10],
+                .dev = p_packet[11],
+                .bus = (uint16_t)(p_packet[12] | (p_packet[13] << 8)),
+                .has_setup = (p_packet[14] == 0),
+                .submit_us = us,
+                .submit_len = length
+            };
+            memcpy(urb.setup, &p_packet[40], sizeof(urb.setup));
+            submit(p_capture, &urb, (p_packet[15] == 0) ? p_data : NULL, data_len);
+        }
+        else
+        {
+            complete(p_capture, tag, us, status, length, (p_packet[15] == 0) ? p_data : NULL, data_len);
+        }
+        free(p_packet);
+    }
+    return true;
+}
+
+/**
+ * @brief usbmon text, one event per line:
+ *        tag timestamp event address status-or-setup length data-tag data
+ *        e.g. "ffff8f1c 3575914555 S Ci:1:001:0 s 80 06 0100 0000 0012 18 <".
+ */
+static bool
+load_text(FILE *p_file, usbmon_capture_t *p_capture)
+{
+    static char line[TEXT_LINE_MAX];
+    static uint8_t data[TEXT_LINE_MAX / 2U];
+    uint64_t last_ts = 0;
+    uint64_t wraps = 0;
+    unsigned line_no = 0;
+
+    while (fgets(line, sizeof(line), p_file) != NULL)
+    {
+        char *p_tokens[TEXT_LINE_MAX / 2U];
+        uint32_t count = 0;
+        char *p_save = NULL;
+
+        line_no++;
+        for (char *p_tok = strtok_r(line, " \t\r\n", &p_save); (p_tok != NULL) && (count < (TEXT_LINE_MAX / 2U));
+             p_tok = strtok_r(NULL, " \t\r\n", &p_save))
+        {
+            p_tokens[count++] = p_tok;
+        }
+        if (count == 0U)
+        {
+            continue;
+        }
+
+        char type;
+        char dir;
+        unsigned bus;
+        unsigned dev;
+        unsigned ep;
+        if ((count < 6U) || (sscanf(p_tokens[3], "%c%c:%u:%u:%u", &type, &dir, &bus, &dev, &ep) != 5))
+        {
+            fprintf(stderr, "line %u: not a usbmon event\n", line_no);
+            return false;
+        }
+
+        // The timestamp is 32 bits of microseconds
+        uint64_t ts = strtoull(p_tokens[1], NULL, 10);
+        if ((ts + (wraps << 32)) < last_ts)
+        {
+            wraps++;
+        }
+        ts += wraps << 32;
+        last_ts = ts;
+
+        uint64_t tag = strtoull(p_tokens[0], NULL, 16);
+        char event = p_tokens[2][0];
+        uint32_t pos = 4;
+        bool has_setup = false;
+        uint8_t setup[8] = { 0 };
+        int32_t status = 0;
+
+        if ((event == 'S') && (strcmp(p_tokens[pos], "s") == 0) && ((pos + 6U) <= count))
+        {
+            unsigned value;
+            has_setup = true;
+            setup[0] = (uint8_t)strtoul(p_tokens[pos + 1U], NULL, 16);
+            setup[1] = (uint8_t)strtoul(p_tokens[pos + 2U], NULL, 16);
+            for (uint32_t word = 0; word < 3U; word++)
+            {
+                value = (unsigned)strtoul(p_tokens[pos + 3U + word], NULL, 16);
+                setup[2U + (2U * word)] = (uint8_t)value;
+                setup[3U + (2U * word)] = (uint8_t)(value >> 8);
+            }
+            pos += 6U;
+        }
+        else
+        {
+            // status, or status:interval[:start frame...]
+            status = (int32_t)strtol(p_tokens[pos], NULL, 10);
+            pos++;
+        }
+        if (pos >= count)
+        {
+            fprintf(stderr, "line %u: no length\n", line_no);
+            return false;
+        }
+
+        uint32_t length = (uint32_t)strtoul(p_tokens[pos++], NULL, 10);
+        uint32_t data_len = 0;
+        bool has_data = (pos < count) && (strcmp(p_tokens[pos], "=") == 0);
+        if (has_data)
+        {
+            for (pos++; pos < count; pos++)
+            {
+                for (const char *p_hex = p_tokens[pos]; (p_hex[0] != '\0') && (p_hex[1] != '\0'); p_hex += 2)
+                {
+                    char byte[3] = { p_hex[0], p_hex[1], '\0' };
+                    data[data_len++] = (uint8_t)strtoul(byte, NULL, 16);
+                }
+            }
+        }
+
+        static const char types[] = { 'Z', 'I', 'C', 'B', '\0' };
+        if ((event == 'S') && (strchr(types, type) == NULL))
+        {
+            fprintf(stderr, "line %u: unknown transfer type %c\n", line_no, type);
+            return false;
+        }
+        if (event == 'S')
+        {
+            usbmon_urb_t urb = {
+                .tag = tag,
+                .bus = (uint16_t)bus,
+                .dev = (uint8_t)dev,
+                .ep = (uint8_t)(ep | ((dir == 'i') ? 0x80U : 0U)),
+                .xfer_type = (uint8_t)(strchr(types, type) - types),
+                .has_setup = has_setup,
+                .submit_us = ts,
+                .submit_len = length
+            };
+            memcpy(urb.setup, setup, sizeof(setup));
+            submit(p_capture, &urb, has_data ? data : NULL, data_len);
+        }
+        else
+        {
+            complete(p_capture, tag, ts, status, length, has_data ? data : NULL, data_len);
+        }
+    }
+    return true;
+}
+
+static void
+submit(usbmon_capture_t *p_capture, const usbmon_urb_t *p_urb, const uint8_t *p_data, uint32_t data_len)
+{
+    if (p_capture->count == p_capture->capacity)
+    {
+        p_capture->capacity = (p_capture->capacity != 0U) ? (2U * p_capture->capacity) : 256U;
+        p_capture->p_urbs = realloc(p_capture->p_urbs, p_capture->capacity * sizeof(usbmon_urb_t));
+        if (p_capture->p_urbs == NULL)
+        {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (!have_first)
+    {
+        first_us = p_urb->submit_us;
+        have_first = true;
+    }
+
+    usbmon_urb_t *p_new = &p_capture->p_urbs[p_capture->count++];
+    *p_new = *p_urb;
+    p_new->submit_us -= first_us;
+    p_new->p_data = NULL;
+    p_new->data_len = 0;
+    if (((p_urb->ep & 0x80U) == 0U) && (p_data != NULL) && (data_len != 0U))
+    {
+        p_new->p_data = malloc(data_len);
+        memcpy(p_new->p_data, p_data, data_len);
+        p_new->data_len = data_len;
+    }
+}
+
+/**
+ * @brief Pair a completion with the latest pending submission of the same
+ *        tag, tags are kernel addresses and come back once an URB is done.
+ */
+static void
+complete(usbmon_capture_t *p_capture, uint64_t tag, uint64_t us, int32_t status,
+         uint32_t length, const uint8_t *p_data, uint32_t data_len)
+{
+    for (size_t i = p_capture->count; i-- > 0U; )
+    {
+        usbmon_urb_t *p_urb = &p_capture->p_urbs[i];
+        if ((p_urb->tag != tag) || p_urb->completed)
+        {
+            continue;
+        }
+        p_urb->completed = true;
+        p_urb->complete_us = us - first_us;
+        p_urb->status = status;
+        p_urb->length = length;
+        if ((p_urb->ep & 0x80U) && (p_data != NULL) && (data_len != 0U))
+        {
+            p_urb->p_data = malloc(data_len);
+            memcpy(p_urb->p_data, p_data, data_len);
+            p_urb->data_len = data_len;
+        }
+        return;
+    }
+}
+
+static uint32_t
+get_u32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t
+get_u64(const uint8_t *p)
+{
+    return (uint64_t)get_u32(p) | ((uint64_t)get_u32(&p[4]) << 32);
+}
+
+/*** end of file ***/
\ No newline at end of file
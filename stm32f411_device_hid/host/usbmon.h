@@ -0,0 +1,68 @@
+/** @file usbmon.h
+ *
+ * @brief Reader for Linux usbmon captures, text or pcap.
+ *
+ * Both formats are turned into the same list of URBs, each one with its
+ * submission and completion paired up. The text format is what
+ * /sys/kernel/debug/usb/usbmon/<bus>u produces, pcap files are what
+ * tcpdump, Wireshark (saved as pcap, not pcapng) and
+ * tools/usb_capture_pcap.py write, with the usbmon link types 189 and 220.
+ */
+
+#ifndef USBMON_H
+#define USBMON_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* usbmon transfer types */
+#define USBMON_ISO          (0U)
+#define USBMON_INTERRUPT    (1U)
+#define USBMON_CONTROL      (2U)
+#define USBMON_BULK         (3U)
+
+/**
+ * @brief One URB.
+ *
+ * Times are microseconds from the start of the capture. submit_len is what
+ * the host asked for or sent, length what the completion reports. p_data is
+ * the data of the submission for OUT and of the completion for IN,
+ * data_len bytes of it were captured. status is 0 or a negative errno,
+ * completed is false for an URB still pending at the end of the capture.
+ */
+typedef struct usbmon_urb_s
+{
+    uint64_t tag;
+    uint16_t bus;
+    uint8_t dev;
+    uint8_t ep;
+    uint8_t xfer_type;
+    bool has_setup;
+    uint8_t setup[8];
+    uint64_t submit_us;
+    uint64_t complete_us;
+    bool completed;
+    int32_t status;
+    uint32_t submit_len;
+    uint32_t length;
+    uint8_t *p_data;
+    uint32_t data_len;
+} usbmon_urb_t;
+
+/**
+ * @brief URBs of a capture in submission order.
+ */
+typedef struct usbmon_capture_s
+{
+    usbmon_urb_t *p_urbs;
+    size_t count;
+    size_t capacity;
+} usbmon_capture_t;
+
+bool usbmon_load(const char *p_path, usbmon_capture_t *p_capture);
+void usbmon_free(usbmon_capture_t *p_capture);
+
+#endif /* USBMON_H */
+
+/*** end of file ***/
\ No newline at end of file
@@ -0,0 +1,427 @@
+/** @file vhost.c
+ *
+ * @brief Virtual USB host on top of the OTG_FS model, see vhost.h.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "usb.h"
+#include "usb_internal.h"
+#include "vhost.h"
+
+#define EP0_PACKET_MAX  (64U)
+
+static vhost_cost_t *isr_cost(uint32_t sources);
+static void account(vhost_cost_t *p_cost, const otg_sim_cost_t *p_call);
+static vhost_result_t handshake_result(otg_sim_handshake_t handshake);
+static bool events_queued(void);
+
+static vhost_stats_t stats;
+static uint32_t ep0_mps = EP0_PACKET_MAX;
+static bool poll_held;
+
+static const char * const source_names[32] = {
+    "CMOD", "MMIS", "OTGINT", "SOF", "RXFLVL", "NPTXFE", "GINAKEFF", "GONAKEFF",
+    "B8", "B9", "ESUSP", "USBSUSP", "USBRST", "ENUMDNE", "ISOODRP", "EOPF",
+    "B16", "B17", "IEPINT", "OEPINT", "IISOIXFR", "IPXFR", "B22", "B23",
+    "HPRTINT", "HCINT", "PTXFE", "B27", "CIDSCHG", "DISCINT", "SRQINT", "WKUINT"
+};
+
+
+/*##########################################################################*/
+/*#                            PUBLIC FUNCTIONS                            #*/
+/*##########################################################################*/
+
+void
+vhost_init(void)
+{
+    otg_sim_init();
+}
+
+/**
+ * @brief Act as the CPU after something happened on the bus or in thread
+ *        code: take the interrupt while the core requests it, then run
+ *        usb_poll, until neither has anything left to do.
+ */
+void
+vhost_service(void)
+{
+    for (;;)
+    {
+        uint32_t entries = 0;
+        uint32_t sources;
+
+        while ((sources = otg_sim_irq_pending()) != 0U)
+        {
+            if (++entries > VHOST_STORM_LIMIT)
+            {
+                stats.storms++;
+                fprintf(stderr, "vhost: interrupt storm, sources %08X\n", (unsigned)sources);
+                return;
+            }
+
+            otg_sim_cost_t call = { 0 };
+            otg_sim_call(usb_irq_handler, true, &call);
+            account(isr_cost(sources), &call);
+        }
+
+        if (!events_queued() || poll_held)
+        {
+            return;
+        }
+
+        otg_sim_cost_t call = { 0 };
+        otg_sim_call(usb_poll, false, &call);
+        account(&stats.poll, &call);
+    }
+}
+
+/**
+ * @brief Run thread code that drives the driver, charged to task, and
+ *        service what it started.
+ */
+void
+vhost_run(void (*p_fn)(void))
+{
+    otg_sim_cost_t call = { 0 };
+
+    otg_sim_call(p_fn, false, &call);
+    account(&stats.task, &call);
+    vhost_service();
+}
+
+/**
+ * @brief Bus reset followed by speed enumeration, each serviced.
+ */
+void
+vhost_reset(void)
+{
+    otg_sim_bus_reset();
+    vhost_service();
+    otg_sim_enum_done();
+    vhost_service();
+}
+
+/**
+ * @brief Start of the next frame, a millisecond passes.
+ */
+void
+vhost_sof(void)
+{
+    otg_sim_advance(USB_FRAME_CYCLES);
+    otg_sim_sof();
+    vhost_service();
+}
+
+/**
+ * @brief bMaxPacketSize0 from the device descriptor, 64 until known.
+ */
+void
+vhost_set_ep0_mps(uint32_t mps)
+{
+    ep0_mps = ((mps != 0U) && (mps <= EP0_PACKET_MAX)) ? mps : EP0_PACKET_MAX;
+}
+
+/**
+ * @brief Keep usb_poll from running, as if the main loop were stuck in
+ *        other work, only interrupts are taken until it is released.
+ */
+void
+vhost_hold_poll(bool hold)
+{
+    poll_held = hold;
+}
+
+/**
+ * @brief Control transfer on EP0.
+ *
+ * @param p_data Data stage, read into for device-to-host requests, sent for
+ *               host-to-device ones. length bytes.
+ * @param p_len  Bytes received in the data stage, may be NULL.
+ *
+ * @return VHOST_OK once the status stage is done, VHOST_STALL if any stage
+ *         was STALLed, VHOST_ERROR for a data stage longer than length or a
+ *         status stage with data.
+ */
+vhost_result_t
+vhost_control(uint8_t addr, uint8_t request_type, uint8_t request, uint16_t value,
+              uint16_t index, uint16_t length, uint8_t *p_data, uint32_t *p_len)
+{
+    uint8_t setup[8] = {
+        request_type, request,
+        (uint8_t)value, (uint8_t)(value >> 8),
+        (uint8_t)index, (uint8_t)(index >> 8),
+        (uint8_t)length, (uint8_t)(length >> 8)
+    };
+    uint8_t packet[EP0_PACKET_MAX];
+    uint32_t done = 0;
+    uint32_t len;
+    vhost_result_t result;
+
+    if (p_len != NULL)
+    {
+        *p_len = 0;
+    }
+
+    stats.transactions++;
+    if (otg_sim_setup(addr, setup) != OTG_SIM_ACK)
+    {
+        return VHOST_TIMEOUT;
+    }
+    vhost_service();
+
+    if ((request_type & 0x80U) && (length != 0U))
+    {
+        // Data IN until a short packet or wLength, then a zero length OUT
+        for (;;)
+        {
+            result = vhost_in(addr, 0, packet, &len);
+            if (result != VHOST_OK)
+            {
+                return result;
+            }
+            if (len > (length - done))
+            {
+                return VHOST_ERROR;
+            }
+            memcpy(&p_data[done], packet, len);
+            done += len;
+            if ((len < ep0_mps) || (done == length))
+            {
+                break;
+            }
+        }
+        if (p_len != NULL)
+        {
+            *p_len = done;
+        }
+        return vhost_out(addr, 0, NULL, 0);
+    }
+
+    while (done < length)
+    {
+        uint32_t chunk = ((length - done) < ep0_mps) ? (length - done) : ep0_mps;
+
+        result = vhost_out(addr, 0, &p_data[done], chunk);
+        if (result != VHOST_OK)
+        {
+            return result;
+        }
+        done += chunk;
+    }
+
+    result = vhost_in(addr, 0, packet, &len);
+    if ((result == VHOST_OK) && (len != 0U))
+    {
+        return VHOST_ERROR;
+    }
+    return result;
+}
+
+/**
+ * @brief Single IN transaction, serviced.
+ *        Interrupt and bulk endpoints with nothing to send NAK by design,
+ *        polling them is one try per frame.
+ */
+vhost_result_t
+vhost_in_try(uint8_t addr, uint8_t ep_num, uint8_t *p_buf, uint32_t *p_len)
+{
+    otg_sim_handshake_t handshake = otg_sim_in(addr, ep_num, p_buf, p_len);
+
+    stats.transactions++;
+    vhost_service();
+    if (handshake == OTG_SIM_NAK)
+    {
+        stats.naks++;
+    }
+    return handshake_result(handshake);
+}
+
+/**
+ * @brief Single OUT transaction, serviced.
+ */
+vhost_result_t
+vhost_out_try(uint8_t addr, uint8_t ep_num, const uint8_t *p_data, uint32_t len)
+{
+    otg_sim_handshake_t handshake = otg_sim_out(addr, ep_num, p_data, len);
+
+    stats.transactions++;
+    vhost_service();
+    if (handshake == OTG_SIM_NAK)
+    {
+        stats.naks++;
+    }
+    return handshake_result(handshake);
+}
+
+/**
+ * @brief IN transaction, repeated while NAKed, up to VHOST_NAK_LIMIT.
+ *
+ * @return VHOST_TIMEOUT if the device kept NAKing.
+ */
+vhost_result_t
+vhost_in(uint8_t addr, uint8_t ep_num, uint8_t *p_buf, uint32_t *p_len)
+{
+    for (uint32_t tries = 0; tries < VHOST_NAK_LIMIT; tries++)
+    {
+        vhost_result_t result = vhost_in_try(addr, ep_num, p_buf, p_len);
+        if (result != VHOST_NAK)
+        {
+            return result;
+        }
+    }
+    return VHOST_TIMEOUT;
+}
+
+/**
+ * @brief OUT transaction, repeated while NAKed, up to VHOST_NAK_LIMIT.
+ */
+vhost_result_t
+vhost_out(uint8_t addr, uint8_t ep_num, const uint8_t *p_data, uint32_t len)
+{
+    for (uint32_t tries = 0; tries < VHOST_NAK_LIMIT; tries++)
+    {
+        vhost_result_t result = vhost_out_try(addr, ep_num, p_data, len);
+        if (result != VHOST_NAK)
+        {
+            return result;
+        }
+    }
+    return VHOST_TIMEOUT;
+}
+
+const vhost_stats_t *
+vhost_get_stats(void)
+{
+    return &stats;
+}
+
+void
+vhost_clear_stats(void)
+{
+    memset(&stats, 0, sizeof(stats));
+}
+
+/**
+ * @brief Sum of everything the driver ran: interrupts, polls and tasks.
+ *        max_instructions is the longest single interrupt entry.
+ */
+void
+vhost_cost_total(const vhost_stats_t *p_stats, vhost_cost_t *p_total)
+{
+    memset(p_total, 0, sizeof(*p_total));
+    for (uint32_t kind = 0; kind < p_stats->isr_kinds; kind++)
+    {
+        const vhost_cost_t *p_cost = &p_stats->isr[kind].cost;
+        p_total->calls += p_cost->calls;
+        p_total->instructions += p_cost->instructions;
+        p_total->reads += p_cost->reads;
+        p_total->writes += p_cost->writes;
+        if (p_cost->max_instructions > p_total->max_instructions)
+        {
+            p_total->max_instructions = p_cost->max_instructions;
+        }
+    }
+    p_total->instructions += p_stats->poll.instructions + p_stats->task.instructions;
+    p_total->reads += p_stats->poll.reads + p_stats->task.reads;
+    p_total->writes += p_stats->poll.writes + p_stats->task.writes;
+}
+
+const char *
+vhost_result_name(vhost_result_t result)
+{
+    static const char * const names[] = { "OK", "NAK", "STALL", "TIMEOUT", "ERROR" };
+
+    return (result <= VHOST_ERROR) ? names[result] : "?";
+}
+
+/**
+ * @brief GINTSTS sources as names joined by '+'.
+ */
+const char *
+vhost_sources_name(uint32_t sources, char *p_buf, size_t size)
+{
+    size_t used = 0;
+
+    p_buf[0] = '\0';
+    while ((sources != 0U) && (used < size))
+    {
+        uint32_t bit = __builtin_ctz(sources);
+        sources &= sources - 1U;
+        used += snprintf(&p_buf[used], size - used, "%s%s", (used != 0U) ? "+" : "",
+                         source_names[bit]);
+    }
+    return p_buf;
+}
+
+
+/*##########################################################################*/
+/*#                       STATIC (PRIVATE) FUNCTIONS                       #*/
+/*##########################################################################*/
+
+/**
+ * @brief Cost entry for an interrupt with these sources pending, the last
+ *        one takes whatever does not fit.
+ */
+static vhost_cost_t *
+isr_cost(uint32_t sources)
+{
+    for (uint32_t kind = 0; kind < stats.isr_kinds; kind++)
+    {
+        if (stats.isr[kind].sources == sources)
+        {
+            return &stats.isr[kind].cost;
+        }
+    }
+    if (stats.isr_kinds < VHOST_ISR_KINDS)
+    {
+        stats.isr[stats.isr_kinds].sources = sources;
+        return &stats.isr[stats.isr_kinds++].cost;
+    }
+    return &stats.isr[VHOST_ISR_KINDS - 1U].cost;
+}
+
+static void
+account(vhost_cost_t *p_cost, const otg_sim_cost_t *p_call)
+{
+    p_cost->calls++;
+    p_cost->instructions += p_call->instructions;
+    p_cost->reads += p_call->reads;
+    p_cost->writes += p_call->writes;
+    if (p_call->instructions > p_cost->max_instructions)
+    {
+        p_cost->max_instructions = p_call->instructions;
+    }
+}
+
+static vhost_result_t
+handshake_result(otg_sim_handshake_t handshake)
+{
+    switch (handshake)
+    {
+        case OTG_SIM_ACK:
+            return VHOST_OK;
+        case OTG_SIM_NAK:
+            return VHOST_NAK;
+        case OTG_SIM_STALL:
+            return VHOST_STALL;
+        default:
+            return VHOST_TIMEOUT;
+    }
+}
+
+/**
+ * @brief Whether usb_poll has events to process, queued bus events or
+ *        latched endpoint interrupts.
+ */
+static bool
+events_queued(void)
+{
+    usb_driver_t *p_driver = usb_get_instance();
+
+    return (p_driver != NULL) && ((p_driver->event_queue.head != p_driver->event_queue.tail) ||
+                                  (p_driver->ep_events != 0U));
+}
+
+/*** end of file ***/
\ No newline at end of file
@@ -0,0 +1,95 @@
+/** @file vhost.h
+ *
+ * @brief Virtual USB host on top of the OTG_FS model.
+ *
+ * Sends tokens through otg_sim.h and between every two of them plays the
+ * part of the CPU: runs usb_irq_handler for as long as the core requests
+ * the interrupt, then usb_poll for the deferred events, all single
+ * stepped, so every transaction is charged with what the driver spent on
+ * it. Control transfers go through SETUP, data and status stages with the
+ * NAK retries a host controller does.
+ */
+
+#ifndef VHOST_H
+#define VHOST_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "otg_sim.h"
+
+#define VHOST_NAK_LIMIT     (32U)   /* NAKs before a transaction times out */
+#define VHOST_STORM_LIMIT   (64U)   /* Interrupt entries without a break */
+#define VHOST_ISR_KINDS     (16U)
+
+typedef enum vhost_result_e
+{
+    VHOST_OK = 0,
+    VHOST_NAK,
+    VHOST_STALL,
+    VHOST_TIMEOUT,
+    VHOST_ERROR
+} vhost_result_t;
+
+/**
+ * @brief What a kind of call cost over all its calls.
+ */
+typedef struct vhost_cost_s
+{
+    uint32_t calls;
+    uint64_t instructions;
+    uint64_t max_instructions;
+    uint64_t reads;
+    uint64_t writes;
+} vhost_cost_t;
+
+/**
+ * @brief Interrupt entries keyed by the GINTSTS sources pending at entry.
+ */
+typedef struct vhost_isr_cost_s
+{
+    uint32_t sources;
+    vhost_cost_t cost;
+} vhost_isr_cost_t;
+
+/**
+ * @brief Costs since the last vhost_clear_stats.
+ *
+ * task is thread code run through vhost_run. storms counts interrupt
+ * loops broken off at VHOST_STORM_LIMIT.
+ */
+typedef struct vhost_stats_s
+{
+    vhost_isr_cost_t isr[VHOST_ISR_KINDS];
+    uint32_t isr_kinds;
+    vhost_cost_t poll;
+    vhost_cost_t task;
+    uint32_t transactions;
+    uint32_t naks;
+    uint32_t storms;
+} vhost_stats_t;
+
+void vhost_init(void);
+void vhost_service(void);
+void vhost_run(void (*p_fn)(void));
+void vhost_reset(void);
+void vhost_sof(void);
+void vhost_set_ep0_mps(uint32_t mps);
+void vhost_hold_poll(bool hold);
+vhost_result_t vhost_control(uint8_t addr, uint8_t request_type, uint8_t request, uint16_t value,
+                             uint16_t index, uint16_t length, uint8_t *p_data, uint32_t *p_len);
+vhost_result_t vhost_in_try(uint8_t addr, uint8_t ep_num, uint8_t *p_buf, uint32_t *p_len);
+vhost_result_t vhost_out_try(uint8_t addr, uint8_t ep_num, const uint8_t *p_data, uint32_t len);
+vhost_result_t vhost_in(uint8_t addr, uint8_t ep_num, uint8_t *p_buf, uint32_t *p_len);
+vhost_result_t vhost_out(uint8_t addr, uint8_t ep_num, const uint8_t *p_data, uint32_t len);
+
+const vhost_stats_t *vhost_get_stats(void);
+void vhost_clear_stats(void);
+void vhost_cost_total(const vhost_stats_t *p_stats, vhost_cost_t *p_total);
+const char *vhost_result_name(vhost_result_t result);
+const char *vhost_sources_name(uint32_t sources, char *p_buf, size_t size);
+
+#endif /* VHOST_H */
+
+/*** end of file ***/
\ No newline at end of file
@@ -0,0 +1,494 @@
+#!/usr/bin/env python3
+"""Compile a hidtools .wara file into a report descriptor and C pack/unpack code.
+
+Understands the subset of the Waratah language the firmware uses:
+
+    [[applicationCollection]]       usage = [page, usage]
+    [[...inputReport]]              optional id = n, same for outputReport
+                                    and featureReport
+    [[...variableItem]]             usage = [page, usage] or
+                                    usageRange = [page, min, max],
+                                    logicalValueRange = [min, max],
+                                    optional sizeInBits
+    [[...arrayItem]]                usageRange = [page, min, max], count = n
+    [[...paddingItem]]              sizeInBits = n
+
+Pages and usages are given by name (the ones in USAGE_PAGES) or by number.
+Like WaratahCmd, global items are only emitted when they change and every
+report is padded to a whole byte.
+
+The report descriptor is used by tools/usb_desc_gen.py. Run on its own the
+script writes a header with, for every report, a struct holding the
+unpacked fields and static inline pack/unpack functions. The code is
+straight line: shifts and masks at the exact bit offsets of the descriptor,
+memcpy for byte aligned arrays and the whole bytes of byte aligned bitmaps,
+a partial last bitmap byte is masked. By hand:
+
+    tools/hid_report_gen.py keyboard_report_desc.wara build/gen/usb_report_gen.h
+"""
+
+import argparse
+import os
+import re
+import sys
+import tomllib
+
+USAGE_PAGES = {
+    "Generic Desktop": (0x01, {
+        "Pointer": 0x01, "Mouse": 0x02, "Joystick": 0x04, "Gamepad": 0x05,
+        "Keyboard": 0x06, "Keypad": 0x07, "X": 0x30, "Y": 0x31, "Z": 0x32,
+        "Wheel": 0x38,
+    }),
+    "Keyboard/Keypad": (0x07, {
+        "Keyboard LeftControl": 0xE0, "Keyboard LeftShift": 0xE1,
+        "Keyboard LeftAlt": 0xE2, "Keyboard Left GUI": 0xE3,
+        "Keyboard RightControl": 0xE4, "Keyboard RightShift": 0xE5,
+        "Keyboard RightAlt": 0xE6, "Keyboard Right GUI": 0xE7,
+    }),
+    "LED": (0x08, {
+        "Num Lock": 0x01, "Caps Lock": 0x02, "Scroll Lock": 0x03,
+        "Compose": 0x04, "Kana": 0x05,
+    }),
+    "Button": (0x09, {}),
+    "Consumer": (0x0C, {"Consumer Control": 0x01}),
+}
+
+MAIN_ITEMS = {"input": (0x80, "Input"), "output": (0x90, "Output"), "feature": (0xB0, "Feature")}
+
+
+class SpecError(Exception):
+    pass
+
+
+def check(cond, msg):
+    if not cond:
+        raise SpecError(msg)
+
+
+def snake(name):
+    return re.sub(r"[^0-9a-z]+", "_", name.lower()).strip("_")
+
+
+class Page:
+    def __init__(self, ref):
+        if isinstance(ref, int):
+            self.id, self.name, self.usages = ref, "0x%04X" % ref, {}
+        else:
+            check(ref in USAGE_PAGES, "unknown usage page %r, give it as a number" % ref)
+            self.name = ref
+            self.id, self.usages = USAGE_PAGES[ref]
+        self.short = snake(self.name.split("/")[0]) if isinstance(ref, str) else "page_%02x" % ref
+
+    def usage(self, ref):
+        """(id, comment text) of a usage of this page."""
+        if isinstance(ref, int):
+            return ref, "0x%04X" % ref
+        check(ref in self.usages, "unknown usage %r on page %s, give it as a number" % (ref, self.name))
+        return self.usages[ref], "%s[0x%04X]" % (ref, self.usages[ref])
+
+
+def bits_for(lo, hi):
+    """Report size holding the logical range, signed when lo < 0."""
+    if lo < 0:
+        return max(lo.bit_length(), hi.bit_length()) + 1
+    return max(hi.bit_length(), 1)
+
+
+class Field:
+    """One main item of a report: count elements of size bits each."""
+
+    def __init__(self, kind, page, usages, logical, size, count, flags, name):
+        self.kind = kind            # "variable", "array" or "padding"
+        self.page = page
+        self.usages = usages        # (min, max, min comment, max comment) or single usage
+        self.logical = logical
+        self.size = size
+        self.count = count
+        self.flags = flags
+        self.name = name
+        self.offset = 0
+
+    @property
+    def bits(self):
+        return self.size * self.count
+
+    @property
+    def is_bitmask(self):
+        return self.kind == "variable" and self.size == 1 and self.count > 1
+
+    def ctype(self):
+        if self.is_bitmask:
+            return "uint%d_t" % max(8, 1 << (self.count - 1).bit_length()) if self.count <= 32 else "uint8_t"
+        width = max(8, 1 << (self.size - 1).bit_length())
+        return "%sint%d_t" % ("" if self.logical[0] < 0 else "u", width)
+
+    def declaration(self):
+        if self.is_bitmask:
+            if self.count <= 32:
+                return "%s %s;" % (self.ctype(), self.name)
+            return "uint8_t %s[%d];" % (self.name, (self.count + 7) // 8)
+        if self.count == 1:
+            return "%s %s;" % (self.ctype(), self.name)
+        return "%s %s[%d];" % (self.ctype(), self.name, self.count)
+
+
+class Report:
+    def __init__(self, kind, report_id):
+        self.kind = kind
+        self.id = report_id
+        self.fields = []
+
+    @property
+    def bits(self):
+        return (8 if self.id else 0) + sum(f.bits for f in self.fields)
+
+    @property
+    def size(self):
+        return self.bits // 8
+
+    def symbol(self, prefix):
+        return "%s_%s%s" % (prefix, self.kind, "_%d" % self.id if self.id else "")
+
+
+def item_order(path):
+    """Per collection the (report kind, [item kinds]) of its reports in file order.
+
+    tomllib keeps each kind of table in its own list, the order of reports
+    and the interleaving of variable, array and padding items is only in
+    the file itself.
+    """
+    collections = []
+    with open(path) as f:
+        for line in f:
+            m = re.match(r"\s*\[\[([\w.]+)\]\]", line)
+            if not m:
+                continue
+            last = m.group(1).split(".")[-1]
+            if last == "applicationCollection":
+                collections.append([])
+            elif last.endswith("Report"):
+                check(collections, "%s outside of a collection" % m.group(1))
+                collections[-1].append((last, []))
+            elif last.endswith("Item"):
+                check(collections and collections[-1], "%s outside of a report" % m.group(1))
+                collections[-1][-1][1].append(last)
+    return collections
+
+
+def parse(path):
+    """List of (collection usage, [Report]) of a .wara file."""
+    with open(path, "rb") as f:
+        spec = tomllib.load(f)
+    orders = iter(item_order(path))
+    collections = []
+    names = set()
+
+    for coll in spec.get("applicationCollection", []):
+        check(len(coll.get("usage", [])) == 2, "applicationCollection needs usage = [page, usage]")
+        page = Page(coll["usage"][0])
+        usage = page.usage(coll["usage"][1])
+        reports = []
+        tables = {k: iter(v) for k, v in coll.items() if k.endswith("Report")}
+        for report_kind, item_kinds in next(orders):
+            rep = next(tables[report_kind])
+            check(report_kind[:-6] in MAIN_ITEMS, "unsupported %s" % report_kind)
+            report = Report(report_kind[:-6], rep.get("id", 0))
+            check(0 <= report.id <= 255, "report id %r" % report.id)
+            items = {k: iter(v) for k, v in rep.items() if k.endswith("Item")}
+            for item_kind in item_kinds:
+                report.fields.append(parse_item(item_kind, next(items[item_kind]), names))
+            if report.bits % 8:
+                report.fields.append(Field("padding", None, None, (0, 0), 8 - report.bits % 8,
+                                           1, 0x03, None))
+            reports.append(report)
+        collections.append(((page, usage), reports))
+
+    keys = [(r.kind, r.id) for _, reports in collections for r in reports]
+    check(len(set(keys)) == len(keys), "report ids have to be unique per report kind")
+    check(all(k[1] for k in keys) or not any(k[1] for k in keys), "either every report has an id or none")
+    return collections
+
+
+def parse_item(kind, item, names):
+    if kind == "paddingItem":
+        return Field("padding", None, None, (0, 0), item["sizeInBits"], 1, 0x03, None)
+
+    if "usageRange" in item:
+        page_ref, lo, hi = item["usageRange"]
+        page = Page(page_ref)
+        (lo, lo_text), (hi, hi_text) = page.usage(lo), page.usage(hi)
+        check(lo <= hi, "usageRange %r is reversed" % item["usageRange"])
+        usages = (lo, hi, lo_text, hi_text)
+        name = "%s_%02x_%02x" % (page.short, lo, hi)
+        count = hi - lo + 1
+    else:
+        page = Page(item["usage"][0])
+        usage, text = page.usage(item["usage"][1])
+        usages = (usage, text)
+        name = snake(item["usage"][1]) if isinstance(item["usage"][1], str) else "%s_%02x" % (page.short, usage)
+        count = 1
+
+    if kind == "variableItem":
+        lo, hi = item.get("logicalValueRange", [0, 1])
+        size = item.get("sizeInBits", bits_for(lo, hi))
+        flags = 0x02
+    elif kind == "arrayItem":
+        check("usageRange" in item, "arrayItem needs a usageRange")
+        lo, hi = usages[0], usages[1]
+        size = item.get("sizeInBits", bits_for(lo, hi))
+        count = item.get("count", 1)
+        flags = 0x00
+        name += "_array"
+    else:
+        raise SpecError("unsupported item %s" % kind)
+    check(1 <= size <= 32, "%s: report size %d" % (name, size))
+    check(size >= bits_for(lo, hi), "%s: %d bits do not hold %d..%d" % (name, size, lo, hi))
+
+    base, n = name, 2
+    while name in names:
+        name, n = "%s_%d" % (base, n), n + 1
+    names.add(name)
+    return Field(kind[:-4], page, usages, (lo, hi), size, count, flags, name)
+
+
+def short_item(prefix, value, signed=False):
+    """Encode a short item with the smallest data size."""
+    for size, code in ((1, 1), (2, 2), (4, 3)):
+        lo, hi = (-(1 << (8 * size - 1)), (1 << (8 * size - 1)) - 1) if signed else (0, (1 << (8 * size)) - 1)
+        if lo <= value <= hi:
+            value &= (1 << (8 * size)) - 1
+            return [prefix | code] + [(value >> (8 * i)) & 0xFF for i in range(size)]
+    raise SpecError("item value %d too large" % value)
+
+
+def main_item_text(kind, flags):
+    parts = ["Constant" if flags & 1 else "Data", "Variable" if flags & 2 else "Array",
+             "Absolute", "NoWrap", "Linear", "PreferredState", "NoNullPosition"]
+    if kind != "input":
+        parts.append("NonVolatile")
+    parts.append("BitField")
+    return "%s(%s)" % (MAIN_ITEMS[kind][1], ", ".join(parts))
+
+
+def descriptor(collections):
+    """Report descriptor as (bytes, comment) lines like WaratahCmd prints it."""
+    lines = []
+    state = {}
+
+    def emit(data, comment, depth):
+        lines.append((data, " " * (4 * depth + 1) + comment))
+
+    def global_item(key, prefix, value, comment, depth, signed=False):
+        if state.get(key) != value:
+            state[key] = value
+            emit(short_item(prefix, value, signed), comment, depth)
+
+    for (page, usage), reports in collections:
+        global_item("page", 0x04, page.id, "UsagePage(%s[0x%04X])" % (page.name, page.id), 0)
+        emit(short_item(0x08, usage[0]), "UsageId(%s)" % usage[1], 0)
+        emit([0xA1, 0x01], "Collection(Application)", 0)
+        for report in reports:
+            if report.id:
+                global_item("id", 0x84, report.id, "ReportId(%d)" % report.id, 1)
+            for field in report.fields:
+                if field.kind != "padding":
+                    global_item("page", 0x04, field.page.id,
+                                "UsagePage(%s[0x%04X])" % (field.page.name, field.page.id), 1)
+                    if len(field.usages) == 4:
+                        emit(short_item(0x18, field.usages[0]), "UsageIdMin(%s)" % field.usages[2], 1)
+                        emit(short_item(0x28, field.usages[1]), "UsageIdMax(%s)" % field.usages[3], 1)
+                    else:
+                        emit(short_item(0x08, field.usages[0]), "UsageId(%s)" % field.usages[1], 1)
+                    global_item("lmin", 0x14, field.logical[0], "LogicalMinimum(%d)" % field.logical[0], 1, True)
+                    global_item("lmax", 0x24, field.logical[1], "LogicalMaximum(%d)" % field.logical[1], 1, True)
+                global_item("count", 0x94, field.count, "ReportCount(%d)" % field.count, 1)
+                global_item("size", 0x74, field.size, "ReportSize(%d)" % field.size, 1)
+                emit(short_item(MAIN_ITEMS[report.kind][0], field.flags),
+                     main_item_text(report.kind, field.flags), 1)
+        emit([0xC0], "EndCollection()", 0)
+    return lines
+
+
+def compile_wara(path):
+    """Report descriptor lines of a .wara file, for usb_desc_gen.py."""
+    return descriptor(parse(path))
+
+
+class Emitter:
+    """Straight line code for one report, one statement per report byte."""
+
+    def __init__(self):
+        self.lines = []
+        self.written = set()
+
+    def store(self, byte, expr):
+        op = "|=" if byte in self.written else "="
+        self.written.add(byte)
+        self.lines.append("    p_report[%d] %s (uint8_t)(%s);" % (byte, op, expr))
+
+    def pack_bits(self, expr, offset, size, width):
+        """Store the low size bits of a width bit expr at a bit offset."""
+        if size < width:
+            expr = "(%s & 0x%XU)" % (expr, (1 << size) - 1)
+        for byte in range(offset // 8, (offset + size - 1) // 8 + 1):
+            shift = 8 * byte - offset
+            self.store(byte, "%s >> %d" % (expr, shift) if shift > 0 else
+                       "%s << %d" % (expr, -shift) if shift < 0 else expr)
+
+    def unpack_bits(self, offset, size):
+        """Expression of size bits at a bit offset."""
+        terms = []
+        for byte in range(offset // 8, (offset + size - 1) // 8 + 1):
+            shift = 8 * byte - offset
+            term = "(uint32_t)p_report[%d]" % byte
+            terms.append("(%s << %d)" % (term, shift) if shift > 0 else
+                         "(%s >> %d)" % (term, -shift) if shift < 0 else term)
+        expr = " | ".join(terms)
+        if size % 8 or offset % 8:
+            expr = "(%s) & 0x%XU" % (expr, (1 << size) - 1)
+        return expr
+
+
+def gen_report(report, prefix):
+    sym = report.symbol(prefix)
+    fields = [f for f in report.fields if f.kind != "padding"]
+    pack, unpack = Emitter(), []
+    offset = 0
+
+    if report.id:
+        pack.store(0, "%s_ID" % sym.upper())
+        offset = 8
+    layout = []
+    for field in report.fields:
+        field.offset = offset
+        offset += field.bits
+        if field.kind == "padding":
+            layout.append(" *   %4d  %4d  padding" % (field.offset, field.bits))
+            continue
+        layout.append(" *   %4d  %4d  %s" % (field.offset, field.bits, field.name))
+        src = "p_src->%s" % field.name
+        dst = "p_dst->%s" % field.name
+        width = int(re.search(r"\d+", field.ctype()).group())
+
+        if field.is_bitmask and field.count > 32:
+            if field.offset % 8 == 0:
+                # Whole bytes by memcpy, a partial last byte is masked so
+                # unused bits never reach the bits after the field
+                nbytes, tail = divmod(field.count, 8)
+                pack.lines.append("    memcpy(&p_report[%d], %s, %d);" % (field.offset // 8, src, nbytes))
+                pack.written.update(range(field.offset // 8, field.offset // 8 + nbytes))
+                unpack.append("    memcpy(%s, &p_report[%d], %d);" % (dst, field.offset // 8, nbytes))
+                if tail:
+                    pack.pack_bits("(uint32_t)%s[%d]" % (src, nbytes), field.offset + 8 * nbytes, tail, 8)
+                    unpack.append("    %s[%d] = (uint8_t)(%s);" % (dst, nbytes, pack.unpack_bits(field.offset + 8 * nbytes, tail)))
+            else:
+                for k in range((field.count + 7) // 8):
+                    size = min(8, field.count - 8 * k)
+                    pack.pack_bits("(uint32_t)%s[%d]" % (src, k), field.offset + 8 * k, size, 8)
+                    unpack.append("    %s[%d] = (uint8_t)(%s);" % (dst, k, pack.unpack_bits(field.offset + 8 * k, size)))
+            continue
+
+        elements = 1 if field.is_bitmask else field.count
+        size = field.bits if field.is_bitmask else field.size
+        if elements > 1 and field.offset % 8 == 0 and size == width:
+            nbytes = elements * width // 8
+            pack.lines.append("    memcpy(&p_report[%d], %s, %d);" % (field.offset // 8, src, nbytes))
+            pack.written.update(range(field.offset // 8, field.offset // 8 + nbytes))
+            unpack.append("    memcpy(%s, &p_report[%d], %d);" % (dst, field.offset // 8, nbytes))
+            continue
+        for e in range(elements):
+            s = src if elements == 1 else "%s[%d]" % (src, e)
+            d = dst if elements == 1 else "%s[%d]" % (dst, e)
+            bit = field.offset + e * size
+            # Signed values are sign extended by the cast, mask them too
+            pack.pack_bits("(uint32_t)%s" % s, bit, size, 32 if field.logical[0] < 0 else width)
+            value = pack.unpack_bits(bit, size)
+            if field.logical[0] < 0 and size < 32:
+                value = "(int32_t)((%s) << %d) >> %d" % (value, 32 - size, 32 - size)
+            unpack.append("    %s = (%s)(%s);" % (d, field.ctype(), value))
+
+    for byte in range(report.size):
+        if byte not in pack.written:
+            pack.store(byte, "0U")
+    pack.lines.sort(key=lambda l: int(re.search(r"p_report\[(\d+)\]", l).group(1)))
+
+    upper = sym.upper()
+    out = [
+        "#define %-40s(%dU)" % (upper + "_ID", report.id),
+        "#define %-40s(%dU)" % (upper + "_SIZE", report.size),
+        "",
+        "/**",
+        " * @brief %s report%s, unpacked." % (report.kind.capitalize(), " %d" % report.id if report.id else ""),
+        " *",
+        " *   bit  bits  field",
+    ] + layout + [
+        " */",
+        "typedef struct %s_s" % sym,
+        "{",
+    ] + ["    %s" % f.declaration() for f in fields] + [
+        "} %s_t;" % sym,
+        "",
+        "/**",
+        " * @brief Pack into the wire format, every report byte is written.",
+        " *",
+        " * @return Report length.",
+        " */",
+        "static inline uint32_t",
+        "%s_pack(const %s_t *p_src, uint8_t *p_report)" % (sym, sym),
+        "{",
+    ] + pack.lines + [
+        "    return %s_SIZE;" % upper,
+        "}",
+        "",
+        "/**",
+        " * @brief Unpack from the wire format%s." % (", the report ID is not checked" if report.id else ""),
+        " */",
+        "static inline void",
+        "%s_unpack(const uint8_t *p_report, %s_t *p_dst)" % (sym, sym),
+        "{",
+    ] + unpack + [
+        "}",
+        "",
+    ]
+    return out
+
+
+def generate(path, out_path, prefix):
+    collections = parse(path)
+    guard = re.sub(r"\W", "_", os.path.basename(out_path)).upper()
+    out = [
+        "/* AUTO-GENERATED by tools/hid_report_gen.py from %s, do not edit. */" % os.path.basename(path),
+        "",
+        "#ifndef %s" % guard,
+        "#define %s" % guard,
+        "",
+        "#include <stdint.h>",
+        "#include <string.h>",
+        "",
+    ]
+    for _, reports in collections:
+        for report in reports:
+            out += gen_report(report, prefix)
+    out += ["#endif /* %s */" % guard]
+    os.makedirs(os.path.dirname(out_path) or ".", exist_ok=True)
+    with open(out_path, "w") as f:
+        f.write("\n".join(out) + "\n")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("wara", help="hidtools report definition")
+    parser.add_argument("out", help="header to write")
+    parser.add_argument("--prefix", default="usb_report", help="prefix of the generated names")
+    args = parser.parse_args()
+
+    try:
+        generate(args.wara, args.out, args.prefix)
+    except SpecError as e:
+        sys.exit("%s: %s" % (args.wara, e))
+    except (KeyError, StopIteration) as e:
+        sys.exit("%s: malformed item %s" % (args.wara, e))
+
+
+if __name__ == "__main__":
+    main()
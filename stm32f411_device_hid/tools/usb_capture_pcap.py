@@ -0,0 +1,219 @@
+#!/usr/bin/env python3
+"""Convert a RAM dump of usb_capture_buf into a usbmon pcap file.
+
+Take the dump with the target halted, e.g. from gdb:
+
+    (gdb) dump binary value usb_capture.bin usb_capture_buf
+
+then run:
+
+    tools/usb_capture_pcap.py usb_capture.bin usb_capture.pcap
+
+The output uses the Linux usbmon link type (LINKTYPE_USB_LINUX_MMAPPED), so
+Wireshark dissects descriptors and class requests as in a capture taken on
+the host. Every record becomes an URB submission and completion:
+
+- a control request is one URB, from its SETUP to the status stage, with
+  the data stage attached and -EPIPE as status when EP0 STALLed it, or
+  -ENOENT when the next SETUP came first, the host gave up on it
+- an OUT packet on any other endpoint is one URB
+- an IN transfer is one URB, the core only reports IN completion per
+  transfer
+
+Only the first bytes of each transaction are captured on the target, the
+URB length is the real one. The device address follows SET_ADDRESS.
+Timestamps are the DWT cycle counter, relative to --start.
+"""
+
+import argparse
+import struct
+import sys
+
+HEADER_FMT = "<IIII"
+ENTRY_FMT = "<IHBBIHBB"
+CAPTURE_MAGIC = 0x55534243
+DEFAULT_CPU_HZ = 72000000
+
+KIND_SETUP = 1
+KIND_OUT = 2
+KIND_IN = 3
+KIND_STALL = 4
+KIND_NAMES = {KIND_SETUP: "SETUP", KIND_OUT: "OUT", KIND_IN: "IN", KIND_STALL: "STALL"}
+
+LINKTYPE_USB_LINUX_MMAPPED = 220
+USBMON_FMT = "<QBBBBHbbqiiIIBBBBBBBBiiII"
+# EPTYP encoding to usbmon transfer type
+USBMON_XFER_TYPE = {0: 2, 1: 0, 2: 3, 3: 1}
+USBMON_CONTROL = 2
+ENOENT = 2
+EPIPE = 32
+
+
+class Record:
+    def __init__(self, idx, ts, kind, ep, length, frame, ep_type, data):
+        self.idx = idx
+        self.ts = ts
+        self.kind = kind
+        self.ep = ep
+        self.length = length
+        self.frame = frame
+        self.ep_type = ep_type
+        self.data = data
+
+
+def load(dump):
+    """Return the records in the dump in order, with unwrapped timestamps."""
+    magic, size, head, data_bytes = struct.unpack_from(HEADER_FMT, dump, 0)
+    if magic != CAPTURE_MAGIC:
+        sys.exit("bad magic 0x%08x, not a usb_capture_buf dump" % magic)
+    entry_size = struct.calcsize(ENTRY_FMT) + data_bytes
+    base = struct.calcsize(HEADER_FMT)
+    if len(dump) < base + size * entry_size:
+        sys.exit("dump truncated: %d bytes for %d entries" % (len(dump), size))
+
+    records = []
+    torn = 0
+    wraps = 0
+    prev_ts = None
+    for idx in range(max(0, head - size), head):
+        off = base + (idx % size) * entry_size
+        ts, seq, kind, ep, length, frame, ep_type, captured = struct.unpack_from(ENTRY_FMT, dump, off)
+        if seq != (idx & 0xFFFF) or kind not in KIND_NAMES:
+            torn += 1
+            continue
+        # A record can be claimed by an interrupt in the middle of another
+        # one, only a big step back is a wrap of the counter
+        if prev_ts is not None and ts < prev_ts and (prev_ts - ts) > 0x80000000:
+            wraps += 1
+        prev_ts = ts
+        data = dump[off + struct.calcsize(ENTRY_FMT):][:min(captured, data_bytes)]
+        records.append(Record(idx, ts + (wraps << 32), kind, ep, length, frame, ep_type, data))
+    if head > size:
+        print("warning: %d older records overwritten, the capture starts in the middle "
+              "and may miss the enumeration; raise USB_CAPTURE_BUF_SIZE above %d"
+              % (head - size, size), file=sys.stderr)
+    if torn:
+        print("%d torn records skipped" % torn, file=sys.stderr)
+    return records
+
+
+class UsbmonWriter:
+    """Pairs records into usbmon submission/completion events."""
+
+    def __init__(self, out, cpu_hz, start, busnum, devnum):
+        self.out = out
+        self.cpu_hz = cpu_hz
+        self.start = start
+        self.busnum = busnum
+        self.devnum = devnum
+        self.urb_id = 0
+        self.control = None
+        self.out.write(struct.pack("<IHHiIII", 0xA1B2C3D4, 2, 4, 0, 0, 65535, LINKTYPE_USB_LINUX_MMAPPED))
+
+    def event(self, ts, urb_id, event, xfer_type, ep, setup, data, length, status):
+        seconds = self.start + ts / self.cpu_hz
+        sec = int(seconds)
+        usec = int((seconds - sec) * 1e6)
+        flag_setup = 0 if setup is not None else ord("-")
+        if data:
+            flag_data = 0
+        else:
+            flag_data = ord("<") if (ep & 0x80) else ord(">")
+        header = struct.pack(USBMON_FMT, urb_id, ord(event), xfer_type, ep, self.devnum, self.busnum,
+                             flag_setup, flag_data, sec, usec, -status, length, len(data),
+                             *(setup or bytes(8)), 0, 0, 0, 0)
+        self.out.write(struct.pack("<IIII", sec, usec, len(header) + len(data), len(header) + len(data)))
+        self.out.write(header + data)
+
+    def urb(self, ts_submit, ts_complete, xfer_type, ep, setup, submit_data, complete_data,
+            submit_length, complete_length, status):
+        self.urb_id += 1
+        self.event(ts_submit, self.urb_id, "S", xfer_type, ep, setup, submit_data, submit_length, 0)
+        self.event(ts_complete, self.urb_id, "C", xfer_type, ep, None, complete_data, complete_length, status)
+
+    def end_control(self, ts, status):
+        setup, ts_setup, data, length = self.control
+        self.control = None
+        request_type, request, value, _, w_length = struct.unpack("<BBHHH", setup)
+        if request_type & 0x80:
+            self.urb(ts_setup, ts, USBMON_CONTROL, 0x80, setup, b"", data, w_length, length, status)
+        else:
+            self.urb(ts_setup, ts, USBMON_CONTROL, 0x00, setup, data, b"", w_length, length, status)
+        # The device answers at the new address once the status stage is done
+        if status == 0 and request_type == 0x00 and request == 0x05:
+            self.devnum = value & 0x7F
+
+    def record(self, rec):
+        if rec.kind == KIND_SETUP:
+            if self.control is not None:
+                self.end_control(rec.ts, ENOENT)
+            self.control = [rec.data.ljust(8, b"\0"), rec.ts, b"", 0]
+            return
+        if (rec.ep & 0x0F) == 0:
+            self.control_stage(rec)
+            return
+        if rec.kind == KIND_STALL:
+            return
+        xfer_type = USBMON_XFER_TYPE[rec.ep_type & 3]
+        if rec.kind == KIND_IN:
+            self.urb(rec.ts, rec.ts, xfer_type, rec.ep, None, b"", rec.data, rec.length, rec.length, 0)
+        else:
+            self.urb(rec.ts, rec.ts, xfer_type, rec.ep, None, rec.data, b"", rec.length, rec.length, 0)
+
+    def control_stage(self, rec):
+        if self.control is None:
+            return
+        if rec.kind == KIND_STALL:
+            self.end_control(rec.ts, EPIPE)
+            return
+        setup = self.control[0]
+        device_to_host = bool(setup[0] & 0x80)
+        data_stage = (rec.kind == KIND_IN) == device_to_host
+        if data_stage and rec.length != 0:
+            # Captured bytes stay contiguous only while nothing was cut off
+            if len(self.control[2]) == self.control[3]:
+                self.control[2] += rec.data
+            self.control[3] += rec.length
+        elif not data_stage:
+            self.end_control(rec.ts, 0)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("dump", help="binary dump of usb_capture_buf")
+    parser.add_argument("pcap", help="pcap file to write")
+    parser.add_argument("--cpu-hz", type=int, default=DEFAULT_CPU_HZ, help="DWT clock frequency")
+    parser.add_argument("--start", type=float, default=0.0,
+                        help="time of DWT count 0, seconds since the epoch")
+    parser.add_argument("--bus", type=int, default=1, help="usbmon bus number")
+    parser.add_argument("--address", type=int, default=None,
+                        help="device address before the first SET_ADDRESS, "
+                             "default 0 if the dump has one and 1 otherwise")
+    parser.add_argument("--list", action="store_true", help="also print the records")
+    args = parser.parse_args()
+
+    with open(args.dump, "rb") as f:
+        records = load(f.read())
+    if not records:
+        sys.exit("no records in the dump")
+
+    address = args.address
+    if address is None:
+        has_set_address = any(r.kind == KIND_SETUP and r.data[:2] == b"\x00\x05" for r in records)
+        address = 0 if has_set_address else 1
+
+    base = records[0].ts
+    with open(args.pcap, "wb") as out:
+        writer = UsbmonWriter(out, args.cpu_hz, args.start, args.bus, address)
+        for rec in records:
+            rec.ts -= base
+            writer.record(rec)
+            if args.list:
+                print("%10u  %12.3f us  frame %4u  %-5s ep 0x%02x  %5u  %s"
+                      % (rec.idx, rec.ts * 1e6 / args.cpu_hz, rec.frame, KIND_NAMES[rec.kind],
+                         rec.ep, rec.length, rec.data.hex(" ")))
+    print("%d records, %d URBs" % (len(records), writer.urb_id), file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,508 @@
+#!/usr/bin/env python3
+"""Generate the USB descriptors from usb/usb_desc.json.
+
+Every length field (bLength, wTotalLength, bNumInterfaces, bNumEndpoints,
+wDescriptorLength, string bLength) is computed here, and string indices are
+assigned in order of appearance. Strings are written as UTF-8 in the spec
+and converted to UTF-16LE here, nothing is converted at run time. With
+"serial_from_uid" the serial number string is a RAM buffer the firmware
+fills in once from the 96-bit device UID. The output is
+
+    usb_desc_gen.c  one word aligned const blob per descriptor and the
+                    usb_desc_table index used by GET_DESCRIPTOR
+    usb_desc_gen.h  lengths, string indices and configuration values the
+                    driver needs at compile time
+
+Run by the makefile, by hand:
+
+    tools/usb_desc_gen.py usb/usb_desc.json build/gen
+
+A HID interface takes its report descriptor from a hidtools .wara file,
+compiled by tools/hid_report_gen.py, or from the header WaratahCmd
+generates from it. The path is relative to the spec. A CDC communication
+interface gets its Header, Call Management, ACM and Union functional
+descriptors from a "cdc" block naming its data interface by symbol.
+
+An interface with a "variants" list is only part of the configuration
+when the generator runs with one of those variants (--variant, "default"
+unless given), interfaces are numbered after the selection.
+
+Interfaces that form one function, like the two of a CDC-ACM port, are
+grouped by an entry of "associations" and get an Interface Association
+Descriptor. A configuration with any IAD gets the Miscellaneous device
+class (0xEF/0x02/0x01) hosts need to look for them. An association is
+dropped with its interfaces when the variant leaves them out.
+
+Endpoints with a "direction" instead of a "bEndpointAddress" are numbered
+here, after the fixed ones, the IN and OUT endpoint of one interface
+sharing a number where possible. An endpoint "symbol" becomes
+USB_DESC_EP_<symbol>, the address the firmware uses.
+"""
+
+import argparse
+import json
+import os
+import re
+import sys
+
+import hid_report_gen
+
+MAX_ENDPOINTS = 4           # OTG_FS: EP0 + 3 IN/OUT endpoint pairs
+UID_HEX_DIGITS = 24         # 96-bit unique ID as hex
+EP_TYPES = {"control": 0, "isochronous": 1, "bulk": 2, "interrupt": 3}
+
+DESC_DEVICE = 1
+DESC_CONFIGURATION = 2
+DESC_STRING = 3
+DESC_INTERFACE = 4
+DESC_ENDPOINT = 5
+DESC_INTERFACE_ASSOCIATION = 0x0B
+DESC_HID = 0x21
+DESC_REPORT = 0x22
+DESC_CS_INTERFACE = 0x24
+
+CDC_HEADER = 0x00
+CDC_CALL_MANAGEMENT = 0x01
+CDC_ACM = 0x02
+CDC_UNION = 0x06
+
+# Miscellaneous Device Class, Common Class, Interface Association
+IAD_DEVICE_CLASS = (0xEF, 0x02, 0x01)
+
+class SpecError(Exception):
+    pass
+
+
+def check(cond, msg):
+    if not cond:
+        raise SpecError(msg)
+
+
+def num(value, what, lo=0, hi=0xFF):
+    """Integer field, given as a number or a "0x.." string."""
+    if isinstance(value, str):
+        value = int(value, 0)
+    check(isinstance(value, int) and lo <= value <= hi,
+          "%s = %r out of range %d..%d" % (what, value, lo, hi))
+    return value
+
+
+def bcd(value, what):
+    """"2.00" -> 0x0200, "1.11" -> 0x0111."""
+    m = re.fullmatch(r"(\d{1,2})\.(\d)(\d)", value)
+    check(m is not None, "%s = %r is not a version like 1.11" % (what, value))
+    return (int(m.group(1), 16) << 8) | (int(m.group(2)) << 4) | int(m.group(3))
+
+
+class Desc:
+    """A descriptor as a list of (bytes, field name, comment) lines."""
+
+    def __init__(self, name, desc_type):
+        self.name = name
+        self.type = desc_type
+        self.fields = []
+
+    def u8(self, value, field, comment=""):
+        self.fields.append(([value & 0xFF], field, comment))
+
+    def u16(self, value, field, comment=""):
+        self.fields.append(([value & 0xFF, value >> 8], field, comment))
+
+    def raw(self, data, field, comment=""):
+        self.fields.append((list(data), field, comment))
+
+    def finish(self):
+        """Prepend bLength and bDescriptorType, returns self."""
+        length = 2 + sum(len(b) for b, _, _ in self.fields)
+        check(length <= 0xFF, "%s is %d bytes long" % (self.name, length))
+        self.fields[:0] = [([length], "bLength", ""), ([self.type], "bDescriptorType", "")]
+        return self
+
+    def data(self):
+        return [b for field in self.fields for b in field[0]]
+
+
+class Strings:
+    """String descriptor table, index 0 is the language ID list."""
+
+    def __init__(self, languages):
+        check(len(languages) >= 1, "at least one language ID is required")
+        lang = Desc("Language IDs", DESC_STRING)
+        for lang_id in languages:
+            lang.u16(num(lang_id, "language ID", 0, 0xFFFF), "wLANGID")
+        self.descs = [lang.finish()]
+        self.index = {}
+
+    def add(self, text, what):
+        """Index of text, 0 when text is None."""
+        if text is None:
+            return 0
+        if text not in self.index:
+            # Characters outside the BMP become surrogate pairs
+            encoded = text.encode("utf-16-le")
+            check(len(encoded) <= 0xFF - 2, "%s string %r is too long" % (what, text))
+            desc = Desc(what, DESC_STRING)
+            desc.raw(encoded, "bString", '"%s"' % text.replace("*/", "*\\/"))
+            self.descs.append(desc.finish())
+            self.index[text] = len(self.descs) - 1
+        return self.index[text]
+
+    def add_uid(self):
+        """Index of the serial number string built from the device UID."""
+        desc = Desc("Serial number, filled in from the device UID by usb_desc_serial_init", DESC_STRING)
+        desc.ram_len = 2 + 2 * UID_HEX_DIGITS
+        self.descs.append(desc)
+        return len(self.descs) - 1
+
+
+def load_report(path):
+    """Report descriptor lines (bytes, item comment) from a .wara file or a
+    WaratahCmd header."""
+    if path.endswith(".wara"):
+        try:
+            return hid_report_gen.compile_wara(path)
+        except hid_report_gen.SpecError as e:
+            raise SpecError("%s: %s" % (path, e))
+    with open(path) as f:
+        text = f.read()
+    m = re.search(r"uint8_t\s+\w+\[\]\s*=\s*\{(.*?)\};", text, re.S)
+    check(m is not None, "%s has no report descriptor array" % path)
+    lines = []
+    for line in m.group(1).splitlines():
+        code, _, comment = line.partition("//")
+        data = [int(tok, 16) for tok in re.findall(r"0x[0-9A-Fa-f]{2}", code)]
+        if data:
+            lines.append((data, comment.rstrip()))
+    check(lines, "%s has an empty report descriptor" % path)
+    return lines
+
+
+def associations_of(cfg, numbers):
+    """Associations whose interfaces are all in the configuration, as
+    (first interface number, spec), checked to be contiguous."""
+    result = []
+    grouped = set()
+    for assoc in cfg.get("associations", []):
+        symbols = assoc["interfaces"]
+        symbol = assoc.get("symbol", symbols[0] if symbols else "?")
+        present = [s for s in symbols if s in numbers]
+        if not present:
+            continue
+        check(len(present) == len(symbols) and len(symbols) >= 2,
+              "association %s needs at least two interfaces, all in the variant" % symbol)
+        first = numbers[symbols[0]]
+        check([numbers[s] for s in symbols] == list(range(first, first + len(symbols))),
+              "association %s interfaces have to be listed in order and contiguous" % symbol)
+        check(grouped.isdisjoint(symbols), "association %s reuses an interface" % symbol)
+        grouped.update(symbols)
+        result.append((first, assoc))
+    return result
+
+
+def assign_endpoints(interfaces):
+    """bEndpointAddress of every endpoint, in configuration order. Fixed
+    addresses are taken first, then each "direction" endpoint gets the
+    number the interface already uses in the other direction if it is
+    free, else the lowest free number."""
+    used = set()
+    for intf in interfaces:
+        for ep in intf.get("endpoints", []):
+            if "bEndpointAddress" in ep:
+                addr = num(ep["bEndpointAddress"], "bEndpointAddress")
+                check(addr & 0x70 == 0 and 0 < (addr & 0x0F) < MAX_ENDPOINTS,
+                      "endpoint 0x%02x does not exist on OTG_FS" % addr)
+                check(addr not in used, "endpoint 0x%02x used twice" % addr)
+                used.add(addr)
+
+    addrs = []
+    for intf in interfaces:
+        own = []
+        for ep in intf.get("endpoints", []):
+            if "bEndpointAddress" in ep:
+                addr = num(ep["bEndpointAddress"], "bEndpointAddress")
+            else:
+                check(ep.get("direction") in ("in", "out"),
+                      "endpoint without bEndpointAddress needs a direction in/out")
+                dir_bit = 0x80 if ep["direction"] == "in" else 0x00
+                numbers = [a & 0x0F for a in own] + list(range(1, MAX_ENDPOINTS))
+                free = [n for n in numbers if (dir_bit | n) not in used]
+                check(free, "no %s endpoint left for interface %s"
+                      % (ep["direction"].upper(), intf.get("symbol", "?")))
+                addr = dir_bit | free[0]
+                used.add(addr)
+            own.append(addr)
+            addrs.append(addr)
+    return addrs
+
+
+def build(spec, spec_dir, variant):
+    dev = spec["device"]
+    cfg = spec["configuration"]
+    interfaces = [intf for intf in cfg["interfaces"] if variant in intf.get("variants", [variant])]
+    numbers = {intf.get("symbol", str(n)): n for n, intf in enumerate(interfaces)}
+    strings = Strings(spec.get("languages", ["0x0409"]))
+    associations = associations_of(cfg, numbers)
+    ep_addr_list = assign_endpoints(interfaces)
+    defines = []
+    reports = []
+
+    ep0_mps = num(dev["bMaxPacketSize0"], "bMaxPacketSize0")
+    check(ep0_mps in (8, 16, 32, 64), "bMaxPacketSize0 has to be 8, 16, 32 or 64")
+
+    device = Desc("Device", DESC_DEVICE)
+    device.u16(bcd(dev["bcdUSB"], "bcdUSB"), "bcdUSB", "USB %s" % dev["bcdUSB"])
+    device_class = (num(dev["bDeviceClass"], "bDeviceClass"),
+                    num(dev["bDeviceSubClass"], "bDeviceSubClass"),
+                    num(dev["bDeviceProtocol"], "bDeviceProtocol"))
+    note = ""
+    if associations:
+        check(device_class in ((0, 0, 0), IAD_DEVICE_CLASS),
+              "a configuration with associations needs device class 0 or 0xEF/0x02/0x01")
+        device_class = IAD_DEVICE_CLASS
+        note = "Miscellaneous, the configuration has IADs"
+    device.u8(device_class[0], "bDeviceClass", note)
+    device.u8(device_class[1], "bDeviceSubClass")
+    device.u8(device_class[2], "bDeviceProtocol")
+    device.u8(ep0_mps, "bMaxPacketSize0")
+    device.u16(num(dev["idVendor"], "idVendor", 0, 0xFFFF), "idVendor")
+    device.u16(num(dev["idProduct"], "idProduct", 0, 0xFFFF), "idProduct")
+    device.u16(bcd(dev["bcdDevice"], "bcdDevice"), "bcdDevice", dev["bcdDevice"])
+    for field, key in (("iManufacturer", "manufacturer"), ("iProduct", "product"),
+                       ("iSerialNumber", "serial")):
+        if key == "serial" and dev.get("serial_from_uid"):
+            check("serial" not in dev, "serial and serial_from_uid are exclusive")
+            index = strings.add_uid()
+            defines.append(("USB_DESC_SERIAL_LEN", strings.descs[index].ram_len))
+        else:
+            index = strings.add(dev.get(key), key.capitalize())
+        device.u8(index, field)
+        if index:
+            defines.append(("USB_DESC_STRING_%s" % key.upper(), index))
+    device.u8(1, "bNumConfigurations")
+    device.finish()
+
+    # Configuration header, the totals are patched in once the rest is known
+    config = Desc("Configuration", DESC_CONFIGURATION)
+    config_value = num(cfg["bConfigurationValue"], "bConfigurationValue", 1)
+    attributes = 0x80 | (0x40 if cfg.get("self_powered") else 0) | \
+        (0x20 if cfg.get("remote_wakeup") else 0)
+    config.u16(0, "wTotalLength")
+    config.u8(0, "bNumInterfaces")
+    config.u8(config_value, "bConfigurationValue")
+    config.u8(strings.add(cfg.get("name"), "Configuration"), "iConfiguration")
+    config.u8(attributes, "bmAttributes", "D6: self powered, D5: remote wakeup")
+    config.u8(num(cfg["max_power_mA"], "max_power_mA", 0, 500) // 2, "bMaxPower",
+              "%d mA" % cfg["max_power_mA"])
+    config.finish()
+
+    body = []
+    hid_descs = []
+    ep_addrs = iter(ep_addr_list)
+    ep_symbols = set()
+    iads = dict(associations)
+    for number, intf in enumerate(interfaces):
+        symbol = intf.get("symbol", str(number))
+        check(re.fullmatch(r"[A-Z0-9_]+", symbol), "interface symbol %r" % symbol)
+        endpoints = intf.get("endpoints", [])
+
+        if number in iads:
+            assoc = iads[number]
+            assoc_symbol = assoc.get("symbol", symbol)
+            count = len(assoc["interfaces"])
+            desc = Desc("Interface Association %s" % assoc_symbol, DESC_INTERFACE_ASSOCIATION)
+            desc.u8(number, "bFirstInterface", symbol)
+            desc.u8(count, "bInterfaceCount")
+            for field, key in (("bFunctionClass", "bInterfaceClass"),
+                               ("bFunctionSubClass", "bInterfaceSubClass"),
+                               ("bFunctionProtocol", "bInterfaceProtocol")):
+                desc.u8(num(assoc.get(field, intf[key]), field), field)
+            desc.u8(strings.add(assoc.get("name"), "Function %s" % assoc_symbol), "iFunction")
+            body.append(desc.finish())
+        desc = Desc("Interface %s" % symbol, DESC_INTERFACE)
+        desc.u8(number, "bInterfaceNumber")
+        desc.u8(0, "bAlternateSetting")
+        desc.u8(len(endpoints), "bNumEndpoints")
+        desc.u8(num(intf["bInterfaceClass"], "bInterfaceClass"), "bInterfaceClass")
+        desc.u8(num(intf["bInterfaceSubClass"], "bInterfaceSubClass"), "bInterfaceSubClass")
+        desc.u8(num(intf["bInterfaceProtocol"], "bInterfaceProtocol"), "bInterfaceProtocol")
+        desc.u8(strings.add(intf.get("name"), "Interface %s" % symbol), "iInterface")
+        body.append(desc.finish())
+        defines.append(("USB_DESC_INTERFACE_%s" % symbol, number))
+
+        if "hid" in intf:
+            hid = intf["hid"]
+            report = load_report(os.path.join(spec_dir, hid["report"]))
+            report_len = sum(len(data) for data, _ in report)
+            desc = Desc("HID %s" % symbol, DESC_HID)
+            desc.u16(bcd(hid["bcdHID"], "bcdHID"), "bcdHID", "HID %s" % hid["bcdHID"])
+            desc.u8(num(hid.get("bCountryCode", 0), "bCountryCode"), "bCountryCode")
+            desc.u8(1, "bNumDescriptors")
+            desc.u8(DESC_REPORT, "bDescriptorType", "Report")
+            desc.u16(report_len, "wDescriptorLength")
+            body.append(desc.finish())
+            hid_descs.append((number, symbol, desc))
+            reports.append((number, symbol, report, hid["report"]))
+            defines.append(("USB_DESC_REPORT_%s_LEN" % symbol, report_len))
+
+        if "cdc" in intf:
+            cdc = intf["cdc"]
+            data_symbol = cdc["data_interface"]
+            check(data_symbol in numbers, "CDC data interface %s is not in the configuration" % data_symbol)
+            data_number = numbers[data_symbol]
+            desc = Desc("CDC Header %s" % symbol, DESC_CS_INTERFACE)
+            desc.u8(CDC_HEADER, "bDescriptorSubtype", "Header")
+            desc.u16(bcd(cdc["bcdCDC"], "bcdCDC"), "bcdCDC", "CDC %s" % cdc["bcdCDC"])
+            body.append(desc.finish())
+            desc = Desc("CDC Call Management %s" % symbol, DESC_CS_INTERFACE)
+            desc.u8(CDC_CALL_MANAGEMENT, "bDescriptorSubtype", "Call Management")
+            desc.u8(num(cdc.get("call_management", 0), "call_management"), "bmCapabilities")
+            desc.u8(data_number, "bDataInterface", data_symbol)
+            body.append(desc.finish())
+            desc = Desc("CDC ACM %s" % symbol, DESC_CS_INTERFACE)
+            desc.u8(CDC_ACM, "bDescriptorSubtype", "Abstract Control Management")
+            desc.u8(num(cdc.get("acm", 0), "acm"), "bmCapabilities")
+            body.append(desc.finish())
+            desc = Desc("CDC Union %s" % symbol, DESC_CS_INTERFACE)
+            desc.u8(CDC_UNION, "bDescriptorSubtype", "Union")
+            desc.u8(number, "bControlInterface", symbol)
+            desc.u8(data_number, "bSubordinateInterface0", data_symbol)
+            body.append(desc.finish())
+
+        for ep in endpoints:
+            addr = next(ep_addrs)
+            ep_type = EP_TYPES.get(ep["type"])
+            mps = num(ep["wMaxPacketSize"], "wMaxPacketSize", 1, 1023)
+            check(ep_type in (1, 2, 3), "endpoint 0x%02x type %r" % (addr, ep["type"]))
+            if ep_type == 2:
+                check(mps in (8, 16, 32, 64), "bulk endpoint 0x%02x wMaxPacketSize %d" % (addr, mps))
+            elif ep_type == 3:
+                check(mps <= 64, "interrupt endpoint 0x%02x wMaxPacketSize %d" % (addr, mps))
+            interval = num(ep.get("bInterval", 0 if ep_type == 2 else 1), "bInterval")
+            check(ep_type != 3 or interval >= 1, "interrupt endpoint 0x%02x bInterval 0" % addr)
+            check(ep_type != 1 or 1 <= interval <= 16, "isochronous endpoint 0x%02x bInterval" % addr)
+            if "symbol" in ep:
+                check(re.fullmatch(r"[A-Z0-9_]+", ep["symbol"]) and ep["symbol"] not in ep_symbols,
+                      "endpoint symbol %r" % ep["symbol"])
+                ep_symbols.add(ep["symbol"])
+                defines.append(("USB_DESC_EP_%s" % ep["symbol"], "0x%02XU" % addr))
+            desc = Desc("Endpoint 0x%02x" % addr, DESC_ENDPOINT)
+            desc.u8(addr, "bEndpointAddress", "%s %d" % ("IN" if addr & 0x80 else "OUT", addr & 0x0F))
+            desc.u8(ep_type, "bmAttributes", ep["type"])
+            desc.u16(mps, "wMaxPacketSize")
+            desc.u8(interval, "bInterval")
+            body.append(desc.finish())
+
+    total = len(config.data()) + sum(len(d.data()) for d in body)
+    check(total <= 0xFFFF, "configuration descriptor is %d bytes long" % total)
+    config.fields[2] = ([total & 0xFF, total >> 8], "wTotalLength", "%d bytes" % total)
+    config.fields[3] = ([len(interfaces)], "bNumInterfaces", "")
+
+    defines[:0] = [
+        ("USB_DESC_EP0_MAX_PACKET", ep0_mps),
+        ("USB_DESC_CONFIGURATION_VALUE", config_value),
+        ("USB_DESC_CONFIGURATION_LEN", total),
+        ("USB_DESC_CONFIGURATION_ATTRIBUTES", "0x%02XU" % attributes),
+        ("USB_DESC_NUM_INTERFACES", len(interfaces)),
+        ("USB_DESC_STRING_COUNT", len(strings.descs)),
+    ]
+    return device, config, body, hid_descs, reports, strings.descs, defines
+
+
+def emit_desc_lines(out, fields):
+    for data, field, comment in fields:
+        text = "".join("0x%02X, " % b for b in data)
+        note = field + (":  " + comment if comment else "")
+        if len(data) > 4:
+            out.append("    /* %s */" % note)
+            for i in range(0, len(data), 8):
+                out.append("    " + "".join("0x%02X, " % b for b in data[i:i + 8]).rstrip())
+        else:
+            out.append("    %-32s/* %s */" % (text.rstrip(), note))
+
+
+def blob(out, name, linkage, length, emit):
+    out.append("%sconst uint8_t %s[%s] __attribute__((aligned(4))) = {" % (linkage, name, length))
+    emit()
+    out.append("};")
+    out.append("")
+
+
+def generate(spec_path, out_dir, variant):
+    with open(spec_path, encoding="utf-8") as f:
+        spec = json.load(f)
+    spec_dir = os.path.dirname(spec_path)
+    device, config, body, hid_descs, reports, strings, defines = build(spec, spec_dir, variant)
+    banner = ["/* AUTO-GENERATED by tools/usb_desc_gen.py from %s (%s), do not edit. */"
+              % (spec_path, variant), ""]
+    table = []
+
+    c = banner + ['#include "usb_desc.h"', ""]
+    blob(c, "usb_desc_device", "static ", "", lambda: emit_desc_lines(c, device.fields))
+    table.append(("USB_DESCRIPTOR_DEVICE", 0, 0, "usb_desc_device"))
+
+    def emit_config():
+        for desc in [config] + body:
+            c.append("    /* %s */" % desc.name)
+            emit_desc_lines(c, desc.fields)
+    blob(c, "usb_desc_configuration", "", "USB_DESC_CONFIGURATION_LEN", emit_config)
+    table.append(("USB_DESCRIPTOR_CONFIGURATION", 0, 0, "usb_desc_configuration"))
+
+    for number, symbol, desc in hid_descs:
+        name = "usb_desc_hid_%s" % symbol.lower()
+        blob(c, name, "static ", "", lambda: emit_desc_lines(c, desc.fields))
+        table.append(("USB_DESCRIPTOR_HID", 0, number, name))
+
+    for number, symbol, report, path in reports:
+        name = "usb_desc_report_%s" % symbol.lower()
+        c.append("// %s" % path)
+        def emit_report():
+            for data, comment in report:
+                c.append("    %-15s//%s" % ("".join("0x%02X, " % b for b in data).rstrip(), comment))
+        blob(c, name, "static ", "USB_DESC_REPORT_%s_LEN" % symbol, emit_report)
+        table.append(("USB_DESCRIPTOR_REPORT", 0, number, name))
+
+    for index, desc in enumerate(strings):
+        name = "usb_desc_string_%d" % index
+        c.append("// %s" % desc.name)
+        if hasattr(desc, "ram_len"):
+            name = "usb_desc_serial"
+            c.append("uint8_t %s[USB_DESC_SERIAL_LEN] __attribute__((aligned(4)));" % name)
+            c.append("")
+        else:
+            blob(c, name, "static ", "", lambda: emit_desc_lines(c, desc.fields))
+        table.append(("USB_DESCRIPTOR_STRING", index, 0, name))
+
+    c.append("const usb_desc_t usb_desc_table[USB_DESC_COUNT] = {")
+    for enum, index, w_index, name in table:
+        c.append("    { %s, %d, %d, sizeof(%s), %s }," % (enum, index, w_index, name, name))
+    c.append("};")
+
+    h = banner + ["#ifndef USB_DESC_GEN_H", "#define USB_DESC_GEN_H", ""]
+    for name, value in defines + [("USB_DESC_COUNT", len(table))]:
+        value = value if isinstance(value, str) else "%dU" % value
+        h.append("#define %-40s(%s)" % (name, value))
+    h += ["", "#endif /* USB_DESC_GEN_H */"]
+
+    os.makedirs(out_dir, exist_ok=True)
+    for name, lines in (("usb_desc_gen.c", c), ("usb_desc_gen.h", h)):
+        with open(os.path.join(out_dir, name), "w", encoding="utf-8") as f:
+            f.write("\n".join(lines) + "\n")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("spec", help="descriptor spec, usb/usb_desc.json")
+    parser.add_argument("out_dir", help="directory for usb_desc_gen.c/.h")
+    parser.add_argument("--variant", default="default", help="interfaces to include, see above")
+    args = parser.parse_args()
+
+    try:
+        generate(args.spec, args.out_dir, args.variant)
+    except SpecError as e:
+        sys.exit("%s: %s" % (args.spec, e))
+    except KeyError as e:
+        sys.exit("%s: missing field %s" % (args.spec, e))
+
+
+if __name__ == "__main__":
+    main()
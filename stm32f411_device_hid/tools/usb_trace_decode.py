@@ -0,0 +1,91 @@
+#!/usr/bin/env python3
+"""Decode a RAM dump of usb_trace_buf into readable text.
+
+Take the dump with the target halted, e.g. from gdb:
+
+    (gdb) dump binary value usb_trace.bin usb_trace_buf
+
+then run:
+
+    tools/usb_trace_decode.py usb_trace.bin
+
+Event names and format strings are read from usb/inc/usb_trace.h, so the
+decoder never has to be updated when an event is added.
+"""
+
+import argparse
+import os
+import re
+import struct
+import sys
+
+HEADER_FMT = "<IIII"
+ENTRY_FMT = "<IHHII"
+TRACE_MAGIC = 0x55545243
+DEFAULT_HEADER = os.path.join(os.path.dirname(__file__), "..", "usb", "inc", "usb_trace.h")
+DEFAULT_CPU_HZ = 72000000
+
+
+def load_events(header_path):
+    """Return a list of (name, format) indexed by event ID."""
+    with open(header_path) as f:
+        text = f.read()
+    body = re.search(r"enum usb_trace_event_e\s*\{(.*?)\};", text, re.S).group(1)
+    events = []
+    for line in body.splitlines():
+        m = re.match(r"\s*(USB_TRACE_EV_\w+)(?:\s*=\s*(\d+))?\s*,?\s*(?:/\*\s*(.*?)\s*\*/)?", line)
+        if not m:
+            continue
+        if m.group(2) is not None:
+            assert int(m.group(2)) == len(events), "explicit IDs have to be sequential"
+        events.append((m.group(1)[len("USB_TRACE_EV_"):], m.group(3) or m.group(1)))
+    return events
+
+
+def decode(dump, events, cpu_hz):
+    magic, size, head, _ = struct.unpack_from(HEADER_FMT, dump, 0)
+    if magic != TRACE_MAGIC:
+        sys.exit("bad magic 0x%08x, not a usb_trace_buf dump" % magic)
+    entry_size = struct.calcsize(ENTRY_FMT)
+    base = struct.calcsize(HEADER_FMT)
+    if len(dump) < base + size * entry_size:
+        sys.exit("dump truncated: %d bytes for %d entries" % (len(dump), size))
+
+    first = max(0, head - size)
+    prev_ts = None
+    lines = []
+    for idx in range(first, head):
+        off = base + (idx % size) * entry_size
+        ts, event, seq, arg0, arg1 = struct.unpack_from(ENTRY_FMT, dump, off)
+        if seq != (idx & 0xFFFF):
+            lines.append("%10s  <torn record %d>" % ("", idx))
+            continue
+        if event < len(events):
+            name, fmt = events[event]
+            nargs = len(re.findall(r"%[0-9]*[a-zA-Z]", fmt))
+            text = fmt % (arg0, arg1)[:nargs] if nargs else fmt
+        else:
+            text = "event %d arg0=0x%08x arg1=0x%08x" % (event, arg0, arg1)
+        delta = 0 if prev_ts is None else (ts - prev_ts) & 0xFFFFFFFF
+        prev_ts = ts
+        lines.append("%10u  +%9.3f us  %s" % (idx, delta * 1e6 / cpu_hz, text))
+    if head > size:
+        lines.insert(0, "(%d older records overwritten)" % (head - size))
+    return lines
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("dump", help="binary dump of usb_trace_buf")
+    parser.add_argument("--header", default=DEFAULT_HEADER, help="path to usb_trace.h")
+    parser.add_argument("--cpu-hz", type=int, default=DEFAULT_CPU_HZ, help="DWT clock frequency")
+    args = parser.parse_args()
+
+    with open(args.dump, "rb") as f:
+        dump = f.read()
+    for line in decode(dump, load_events(args.header), args.cpu_hz):
+        print(line)
+
+
+if __name__ == "__main__":
+    main()
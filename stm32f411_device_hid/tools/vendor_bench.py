@@ -0,0 +1,191 @@
+#!/usr/bin/env python3
+"""Stream the vendor bulk interface and report throughput and CPU load.
+
+Flash a benchmark build first:
+
+    make clean && make BENCH=1 all flash
+
+then run, with pyusb installed and access to the device:
+
+    tools/vendor_bench.py --mode in --seconds 10
+
+The host side counts the bytes it moved and checks the IN counter stream,
+the device side result (bytes/s over its own window, share of the CPU
+taken by the USB driver) is read with a vendor request after every second.
+"""
+
+import argparse
+import struct
+import sys
+import threading
+import time
+
+try:
+    import usb.core
+    import usb.util
+except ImportError:
+    sys.exit("vendor_bench.py needs pyusb (pip install pyusb)")
+
+VID = 0x1111
+PID = 0x1111
+VENDOR_CLASS = 0xFF
+
+REQUEST_SET_MODE = 0x01
+REQUEST_GET_RESULT = 0x02
+MODE_IN = 0x01
+MODE_OUT = 0x02
+MODES = {"in": MODE_IN, "out": MODE_OUT, "both": MODE_IN | MODE_OUT}
+
+# usb_vendor_bench_result_t
+RESULT_FMT = "<8I"
+RESULT_FIELDS = ("window_cycles", "tx_bytes_per_s", "rx_bytes_per_s", "usb_load",
+                 "tx_refused", "rx_stalls", "rx_errors", "windows")
+
+READ_SIZE = 16384
+WRITE_SIZE = 16384
+TIMEOUT_MS = 1000
+
+
+def vendor_request(dev, interface, request, value=0, length=0):
+    out = 0x41 if length == 0 else 0xC1  # vendor, interface recipient
+    return dev.ctrl_transfer(out, request, value, interface, length or None, TIMEOUT_MS)
+
+
+def find_vendor_interface(dev):
+    """Number of the vendor class interface and its bulk IN and OUT endpoint addresses."""
+    for intf in dev.get_active_configuration():
+        if intf.bInterfaceClass != VENDOR_CLASS:
+            continue
+        ep_in = ep_out = None
+        for ep in intf:
+            if usb.util.endpoint_type(ep.bmAttributes) != usb.util.ENDPOINT_TYPE_BULK:
+                continue
+            if usb.util.endpoint_direction(ep.bEndpointAddress) == usb.util.ENDPOINT_IN:
+                ep_in = ep.bEndpointAddress
+            else:
+                ep_out = ep.bEndpointAddress
+        if ep_in is not None and ep_out is not None:
+            return intf.bInterfaceNumber, ep_in, ep_out
+    return None
+
+
+def counter_bytes(first_word, words):
+    return struct.pack("<%dI" % words, *((first_word + i) & 0xFFFFFFFF for i in range(words)))
+
+
+class Reader(threading.Thread):
+    """Read the IN stream and check that it is one 32-bit counter."""
+
+    def __init__(self, dev, ep, stop):
+        super().__init__(daemon=True)
+        self.dev, self.ep, self.stop = dev, ep, stop
+        self.bytes = 0
+        self.errors = 0
+        self.next_word = None
+        self.pending = b""
+
+    def run(self):
+        while not self.stop.is_set():
+            try:
+                data = bytes(self.dev.read(self.ep, READ_SIZE, TIMEOUT_MS))
+            except usb.core.USBTimeoutError:
+                continue
+            self.bytes += len(data)
+            self.check(data)
+
+    def check(self, data):
+        data = self.pending + data
+        words = len(data) // 4
+        self.pending = data[words * 4:]
+        if words == 0:
+            return
+        values = struct.unpack("<%dI" % words, data[:words * 4])
+        if self.next_word is None:
+            self.next_word = values[0]
+        for value in values:
+            if value != self.next_word:
+                self.errors += 1
+                self.next_word = value
+            self.next_word = (self.next_word + 1) & 0xFFFFFFFF
+
+
+class Writer(threading.Thread):
+    """Send the counter stream the device checks on OUT."""
+
+    def __init__(self, dev, ep, stop):
+        super().__init__(daemon=True)
+        self.dev, self.ep, self.stop = dev, ep, stop
+        self.bytes = 0
+
+    def run(self):
+        word = 0
+        while not self.stop.is_set():
+            data = counter_bytes(word, WRITE_SIZE // 4)
+            try:
+                self.bytes += self.dev.write(self.ep, data, TIMEOUT_MS)
+            except usb.core.USBTimeoutError:
+                continue
+            word += WRITE_SIZE // 4
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--mode", choices=sorted(MODES), default="in", help="directions to stream")
+    parser.add_argument("--seconds", type=int, default=10, help="length of the run")
+    parser.add_argument("--vid", type=lambda v: int(v, 0), default=VID)
+    parser.add_argument("--pid", type=lambda v: int(v, 0), default=PID)
+    args = parser.parse_args()
+
+    dev = usb.core.find(idVendor=args.vid, idProduct=args.pid)
+    if dev is None:
+        sys.exit("device %04x:%04x not found" % (args.vid, args.pid))
+    found = find_vendor_interface(dev)
+    if found is None:
+        sys.exit("no vendor interface with bulk IN and OUT endpoints, not a BENCH=1 build?")
+    interface, ep_in, ep_out = found
+    if dev.is_kernel_driver_active(interface):
+        dev.detach_kernel_driver(interface)
+    usb.util.claim_interface(dev, interface)
+
+    mode = MODES[args.mode]
+    vendor_request(dev, interface, REQUEST_SET_MODE, mode)
+    stop = threading.Event()
+    threads = []
+    if mode & MODE_IN:
+        threads.append(Reader(dev, ep_in, stop))
+    if mode & MODE_OUT:
+        threads.append(Writer(dev, ep_out, stop))
+    for thread in threads:
+        thread.start()
+
+    print("%4s %12s %12s %12s %12s %7s %8s %8s" % ("s", "host in B/s", "host out B/s", "dev in B/s",
+                                                    "dev out B/s", "load", "refused", "stalls"))
+    last = {thread: 0 for thread in threads}
+    start = time.monotonic()
+    for second in range(1, args.seconds + 1):
+        time.sleep(max(0.0, start + second - time.monotonic()))
+        moved = {}
+        for thread in threads:
+            moved[type(thread)] = thread.bytes - last[thread]
+            last[thread] = thread.bytes
+        result = dict(zip(RESULT_FIELDS, struct.unpack(
+            RESULT_FMT, bytes(vendor_request(dev, interface, REQUEST_GET_RESULT, 0, struct.calcsize(RESULT_FMT))))))
+        print("%4d %12d %12d %12d %12d %6.1f%% %8d %8d" % (
+            second, moved.get(Reader, 0), moved.get(Writer, 0), result["tx_bytes_per_s"],
+            result["rx_bytes_per_s"], result["usb_load"] / 10.0, result["tx_refused"], result["rx_stalls"]))
+
+    stop.set()
+    for thread in threads:
+        thread.join()
+    vendor_request(dev, interface, REQUEST_SET_MODE, 0)
+    result = dict(zip(RESULT_FIELDS, struct.unpack(
+        RESULT_FMT, bytes(vendor_request(dev, interface, REQUEST_GET_RESULT, 0, struct.calcsize(RESULT_FMT))))))
+    usb.util.release_interface(dev, interface)
+
+    errors = sum(thread.errors for thread in threads if isinstance(thread, Reader))
+    print("IN pattern errors: %d, OUT pattern errors: %d" % (errors, result["rx_errors"]))
+    return 1 if errors or result["rx_errors"] else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -14,6 +14,7 @@
 #include "stm32f411xe.h"
 
 #include "qassert.h"
+#include "usb_fifo.h"
 
 
 /**
@@ -28,6 +29,11 @@
  *                          from POWERED state.
  * USB_STATE_DEFAULT:       Default state after reset, at this point EP0 is configured
  *                          and ready to receive SET_ADDRESS command from the host.
+ * USB_STATE_ADDRESS:       Address assigned by SET_ADDRESS.
+ * USB_STATE_CONFIGURED:    Non-zero configuration selected by SET_CONFIGURATION.
+ * USB_STATE_SUSPENDED:     Bus idle for 3 ms, left on resume or reset.
+ *
+ * Every state has its own interrupt mask profile, see usb_set_state.
  */
 typedef enum usb_state_e
 {
@@ -36,7 +42,9 @@ typedef enum usb_state_e
     USB_STATE_POWERED,
     USB_STATE_DEFAULT,
     USB_STATE_ADDRESS,
-    USB_STATE_SUSPENDED
+    USB_STATE_CONFIGURED,
+    USB_STATE_SUSPENDED,
+    USB_STATE_COUNT
 } usb_state_t;
 
 /**
@@ -67,27 +75,258 @@ typedef union usb_setup_packet_u
 } usb_setup_packet_t;
 
 
+#define USB_GINTSTS_SOURCES (32U)
+#define USB_MAX_INTERFACES  (4U)
+#define USB_MAX_ENDPOINTS   (4U)  /* OTG_FS: EP0 + 3 IN/OUT endpoint pairs */
+
+/**
+ * @brief Per-source interrupt statistics.
+ *
+ * Indexed by GINTSTS bit number. count is incremented every time the source
+ * is serviced, cycles accumulates the DWT cycle count spent in its handler.
+ * The *_eps_per_entry histograms count OEPINT/IEPINT entries by the number
+ * of endpoints serviced in that entry. poll_cycles accumulates the cycles
+ * usb_poll spent processing deferred events.
+ */
+typedef struct usb_isr_stats_s
+{
+    uint32_t count[USB_GINTSTS_SOURCES];
+    uint32_t cycles[USB_GINTSTS_SOURCES];
+    uint32_t oepint_eps_per_entry[USB_MAX_ENDPOINTS + 1];
+    uint32_t iepint_eps_per_entry[USB_MAX_ENDPOINTS + 1];
+    uint32_t poll_cycles;
+} usb_isr_stats_t;
+
+/**
+ * @brief Device state counters.
+ *
+ * Indexed by usb_state_t. entries counts transitions into the state,
+ * irqs the OTG_FS interrupt entries taken while in it.
+ */
+typedef struct usb_state_stats_s
+{
+    uint32_t entries[USB_STATE_COUNT];
+    uint32_t irqs[USB_STATE_COUNT];
+} usb_state_stats_t;
+
+/**
+ * @brief FIFO RAM use of one function of the configuration.
+ *
+ * A function is the interfaces grouped by an IAD, or a single interface
+ * without one. tx_words adds up the TX FIFOs of its IN endpoints.
+ */
+typedef struct usb_fifo_function_s
+{
+    uint8_t first_interface;
+    uint8_t num_interfaces;
+    uint16_t tx_words;
+} usb_fifo_function_t;
+
+/**
+ * @brief FIFO RAM split of the current configuration.
+ *
+ * Filled in by SET_CONFIGURATION. rx_words and ep0_words are shared by
+ * all functions, num_functions is 0 while unconfigured.
+ */
+typedef struct usb_fifo_report_s
+{
+    uint16_t rx_words;
+    uint16_t ep0_words;
+    uint16_t free_words;
+    uint8_t num_functions;
+    usb_fifo_function_t function[USB_MAX_INTERFACES];
+} usb_fifo_report_t;
+
+#define USB_EVENT_QUEUE_SIZE (16U) /* Has to be a power of two */
+
+/**
+ * @brief Bus event types queued by the interrupt handler.
+ */
+typedef enum usb_event_type_e
+{
+    USB_EVENT_NONE = 0,
+    USB_EVENT_USBRST,
+    USB_EVENT_ENUMDNE,
+    USB_EVENT_USBSUSP,
+    USB_EVENT_WKUP
+} usb_event_type_t;
+
+/**
+ * @brief Bus event queued by the top half of the interrupt handler.
+ *
+ * Endpoint interrupts do not go through the queue, they come at the rate
+ * of the packets and are latched per endpoint instead, see usb_ep_t.
+ */
+typedef struct usb_event_s
+{
+    uint8_t type;
+} usb_event_t;
+
+/**
+ * @brief Lock-free single-producer/single-consumer event queue.
+ *
+ * Filled by usb_irq_handler, drained by usb_poll.
+ */
+typedef struct usb_event_queue_s
+{
+    volatile uint32_t head;
+    volatile uint32_t tail;
+    uint32_t dropped;
+    uint32_t high_water;
+    usb_event_t events[USB_EVENT_QUEUE_SIZE];
+} usb_event_queue_t;
+
+typedef struct usb_driver_s usb_driver_t;
+
+/**
+ * @brief Endpoint interrupt callback.
+ *
+ * Called from the bottom half with the acknowledged DOEPINT/DIEPINT bits.
+ */
+typedef void (*usb_ep_callback_t)(usb_driver_t *p_driver, uint32_t ep_num, uint32_t status);
+
+/**
+ * @brief OUT transfer completion.
+ *
+ * Called from the bottom half when a transfer armed by usb_ep_receive
+ * ends, with the buffer it was given and the number of bytes the host
+ * wrote into it. The endpoint is idle again and may be re-armed from here.
+ */
+typedef void (*usb_ep_rx_complete_t)(usb_driver_t *p_driver, uint32_t ep_num,
+                                     uint8_t *p_buf, uint32_t len);
+
+/**
+ * @brief SETUP request handler.
+ *
+ * Sends the data or status stage itself and returns true, or returns false
+ * to have the request STALLed.
+ */
+typedef bool (*usb_setup_handler_t)(usb_driver_t *p_driver, const usb_setup_packet_t *p_setup);
+
+/**
+ * @brief Endpoint states.
+ */
+typedef enum usb_ep_state_e
+{
+    USB_EP_STATE_DISABLED = 0,
+    USB_EP_STATE_IDLE,
+    USB_EP_STATE_BUSY,
+    USB_EP_STATE_STALLED
+} usb_ep_state_t;
+
+/**
+ * @brief Endpoint transfer types, values match bmAttributes and EPTYP.
+ */
+typedef enum usb_ep_type_e
+{
+    USB_EP_TYPE_CONTROL = 0,
+    USB_EP_TYPE_ISOCHRONOUS,
+    USB_EP_TYPE_BULK,
+    USB_EP_TYPE_INTERRUPT
+} usb_ep_type_t;
+
+/**
+ * @brief Per-endpoint state, one table for each direction.
+ *
+ * fifo_words is the TX FIFO depth given to an IN endpoint by the FIFO RAM
+ * allocator. tx_* and rx_* describe the transfer currently in progress,
+ * count being the number of bytes already moved. IN data is read through
+ * tx_cursor, from the caller's segment list or from tx_seg for a single
+ * buffer, tx_segs is where that list starts. tx_queued is how much of
+ * the transfer has been programmed into DIEPTSIZ so far and tx_zlp is set
+ * while a terminating zero length packet is still owed. An OUT transfer is
+ * programmed into DOEPTSIZ at once, rx_count is filled in by the RXFLVL
+ * handler as it pops the packets straight into p_rx_buf, rx_complete is
+ * called once the transfer ends. rx_dropped counts OUT bytes that arrived
+ * with no room for them and were discarded. xfrc_frame and
+ * xfrc_offset time the last IN XFRC: frame number and DWT cycles since the
+ * SOF of that frame, latched in the top half. events collects the
+ * DOEPINT/DIEPINT bits the top half acknowledged until usb_poll takes
+ * them, so any number of interrupts before it runs ends up in one call.
+ */
+typedef struct usb_ep_s
+{
+    usb_ep_state_t state;
+    usb_ep_type_t type;
+    uint16_t max_packet_size;
+    uint16_t fifo_words;
+    usb_fifo_seg_t tx_seg;
+    usb_fifo_cursor_t tx_cursor;
+    const usb_fifo_seg_t *tx_segs;
+    uint32_t tx_len;
+    uint32_t tx_count;
+    uint32_t tx_queued;
+    bool tx_zlp;
+    uint8_t *p_rx_buf;
+    uint32_t rx_len;
+    uint32_t rx_count;
+    usb_ep_rx_complete_t rx_complete;
+    uint32_t rx_dropped;
+    usb_ep_callback_t callback;
+    uint32_t irq_count;
+    uint32_t xfrc_frame;
+    uint32_t xfrc_offset;
+    volatile uint32_t events;
+} usb_ep_t;
+
+/**
+ * @brief USB initialization data.
+ *
+ * deferred_processing: When set, the interrupt handler only latches register
+ *                      state into the event queue and the endpoints and all
+ *                      request handling runs from usb_poll, which has to be
+ *                      called from the main loop.
+ */
 typedef struct usb_init_s
 {
     /* public */
     bool vbus_sensing;
+    bool deferred_processing;
     /* private */
 } usb_init_t;
 
-typedef struct usb_driver_s
+struct usb_driver_s
 {
     /* public */
     
     /* private */
     usb_state_t state;
+    usb_state_t resume_state;
+    usb_state_stats_t state_stats;
+    bool vbus_sensing;
     uint32_t device_address;
+    uint32_t configuration;
+    bool remote_wakeup;
     usb_setup_packet_t setup_packet;
-    uint8_t ep0_tx_buf[64];
-    uint32_t ep0_tx_buf_len;
-} usb_driver_t;
+    uint32_t fifo_words_used;
+    usb_fifo_report_t fifo_report;
+    usb_isr_stats_t isr_stats;
+    uint32_t sof_frame;
+    uint32_t sof_cycles;
+    uint32_t sof_count;
+    bool deferred_processing;
+    usb_event_queue_t event_queue;
+    volatile uint32_t ep_events;    /* Endpoints with events, DAINT layout */
+    uint32_t rx_setup[2];           /* Last SETUP packet popped by RXFLVL */
+    uint32_t stup_setup[2];         /* The one that goes with a latched STUP */
+    usb_ep_t ep_in[USB_MAX_ENDPOINTS];
+    usb_ep_t ep_out[USB_MAX_ENDPOINTS];
+};
 
 void usb_init(usb_driver_t *driver, usb_init_t *init);
 void usb_irq_handler(void);
+void usb_poll(void);
+void usb_ep_set_callback(uint8_t ep_addr, usb_ep_callback_t callback);
+void usb_ep_open(uint8_t ep_addr, usb_ep_type_t type, uint16_t max_packet_size);
+void usb_ep_close(uint8_t ep_addr);
+void usb_ep_stall(uint8_t ep_addr, bool stall);
+void usb_setup_register_class(uint8_t interface, usb_setup_handler_t handler);
+void usb_setup_register_vendor(usb_setup_handler_t handler);
+bool usb_ep_transmit(uint32_t ep_num, const uint8_t *p_src, uint32_t len, bool zlp);
+bool usb_ep_transmit_segs(uint32_t ep_num, const usb_fifo_seg_t *p_segs, uint32_t count, bool zlp);
+bool usb_ep_receive(uint32_t ep_num, uint8_t *p_dst, uint32_t len, usb_ep_rx_complete_t complete);
+uint32_t usb_fifo_free_words(void);
+const usb_fifo_report_t *usb_fifo_get_report(void);
 
 
 
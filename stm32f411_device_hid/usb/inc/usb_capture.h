@@ -0,0 +1,100 @@
+/** @file usb_capture.h
+ *
+ * @brief Device side capture of completed USB transactions.
+ *
+ * Every SETUP packet, every OUT packet and every IN transfer the host has
+ * taken is recorded into a RAM ring buffer with its DWT timestamp, frame
+ * number, endpoint, length and the first USB_CAPTURE_DATA_BYTES of data.
+ * The core only reports IN completion per transfer, so an IN record covers
+ * the whole transfer. A STALL armed on EP0 is recorded too, it ends the
+ * control request for the host.
+ *
+ * tools/usb_capture_pcap.py turns a dump of usb_capture_buf into a pcap file
+ * with the Linux usbmon link type, readable by Wireshark next to a capture
+ * taken on the host.
+ */
+
+#ifndef USB_CAPTURE_H
+#define USB_CAPTURE_H
+
+#include <stdint.h>
+
+#include "usb_fifo.h"
+
+#ifndef USB_CAPTURE_ENABLE
+#define USB_CAPTURE_ENABLE 1
+#endif
+
+/* Entries, has to be a power of two. Size it for the traffic to look at:
+ * an enumeration of this device with its first class requests takes 70
+ * records (host/enum_bench -n 1), older records are overwritten. Each
+ * entry is 16 bytes plus USB_CAPTURE_DATA_BYTES of RAM. */
+#ifndef USB_CAPTURE_BUF_SIZE
+#define USB_CAPTURE_BUF_SIZE    (128U)
+#endif
+
+#define USB_CAPTURE_MAGIC       (0x55534243U) /* "CBSU" */
+#define USB_CAPTURE_DATA_BYTES  (16U)         /* Has to be a multiple of 4 */
+
+/**
+ * @brief Record kinds.
+ */
+enum usb_capture_kind_e
+{
+    USB_CAPTURE_SETUP = 1,
+    USB_CAPTURE_OUT,
+    USB_CAPTURE_IN,
+    USB_CAPTURE_STALL
+};
+
+/**
+ * @brief Single capture record.
+ *
+ * ep is the endpoint address with the direction bit, ep_type the transfer
+ * type of the endpoint (EPTYP encoding). len is the number of bytes moved,
+ * captured how many of them are in data, 0 for an OUT packet that was
+ * dropped for lack of a buffer.
+ */
+typedef struct usb_capture_entry_s
+{
+    uint32_t timestamp;
+    uint16_t seq;
+    uint8_t kind;
+    uint8_t ep;
+    uint32_t len;
+    uint16_t frame;
+    uint8_t ep_type;
+    uint8_t captured;
+    uint8_t data[USB_CAPTURE_DATA_BYTES];
+} usb_capture_entry_t;
+
+/**
+ * @brief Capture ring buffer, same scheme as usb_trace_buf.
+ */
+typedef struct usb_capture_buf_s
+{
+    uint32_t magic;
+    uint32_t size;
+    volatile uint32_t head;
+    uint32_t data_bytes;
+    usb_capture_entry_t entries[USB_CAPTURE_BUF_SIZE];
+} usb_capture_buf_t;
+
+extern usb_capture_buf_t usb_capture_buf;
+
+void usb_capture_record(uint32_t kind, uint32_t ep_addr, const uint8_t *p_data, uint32_t len);
+void usb_capture_record_segs(uint32_t kind, uint32_t ep_addr, const usb_fifo_seg_t *p_segs, uint32_t len);
+
+#if USB_CAPTURE_ENABLE
+    #define USB_CAPTURE_RECORD(kind_, ep_addr_, p_data_, len_) \
+        usb_capture_record((kind_), (ep_addr_), (p_data_), (len_))
+    #define USB_CAPTURE_RECORD_SEGS(kind_, ep_addr_, p_segs_, len_) \
+        usb_capture_record_segs((kind_), (ep_addr_), (p_segs_), (len_))
+#else
+    #define USB_CAPTURE_RECORD(kind_, ep_addr_, p_data_, len_)      ((void)0)
+    #define USB_CAPTURE_RECORD_SEGS(kind_, ep_addr_, p_segs_, len_) ((void)0)
+#endif
+
+#endif /* USB_CAPTURE_H */
+
+/*** end of file ***/
\ No newline at end of file
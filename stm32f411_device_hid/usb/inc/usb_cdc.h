@@ -0,0 +1,96 @@
+/** @file usb_cdc.h
+ *
+ * @brief CDC-ACM console on the bulk stream.
+ */
+
+#ifndef USB_CDC_H
+#define USB_CDC_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "usb.h"
+#include "usb_desc_gen.h"
+
+#define USB_CDC_COMM_INTERFACE      (1U)
+#define USB_CDC_NOTIFY_EP           USB_DESC_EP_CDC_NOTIFY
+#define USB_CDC_BLOCK_TIMEOUT_MS    (20U)   /* Longest a blocking write waits for the host */
+
+/**
+ * @brief CDC class requests (CDC PSTN 1.2, 6.3).
+ */
+enum usb_cdc_request_e
+{
+    USB_CDC_REQUEST_SET_LINE_CODING        = 0x20,
+    USB_CDC_REQUEST_GET_LINE_CODING        = 0x21,
+    USB_CDC_REQUEST_SET_CONTROL_LINE_STATE = 0x22,
+    USB_CDC_REQUEST_SEND_BREAK             = 0x23
+};
+
+#define USB_CDC_CONTROL_LINE_DTR    (0x01U)
+#define USB_CDC_CONTROL_LINE_RTS    (0x02U)
+
+/**
+ * @brief Line coding, wire format of SET/GET_LINE_CODING.
+ *
+ * Only stored and reported back, the console has no UART behind it.
+ */
+typedef struct __attribute__((packed)) usb_cdc_line_coding_s
+{
+    uint32_t rate;
+    uint8_t stop_bits;
+    uint8_t parity;
+    uint8_t data_bits;
+} usb_cdc_line_coding_t;
+
+/**
+ * @brief What a console write does when the IN ring is full.
+ *
+ * USB_CDC_OVERFLOW_DROP:  Drop what does not fit and count it.
+ * USB_CDC_OVERFLOW_BLOCK: Wait up to USB_CDC_BLOCK_TIMEOUT_MS for the host
+ *                         while a terminal has the port open (DTR set), then
+ *                         drop. Only in thread mode outside usb_poll, from
+ *                         anywhere else it drops like USB_CDC_OVERFLOW_DROP.
+ */
+typedef enum usb_cdc_overflow_e
+{
+    USB_CDC_OVERFLOW_DROP = 0,
+    USB_CDC_OVERFLOW_BLOCK
+} usb_cdc_overflow_t;
+
+/**
+ * @brief Console counters.
+ *
+ * blocked counts writes that had to wait, timeouts the ones that still
+ * dropped data after waiting.
+ */
+typedef struct usb_cdc_stats_s
+{
+    uint32_t written;
+    uint32_t dropped;
+    uint32_t blocked;
+    uint32_t timeouts;
+} usb_cdc_stats_t;
+
+#ifdef USB_DESC_INTERFACE_CDC_COMM
+
+void usb_cdc_configure(usb_driver_t *p_driver);
+bool usb_cdc_class_request(usb_driver_t *p_driver, const usb_setup_packet_t *p_setup);
+bool usb_cdc_connected(void);
+void usb_cdc_set_overflow(usb_cdc_overflow_t overflow);
+uint32_t usb_cdc_write(const uint8_t *p_src, uint32_t len);
+const usb_cdc_stats_t *usb_cdc_get_stats(void);
+
+#else
+
+/* No console in this descriptor variant, output goes nowhere */
+static inline void usb_cdc_configure(usb_driver_t *p_driver) { (void)p_driver; }
+static inline bool usb_cdc_connected(void) { return false; }
+static inline void usb_cdc_set_overflow(usb_cdc_overflow_t overflow) { (void)overflow; }
+static inline uint32_t usb_cdc_write(const uint8_t *p_src, uint32_t len) { (void)p_src; (void)len; return 0; }
+
+#endif /* USB_DESC_INTERFACE_CDC_COMM */
+
+#endif /* USB_CDC_H */
+
+/*** end of file ***/
\ No newline at end of file
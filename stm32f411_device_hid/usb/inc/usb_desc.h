@@ -1,5 +1,21 @@
 /**
- * @file usb_descriptor.h
+ * @file usb_desc.h
+ *
+ * @brief USB descriptors.
+ *
+ * The descriptors are generated at build time from usb/usb_desc.json by
+ * tools/usb_desc_gen.py, which computes every length field. Each
+ * descriptor is a word aligned blob so it goes through the aligned FIFO
+ * copy, usb_desc_table indexes them for GET_DESCRIPTOR. Strings are UTF-8
+ * in the spec and UTF-16LE in the blobs. The serial number is the only
+ * descriptor built at run time, once, from the device UID. Endpoint
+ * addresses are assigned by the generator as well, the class drivers use
+ * its USB_DESC_EP_* defines.
+ *
+ * The report descriptor is compiled from
+ * hidtools_scripts/keyboard_report_desc.wara (report protocol, N-key
+ * rollover). In boot protocol the host ignores it and expects the fixed
+ * 8 byte layout of HID 1.11 Appendix B.
  */
 
 #ifndef USB_DESC_H
@@ -9,170 +25,39 @@
 
 #include "usb.h"
 #include "usb_internal.h"
+#include "usb_desc_gen.h"
 
-#define MAJOR_VER 0x01
-#define MINOR_VER 0x00
-
-// String descriptor indexes
-//
-#define USB_DESC_STRING_MANUFACTURER 0x00
-#define USB_DESC_STRING_PRODUCT      0x01
-
-
-/*##########################################################################*/
-/*#                          DEVICE DESCRIPTOR                             #*/
-/*##########################################################################*/
-
-const uint8_t device_descriptor[] = {
-    18,                             /* bLength */
-    0x01,                           /* bDescriptorType:     Device Descriptor*/
-    0x00, 0x02,                     /* bcdUSB:              USB 2.0 */
-    0x00,                           /* bDeviceClass:        No class at device level */
-    0x00,                           /* bDeviceSubClass      No subclass */
-    0x00,                           /* bDeviceProtocol      No protocol */
-    USB_EP0_RX_FIFO_SIZE,           /* bMaxPacketSize0*/
-    0x11, 0x11,                     /* idVendor             Prototype vendor id*/
-    0x11, 0x11,                     /* idProduct            Prototype vendor id*/
-    MAJOR_VER, MAJOR_VER,           /* bcdDevice */
-    USB_DESC_STRING_MANUFACTURER,   /* iManufacturer */
-    USB_DESC_STRING_PRODUCT,        /* iProduct */
-    0x00,                           /* iSerialNumber        No serial number string*/
-    0x01                            /* bNumConfigurations */
-};
-
-/*##########################################################################*/
-/*#                          REPORT DESCRIPTOR                             #*/
-/*##########################################################################*/
-
-// AUTO-GENERATED by WaratahCmd.exe (https://github.com/microsoft/hidtools)
-
-// HID Usage Tables: 1.5.0
-// Descriptor size: 37 (bytes)
-// +----------+-------+-------------------+
-// | ReportId | Kind  | ReportSizeInBytes |
-// +----------+-------+-------------------+
-// |        1 | Input |                 8 |
-// +----------+-------+-------------------+
-static const uint8_t report_descriptor[] = 
-{
-    0x05, 0x01,    // UsagePage(Generic Desktop[0x0001])
-    0x09, 0x06,    // UsageId(Keyboard[0x0006])
-    0xA1, 0x01,    // Collection(Application)
-    0x85, 0x01,    //     ReportId(1)
-    0x05, 0x07,    //     UsagePage(Keyboard/Keypad[0x0007])
-    0x19, 0xE0,    //     UsageIdMin(Keyboard LeftControl[0x00E0])
-    0x29, 0xE7,    //     UsageIdMax(Keyboard Right GUI[0x00E7])
-    0x15, 0x00,    //     LogicalMinimum(0)
-    0x25, 0x01,    //     LogicalMaximum(1)
-    0x95, 0x08,    //     ReportCount(8)
-    0x75, 0x01,    //     ReportSize(1)
-    0x81, 0x02,    //     Input(Data, Variable, Absolute, NoWrap, Linear, PreferredState, NoNullPosition, BitField)
-    0x19, 0x01,    //     UsageIdMin(ErrorRollOver[0x0001])
-    0x29, 0x65,    //     UsageIdMax(Keyboard Application[0x0065])
-    0x15, 0x01,    //     LogicalMinimum(1)
-    0x25, 0x65,    //     LogicalMaximum(101)
-    0x75, 0x07,    //     ReportSize(7)
-    0x81, 0x00,    //     Input(Data, Array, Absolute, NoWrap, Linear, PreferredState, NoNullPosition, BitField)
-    0xC0           // EndCollection()
-};
-
-/*##########################################################################*/
-/*#                        CONFUGIRATION DESCRIPTOR                        #*/
-/*#                          INTERFACE DESCRIPTOR                          #*/
-/*#                          ENDPOINT DESCRIPTOR                           #*/
-/*#                            HID DESCRIPTOR                              #*/
-/*##########################################################################*/
-
-const uint8_t configuraiton_descriptor[] = {
-    9,                              /* bLength */
-    0x02,                           /* dDescriptorType:     Configuration Descriptor*/
-    (9+9+7+9), 0x00,                  /* wTotalLength:        Total number of bytes in this and following desscriptors*/
-    0x01,                           /* bNumInterfaces:      Number of interfaces supported by this configuration*/
-    0x01,                           /* bConfigurationValue: Used by SET CONFIGURATION to select this desc*/
-    0x00,                           /* iConfiguration:      Index of string descriptor describing configuration*/
-    0b11000000,                     /* bmAttributes:        D6: Self-powered, D5: Remote Wakeup*/
-    0x01,                           /* bMaxPower:           in units of 2mA*/
-
-    9,                              /* bLength */
-    0x04,                           /* dDescriptorType:     Interface Descriptor*/
-    0x01,                           /* bInterfaceNumber:    ID number*/
-    0x01,                           /* bAletrnateSetting:   Used to select alternate setting*/
-    0x01,                           /* bNumEndpoints:       Number of endpoints used by this interface*/
-    0x03,                           /* bInterfaceClass      Human Interface Device*/
-    0x01,                           /* bInterfaceSubClass   Support boot protocol*/
-    0x01,                           /* bInterfaceProtocol   Keyboard*/
-    0x00,                           /* iInterface*/
-
-    7,                              /* bLength */
-    0x05,                           /* dDescriptorType:     Endpoint Descriptor*/
-    0b10000001,                     /* bEndpointAddress:    D3-D0: endpoint number, D7: IN direciton*/
-    0x03,                           /* bmAttribures:        Interrupt*/
-    0x08, 0x00,                     /* wMaxPacketSize       8bytes*/
-    0x0A,                           /* bInterval:           10ms*/
-
-    9,                              /* bLength */
-    0x21,                           /* dDescriptorType:     HID Descriptor*/
-    0x01, 0x11,                     /* bcdHID:              HID class specification release number*/
-    0x00,                           /* bCountryCode:        Hardware target country*/
-    0x01,                           /* bNumDescriptors:     Number of HID class descriptors to follow*/
-    0x22,                           /* bDescriptorType:     Report descriptor*/
-    sizeof(report_descriptor), 0x00 /* wDescriptorLength:   Length of report descriptor*/
-};
-
-/*##########################################################################*/
-/*#                           STRING DESCRIPTORS                           #*/
-/*##########################################################################*/
-
-const uint8_t string_descriptor_language[] = {
-    4,                              /* bLength */
-    0x03,                           /* bDescriptorType:     String Descriptor */
-    0x09, 0x04                      /* Language ID:         English (United States) */
-};
-
-/**
- * @brief String descriptor for manufacturer.
- */
-const uint8_t string_descriptor_manufacturer[] = {
-    16,                             /* bLength */
-    0x03,                           /* bDescriptorType:     String Descriptor */
-    'M', 0x00,                      /* Manufacturer */
-    'E', 0x00,
-    'D', 0x00,
-    '0', 0x00,
-    'K', 0x00,
-    'I', 0x00,
-    'N', 0x00
-};
+_Static_assert(USB_DESC_EP0_MAX_PACKET == USB_EP0_RX_FIFO_SIZE,
+               "bMaxPacketSize0 has to match the EP0 buffer size");
+_Static_assert(USB_DESC_NUM_INTERFACES <= USB_MAX_INTERFACES,
+               "more interfaces than USB_MAX_INTERFACES");
 
 /**
- * @brief String descriptor for product.
+ * @brief Descriptor index entry.
+ *
+ * index is the descriptor index of wValue, w_index the interface number of
+ * class descriptors (HID, report). String descriptors match any language.
  */
-const uint8_t string_descriptor_product[] = {
-    18,                             /* bLength */
-    0x03,                           /* bDescriptorType:     String Descriptor */
-    'K', 0x00,                      /* Product */
-    'e', 0x00,
-    'y', 0x00,
-    'b', 0x00,
-    'o', 0x00,
-    'a', 0x00,
-    'r', 0x00,
-    'd', 0x00
-};
-
-/**
- * @brief String descriptor table.
- */
-const uint8_t *string_descriptors[] = {
-    string_descriptor_language,
-    string_descriptor_manufacturer,
-    string_descriptor_product
-};
-
+typedef struct usb_desc_s
+{
+    uint8_t type;
+    uint8_t index;
+    uint16_t w_index;
+    uint16_t length;
+    const uint8_t *p_data;
+} usb_desc_t;
 
+extern const usb_desc_t usb_desc_table[USB_DESC_COUNT];
+extern const uint8_t usb_desc_configuration[USB_DESC_CONFIGURATION_LEN];
 
+#ifdef USB_DESC_SERIAL_LEN
+extern uint8_t usb_desc_serial[USB_DESC_SERIAL_LEN];
 
+void usb_desc_serial_init(void);
+#else
+static inline void usb_desc_serial_init(void) {}
+#endif
 
 #endif /* USB_DESC_H */
 
-/*** end of file ***/
\ No newline at end of file
+/*** end of file ***/
@@ -0,0 +1,41 @@
+/** @file usb_fifo.h
+ *
+ * @brief Copy routines between memory and the OTG_FS data FIFO.
+ *
+ * The FIFO is a single 32-bit register, every access pushes or pops one word.
+ * Buffers can start at any byte offset, the routines never do a misaligned
+ * word access and never touch memory outside the buffer. The file only
+ * depends on stdint so it can be built and benchmarked on the host.
+ */
+
+#ifndef USB_FIFO_H
+#define USB_FIFO_H
+
+#include <stdint.h>
+
+/**
+ * @brief One piece of a scatter-gather source.
+ */
+typedef struct usb_fifo_seg_s
+{
+    const uint8_t *p_data;
+    uint32_t len;
+} usb_fifo_seg_t;
+
+/**
+ * @brief Read position in a segment list, advanced by usb_fifo_push_gather.
+ */
+typedef struct usb_fifo_cursor_s
+{
+    const usb_fifo_seg_t *p_seg;
+    uint32_t offset;
+} usb_fifo_cursor_t;
+
+void usb_fifo_push(volatile uint32_t *p_fifo, const uint8_t *p_src, uint32_t len);
+void usb_fifo_push_gather(volatile uint32_t *p_fifo, usb_fifo_cursor_t *p_cursor, uint32_t len);
+void usb_fifo_pop(volatile uint32_t *p_fifo, uint8_t *p_dst, uint32_t len);
+void usb_fifo_discard(volatile uint32_t *p_fifo, uint32_t len);
+
+#endif /* USB_FIFO_H */
+
+/*** end of file ***/
\ No newline at end of file
@@ -0,0 +1,90 @@
+/** @file usb_hid.h
+ *
+ * @brief HID report path on the interrupt IN endpoint.
+ */
+
+#ifndef USB_HID_H
+#define USB_HID_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "usb.h"
+#include "usb_desc_gen.h"
+
+#define USB_HID_REPORT_EP           USB_DESC_EP_KEYBOARD_IN
+#define USB_HID_REPORT_MAX_SIZE     (64U)
+#define USB_HID_QUEUE_SLOTS         (2U)
+#define USB_HID_INTERFACE           (0U)
+#define USB_HID_SOF_MIN_SAMPLES     (4U)    /* Polls observed before scheduling */
+#define USB_HID_SOF_MARGIN_CYCLES   (720U)  /* 10 us on top of the build time */
+#define USB_HID_REPORT_TYPE_INPUT   (0x01U) /* GET_REPORT wValue high byte */
+
+/**
+ * @brief HID class requests (HID 1.11, 7.2).
+ */
+enum usb_hid_request_e
+{
+    USB_HID_REQUEST_GET_REPORT   = 0x01,
+    USB_HID_REQUEST_GET_IDLE     = 0x02,
+    USB_HID_REQUEST_GET_PROTOCOL = 0x03,
+    USB_HID_REQUEST_SET_REPORT   = 0x09,
+    USB_HID_REQUEST_SET_IDLE     = 0x0A,
+    USB_HID_REQUEST_SET_PROTOCOL = 0x0B
+};
+
+/**
+ * @brief HID protocols, report protocol is the default after reset.
+ */
+typedef enum usb_hid_protocol_e
+{
+    USB_HID_PROTOCOL_BOOT   = 0,
+    USB_HID_PROTOCOL_REPORT = 1
+} usb_hid_protocol_t;
+
+/**
+ * @brief HID report counters.
+ *
+ * depth is the number of reports held by the driver, the one on the bus
+ * included. A report is dropped when both slots are taken or the device is
+ * not configured. poll_period (frames) and poll_offset (DWT cycles after SOF)
+ * are what the SOF scheduler learned about the host polling EP1,
+ * sof_builds counts reports it built and sof_missed the ones that were not
+ * picked up by the poll they were aimed at.
+ */
+typedef struct usb_hid_stats_s
+{
+    uint32_t depth;
+    uint32_t depth_high_water;
+    uint32_t queued;
+    uint32_t sent;
+    uint32_t dropped;
+    uint32_t poll_period;
+    uint32_t poll_offset;
+    uint32_t sof_builds;
+    uint32_t sof_missed;
+} usb_hid_stats_t;
+
+/**
+ * @brief Report source for the SOF scheduler and GET_REPORT.
+ *
+ * Called from the SOF interrupt just before the host polls with current
+ * false: builds the report into p_report and returns its length, 0 when
+ * there is nothing new to send. With current true, for GET_REPORT, it
+ * builds the report of the current state in any case and leaves what is
+ * sent on the interrupt endpoint alone.
+ */
+typedef uint32_t (*usb_hid_report_source_t)(uint8_t *p_report, bool current);
+
+void usb_hid_configure(usb_driver_t *p_driver);
+bool usb_hid_class_request(usb_driver_t *p_driver, const usb_setup_packet_t *p_setup);
+usb_hid_protocol_t usb_hid_get_protocol(void);
+bool usb_hid_send_report(const uint8_t *p_report, uint32_t len);
+void usb_hid_set_report_source(usb_hid_report_source_t source);
+bool usb_hid_sof_active(void);
+void usb_hid_sof(usb_driver_t *p_driver);
+const usb_hid_stats_t *usb_hid_get_stats(void);
+
+#endif /* USB_HID_H */
+
+/*** end of file ***/
\ No newline at end of file
@@ -9,15 +9,39 @@
 
 #include "usb.h"
 
-#define USB_GLOBAL_RX_FIFO_SIZE (128U)
 #define USB_EP0_RX_FIFO_SIZE    (64U)
-#define USB_EP0_TX_FIFO_SIZE    (64U)
+
+/*
+ * FIFO RAM is given out in 32-bit words. The shared RX FIFO is sized as
+ * recommended by RM0383: (5 * control EPs + 8) + (max packet / 4 + 1)
+ * + (2 * OUT EPs) + 1, with room for two max size packets. Every IN
+ * endpoint gets its own TX FIFO carved from what is left.
+ */
+#define USB_FIFO_RAM_WORDS      (320U)
+#define USB_FIFO_MIN_TX_WORDS   (16U)
+#define USB_RX_FIFO_WORDS       ((5U * 1U + 8U) + 2U * ((64U / 4U) + 1U) + \
+                                 (2U * USB_MAX_ENDPOINTS) + 1U)
+#define USB_EP0_TX_FIFO_WORDS   (USB_EP0_RX_FIFO_SIZE / 4U)
+
+#define USB_FRAME_MASK          (0x7FFU)    /* 11-bit full speed frame number */
+#define USB_FRAME_CYCLES        (72000U)    /* DWT cycles per 1 ms frame */
+
+#define MAX(a, b)                (((a) > (b)) ? (a) : (b))
+#define MIN(a, b)                (((a) < (b)) ? (a) : (b))
 
 #define USB_OTG_DEVICE           ((USB_OTG_DeviceTypeDef *) (USB_OTG_FS_PERIPH_BASE + USB_OTG_DEVICE_BASE))
 #define USB_EP_OUT(ep_num) 		 ((USB_OTG_OUTEndpointTypeDef *) ((USB_OTG_FS_PERIPH_BASE +  USB_OTG_OUT_ENDPOINT_BASE) + ((ep_num) * USB_OTG_EP_REG_SIZE)))
 #define USB_EP_IN(ep_num)    	 ((USB_OTG_INEndpointTypeDef *)	((USB_OTG_FS_PERIPH_BASE + USB_OTG_IN_ENDPOINT_BASE) + ((ep_num) * USB_OTG_EP_REG_SIZE)))
 #define USB_OTG_DFIFO(ep_num)    (*(volatile uint32_t *)(USB_OTG_FS_PERIPH_BASE  + USB_OTG_FIFO_BASE + ((ep_num) * USB_OTG_FIFO_SIZE)))
-#define USB_OTG_PCGCCTL          (*(volatile uint32_t *)( USB_OTG_FS_PERIPH_BASE + USB_OTG_PCGCCTL_BASE))
+#define USB_OTG_PCGC             ((usb_otg_pcgc_t *) (USB_OTG_FS_PERIPH_BASE + USB_OTG_PCGCCTL_BASE))
+
+/**
+ * @brief Power and clock gating block, CMSIS has no type for it.
+ */
+typedef struct usb_otg_pcgc_s
+{
+    volatile uint32_t PCGCCTL;
+} usb_otg_pcgc_t;
 
 
 /**
@@ -49,9 +73,36 @@ enum usb_request_e
     USB_BREQUEST_SET_CONFIGURATION = 9,
     USB_BREQUEST_GET_INTERFACE = 10,
     USB_BREQUEST_SET_INTERFACE = 11,
-    USB_BREQUEST_SYNCH_FRAME = 12
+    USB_BREQUEST_SYNCH_FRAME = 12,
+    USB_BREQUEST_COUNT
 };
 
+/**
+ * @brief bmRequestType fields.
+ */
+#define USB_BMREQUEST_RECIPIENT_MASK    (0x1FU)
+#define USB_BMREQUEST_TYPE_MASK         (0x60U)
+#define USB_BMREQUEST_TYPE_Pos          (5U)
+
+enum usb_request_type_e
+{
+    USB_REQUEST_TYPE_STANDARD = 0,
+    USB_REQUEST_TYPE_CLASS    = 1,
+    USB_REQUEST_TYPE_VENDOR   = 2,
+    USB_REQUEST_TYPE_RESERVED = 3
+};
+
+enum usb_request_recipient_e
+{
+    USB_RECIPIENT_DEVICE    = 0,
+    USB_RECIPIENT_INTERFACE = 1,
+    USB_RECIPIENT_ENDPOINT  = 2,
+    USB_RECIPIENT_COUNT
+};
+
+#define USB_FEATURE_ENDPOINT_HALT           (0U)
+#define USB_FEATURE_DEVICE_REMOTE_WAKEUP    (1U)
+
 /**
  * @brief Value in descriptor request.
  */
@@ -66,13 +117,56 @@ enum usb_descriptor_value_e
     USB_DESCRIPTOR_OTHER_SPEED_CONFIGURATION = 7,
     USB_DESCRIPTOR_INTERFACE_POWER = 8,
     USB_DESCRIPTOR_OTG = 9,
+    USB_DESCRIPTOR_INTERFACE_ASSOCIATION = 0x0B,
+    USB_DESCRIPTOR_HID = 0x21,
     USB_DESCRIPTOR_REPORT = 0x22
 };
 
+/**
+ * @brief Completion of a control write data stage.
+ *
+ * Called from the bottom half with the number of bytes received into the
+ * buffer given to usb_ep0_receive. Returns false to have the request
+ * STALLed instead of acknowledged.
+ */
+typedef bool (*usb_ep0_rx_handler_t)(usb_driver_t *p_driver, uint32_t len);
+
 uint32_t flush_tx_fifo(void);
 uint32_t flush_rx_fifo(void);
-void usb_write_fifo(const uint8_t *src, size_t len);
+void usb_set_state(usb_state_t state);
+void usb_ep0_stall(void);
+void usb_ep0_transmit(const uint8_t *p_src, size_t len, size_t req_len);
+void usb_ep0_receive(uint8_t *p_dst, size_t len, usb_ep0_rx_handler_t handler);
+bool usb_poll_active(void);
+void usb_ep_tx_fifo_empty(uint32_t ep_num);
+bool usb_ep_tx_complete(uint32_t ep_num);
 usb_driver_t *usb_get_instance(void);
+void usb_fifo_reset(uint32_t rx_words);
+bool usb_fifo_alloc_tx(uint32_t ep_num, uint32_t words);
+void usb_ep0_in_callback(usb_driver_t *p_driver, uint32_t ep_num, uint32_t diepint_reg);
+void usb_ep0_out_callback(usb_driver_t *p_driver, uint32_t ep_num, uint32_t doepint_reg);
+
+/**
+ * @brief Mask all interrupts, returns the previous PRIMASK.
+ *        Guards read-modify-writes of registers that are also modified from
+ *        the interrupt handler (DIEPEMPMSK, GINTMSK).
+ */
+static inline uint32_t
+usb_critical_enter(void)
+{
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    return primask;
+}
+
+/**
+ * @brief Restore PRIMASK saved by usb_critical_enter.
+ */
+static inline void
+usb_critical_exit(uint32_t primask)
+{
+    __set_PRIMASK(primask);
+}
 
 #endif /* USB_PRIVATE_H */
 
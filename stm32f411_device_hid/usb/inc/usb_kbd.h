@@ -0,0 +1,45 @@
+/** @file usb_kbd.h
+ *
+ * @brief Keyboard state and report coalescing.
+ */
+
+#ifndef USB_KBD_H
+#define USB_KBD_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "usb_report_gen.h"
+
+#define USB_KBD_BOOT_KEYS           (6U)
+#define USB_KBD_BOOT_REPORT_SIZE    (2U + USB_KBD_BOOT_KEYS)
+#define USB_KBD_NKRO_USAGES         (0xE0U) /* report descriptor bitmap, usages 0x00-0xDF */
+#define USB_KBD_NKRO_REPORT_SIZE    (USB_REPORT_INPUT_SIZE) /* generated from the .wara file */
+#define USB_KBD_REPORT_MAX_SIZE     (USB_KBD_NKRO_REPORT_SIZE)
+
+#define USB_KBD_USAGE_ERROR_ROLLOVER    (0x01U)
+#define USB_KBD_USAGE_LEFT_CONTROL      (0xE0U)
+#define USB_KBD_USAGE_RIGHT_GUI         (0xE7U)
+
+/**
+ * @brief Keyboard counters.
+ *
+ * events counts every key change, reports the reports built, so
+ * events - reports is what coalescing saved.
+ */
+typedef struct usb_kbd_stats_s
+{
+    uint32_t events;
+    uint32_t reports;
+    uint32_t rollover;
+} usb_kbd_stats_t;
+
+void usb_kbd_init(void);
+void usb_kbd_set_key(uint8_t usage, bool pressed);
+void usb_kbd_task(void);
+uint32_t usb_kbd_build_report(uint8_t *p_report, bool current);
+const usb_kbd_stats_t *usb_kbd_get_stats(void);
+
+#endif /* USB_KBD_H */
+
+/*** end of file ***/
\ No newline at end of file
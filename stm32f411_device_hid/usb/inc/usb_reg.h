@@ -0,0 +1,186 @@
+/** @file usb_reg.h
+ *
+ * @brief OTG_FS register access layer.
+ *
+ * Every register access of the driver goes through these macros, so what
+ * kind of access it is shows at the call site:
+ *
+ * - USB_REG_RD / USB_REG_WR are a single read or write.
+ * - USB_REG_SET / USB_REG_CLR / USB_REG_MOD are an explicit read-modify-write,
+ *   one read and one write however many bits change. They refuse the
+ *   write-1-to-clear interrupt registers at compile time: writing back what
+ *   was read there acknowledges every pending flag, not just the ones meant.
+ * - usb_reg_ack_gintsts / _diepint / _doepint write only the flags given.
+ * - USB_SHADOW_* keep a RAM copy of the interrupt mask registers. Only the
+ *   driver writes them, so the interrupt handlers read the copy instead of
+ *   going out to the peripheral bus on every entry.
+ *
+ * With USB_REG_COUNT_ENABLE set every access is also counted per register
+ * in usb_reg_stats. The counters are not updated atomically, interrupts
+ * can lose the odd count, which is fine for what they are for.
+ */
+
+#ifndef USB_REG_H
+#define USB_REG_H
+
+#include <stdint.h>
+
+#include "usb_internal.h"
+
+#ifndef USB_REG_COUNT_ENABLE
+#define USB_REG_COUNT_ENABLE 0
+#endif
+
+/**
+ * @brief Registers used by the driver. Endpoint registers are counted
+ *        together for all endpoints.
+ */
+enum usb_reg_e
+{
+    USB_REG_GUSBCFG = 0,
+    USB_REG_GRSTCTL,
+    USB_REG_GINTSTS,
+    USB_REG_GINTMSK,
+    USB_REG_GRXSTSP,
+    USB_REG_GRXFSIZ,
+    USB_REG_DIEPTXF,
+    USB_REG_GCCFG,
+    USB_REG_GAHBCFG,
+    USB_REG_DCFG,
+    USB_REG_DCTL,
+    USB_REG_DSTS,
+    USB_REG_DIEPMSK,
+    USB_REG_DOEPMSK,
+    USB_REG_DAINT,
+    USB_REG_DAINTMSK,
+    USB_REG_DIEPEMPMSK,
+    USB_REG_DIEPCTL,
+    USB_REG_DIEPINT,
+    USB_REG_DIEPTSIZ,
+    USB_REG_DTXFSTS,
+    USB_REG_DOEPCTL,
+    USB_REG_DOEPINT,
+    USB_REG_DOEPTSIZ,
+    USB_REG_PCGCCTL,
+    USB_REG_COUNT
+};
+
+/* Registers a read-modify-write would acknowledge flags on */
+#define USB_REG_W1C ((1U << USB_REG_GINTSTS) | (1U << USB_REG_DIEPINT) | (1U << USB_REG_DOEPINT))
+
+/**
+ * @brief Access counters, per register.
+ */
+typedef struct usb_reg_stats_s
+{
+    uint32_t reads[USB_REG_COUNT];
+    uint32_t writes[USB_REG_COUNT];
+} usb_reg_stats_t;
+
+/**
+ * @brief Copies of the interrupt mask registers.
+ */
+typedef struct usb_reg_shadow_s
+{
+    uint32_t GINTMSK;
+    uint32_t DIEPMSK;
+    uint32_t DOEPMSK;
+    uint32_t DAINTMSK;
+    uint32_t DIEPEMPMSK;
+} usb_reg_shadow_t;
+
+extern usb_reg_shadow_t usb_reg_shadow;
+extern usb_reg_stats_t usb_reg_stats;
+extern const char * const usb_reg_names[USB_REG_COUNT];
+
+void usb_reg_shadow_load(void);
+void usb_reg_stats_clear(void);
+
+#if USB_REG_COUNT_ENABLE
+    #define USB_REG_COUNT_RD(reg_)  (usb_reg_stats.reads[USB_REG_##reg_]++)
+    #define USB_REG_COUNT_WR(reg_)  (usb_reg_stats.writes[USB_REG_##reg_]++)
+#else
+    #define USB_REG_COUNT_RD(reg_)  ((void)0)
+    #define USB_REG_COUNT_WR(reg_)  ((void)0)
+#endif
+
+#define USB_REG_NOT_W1C(reg_) \
+    _Static_assert(!(USB_REG_W1C & (1U << USB_REG_##reg_)), \
+                   #reg_ " is write-1-to-clear, acknowledge with usb_reg_ack_*")
+
+#define USB_REG_RD(p_base_, reg_) \
+    (USB_REG_COUNT_RD(reg_), (p_base_)->reg_)
+
+#define USB_REG_WR(p_base_, reg_, value_) \
+    do { USB_REG_COUNT_WR(reg_); (p_base_)->reg_ = (value_); } while (0)
+
+#define USB_REG_MOD(p_base_, reg_, clear_, set_) \
+    do { \
+        USB_REG_NOT_W1C(reg_); \
+        USB_REG_COUNT_RD(reg_); \
+        USB_REG_COUNT_WR(reg_); \
+        (p_base_)->reg_ = ((p_base_)->reg_ & ~(uint32_t)(clear_)) | (set_); \
+    } while (0)
+
+#define USB_REG_SET(p_base_, reg_, bits_)   USB_REG_MOD(p_base_, reg_, 0U, bits_)
+#define USB_REG_CLR(p_base_, reg_, bits_)   USB_REG_MOD(p_base_, reg_, bits_, 0U)
+
+#define USB_SHADOW_RD(reg_)                 (usb_reg_shadow.reg_)
+
+#define USB_SHADOW_WR(p_base_, reg_, value_) \
+    do { usb_reg_shadow.reg_ = (value_); USB_REG_WR(p_base_, reg_, usb_reg_shadow.reg_); } while (0)
+
+#define USB_SHADOW_SET(p_base_, reg_, bits_) \
+    USB_SHADOW_WR(p_base_, reg_, usb_reg_shadow.reg_ | (bits_))
+
+#define USB_SHADOW_CLR(p_base_, reg_, bits_) \
+    USB_SHADOW_WR(p_base_, reg_, usb_reg_shadow.reg_ & ~(uint32_t)(bits_))
+
+/**
+ * @brief Acknowledge core interrupts. Read-only flags ignore the write.
+ */
+static inline void
+usb_reg_ack_gintsts(uint32_t flags)
+{
+    USB_REG_WR(USB_OTG_FS, GINTSTS, flags);
+}
+
+/**
+ * @brief Acknowledge IN endpoint interrupts.
+ */
+static inline void
+usb_reg_ack_diepint(uint32_t ep_num, uint32_t flags)
+{
+    USB_REG_WR(USB_EP_IN(ep_num), DIEPINT, flags);
+}
+
+/**
+ * @brief Acknowledge OUT endpoint interrupts.
+ */
+static inline void
+usb_reg_ack_doepint(uint32_t ep_num, uint32_t flags)
+{
+    USB_REG_WR(USB_EP_OUT(ep_num), DOEPINT, flags);
+}
+
+/**
+ * @brief Write the TX FIFO size register of an IN endpoint, EP0 has its
+ *        own outside the DIEPTXF array.
+ */
+static inline void
+usb_reg_write_dieptxf(uint32_t ep_num, uint32_t value)
+{
+    USB_REG_COUNT_WR(DIEPTXF);
+    if (ep_num == 0U)
+    {
+        USB_OTG_FS->DIEPTXF0_HNPTXFSIZ = value;
+    }
+    else
+    {
+        USB_OTG_FS->DIEPTXF[ep_num - 1U] = value;
+    }
+}
+
+#endif /* USB_REG_H */
+
+/*** end of file ***/
\ No newline at end of file
@@ -0,0 +1,51 @@
+/** @file usb_stream.h
+ *
+ * @brief Bulk streaming on the STREAM_IN/STREAM_OUT endpoint pair.
+ */
+
+#ifndef USB_STREAM_H
+#define USB_STREAM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "usb.h"
+#include "usb_desc_gen.h"
+
+#define USB_STREAM_IN_EP            USB_DESC_EP_STREAM_IN
+#define USB_STREAM_OUT_EP           USB_DESC_EP_STREAM_OUT
+#define USB_STREAM_TX_RING_SIZE     (4096U) /* Has to be a power of two */
+#define USB_STREAM_TX_MAX_TRANSFER  (1024U) /* About one frame of bulk packets */
+#define USB_STREAM_RX_BLOCKS        (4U)
+#define USB_STREAM_RX_BLOCK_SIZE    (512U)  /* Multiple of the max packet size */
+
+/**
+ * @brief Streaming counters.
+ *
+ * tx_refused counts bytes usb_stream_write could not take because the ring
+ * was full, rx_stalls how often OUT was left NAKing because every receive
+ * block was waiting for usb_stream_read. cycles is the time spent copying
+ * in usb_stream_write and usb_stream_read.
+ */
+typedef struct usb_stream_stats_s
+{
+    uint32_t tx_bytes;
+    uint32_t tx_transfers;
+    uint32_t tx_refused;
+    uint32_t tx_high_water;
+    uint32_t rx_bytes;
+    uint32_t rx_transfers;
+    uint32_t rx_stalls;
+    uint32_t cycles;
+} usb_stream_stats_t;
+
+void usb_stream_configure(usb_driver_t *p_driver);
+uint32_t usb_stream_write(const uint8_t *p_src, uint32_t len);
+uint32_t usb_stream_write_free(void);
+uint32_t usb_stream_read(uint8_t *p_dst, uint32_t len);
+uint32_t usb_stream_read_available(void);
+const usb_stream_stats_t *usb_stream_get_stats(void);
+
+#endif /* USB_STREAM_H */
+
+/*** end of file ***/
\ No newline at end of file
@@ -0,0 +1,120 @@
+/** @file usb_trace.h
+ *
+ * @brief Binary event trace for the USB driver.
+ *
+ * Replaces printf in the interrupt path. Each event is a fixed 16 byte record
+ * (DWT timestamp, event ID, sequence number and two 32-bit arguments) written
+ * into a RAM ring buffer, formatting is done later on the host by
+ * tools/usb_trace_decode.py from a dump of usb_trace_buf.
+ *
+ * The comment after each event ID is the format string used by the decoder,
+ * arg0 and arg1 are substituted in order.
+ */
+
+#ifndef USB_TRACE_H
+#define USB_TRACE_H
+
+#include <stdint.h>
+
+#define USB_TRACE_LEVEL_NONE  0
+#define USB_TRACE_LEVEL_ERROR 1
+#define USB_TRACE_LEVEL_INFO  2
+#define USB_TRACE_LEVEL_DEBUG 3
+
+#ifndef USB_TRACE_LEVEL
+#define USB_TRACE_LEVEL USB_TRACE_LEVEL_INFO
+#endif
+
+#define USB_TRACE_MAGIC     (0x55545243U) /* "CRTU" */
+#define USB_TRACE_BUF_SIZE  (128U)        /* Entries, has to be a power of two */
+
+/**
+ * @brief Trace event IDs.
+ */
+enum usb_trace_event_e
+{
+    USB_TRACE_EV_NONE = 0,          /* - */
+    USB_TRACE_EV_MMIS,              /* MMIS */
+    USB_TRACE_EV_USBRST,            /* USBRST */
+    USB_TRACE_EV_ENUMDNE,           /* ENUMDNE */
+    USB_TRACE_EV_RXFLVL,            /* RXFLVL grxstsp=0x%08x bcnt=%u */
+    USB_TRACE_EV_OEPINT,            /* OEPINT ep=%u doepint=0x%08x */
+    USB_TRACE_EV_IEPINT,            /* IEPINT ep=%u diepint=0x%08x */
+    USB_TRACE_EV_SETUP,             /* SETUP bmRequestType/bRequest=0x%04x wValue=0x%04x */
+    USB_TRACE_EV_SETUP_UNSUPPORTED, /* SETUP STALL bmRequestType/bRequest=0x%04x wIndex=%u */
+    USB_TRACE_EV_GET_DESCRIPTOR,    /* GET_DESCRIPTOR type=%u index=%u */
+    USB_TRACE_EV_EP_NOT_READY,      /* ERR: EP%u not ready */
+    USB_TRACE_EV_TX_START,          /* TX start ep=%u len=%u */
+    USB_TRACE_EV_TX_WRITE,          /* TX packet ep=%u len=%u */
+    USB_TRACE_EV_TX_BUSY,           /* ERR: TX ep=%u busy, dropped len=%u */
+    USB_TRACE_EV_RX_START,          /* RX start ep=%u len=%u */
+    USB_TRACE_EV_RX_DROPPED,        /* ERR: RX ep=%u no buffer, dropped len=%u */
+    USB_TRACE_EV_EVENT_DROPPED,     /* ERR: event queue full, dropped type=%u total=%u */
+    USB_TRACE_EV_FIFO_ALLOC,        /* TX FIFO ep=%u words=%u */
+    USB_TRACE_EV_FIFO_OVERCOMMIT,   /* ERR: TX FIFO ep=%u does not fit, free words=%u */
+    USB_TRACE_EV_SET_CONFIGURATION, /* SET_CONFIGURATION config=%u free FIFO words=%u */
+    USB_TRACE_EV_FIFO_SHARED,       /* FIFO shared: RX words=%u EP0 TX words=%u */
+    USB_TRACE_EV_FIFO_FUNCTION,     /* FIFO function at interface %u: TX words=%u */
+    USB_TRACE_EV_HID_REPORT_DROPPED,/* ERR: HID report dropped, depth=%u dropped=%u */
+    USB_TRACE_EV_HID_PROTOCOL,      /* HID SET_PROTOCOL %u */
+    USB_TRACE_EV_CDC_CONTROL_LINES, /* CDC DTR=%u RTS=%u */
+    USB_TRACE_EV_CDC_LINE_CODING,   /* CDC line coding %u baud, bits/parity/stop=0x%06x */
+    USB_TRACE_EV_STATE,             /* STATE %u -> %u */
+    USB_TRACE_EV_COUNT
+};
+
+/**
+ * @brief Single trace record.
+ */
+typedef struct usb_trace_entry_s
+{
+    uint32_t timestamp;
+    uint16_t event;
+    uint16_t seq;
+    uint32_t arg0;
+    uint32_t arg1;
+} usb_trace_entry_t;
+
+/**
+ * @brief Trace ring buffer.
+ *
+ * head counts every record ever started, the newest record is at
+ * (head - 1) % size. The header lets the decoder validate a raw dump.
+ */
+typedef struct usb_trace_buf_s
+{
+    uint32_t magic;
+    uint32_t size;
+    volatile uint32_t head;
+    uint32_t reserved;
+    usb_trace_entry_t entries[USB_TRACE_BUF_SIZE];
+} usb_trace_buf_t;
+
+extern usb_trace_buf_t usb_trace_buf;
+
+void usb_trace_record(uint32_t event, uint32_t arg0, uint32_t arg1);
+
+#if USB_TRACE_LEVEL >= USB_TRACE_LEVEL_ERROR
+    #define USB_TRACE_ERR(event_, arg0_, arg1_) \
+        usb_trace_record((event_), (uint32_t)(arg0_), (uint32_t)(arg1_))
+#else
+    #define USB_TRACE_ERR(event_, arg0_, arg1_)     ((void)0)
+#endif
+
+#if USB_TRACE_LEVEL >= USB_TRACE_LEVEL_INFO
+    #define USB_TRACE_INFO(event_, arg0_, arg1_) \
+        usb_trace_record((event_), (uint32_t)(arg0_), (uint32_t)(arg1_))
+#else
+    #define USB_TRACE_INFO(event_, arg0_, arg1_)    ((void)0)
+#endif
+
+#if USB_TRACE_LEVEL >= USB_TRACE_LEVEL_DEBUG
+    #define USB_TRACE_DBG(event_, arg0_, arg1_) \
+        usb_trace_record((event_), (uint32_t)(arg0_), (uint32_t)(arg1_))
+#else
+    #define USB_TRACE_DBG(event_, arg0_, arg1_)     ((void)0)
+#endif
+
+#endif /* USB_TRACE_H */
+
+/*** end of file ***/
\ No newline at end of file
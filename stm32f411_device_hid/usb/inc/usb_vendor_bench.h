@@ -0,0 +1,62 @@
+/** @file usb_vendor_bench.h
+ *
+ * @brief Throughput and CPU load benchmark of the vendor bulk interface.
+ */
+
+#ifndef USB_VENDOR_BENCH_H
+#define USB_VENDOR_BENCH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "usb.h"
+
+#define USB_VENDOR_INTERFACE        (1U)
+#define USB_VENDOR_BENCH_CHUNK      (256U)  /* Bytes produced and consumed per call */
+#define USB_VENDOR_BENCH_WINDOW_MS  (1000U)
+
+/**
+ * @brief Vendor requests of the benchmark, recipient interface.
+ *
+ * SET_MODE takes a usb_vendor_bench_mode_e bit mask in wValue, GET_RESULT
+ * returns the usb_vendor_bench_result_t of the last complete window.
+ */
+enum usb_vendor_bench_request_e
+{
+    USB_VENDOR_BENCH_REQUEST_SET_MODE   = 0x01,
+    USB_VENDOR_BENCH_REQUEST_GET_RESULT = 0x02
+};
+
+enum usb_vendor_bench_mode_e
+{
+    USB_VENDOR_BENCH_MODE_IN  = 0x01,   /* Fill the IN ring with the counter pattern */
+    USB_VENDOR_BENCH_MODE_OUT = 0x02    /* Drain OUT and check the counter pattern */
+};
+
+/**
+ * @brief Result of one measurement window.
+ *
+ * usb_load is the share of the CPU, in 1/1000, taken by the USB interrupt,
+ * usb_poll and the copies in and out of the stream buffers. Producing and
+ * checking the pattern is not counted, it stands in for the application.
+ * rx_errors counts OUT bytes that broke the counter pattern.
+ */
+typedef struct usb_vendor_bench_result_s
+{
+    uint32_t window_cycles;
+    uint32_t tx_bytes_per_s;
+    uint32_t rx_bytes_per_s;
+    uint32_t usb_load;
+    uint32_t tx_refused;
+    uint32_t rx_stalls;
+    uint32_t rx_errors;
+    uint32_t windows;
+} usb_vendor_bench_result_t;
+
+void usb_vendor_bench_init(usb_driver_t *p_driver);
+void usb_vendor_bench_task(void);
+const usb_vendor_bench_result_t *usb_vendor_bench_get_result(void);
+
+#endif /* USB_VENDOR_BENCH_H */
+
+/*** end of file ***/
\ No newline at end of file
@@ -5,6 +5,11 @@
 
 #include "usb.h"
 #include "usb_internal.h"
+#include "usb_reg.h"
+#include "usb_desc.h"
+#include "usb_fifo.h"
+#include "usb_trace.h"
+#include "usb_capture.h"
 
 #define THIS_FILE__ "usb.c"
 
@@ -15,9 +20,57 @@ static void device_init(usb_init_t *init);
 static void core_soft_reset(void);
 static void force_device_mode(void);
 static void reset_endpoints(void);
+static void start_transfer(uint32_t ep_num, const usb_fifo_seg_t *p_segs, uint32_t len, bool zlp);
+static void start_tx_chunk(uint32_t ep_num);
+static void write_packet(uint32_t ep_num, uint32_t len);
 
 static usb_driver_t *p_usb_driver = NULL;
 
+/**
+ * @brief Interrupt mask profile of a device state.
+ *
+ * gintmsk replaces GINTMSK. The endpoint masks are only written when
+ * endpoint_masks is set, suspend keeps them as they are. DAINTMSK gets the
+ * EP0 bits of the profile plus every endpoint opened by usb_ep_open.
+ */
+typedef struct usb_int_profile_s
+{
+    uint32_t gintmsk;
+    bool endpoint_masks;
+    uint32_t daintmsk;
+    uint32_t diepmsk;
+    uint32_t doepmsk;
+} usb_int_profile_t;
+
+#define USB_GINTMSK_ALWAYS  (USB_OTG_GINTMSK_USBRST | USB_OTG_GINTMSK_ENUMDNEM | \
+                             USB_OTG_GINTMSK_MMISM)
+#define USB_GINTMSK_ACTIVE  (USB_GINTMSK_ALWAYS | USB_OTG_GINTMSK_IEPINT |      \
+                             USB_OTG_GINTMSK_OEPINT | USB_OTG_GINTMSK_RXFLVLM | \
+                             USB_OTG_GINTMSK_USBSUSPM)
+#define USB_DAINTMSK_EP0    ((1U << USB_OTG_DAINTMSK_IEPM_Pos) | (1U << USB_OTG_DAINTMSK_OEPM_Pos))
+#define USB_DIEPMSK_ACTIVE  (USB_OTG_DIEPMSK_XFRCM | USB_OTG_DIEPMSK_TOM | USB_OTG_DIEPMSK_EPDM)
+#define USB_DOEPMSK_ACTIVE  (USB_OTG_DOEPMSK_STUPM | USB_OTG_DOEPMSK_XFRCM | \
+                             USB_OTG_DOEPMSK_EPDM | USB_OTG_DOEPMSK_OTEPSPRM)
+
+/*
+ * Nothing but reset and enumeration matters until the host has reset the
+ * bus. SOF is only needed once configured (HID report scheduling), and in
+ * suspend only resume and reset can happen.
+ */
+static const usb_int_profile_t usb_int_profiles[USB_STATE_COUNT] = {
+    [USB_STATE_NONE]       = { 0U, true, 0U, 0U, 0U },
+    [USB_STATE_POWERED]    = { USB_GINTMSK_ALWAYS, true, 0U, 0U, 0U },
+    [USB_STATE_RESET]      = { USB_GINTMSK_ACTIVE, true, USB_DAINTMSK_EP0,
+                               USB_DIEPMSK_ACTIVE, USB_DOEPMSK_ACTIVE },
+    [USB_STATE_DEFAULT]    = { USB_GINTMSK_ACTIVE, true, USB_DAINTMSK_EP0,
+                               USB_DIEPMSK_ACTIVE, USB_DOEPMSK_ACTIVE },
+    [USB_STATE_ADDRESS]    = { USB_GINTMSK_ACTIVE, true, USB_DAINTMSK_EP0,
+                               USB_DIEPMSK_ACTIVE, USB_DOEPMSK_ACTIVE },
+    [USB_STATE_CONFIGURED] = { USB_GINTMSK_ACTIVE | USB_OTG_GINTMSK_SOFM, true, USB_DAINTMSK_EP0,
+                               USB_DIEPMSK_ACTIVE, USB_DOEPMSK_ACTIVE },
+    [USB_STATE_SUSPENDED]  = { USB_GINTMSK_ALWAYS | USB_OTG_GINTMSK_WUIM, false, 0U, 0U, 0U },
+};
+
 
 /*##########################################################################*/
 /*#                            PUBLIC FUNCTIONS                            #*/
@@ -30,6 +83,18 @@ void
 usb_init(usb_driver_t *p_driver, usb_init_t *init)
 {
     p_usb_driver = p_driver;
+    p_usb_driver->deferred_processing = init->deferred_processing;
+    p_usb_driver->vbus_sensing = init->vbus_sensing;
+    usb_ep_set_callback(0x00, usb_ep0_out_callback);
+    usb_ep_set_callback(0x80, usb_ep0_in_callback);
+    usb_desc_serial_init();
+
+    // Enable DWT cycle counter used for interrupt profiling
+    //
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0U;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
     gpio_init(init);
     RCC->AHB2ENR |= RCC_AHB2ENR_OTGFSEN;
     core_init(init);
@@ -39,6 +104,273 @@ usb_init(usb_driver_t *p_driver, usb_init_t *init)
     NVIC_EnableIRQ(OTG_FS_IRQn);
 }
 
+/**
+ * @brief Register the interrupt callback of an endpoint.
+ *
+ * @param ep_addr  Endpoint address, bit 7 set for IN endpoints.
+ * @param callback Called from the bottom half for every endpoint event.
+ */
+void
+usb_ep_set_callback(uint8_t ep_addr, usb_ep_callback_t callback)
+{
+    uint32_t ep_num = ep_addr & 0x0FU;
+
+    REQUIRE(ep_num < USB_MAX_ENDPOINTS);
+    if (ep_addr & 0x80U)
+    {
+        p_usb_driver->ep_in[ep_num].callback = callback;
+    }
+    else
+    {
+        p_usb_driver->ep_out[ep_num].callback = callback;
+    }
+}
+
+/**
+ * @brief Activate an endpoint.
+ *        IN endpoints use the TX FIFO with their own number, which has to be
+ *        allocated with usb_fifo_alloc_tx before data is written.
+ *
+ * @param ep_addr         Endpoint address, bit 7 set for IN endpoints.
+ * @param type            Transfer type.
+ * @param max_packet_size Max packet size in bytes.
+ */
+void
+usb_ep_open(uint8_t ep_addr, usb_ep_type_t type, uint16_t max_packet_size)
+{
+    uint32_t ep_num = ep_addr & 0x0FU;
+
+    REQUIRE((ep_num != 0) && (ep_num < USB_MAX_ENDPOINTS));
+    if (ep_addr & 0x80U)
+    {
+        usb_ep_t *p_ep = &p_usb_driver->ep_in[ep_num];
+        p_ep->type = type;
+        p_ep->max_packet_size = max_packet_size;
+        p_ep->state = USB_EP_STATE_IDLE;
+
+        USB_REG_WR(USB_EP_IN(ep_num), DIEPCTL, ((max_packet_size << USB_OTG_DIEPCTL_MPSIZ_Pos) |
+                                                (type << USB_OTG_DIEPCTL_EPTYP_Pos)           |
+                                                (ep_num << USB_OTG_DIEPCTL_TXFNUM_Pos)        |
+                                                USB_OTG_DIEPCTL_SD0PID_SEVNFRM                |
+                                                USB_OTG_DIEPCTL_USBAEP));
+        USB_SHADOW_SET(USB_OTG_DEVICE, DAINTMSK, (1U << (USB_OTG_DAINTMSK_IEPM_Pos + ep_num)));
+    }
+    else
+    {
+        usb_ep_t *p_ep = &p_usb_driver->ep_out[ep_num];
+        p_ep->type = type;
+        p_ep->max_packet_size = max_packet_size;
+        p_ep->state = USB_EP_STATE_IDLE;
+
+        USB_REG_WR(USB_EP_OUT(ep_num), DOEPCTL, ((max_packet_size << USB_OTG_DOEPCTL_MPSIZ_Pos) |
+                                                 (type << USB_OTG_DOEPCTL_EPTYP_Pos)           |
+                                                 USB_OTG_DOEPCTL_SD0PID_SEVNFRM                |
+                                                 USB_OTG_DOEPCTL_USBAEP));
+        USB_SHADOW_SET(USB_OTG_DEVICE, DAINTMSK, (1U << (USB_OTG_DAINTMSK_OEPM_Pos + ep_num)));
+    }
+}
+
+/**
+ * @brief Deactivate an endpoint.
+ *
+ * @param ep_addr Endpoint address, bit 7 set for IN endpoints.
+ */
+void
+usb_ep_close(uint8_t ep_addr)
+{
+    uint32_t ep_num = ep_addr & 0x0FU;
+
+    REQUIRE((ep_num != 0) && (ep_num < USB_MAX_ENDPOINTS));
+    if (ep_addr & 0x80U)
+    {
+        USB_SHADOW_CLR(USB_OTG_DEVICE, DAINTMSK, (1U << (USB_OTG_DAINTMSK_IEPM_Pos + ep_num)));
+        USB_REG_WR(USB_EP_IN(ep_num), DIEPCTL, USB_OTG_DIEPCTL_SNAK);
+        p_usb_driver->ep_in[ep_num].state = USB_EP_STATE_DISABLED;
+    }
+    else
+    {
+        USB_SHADOW_CLR(USB_OTG_DEVICE, DAINTMSK, (1U << (USB_OTG_DAINTMSK_OEPM_Pos + ep_num)));
+        USB_REG_WR(USB_EP_OUT(ep_num), DOEPCTL, USB_OTG_DOEPCTL_SNAK);
+        p_usb_driver->ep_out[ep_num].state = USB_EP_STATE_DISABLED;
+        p_usb_driver->ep_out[ep_num].p_rx_buf = NULL;
+        p_usb_driver->ep_out[ep_num].rx_complete = NULL;
+    }
+}
+
+/**
+ * @brief Set or clear the halt condition of an endpoint.
+ *        Clearing also resets the data toggle to DATA0 as required after
+ *        CLEAR_FEATURE(ENDPOINT_HALT).
+ *
+ * @param ep_addr Endpoint address, bit 7 set for IN endpoints.
+ * @param stall   true to halt the endpoint.
+ */
+void
+usb_ep_stall(uint8_t ep_addr, bool stall)
+{
+    uint32_t ep_num = ep_addr & 0x0FU;
+
+    REQUIRE((ep_num != 0) && (ep_num < USB_MAX_ENDPOINTS));
+    if (ep_addr & 0x80U)
+    {
+        if (stall)
+        {
+            USB_REG_SET(USB_EP_IN(ep_num), DIEPCTL, USB_OTG_DIEPCTL_STALL);
+        }
+        else
+        {
+            USB_REG_MOD(USB_EP_IN(ep_num), DIEPCTL, USB_OTG_DIEPCTL_STALL,
+                        USB_OTG_DIEPCTL_SD0PID_SEVNFRM);
+        }
+        p_usb_driver->ep_in[ep_num].state = stall ? USB_EP_STATE_STALLED : USB_EP_STATE_IDLE;
+    }
+    else
+    {
+        if (stall)
+        {
+            USB_REG_SET(USB_EP_OUT(ep_num), DOEPCTL, USB_OTG_DOEPCTL_STALL);
+        }
+        else
+        {
+            USB_REG_MOD(USB_EP_OUT(ep_num), DOEPCTL, USB_OTG_DOEPCTL_STALL,
+                        USB_OTG_DOEPCTL_SD0PID_SEVNFRM);
+        }
+        p_usb_driver->ep_out[ep_num].state = stall ? USB_EP_STATE_STALLED : USB_EP_STATE_IDLE;
+    }
+}
+
+/**
+ * @brief Start an IN transfer of any length.
+ *        The transfer is split into max packet size packets and programmed
+ *        in chunks as large as DIEPTSIZ allows. The first packets go into
+ *        the FIFO right away, the rest is refilled from the TXFE interrupt.
+ *        The endpoint callback sees XFRC once, after the last packet.
+ *
+ * @param ep_num IN endpoint number.
+ * @param p_src  Data to send, has to stay valid until the transfer is done.
+ * @param len    Number of bytes, 0 sends a single zero length packet.
+ * @param zlp    Terminate with a zero length packet if len is a multiple
+ *               of the max packet size.
+ *
+ * @return false if the endpoint is still busy with a previous transfer.
+ */
+bool
+usb_ep_transmit(uint32_t ep_num, const uint8_t *p_src, uint32_t len, bool zlp)
+{
+    REQUIRE(ep_num < USB_MAX_ENDPOINTS);
+    usb_ep_t *p_ep = &p_usb_driver->ep_in[ep_num];
+
+    if ((ep_num != 0) && (p_ep->state == USB_EP_STATE_BUSY))
+    {
+        USB_TRACE_ERR(USB_TRACE_EV_TX_BUSY, ep_num, len);
+        return false;
+    }
+
+    p_ep->tx_seg.p_data = p_src;
+    p_ep->tx_seg.len = len;
+    start_transfer(ep_num, &p_ep->tx_seg, len, zlp);
+    return true;
+}
+
+/**
+ * @brief Start an IN transfer gathered from several buffers.
+ *        The segments are sent back to back as one transfer, packets
+ *        spanning a segment boundary are assembled on the way into the
+ *        FIFO, nothing is staged in between. Otherwise like
+ *        usb_ep_transmit.
+ *
+ * @param ep_num IN endpoint number.
+ * @param p_segs Segments in order. The array and the data it points to
+ *               have to stay valid until the transfer is done.
+ * @param count  Number of segments, empty segments are allowed.
+ * @param zlp    Terminate with a zero length packet if the total length is
+ *               a multiple of the max packet size.
+ *
+ * @return false if the endpoint is still busy with a previous transfer.
+ */
+bool
+usb_ep_transmit_segs(uint32_t ep_num, const usb_fifo_seg_t *p_segs, uint32_t count, bool zlp)
+{
+    REQUIRE((ep_num < USB_MAX_ENDPOINTS) && (count != 0));
+    usb_ep_t *p_ep = &p_usb_driver->ep_in[ep_num];
+    uint32_t len = 0;
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        len += p_segs[i].len;
+    }
+
+    if ((ep_num != 0) && (p_ep->state == USB_EP_STATE_BUSY))
+    {
+        USB_TRACE_ERR(USB_TRACE_EV_TX_BUSY, ep_num, len);
+        return false;
+    }
+
+    start_transfer(ep_num, p_segs, len, zlp);
+    return true;
+}
+
+/**
+ * @brief Arm an OUT endpoint for a transfer of up to len bytes.
+ *        PKTCNT and XFRSIZ cover the whole buffer, so the core receives
+ *        every packet of the transfer without software intervention. The
+ *        RXFLVL handler pops each packet from the FIFO straight into p_dst,
+ *        there is no driver buffer in between. The transfer ends with the
+ *        buffer full or a short packet, then complete gets the length
+ *        received. The buffer belongs to the driver until then.
+ *
+ * @param p_dst    Receive buffer, word aligned for the fast FIFO copy.
+ * @param len      Buffer size, a multiple of the max packet size so that any
+ *                 packet the host sends fits.
+ * @param complete Completion callback, may be NULL if the endpoint callback
+ *                 looks at rx_count itself.
+ *
+ * @return false if the endpoint is not open or still busy.
+ */
+bool
+usb_ep_receive(uint32_t ep_num, uint8_t *p_dst, uint32_t len, usb_ep_rx_complete_t complete)
+{
+    REQUIRE((ep_num != 0) && (ep_num < USB_MAX_ENDPOINTS));
+    usb_ep_t *p_ep = &p_usb_driver->ep_out[ep_num];
+    uint32_t mps = p_ep->max_packet_size;
+
+    if (p_ep->state != USB_EP_STATE_IDLE)
+    {
+        return false;
+    }
+    REQUIRE((len != 0) && ((len % mps) == 0) && ((len / mps) <= 0x3FFU));
+
+    p_ep->p_rx_buf = p_dst;
+    p_ep->rx_len = len;
+    p_ep->rx_count = 0;
+    p_ep->rx_complete = complete;
+    p_ep->state = USB_EP_STATE_BUSY;
+
+    USB_TRACE_DBG(USB_TRACE_EV_RX_START, ep_num, len);
+    USB_REG_WR(USB_EP_OUT(ep_num), DOEPTSIZ, (((len / mps) << USB_OTG_DOEPTSIZ_PKTCNT_Pos) |
+                                              (len << USB_OTG_DOEPTSIZ_XFRSIZ_Pos)));
+    USB_REG_SET(USB_EP_OUT(ep_num), DOEPCTL, (USB_OTG_DOEPCTL_CNAK | USB_OTG_DOEPCTL_EPENA));
+    return true;
+}
+
+/**
+ * @brief Number of FIFO RAM words not given out yet.
+ */
+uint32_t
+usb_fifo_free_words(void)
+{
+    return USB_FIFO_RAM_WORDS - p_usb_driver->fifo_words_used;
+}
+
+/**
+ * @brief FIFO RAM split between the functions of the configuration.
+ */
+const usb_fifo_report_t *
+usb_fifo_get_report(void)
+{
+    return &p_usb_driver->fifo_report;
+}
+
 /*##########################################################################*/
 /*#                            INTERNAL FUNCTIONS                          #*/
 /*##########################################################################*/
@@ -49,68 +381,272 @@ usb_get_instance(void)
     return p_usb_driver;
 }
 
+/**
+ * @brief Release all TX FIFOs and size the shared RX FIFO.
+ *        FIFO RAM is handed out bottom up: RX FIFO first, then TX FIFOs in
+ *        the order they are allocated.
+ *        Whatever the FIFOs still hold is dropped: the TX FIFOs are flushed
+ *        before they move and all FIFOs once the new sizes are in place, the
+ *        core requires that after GRXFSIZ or DIEPTXFx change. Once the bus
+ *        is live the RX flush runs under a global OUT NAK.
+ *
+ * @param rx_words RX FIFO depth in words.
+ */
+void
+usb_fifo_reset(uint32_t rx_words)
+{
+    REQUIRE(rx_words <= USB_FIFO_RAM_WORDS);
+
+    flush_tx_fifo();
+
+    USB_REG_WR(USB_OTG_FS, GRXFSIZ, rx_words);
+    for (uint32_t ep_num = 0; ep_num < 16U; ep_num++)
+    {
+        usb_reg_write_dieptxf(ep_num, 0U);
+    }
+
+    flush_tx_fifo();
+    // On a live bus OUT packets keep arriving, the RX FIFO may only be
+    // flushed once the global OUT NAK is in effect
+    if (p_usb_driver->state != USB_STATE_NONE)
+    {
+        USB_REG_SET(USB_OTG_DEVICE, DCTL, USB_OTG_DCTL_SGONAK);
+        while (!(USB_REG_RD(USB_OTG_FS, GINTSTS) & USB_OTG_GINTSTS_BOUTNAKEFF));
+        flush_rx_fifo();
+        USB_REG_SET(USB_OTG_DEVICE, DCTL, USB_OTG_DCTL_CGONAK);
+    }
+    else
+    {
+        flush_rx_fifo();
+    }
+
+    for (uint32_t ep_num = 0; ep_num < USB_MAX_ENDPOINTS; ep_num++)
+    {
+        p_usb_driver->ep_in[ep_num].fifo_words = 0;
+    }
+    p_usb_driver->fifo_words_used = rx_words;
+}
+
+/**
+ * @brief Allocate a TX FIFO for an IN endpoint.
+ *        Nothing is changed when the request does not fit.
+ *
+ * @param ep_num IN endpoint number.
+ * @param words  FIFO depth in words, at least USB_FIFO_MIN_TX_WORDS.
+ *
+ * @return false on overcommit.
+ */
+bool
+usb_fifo_alloc_tx(uint32_t ep_num, uint32_t words)
+{
+    REQUIRE(ep_num < USB_MAX_ENDPOINTS);
+    REQUIRE(p_usb_driver->ep_in[ep_num].fifo_words == 0);
+
+    if (words < USB_FIFO_MIN_TX_WORDS)
+    {
+        words = USB_FIFO_MIN_TX_WORDS;
+    }
+    if (words > usb_fifo_free_words())
+    {
+        USB_TRACE_ERR(USB_TRACE_EV_FIFO_OVERCOMMIT, ep_num, usb_fifo_free_words());
+        return false;
+    }
+
+    uint32_t fifo_reg = ((words << USB_OTG_DIEPTXF_INEPTXFD_Pos) |
+                         (p_usb_driver->fifo_words_used << USB_OTG_DIEPTXF_INEPTXSA_Pos));
+    usb_reg_write_dieptxf(ep_num, fifo_reg);
+    p_usb_driver->ep_in[ep_num].fifo_words = words;
+    p_usb_driver->fifo_words_used += words;
+
+    USB_TRACE_INFO(USB_TRACE_EV_FIFO_ALLOC, ep_num, words);
+    return true;
+}
+
+/**
+ * @brief Flush all TX FIFOs and wait for the core to finish.
+ */
 uint32_t
 flush_tx_fifo(void)
 {
-    while (!(USB_OTG_FS->GRSTCTL & USB_OTG_GRSTCTL_AHBIDL));
+    while (!(USB_REG_RD(USB_OTG_FS, GRSTCTL) & USB_OTG_GRSTCTL_AHBIDL));
 
-    USB_OTG_FS->GRSTCTL |= USB_OTG_GRSTCTL_TXFFLSH;
-    while(USB_OTG_FS->GRSTCTL & USB_OTG_GRSTCTL_TXFFLSH);
+    // TXFNUM 0x10 selects every TX FIFO, its reset value 0 only FIFO 0
+    USB_REG_MOD(USB_OTG_FS, GRSTCTL, USB_OTG_GRSTCTL_TXFNUM,
+                (0x10U << USB_OTG_GRSTCTL_TXFNUM_Pos) | USB_OTG_GRSTCTL_TXFFLSH);
+    while(USB_REG_RD(USB_OTG_FS, GRSTCTL) & USB_OTG_GRSTCTL_TXFFLSH);
     return 1;
 }
 
+/**
+ * @brief Flush the RX FIFO and wait for the core to finish.
+ */
 uint32_t
 flush_rx_fifo(void)
 {
-    while (!(USB_OTG_FS->GRSTCTL & USB_OTG_GRSTCTL_AHBIDL));
+    while (!(USB_REG_RD(USB_OTG_FS, GRSTCTL) & USB_OTG_GRSTCTL_AHBIDL));
 
-    USB_OTG_FS->GRSTCTL |= USB_OTG_GRSTCTL_RXFFLSH;
-    while(USB_OTG_FS->GRSTCTL & USB_OTG_GRSTCTL_RXFFLSH);
+    USB_REG_SET(USB_OTG_FS, GRSTCTL, USB_OTG_GRSTCTL_RXFFLSH);
+    while(USB_REG_RD(USB_OTG_FS, GRSTCTL) & USB_OTG_GRSTCTL_RXFFLSH);
     return 1;
 }
 
+/**
+ * @brief Move the device to a new state and apply its interrupt profile.
+ *        Safe from thread and interrupt context, GINTMSK is also modified by
+ *        the RXFLVL handler.
+ *
+ * @param state New state. Entering SUSPENDED remembers the state to return
+ *              to on resume.
+ */
 void
-usb_write_fifo(const uint8_t *p_src, size_t len)
+usb_set_state(usb_state_t state)
 {
-    if (!(USB_EP_IN(0)->DIEPCTL & USB_OTG_DIEPCTL_USBAEP))
+    REQUIRE(state < USB_STATE_COUNT);
+    const usb_int_profile_t *p_profile = &usb_int_profiles[state];
+    uint32_t gintmsk = p_profile->gintmsk;
+
+    if (p_usb_driver->vbus_sensing)
     {
-        printf("ERR: EP 0 NOT READY!\n");
-        return;
+        gintmsk |= (USB_OTG_GINTMSK_SRQIM | USB_OTG_GINTMSK_OTGINT);
     }
 
-    // Check for available space
-    size_t len_in_words = (len + 3) / 4;
-    size_t available_space = (USB_EP_IN(0)->DTXFSTS & USB_OTG_DTXFSTS_INEPTFSAV);
-    printf("\tAvailable space: %d\n", available_space);
-    if (len_in_words > available_space)
+    uint32_t primask = usb_critical_enter();
+    USB_TRACE_INFO(USB_TRACE_EV_STATE, p_usb_driver->state, state);
+    if ((state == USB_STATE_SUSPENDED) && (p_usb_driver->state != USB_STATE_SUSPENDED))
     {
-        printf("ERR: Not enough space in TX FIFO!\n");
-        return;
+        p_usb_driver->resume_state = p_usb_driver->state;
     }
+    p_usb_driver->state = state;
+    p_usb_driver->state_stats.entries[state]++;
 
-    USB_EP_IN(0)->DIEPTSIZ =
-        ((1U << USB_OTG_DIEPTSIZ_PKTCNT_Pos) |
-         (len << USB_OTG_DIEPTSIZ_XFRSIZ_Pos));
+    if (p_profile->endpoint_masks)
+    {
+        uint32_t daintmsk = p_profile->daintmsk;
+        for (uint32_t ep_num = 1; ep_num < USB_MAX_ENDPOINTS; ep_num++)
+        {
+            if (p_usb_driver->ep_in[ep_num].state != USB_EP_STATE_DISABLED)
+            {
+                daintmsk |= (1U << (USB_OTG_DAINTMSK_IEPM_Pos + ep_num));
+            }
+            if (p_usb_driver->ep_out[ep_num].state != USB_EP_STATE_DISABLED)
+            {
+                daintmsk |= (1U << (USB_OTG_DAINTMSK_OEPM_Pos + ep_num));
+            }
+        }
+        USB_SHADOW_WR(USB_OTG_DEVICE, DIEPMSK, p_profile->diepmsk);
+        USB_SHADOW_WR(USB_OTG_DEVICE, DOEPMSK, p_profile->doepmsk);
+        USB_SHADOW_WR(USB_OTG_DEVICE, DAINTMSK, daintmsk);
+    }
+    USB_SHADOW_WR(USB_OTG_FS, GINTMSK, gintmsk);
+    usb_critical_exit(primask);
+}
 
-    USB_EP_IN(0)->DIEPCTL &= ~(USB_OTG_DIEPCTL_STALL);
-    USB_EP_IN(0)->DIEPCTL |= (USB_OTG_DIEPCTL_CNAK | USB_OTG_DIEPCTL_EPENA);
+/**
+ * @brief Send a control IN data or status stage on EP0.
+ *        A zero length packet follows when the data is shorter than what
+ *        the host asked for and ends on a packet boundary. The OUT side is
+ *        enabled for the status stage sent by the host.
+ *
+ * @param p_src   Data to send, has to stay valid until the transfer is done.
+ * @param len     Number of bytes to send.
+ * @param req_len wLength of the request.
+ */
+void
+usb_ep0_transmit(const uint8_t *p_src, size_t len, size_t req_len)
+{
+    uint32_t diepctl = USB_REG_RD(USB_EP_IN(0), DIEPCTL);
 
-    for (uint32_t i = 0; i < (len / 4); i ++)
+    if (!(diepctl & USB_OTG_DIEPCTL_USBAEP))
     {
-        USB_OTG_DFIFO(0) = ((uint32_t *)p_src)[i];
+        USB_TRACE_ERR(USB_TRACE_EV_EP_NOT_READY, 0, 0);
+        return;
     }
-    if (len % 4)
+
+    if (diepctl & USB_OTG_DIEPCTL_STALL)
     {
-        uint32_t remaining = 0;
-        memcpy(&remaining, &p_src[len - (len % 4)], len % 4);
-        USB_OTG_DFIFO(0) = remaining;
+        USB_REG_CLR(USB_EP_IN(0), DIEPCTL, USB_OTG_DIEPCTL_STALL);
     }
+    usb_ep_transmit(0, p_src, len, len < req_len);
 
-    USB_EP_OUT(0)->DOEPCTL |= (USB_OTG_DOEPCTL_CNAK | USB_OTG_DOEPCTL_EPENA);
-    printf("\tWrote len: %d\n", len);
+    USB_REG_SET(USB_EP_OUT(0), DOEPCTL, (USB_OTG_DOEPCTL_CNAK | USB_OTG_DOEPCTL_EPENA));
 }
 
+/**
+ * @brief STALL the data or status stage of the current control request.
+ *        The core clears the STALL bits itself on the next SETUP, which is
+ *        also accepted again right away.
+ */
+void
+usb_ep0_stall(void)
+{
+    USB_REG_SET(USB_EP_IN(0), DIEPCTL, USB_OTG_DIEPCTL_STALL);
+    USB_REG_SET(USB_EP_OUT(0), DOEPCTL, USB_OTG_DOEPCTL_STALL);
+    USB_REG_WR(USB_EP_OUT(0), DOEPTSIZ, (USB_OTG_DOEPTSIZ_STUPCNT |
+                                        (1U << USB_OTG_DOEPTSIZ_PKTCNT_Pos) |
+                                        (USB_EP0_RX_FIFO_SIZE << USB_OTG_DOEPTSIZ_XFRSIZ_Pos)));
+    p_usb_driver->ep_in[0].state = USB_EP_STATE_IDLE;
+    USB_CAPTURE_RECORD(USB_CAPTURE_STALL, 0x80U, NULL, 0);
+}
 
+/**
+ * @brief TX FIFO empty handler.
+ *        Writes as many whole packets of the programmed chunk as the FIFO
+ *        has room for. The TXFE interrupt of the endpoint stays unmasked
+ *        until the whole chunk is in the FIFO.
+ *
+ * @param ep_num IN endpoint number.
+ */
+void
+usb_ep_tx_fifo_empty(uint32_t ep_num)
+{
+    usb_ep_t *p_ep = &p_usb_driver->ep_in[ep_num];
+
+    while (p_ep->tx_count < p_ep->tx_queued)
+    {
+        uint32_t len = MIN(p_ep->tx_queued - p_ep->tx_count, p_ep->max_packet_size);
+        uint32_t available_words = USB_REG_RD(USB_EP_IN(ep_num), DTXFSTS) & USB_OTG_DTXFSTS_INEPTFSAV;
+
+        if (((len + 3U) / 4U) > available_words)
+        {
+            break;
+        }
+        write_packet(ep_num, len);
+        p_ep->tx_count += len;
+    }
+
+    uint32_t primask = usb_critical_enter();
+    if (p_ep->tx_count < p_ep->tx_queued)
+    {
+        USB_SHADOW_SET(USB_OTG_DEVICE, DIEPEMPMSK, (1U << ep_num));
+    }
+    else if (USB_SHADOW_RD(DIEPEMPMSK) & (1U << ep_num))
+    {
+        USB_SHADOW_CLR(USB_OTG_DEVICE, DIEPEMPMSK, (1U << ep_num));
+    }
+    usb_critical_exit(primask);
+}
+
+/**
+ * @brief Transfer complete (XFRC) handler.
+ *        Programs the next chunk or the owed zero length packet.
+ *
+ * @param ep_num IN endpoint number.
+ *
+ * @return true when the whole transfer is done.
+ */
+bool
+usb_ep_tx_complete(uint32_t ep_num)
+{
+    usb_ep_t *p_ep = &p_usb_driver->ep_in[ep_num];
+
+    if ((p_ep->tx_queued < p_ep->tx_len) || p_ep->tx_zlp)
+    {
+        start_tx_chunk(ep_num);
+        return false;
+    }
+    p_ep->state = USB_EP_STATE_IDLE;
+    return true;
+}
 
 /*##########################################################################*/
 /*#                       STATIC (PRIVATE) FUNCTIONS                       #*/
@@ -158,11 +694,12 @@ gpio_init(usb_init_t *init)
 static void
 core_init(usb_init_t *init)
 {
-    USB_OTG_FS->GUSBCFG |= USB_OTG_GUSBCFG_PHYSEL;
+    USB_REG_SET(USB_OTG_FS, GUSBCFG, USB_OTG_GUSBCFG_PHYSEL);
 
     core_soft_reset();
+    usb_reg_shadow_load();
 
-    USB_OTG_FS->GCCFG |= USB_OTG_GCCFG_PWRDWN; //TODO CHECK
+    USB_REG_SET(USB_OTG_FS, GCCFG, USB_OTG_GCCFG_PWRDWN); //TODO CHECK
 }
 
 /**
@@ -173,64 +710,44 @@ device_init(usb_init_t *init)
 {
     force_device_mode();
 
-    for (uint32_t i = 0; i < 15U; i++)
-    {
-        USB_OTG_FS->DIEPTXF[i] = 0U;
-    }
+    usb_fifo_reset(USB_RX_FIFO_WORDS);
 
     if (init->vbus_sensing)
     {
-        USB_OTG_DEVICE->DCTL |= USB_OTG_DCTL_SDIS;
-        USB_OTG_FS->GCCFG |= USB_OTG_GCCFG_NOVBUSSENS;
-        USB_OTG_FS->GCCFG &= ~USB_OTG_GCCFG_VBUSBSEN;
-        USB_OTG_FS->GCCFG &= ~USB_OTG_GCCFG_VBUSASEN;
+        USB_REG_SET(USB_OTG_DEVICE, DCTL, USB_OTG_DCTL_SDIS);
+        USB_REG_MOD(USB_OTG_FS, GCCFG, (USB_OTG_GCCFG_VBUSBSEN | USB_OTG_GCCFG_VBUSASEN),
+                    USB_OTG_GCCFG_NOVBUSSENS);
     }
     else
     {
-        USB_OTG_FS->GCCFG &= ~USB_OTG_GCCFG_NOVBUSSENS;
-        USB_OTG_FS->GCCFG |= USB_OTG_GCCFG_VBUSBSEN;
+        USB_REG_MOD(USB_OTG_FS, GCCFG, USB_OTG_GCCFG_NOVBUSSENS, USB_OTG_GCCFG_VBUSBSEN);
     }
 
-    USB_OTG_PCGCCTL = 0U;
-    USB_OTG_DEVICE->DCFG |= USB_OTG_DCFG_DSPD;
+    USB_REG_WR(USB_OTG_PCGC, PCGCCTL, 0U);
+    USB_REG_SET(USB_OTG_DEVICE, DCFG, USB_OTG_DCFG_DSPD);
 
-    flush_rx_fifo();
-    flush_tx_fifo();
+    // TXFE when the TX FIFO is half empty: with double buffered IN FIFOs the
+    // next packet is written while the previous one is still on the bus
+    USB_REG_CLR(USB_OTG_FS, GAHBCFG, USB_OTG_GAHBCFG_TXFELVL);
 
     reset_endpoints();
 
     // Configure interrupts
     //
-    USB_OTG_FS->GINTSTS = 0U;
-    USB_OTG_FS->GINTSTS = 0xBFFFFFFFU;
-
-    USB_OTG_FS->GINTMSK |= (USB_OTG_GINTMSK_USBRST   |
-                            USB_OTG_GINTMSK_ENUMDNEM |
-                            USB_OTG_GINTMSK_IEPINT   |
-                            USB_OTG_GINTMSK_OEPINT   |
-                            USB_OTG_GINTMSK_RXFLVLM  |
-                            USB_OTG_GINTMSK_SOFM     |
-                            USB_OTG_GINTMSK_MMISM    |
-                            USB_OTG_GINTMSK_USBSUSPM |
-                            USB_OTG_GINTMSK_WUIM);
-    if (init->vbus_sensing)
-    {
-        USB_OTG_FS->GINTMSK |= (USB_OTG_GINTMSK_SRQIM |
-                                USB_OTG_GINTMSK_OTGINT);
-    }
+    usb_reg_ack_gintsts(0xBFFFFFFFU);
+
+    usb_set_state(USB_STATE_POWERED);
 
-    USB_OTG_PCGCCTL &= ~(USB_OTG_PCGCR_STPPCLK | USB_OTG_PCGCR_GATEHCLK);
-    USB_OTG_DEVICE->DCTL |= USB_OTG_DCTL_SDIS;
+    USB_REG_CLR(USB_OTG_PCGC, PCGCCTL, (USB_OTG_PCGCR_STPPCLK | USB_OTG_PCGCR_GATEHCLK));
+    USB_REG_SET(USB_OTG_DEVICE, DCTL, USB_OTG_DCTL_SDIS);
 
-    USB_OTG_FS->GRXFSIZ = USB_GLOBAL_RX_FIFO_SIZE;
-    USB_OTG_FS->DIEPTXF0_HNPTXFSIZ = (USB_EP0_TX_FIFO_SIZE
-                                      << USB_OTG_DIEPTXF_INEPTXFD_Pos);
+    ALLEGE(usb_fifo_alloc_tx(0, USB_EP0_TX_FIFO_WORDS));
 
-    USB_OTG_FS->GCCFG |= USB_OTG_GCCFG_PWRDWN;
-    USB_OTG_FS->GAHBCFG |= USB_OTG_GAHBCFG_GINT;
+    USB_REG_SET(USB_OTG_FS, GCCFG, USB_OTG_GCCFG_PWRDWN);
+    USB_REG_SET(USB_OTG_FS, GAHBCFG, USB_OTG_GAHBCFG_GINT);
 
-    USB_OTG_PCGCCTL &= ~(USB_OTG_PCGCR_STPPCLK | USB_OTG_PCGCR_GATEHCLK);
-    USB_OTG_DEVICE->DCTL &= ~(USB_OTG_DCTL_SDIS);
+    USB_REG_CLR(USB_OTG_PCGC, PCGCCTL, (USB_OTG_PCGCR_STPPCLK | USB_OTG_PCGCR_GATEHCLK));
+    USB_REG_CLR(USB_OTG_DEVICE, DCTL, USB_OTG_DCTL_SDIS);
 }
 
 /**
@@ -239,11 +756,11 @@ device_init(usb_init_t *init)
 static void
 core_soft_reset(void)
 {
-    while (!(USB_OTG_FS->GRSTCTL & USB_OTG_GRSTCTL_AHBIDL));
+    while (!(USB_REG_RD(USB_OTG_FS, GRSTCTL) & USB_OTG_GRSTCTL_AHBIDL));
 
-    USB_OTG_FS->GRSTCTL |= USB_OTG_GRSTCTL_CSRST;
+    USB_REG_SET(USB_OTG_FS, GRSTCTL, USB_OTG_GRSTCTL_CSRST);
 
-    while (USB_OTG_FS->GRSTCTL & USB_OTG_GRSTCTL_CSRST);
+    while (USB_REG_RD(USB_OTG_FS, GRSTCTL) & USB_OTG_GRSTCTL_CSRST);
 }
 
 /**
@@ -253,46 +770,103 @@ core_soft_reset(void)
 static void
 force_device_mode(void)
 {
-    USB_OTG_FS->GUSBCFG &= ~(USB_OTG_GUSBCFG_FDMOD |
-                                USB_OTG_GUSBCFG_FHMOD);
-    USB_OTG_FS->GUSBCFG |= USB_OTG_GUSBCFG_FDMOD;
+    USB_REG_MOD(USB_OTG_FS, GUSBCFG, (USB_OTG_GUSBCFG_FDMOD | USB_OTG_GUSBCFG_FHMOD),
+                USB_OTG_GUSBCFG_FDMOD);
 
-    while(USB_OTG_FS->GINTSTS & USB_OTG_GINTSTS_CMOD);
+    while(USB_REG_RD(USB_OTG_FS, GINTSTS) & USB_OTG_GINTSTS_CMOD);
 }
 
 /**
- * @brief Reset endpoints.
+ * @brief Set up the state of a new IN transfer and program its first chunk.
  */
 static void
-reset_endpoints(void)
+start_transfer(uint32_t ep_num, const usb_fifo_seg_t *p_segs, uint32_t len, bool zlp)
 {
-    USB_OTG_DEVICE->DIEPMSK = 0U;
-    USB_OTG_DEVICE->DOEPMSK = 0U;
-    USB_OTG_DEVICE->DAINTMSK = 0U;
+    usb_ep_t *p_ep = &p_usb_driver->ep_in[ep_num];
+
+    p_ep->tx_segs = p_segs;
+    p_ep->tx_cursor.p_seg = p_segs;
+    p_ep->tx_cursor.offset = 0;
+    p_ep->tx_len = len;
+    p_ep->tx_count = 0;
+    p_ep->tx_queued = 0;
+    p_ep->tx_zlp = zlp && (len != 0) && ((len % p_ep->max_packet_size) == 0);
+    p_ep->state = USB_EP_STATE_BUSY;
+
+    USB_TRACE_DBG(USB_TRACE_EV_TX_START, ep_num, len);
+    start_tx_chunk(ep_num);
+}
 
-    if (USB_EP_IN(0)->DIEPCTL & USB_OTG_DIEPCTL_EPENA)
-    {
-        USB_EP_IN(0)->DIEPCTL |= USB_OTG_DIEPCTL_SNAK;
-    }
-    else
+/**
+ * @brief Program the next chunk of the current IN transfer.
+ *        EP0 has a 7 bit XFRSIZ and 2 bit PKTCNT, the other endpoints 19 and
+ *        10 bits. A chunk that is not the last one has to be a whole number
+ *        of packets, otherwise the host would see a short packet early.
+ */
+static void
+start_tx_chunk(uint32_t ep_num)
+{
+    usb_ep_t *p_ep = &p_usb_driver->ep_in[ep_num];
+    uint32_t mps = p_ep->max_packet_size;
+    uint32_t max_xfrsiz = (ep_num == 0) ? 0x7FU : 0x7FFFFU;
+    uint32_t max_pktcnt = (ep_num == 0) ? 0x3U : 0x3FFU;
+    uint32_t max_chunk = MIN((max_xfrsiz / mps), max_pktcnt) * mps;
+    uint32_t chunk = MIN(p_ep->tx_len - p_ep->tx_queued, max_chunk);
+    uint32_t pktcnt = (chunk + mps - 1U) / mps;
+
+    if (chunk == 0)
     {
-        USB_EP_IN(0)->DIEPCTL = 0U;
+        // Zero length packet, either requested or owed after the data
+        pktcnt = 1U;
+        p_ep->tx_zlp = false;
     }
 
-    USB_EP_IN(0)->DIEPTSIZ = 0U;
-    USB_EP_IN(0)->DIEPINT = 0xFB7FU;
+    USB_REG_WR(USB_EP_IN(ep_num), DIEPTSIZ, ((pktcnt << USB_OTG_DIEPTSIZ_PKTCNT_Pos) |
+                                             (chunk << USB_OTG_DIEPTSIZ_XFRSIZ_Pos)));
+    USB_REG_SET(USB_EP_IN(ep_num), DIEPCTL, (USB_OTG_DIEPCTL_CNAK | USB_OTG_DIEPCTL_EPENA));
+    p_ep->tx_queued += chunk;
 
-    if (USB_EP_OUT(0)->DOEPCTL & USB_OTG_DOEPCTL_EPENA)
+    if (chunk != 0)
     {
-        USB_EP_OUT(0)->DOEPCTL |= USB_OTG_DOEPCTL_SNAK;
-    }
-    else
-    {
-        USB_EP_OUT(0)->DOEPCTL = 0U;
+        usb_ep_tx_fifo_empty(ep_num);
     }
+}
+
+/**
+ * @brief Write the next packet of the transfer into the TX FIFO of an
+ *        endpoint, from wherever tx_cursor stands.
+ */
+static void
+write_packet(uint32_t ep_num, uint32_t len)
+{
+    usb_fifo_push_gather(&USB_OTG_DFIFO(ep_num), &p_usb_driver->ep_in[ep_num].tx_cursor, len);
+    USB_TRACE_DBG(USB_TRACE_EV_TX_WRITE, ep_num, len);
+}
+
+/**
+ * @brief Reset endpoints.
+ */
+static void
+reset_endpoints(void)
+{
+    USB_SHADOW_WR(USB_OTG_DEVICE, DIEPMSK, 0U);
+    USB_SHADOW_WR(USB_OTG_DEVICE, DOEPMSK, 0U);
+    USB_SHADOW_WR(USB_OTG_DEVICE, DAINTMSK, 0U);
+
+    // Write back what was read, with SNAK, rather than read again
+    uint32_t diepctl = USB_REG_RD(USB_EP_IN(0), DIEPCTL);
+    USB_REG_WR(USB_EP_IN(0), DIEPCTL, (diepctl & USB_OTG_DIEPCTL_EPENA)
+                                      ? (diepctl | USB_OTG_DIEPCTL_SNAK) : 0U);
+
+    USB_REG_WR(USB_EP_IN(0), DIEPTSIZ, 0U);
+    usb_reg_ack_diepint(0, 0xFB7FU);
+
+    uint32_t doepctl = USB_REG_RD(USB_EP_OUT(0), DOEPCTL);
+    USB_REG_WR(USB_EP_OUT(0), DOEPCTL, (doepctl & USB_OTG_DOEPCTL_EPENA)
+                                       ? (doepctl | USB_OTG_DOEPCTL_SNAK) : 0U);
 
-    USB_EP_OUT(0)->DOEPTSIZ = 0U;
-    USB_EP_OUT(0)->DOEPINT = 0xFB7FU;
+    USB_REG_WR(USB_EP_OUT(0), DOEPTSIZ, 0U);
+    usb_reg_ack_doepint(0, 0xFB7FU);
 }
 
 /*** end of file ***/
\ No newline at end of file
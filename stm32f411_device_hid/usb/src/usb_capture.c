@@ -0,0 +1,85 @@
+/** @file usb_capture.c
+ *
+ * @brief Device side capture of completed USB transactions.
+ */
+
+#include "stm32f411xe.h"
+
+#include "usb_capture.h"
+#include "usb_internal.h"
+
+#define THIS_FILE__ "usb_capture.c"
+
+_Static_assert((USB_CAPTURE_BUF_SIZE & (USB_CAPTURE_BUF_SIZE - 1U)) == 0U,
+               "USB_CAPTURE_BUF_SIZE has to be a power of two");
+_Static_assert((USB_CAPTURE_DATA_BYTES % 4U) == 0U,
+               "USB_CAPTURE_DATA_BYTES has to be a multiple of 4");
+_Static_assert(USB_CAPTURE_DATA_BYTES <= 0xFFU,
+               "USB_CAPTURE_DATA_BYTES does not fit the captured field");
+
+usb_capture_buf_t usb_capture_buf = {
+    .magic = USB_CAPTURE_MAGIC,
+    .size = USB_CAPTURE_BUF_SIZE,
+    .head = 0U,
+    .data_bytes = USB_CAPTURE_DATA_BYTES
+};
+
+/**
+ * @brief Record a transaction from a single buffer.
+ *
+ * @param p_data Data of the transaction, NULL if it was not kept.
+ */
+void
+usb_capture_record(uint32_t kind, uint32_t ep_addr, const uint8_t *p_data, uint32_t len)
+{
+    usb_fifo_seg_t seg = { .p_data = p_data, .len = len };
+
+    usb_capture_record_segs(kind, ep_addr, (p_data != NULL) ? &seg : NULL, len);
+}
+
+/**
+ * @brief Record a transaction.
+ *
+ * Safe to call from any context, the slot is claimed and published like in
+ * usb_trace_record. Only the first USB_CAPTURE_DATA_BYTES are copied, from
+ * as many segments as it takes.
+ *
+ * @param kind    One of enum usb_capture_kind_e.
+ * @param ep_addr Endpoint address, bit 7 set for IN.
+ * @param p_segs  Data of the transaction, covering len bytes, NULL if it
+ *                was not kept.
+ * @param len     Bytes moved.
+ */
+void
+usb_capture_record_segs(uint32_t kind, uint32_t ep_addr, const usb_fifo_seg_t *p_segs, uint32_t len)
+{
+    usb_driver_t *p_driver = usb_get_instance();
+    const usb_ep_t *p_ep = (ep_addr & 0x80U) ? &p_driver->ep_in[ep_addr & 0x0FU]
+                                             : &p_driver->ep_out[ep_addr & 0x0FU];
+    uint32_t idx = __atomic_fetch_add(&usb_capture_buf.head, 1U, __ATOMIC_RELAXED);
+    usb_capture_entry_t *p_entry = &usb_capture_buf.entries[idx & (USB_CAPTURE_BUF_SIZE - 1U)];
+    uint32_t captured = 0;
+
+    p_entry->timestamp = DWT->CYCCNT;
+    p_entry->kind = (uint8_t)kind;
+    p_entry->ep = (uint8_t)ep_addr;
+    p_entry->len = len;
+    p_entry->frame = (uint16_t)p_driver->sof_frame;
+    p_entry->ep_type = (uint8_t)p_ep->type;
+
+    uint32_t wanted = MIN(len, USB_CAPTURE_DATA_BYTES);
+    while ((p_segs != NULL) && (captured < wanted))
+    {
+        uint32_t part = MIN(p_segs->len, wanted - captured);
+        for (uint32_t i = 0; i < part; i++)
+        {
+            p_entry->data[captured++] = p_segs->p_data[i];
+        }
+        p_segs++;
+    }
+    p_entry->captured = (uint8_t)captured;
+    __atomic_signal_fence(__ATOMIC_RELEASE);
+    p_entry->seq = (uint16_t)idx;
+}
+
+/*** end of file ***/
\ No newline at end of file
@@ -0,0 +1,225 @@
+/** @file usb_cdc.c
+ *
+ * @brief CDC-ACM console on the bulk stream.
+ *
+ * The communication interface only answers the ACM line requests, the
+ * data interface is the bulk stream of usb_stream.c. Console writes are
+ * copied into its IN ring and leave from there at the pace of the host,
+ * so printf costs a copy instead of a debugger round trip. Output written
+ * before a host opened the port stays in the ring until it is read or
+ * pushed out by newer output being dropped.
+ *
+ * The notification endpoint is declared because hosts expect it, no
+ * SERIAL_STATE notification is ever sent.
+ */
+
+#include "usb_cdc.h"
+#include "usb_stream.h"
+#include "usb_internal.h"
+#include "usb_trace.h"
+
+#ifdef USB_DESC_INTERFACE_CDC_COMM
+
+#define THIS_FILE__ "usb_cdc.c"
+
+#define CDC_BLOCK_TIMEOUT_CYCLES    (USB_CDC_BLOCK_TIMEOUT_MS * USB_FRAME_CYCLES)
+
+_Static_assert(USB_CDC_COMM_INTERFACE == USB_DESC_INTERFACE_CDC_COMM,
+               "USB_CDC_COMM_INTERFACE does not match usb_desc.json");
+_Static_assert(sizeof(usb_cdc_line_coding_t) == 7U, "line coding is 7 bytes on the wire");
+
+/**
+ * @brief Console state.
+ *
+ * line_coding_rx takes the SET_LINE_CODING data stage, it is only copied
+ * to line_coding once complete.
+ */
+typedef struct usb_cdc_s
+{
+    usb_cdc_line_coding_t line_coding;
+    usb_cdc_line_coding_t line_coding_rx;
+    volatile uint8_t control_lines;
+    usb_cdc_overflow_t overflow;
+    usb_cdc_stats_t stats;
+} usb_cdc_t;
+
+static bool line_coding_received(usb_driver_t *p_driver, uint32_t len);
+static bool can_block(void);
+
+static usb_cdc_t cdc = {
+    .line_coding = { .rate = 115200U, .stop_bits = 0U, .parity = 0U, .data_bits = 8U },
+    .overflow = USB_CDC_OVERFLOW_DROP
+};
+
+
+/*##########################################################################*/
+/*#                            PUBLIC FUNCTIONS                            #*/
+/*##########################################################################*/
+
+/**
+ * @brief Register the class requests for a new configuration.
+ *        Called after SET_CONFIGURATION opened the endpoints. The port
+ *        counts as closed until the host sets DTR again.
+ */
+void
+usb_cdc_configure(usb_driver_t *p_driver)
+{
+    (void)p_driver;
+
+    cdc.control_lines = 0;
+    usb_setup_register_class(USB_CDC_COMM_INTERFACE, usb_cdc_class_request);
+}
+
+/**
+ * @brief CDC class request handler.
+ *
+ * @return false if the request is not handled.
+ */
+bool
+usb_cdc_class_request(usb_driver_t *p_driver, const usb_setup_packet_t *p_setup)
+{
+    (void)p_driver;
+
+    if (p_setup->index != USB_CDC_COMM_INTERFACE)
+    {
+        return false;
+    }
+
+    switch ((enum usb_cdc_request_e)p_setup->request)
+    {
+        case USB_CDC_REQUEST_SET_LINE_CODING:
+            if (p_setup->length != sizeof(cdc.line_coding_rx))
+            {
+                return false;
+            }
+            usb_ep0_receive((uint8_t *)&cdc.line_coding_rx, sizeof(cdc.line_coding_rx),
+                            line_coding_received);
+            return true;
+        case USB_CDC_REQUEST_GET_LINE_CODING:
+            usb_ep0_transmit((const uint8_t *)&cdc.line_coding,
+                             MIN(sizeof(cdc.line_coding), p_setup->length), p_setup->length);
+            return true;
+        case USB_CDC_REQUEST_SET_CONTROL_LINE_STATE:
+            cdc.control_lines = (uint8_t)(p_setup->value &
+                                          (USB_CDC_CONTROL_LINE_DTR | USB_CDC_CONTROL_LINE_RTS));
+            USB_TRACE_INFO(USB_TRACE_EV_CDC_CONTROL_LINES,
+                           !!(cdc.control_lines & USB_CDC_CONTROL_LINE_DTR),
+                           !!(cdc.control_lines & USB_CDC_CONTROL_LINE_RTS));
+            usb_ep0_transmit(NULL, 0, 0);
+            return true;
+        case USB_CDC_REQUEST_SEND_BREAK:
+            usb_ep0_transmit(NULL, 0, 0);
+            return true;
+        default:
+            return false;
+    }
+}
+
+/**
+ * @brief Whether a terminal has the port open, i.e. the host set DTR.
+ */
+bool
+usb_cdc_connected(void)
+{
+    return (cdc.control_lines & USB_CDC_CONTROL_LINE_DTR) != 0U;
+}
+
+/**
+ * @brief Select what console writes do when the IN ring is full.
+ */
+void
+usb_cdc_set_overflow(usb_cdc_overflow_t overflow)
+{
+    cdc.overflow = overflow;
+}
+
+/**
+ * @brief Console write, see usb_cdc_overflow_t for a full ring.
+ *        Safe to call from interrupts, where it never blocks.
+ *
+ * @return Number of bytes queued, the rest was dropped.
+ */
+uint32_t
+usb_cdc_write(const uint8_t *p_src, uint32_t len)
+{
+    uint32_t written = usb_stream_write(p_src, len);
+
+    if ((written < len) && (cdc.overflow == USB_CDC_OVERFLOW_BLOCK) && can_block())
+    {
+        uint32_t start = DWT->CYCCNT;
+
+        cdc.stats.blocked++;
+        while ((written < len) && usb_cdc_connected() &&
+               ((DWT->CYCCNT - start) < CDC_BLOCK_TIMEOUT_CYCLES))
+        {
+            // With deferred processing the ring only drains through usb_poll
+            usb_poll();
+            written += usb_stream_write(&p_src[written], len - written);
+        }
+        if (written < len)
+        {
+            cdc.stats.timeouts++;
+        }
+    }
+
+    uint32_t primask = usb_critical_enter();
+    cdc.stats.written += written;
+    cdc.stats.dropped += len - written;
+    usb_critical_exit(primask);
+    return written;
+}
+
+/**
+ * @brief Console counters.
+ */
+const usb_cdc_stats_t *
+usb_cdc_get_stats(void)
+{
+    return &cdc.stats;
+}
+
+
+/*##########################################################################*/
+/*#                       STATIC (PRIVATE) FUNCTIONS                       #*/
+/*##########################################################################*/
+
+/**
+ * @brief SET_LINE_CODING data stage completion.
+ *
+ * @return false if the host sent less than a whole line coding.
+ */
+static bool
+line_coding_received(usb_driver_t *p_driver, uint32_t len)
+{
+    (void)p_driver;
+
+    if (len != sizeof(cdc.line_coding_rx))
+    {
+        return false;
+    }
+    cdc.line_coding = cdc.line_coding_rx;
+    USB_TRACE_INFO(USB_TRACE_EV_CDC_LINE_CODING, cdc.line_coding.rate,
+                   (cdc.line_coding.data_bits << 16) | (cdc.line_coding.parity << 8) |
+                   cdc.line_coding.stop_bits);
+    return true;
+}
+
+/**
+ * @brief Whether a console write may wait for the host.
+ *        Not from an interrupt or with interrupts masked, the ring could
+ *        only drain through the code that is waiting, and not from a class
+ *        callback inside usb_poll, which the wait loop calls itself.
+ */
+static bool
+can_block(void)
+{
+    return (__get_IPSR() == 0U) &&
+           (__get_PRIMASK() == 0U) &&
+           !usb_poll_active() &&
+           (usb_get_instance() != NULL) &&
+           (usb_get_instance()->state == USB_STATE_CONFIGURED);
+}
+
+#endif /* USB_DESC_INTERFACE_CDC_COMM */
+
+/*** end of file ***/
\ No newline at end of file
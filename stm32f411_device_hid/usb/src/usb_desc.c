@@ -0,0 +1,51 @@
+/** @file usb_desc.c
+ *
+ * @brief Run time part of the USB descriptors.
+ *
+ * Everything else is generated at build time, see usb_desc.h.
+ */
+
+#include "usb_desc.h"
+
+#define THIS_FILE__ "usb_desc.c"
+
+#ifdef USB_DESC_SERIAL_LEN
+
+#define UID_WORDS   (3U)
+
+_Static_assert(USB_DESC_SERIAL_LEN == (2U + 2U * 8U * UID_WORDS),
+               "serial number string has to hold the UID as hex");
+
+
+/*##########################################################################*/
+/*#                            PUBLIC FUNCTIONS                            #*/
+/*##########################################################################*/
+
+/**
+ * @brief Build the serial number string descriptor from the 96-bit UID.
+ *        The UID is printed as 24 upper case hex digits, UTF-16LE. Called
+ *        once from usb_init, GET_DESCRIPTOR then serves the cached buffer.
+ */
+void
+usb_desc_serial_init(void)
+{
+    const volatile uint32_t *p_uid = (const volatile uint32_t *)UID_BASE;
+    uint8_t *p_char = &usb_desc_serial[2];
+
+    usb_desc_serial[0] = USB_DESC_SERIAL_LEN;
+    usb_desc_serial[1] = USB_DESCRIPTOR_STRING;
+    for (uint32_t word = 0; word < UID_WORDS; word++)
+    {
+        uint32_t uid = p_uid[word];
+        for (int32_t shift = 28; shift >= 0; shift -= 4)
+        {
+            uint32_t nibble = (uid >> shift) & 0x0FU;
+            *p_char++ = (uint8_t)((nibble < 10U) ? ('0' + nibble) : ('A' - 10U + nibble));
+            *p_char++ = 0x00U;
+        }
+    }
+}
+
+#endif /* USB_DESC_SERIAL_LEN */
+
+/*** end of file ***/
\ No newline at end of file
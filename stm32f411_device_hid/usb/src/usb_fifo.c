@@ -0,0 +1,297 @@
+/** @file usb_fifo.c
+ *
+ * @brief Copy routines between memory and the OTG_FS data FIFO.
+ *
+ * Aligned buffers are copied word by word, four words per loop iteration.
+ * Unaligned buffers are copied with aligned word accesses only: the bytes up
+ * to the first word boundary are collected into a carry word and every
+ * following aligned word is shifted and merged with it. The last 1-3 bytes
+ * are assembled with shifts, the FIFO is little endian like the core.
+ *
+ * A gathered packet is pushed segment by segment through the same routine.
+ * Only the word that straddles a segment boundary is assembled by hand, so
+ * a packet built from several buffers never goes through a staging copy.
+ */
+
+#include "usb_fifo.h"
+
+#define THIS_FILE__ "usb_fifo.c"
+
+// Register access, overridden by the host benchmark to model the FIFO
+#ifndef USB_FIFO_WRITE
+#define USB_FIFO_WRITE(p_fifo_, word_)  (*(p_fifo_) = (word_))
+#endif
+#ifndef USB_FIFO_READ
+#define USB_FIFO_READ(p_fifo_)          (*(p_fifo_))
+#endif
+
+// Word access to a byte buffer, exempt from strict aliasing
+typedef uint32_t __attribute__((may_alias)) usb_fifo_word_t;
+
+static inline uint32_t load_tail(const uint8_t *p_src, uint32_t len);
+static inline void store_tail(uint8_t *p_dst, uint32_t word, uint32_t len);
+
+
+/*##########################################################################*/
+/*#                            PUBLIC FUNCTIONS                            #*/
+/*##########################################################################*/
+
+/**
+ * @brief Push a packet into the TX FIFO.
+ *
+ * @param p_fifo FIFO register of the endpoint.
+ * @param p_src  Packet data, any alignment.
+ * @param len    Number of bytes, the last word is zero padded.
+ */
+void
+usb_fifo_push(volatile uint32_t *p_fifo, const uint8_t *p_src, uint32_t len)
+{
+    uint32_t offset = (uintptr_t)p_src & 3U;
+
+    if (offset == 0U)
+    {
+        const usb_fifo_word_t *p_word = (const usb_fifo_word_t *)p_src;
+        uint32_t words = len / 4U;
+
+        for (; words >= 4U; words -= 4U, p_word += 4)
+        {
+            USB_FIFO_WRITE(p_fifo, p_word[0]);
+            USB_FIFO_WRITE(p_fifo, p_word[1]);
+            USB_FIFO_WRITE(p_fifo, p_word[2]);
+            USB_FIFO_WRITE(p_fifo, p_word[3]);
+        }
+        for (; words != 0U; words--)
+        {
+            USB_FIFO_WRITE(p_fifo, *p_word++);
+        }
+        if (len & 3U)
+        {
+            USB_FIFO_WRITE(p_fifo, load_tail((const uint8_t *)p_word, len & 3U));
+        }
+        return;
+    }
+
+    uint32_t head = 4U - offset;
+
+    if (len <= head)
+    {
+        USB_FIFO_WRITE(p_fifo, load_tail(p_src, len));
+        return;
+    }
+
+    // carry holds head bytes, each output word takes 4 - head more
+    uint32_t carry = load_tail(p_src, head);
+    uint32_t shift_up = head * 8U;
+    uint32_t shift_down = 32U - shift_up;
+    const usb_fifo_word_t *p_word = (const usb_fifo_word_t *)(p_src + head);
+    uint32_t remaining = len - head;
+
+    for (; remaining >= 4U; remaining -= 4U)
+    {
+        uint32_t word = *p_word++;
+        USB_FIFO_WRITE(p_fifo, carry | (word << shift_up));
+        carry = word >> shift_down;
+    }
+
+    // head carried bytes plus remaining tail bytes, up to two more words
+    uint32_t tail = load_tail((const uint8_t *)p_word, remaining);
+    USB_FIFO_WRITE(p_fifo, carry | (tail << shift_up));
+    if ((head + remaining) > 4U)
+    {
+        USB_FIFO_WRITE(p_fifo, tail >> shift_down);
+    }
+}
+
+/**
+ * @brief Push a packet gathered from a list of segments into the TX FIFO.
+ *
+ * @param p_fifo   FIFO register of the endpoint.
+ * @param p_cursor Where the packet starts, left where the next one starts.
+ *                 Segments may have any alignment and length, including 0.
+ * @param len      Number of bytes, the segments have to hold at least that
+ *                 many. The last word is zero padded.
+ */
+void
+usb_fifo_push_gather(volatile uint32_t *p_fifo, usb_fifo_cursor_t *p_cursor, uint32_t len)
+{
+    uint32_t carry = 0U;
+    uint32_t carry_bytes = 0U;
+
+    while (len != 0U)
+    {
+        const usb_fifo_seg_t *p_seg = p_cursor->p_seg;
+        const uint8_t *p_src = &p_seg->p_data[p_cursor->offset];
+        uint32_t n = p_seg->len - p_cursor->offset;
+
+        if (n > len)
+        {
+            n = len;
+        }
+        len -= n;
+        p_cursor->offset += n;
+        if (p_cursor->offset == p_seg->len)
+        {
+            p_cursor->p_seg++;
+            p_cursor->offset = 0U;
+        }
+
+        // Complete the word left open by the previous segment
+        if (carry_bytes != 0U)
+        {
+            uint32_t fill = 4U - carry_bytes;
+
+            if (fill > n)
+            {
+                fill = n;
+            }
+            carry |= load_tail(p_src, fill) << (carry_bytes * 8U);
+            carry_bytes += fill;
+            p_src += fill;
+            n -= fill;
+            if (carry_bytes < 4U)
+            {
+                continue;
+            }
+            USB_FIFO_WRITE(p_fifo, carry);
+        }
+
+        // Whole words take the aligned or shifting path of usb_fifo_push
+        uint32_t whole = n & ~3U;
+        if (whole != 0U)
+        {
+            usb_fifo_push(p_fifo, p_src, whole);
+        }
+        carry_bytes = n & 3U;
+        carry = load_tail(&p_src[whole], carry_bytes);
+    }
+
+    if (carry_bytes != 0U)
+    {
+        USB_FIFO_WRITE(p_fifo, carry);
+    }
+}
+
+/**
+ * @brief Pop a packet from the RX FIFO.
+ *
+ * @param p_fifo FIFO register, every endpoint shares the RX FIFO.
+ * @param p_dst  Destination, any alignment.
+ * @param len    Number of bytes as reported by GRXSTSP BCNT.
+ */
+void
+usb_fifo_pop(volatile uint32_t *p_fifo, uint8_t *p_dst, uint32_t len)
+{
+    uint32_t offset = (uintptr_t)p_dst & 3U;
+
+    if (offset == 0U)
+    {
+        usb_fifo_word_t *p_word = (usb_fifo_word_t *)p_dst;
+        uint32_t words = len / 4U;
+
+        for (; words >= 4U; words -= 4U, p_word += 4)
+        {
+            p_word[0] = USB_FIFO_READ(p_fifo);
+            p_word[1] = USB_FIFO_READ(p_fifo);
+            p_word[2] = USB_FIFO_READ(p_fifo);
+            p_word[3] = USB_FIFO_READ(p_fifo);
+        }
+        for (; words != 0U; words--)
+        {
+            *p_word++ = USB_FIFO_READ(p_fifo);
+        }
+        if (len & 3U)
+        {
+            store_tail((uint8_t *)p_word, USB_FIFO_READ(p_fifo), len & 3U);
+        }
+        return;
+    }
+
+    uint32_t head = 4U - offset;
+
+    if (len <= head)
+    {
+        store_tail(p_dst, USB_FIFO_READ(p_fifo), len);
+        return;
+    }
+
+    // Every popped word completes the destination word started by carry
+    // and leaves offset bytes in carry for the next one
+    uint32_t word = USB_FIFO_READ(p_fifo);
+    uint32_t shift_down = head * 8U;
+    uint32_t shift_up = 32U - shift_down;
+    store_tail(p_dst, word, head);
+    uint32_t carry = word >> shift_down;
+    usb_fifo_word_t *p_word = (usb_fifo_word_t *)(p_dst + head);
+    uint32_t remaining = len - head;
+
+    for (; remaining >= 4U; remaining -= 4U)
+    {
+        word = USB_FIFO_READ(p_fifo);
+        *p_word++ = carry | (word << shift_up);
+        carry = word >> shift_down;
+    }
+
+    // carry holds offset bytes, pop one more word only if more are owed
+    if (remaining > offset)
+    {
+        carry |= (USB_FIFO_READ(p_fifo) << shift_up);
+    }
+    store_tail((uint8_t *)p_word, carry, remaining);
+}
+
+/**
+ * @brief Drop a packet from the RX FIFO.
+ *
+ * @param p_fifo FIFO register.
+ * @param len    Number of bytes as reported by GRXSTSP BCNT.
+ */
+void
+usb_fifo_discard(volatile uint32_t *p_fifo, uint32_t len)
+{
+    for (uint32_t words = (len + 3U) / 4U; words != 0U; words--)
+    {
+        (void)USB_FIFO_READ(p_fifo);
+    }
+}
+
+
+/*##########################################################################*/
+/*#                       STATIC (PRIVATE) FUNCTIONS                       #*/
+/*##########################################################################*/
+
+/**
+ * @brief Assemble 0-4 bytes into the low end of a word.
+ */
+static inline uint32_t
+load_tail(const uint8_t *p_src, uint32_t len)
+{
+    uint32_t word = 0U;
+
+    switch (len)
+    {
+        case 4U: word |= (uint32_t)p_src[3] << 24; /* fall through */
+        case 3U: word |= (uint32_t)p_src[2] << 16; /* fall through */
+        case 2U: word |= (uint32_t)p_src[1] << 8;  /* fall through */
+        case 1U: word |= (uint32_t)p_src[0];       /* fall through */
+        default: break;
+    }
+    return word;
+}
+
+/**
+ * @brief Store the low 0-4 bytes of a word.
+ */
+static inline void
+store_tail(uint8_t *p_dst, uint32_t word, uint32_t len)
+{
+    switch (len)
+    {
+        case 4U: p_dst[3] = (uint8_t)(word >> 24); /* fall through */
+        case 3U: p_dst[2] = (uint8_t)(word >> 16); /* fall through */
+        case 2U: p_dst[1] = (uint8_t)(word >> 8);  /* fall through */
+        case 1U: p_dst[0] = (uint8_t)word;         /* fall through */
+        default: break;
+    }
+}
+
+/*** end of file ***/
\ No newline at end of file
@@ -0,0 +1,380 @@
+/** @file usb_hid.c
+ *
+ * @brief HID report path on the interrupt IN endpoint.
+ *
+ * Reports are copied into one of two slots, so the caller never waits for
+ * the host. The slot at head is the one on the bus, the other one holds the
+ * next report and is started from the XFRC callback of the previous one.
+ *
+ * With a report source registered the driver also learns when the host
+ * polls EP1: the XFRC of a report that was loaded in an earlier frame gives
+ * the poll frame and the cycles after SOF it came at. Once the poll period
+ * is known usb_hid_sof builds the report in the SOF interrupt of the poll
+ * frame, or of the frame before if the poll comes too early in the frame to
+ * build and load in time, so the host always gets the state of the last
+ * possible moment.
+ */
+
+#include "usb_hid.h"
+#include "usb_internal.h"
+#include "usb_trace.h"
+
+#define THIS_FILE__ "usb_hid.c"
+
+/**
+ * @brief Report queue.
+ */
+typedef struct usb_hid_queue_s
+{
+    uint8_t report[USB_HID_QUEUE_SLOTS][USB_HID_REPORT_MAX_SIZE] __attribute__((aligned(4)));
+    uint8_t get_report[USB_HID_REPORT_MAX_SIZE] __attribute__((aligned(4)));
+    uint32_t len[USB_HID_QUEUE_SLOTS];
+    bool scheduled[USB_HID_QUEUE_SLOTS];
+    uint32_t head;
+    usb_hid_stats_t stats;
+    uint8_t protocol;
+    uint8_t idle_rate;
+} usb_hid_queue_t;
+
+/**
+ * @brief SOF scheduler state.
+ *
+ * load_frame is the frame the report on the bus was loaded in, poll_frame
+ * the last poll observed and expected_frame the poll a scheduled report is
+ * aimed at. lead_cycles is the worst build and load time seen so far.
+ */
+typedef struct usb_hid_sched_s
+{
+    usb_hid_report_source_t source;
+    uint32_t load_frame;
+    uint32_t poll_frame;
+    uint32_t expected_frame;
+    uint32_t lead_cycles;
+    uint32_t samples;
+    bool in_flight_scheduled;
+} usb_hid_sched_t;
+
+static bool queue_report(const uint8_t *p_report, uint32_t len, bool scheduled);
+static void report_in_callback(usb_driver_t *p_driver, uint32_t ep_num, uint32_t status);
+static void learn_poll(const usb_ep_t *p_ep);
+static void start_report(void);
+
+static usb_hid_queue_t hid_queue;
+static usb_hid_sched_t hid_sched;
+
+
+/*##########################################################################*/
+/*#                            PUBLIC FUNCTIONS                            #*/
+/*##########################################################################*/
+
+/**
+ * @brief Reset the report queue for a new configuration.
+ *        Called after SET_CONFIGURATION opened the endpoints.
+ */
+void
+usb_hid_configure(usb_driver_t *p_driver)
+{
+    (void)p_driver;
+
+    uint32_t primask = usb_critical_enter();
+    hid_queue.head = 0;
+    hid_queue.stats.depth = 0;
+    usb_critical_exit(primask);
+    hid_queue.protocol = USB_HID_PROTOCOL_REPORT;
+    hid_queue.idle_rate = 0;
+    hid_sched.samples = 0;
+    hid_queue.stats.poll_period = 0;
+
+    usb_ep_set_callback(USB_HID_REPORT_EP, report_in_callback);
+    usb_setup_register_class(USB_HID_INTERFACE, usb_hid_class_request);
+}
+
+/**
+ * @brief Queue a report for the next IN transaction, never blocks.
+ *        Starts the transfer right away when the endpoint is idle.
+ *
+ * @param p_report Report, copied before returning.
+ * @param len      Report length including the report ID.
+ *
+ * @return false if the report was dropped.
+ */
+bool
+usb_hid_send_report(const uint8_t *p_report, uint32_t len)
+{
+    return queue_report(p_report, len, false);
+}
+
+/**
+ * @brief Register the function that builds reports for the SOF scheduler
+ *        and GET_REPORT.
+ */
+void
+usb_hid_set_report_source(usb_hid_report_source_t source)
+{
+    hid_sched.source = source;
+}
+
+/**
+ * @brief Whether the SOF scheduler has learned the poll timing and builds
+ *        reports itself. The report source should not send on its own then.
+ */
+bool
+usb_hid_sof_active(void)
+{
+    return (hid_sched.source != NULL) &&
+           (hid_sched.samples >= USB_HID_SOF_MIN_SAMPLES) &&
+           (hid_queue.stats.poll_period != 0U);
+}
+
+/**
+ * @brief SOF hook, called from the SOF interrupt.
+ *        Builds and loads the report when the host polls in this frame, or
+ *        in the next one early enough that it has to be done now.
+ */
+void
+usb_hid_sof(usb_driver_t *p_driver)
+{
+    usb_hid_stats_t *p_stats = &hid_queue.stats;
+
+    if (!usb_hid_sof_active() || (p_stats->depth != 0U) ||
+        (p_driver->ep_in[USB_HID_REPORT_EP & 0x0FU].state != USB_EP_STATE_IDLE))
+    {
+        return;
+    }
+
+    uint32_t frame = p_driver->sof_frame;
+    uint32_t since_poll = (frame - hid_sched.poll_frame) & USB_FRAME_MASK;
+    uint32_t to_poll = (p_stats->poll_period - (since_poll % p_stats->poll_period))
+                        % p_stats->poll_period;
+    bool early_poll = (p_stats->poll_offset <= hid_sched.lead_cycles);
+
+    if (!((to_poll == 0U) && !early_poll) && !((to_poll == 1U) && early_poll))
+    {
+        return;
+    }
+
+    uint8_t report[USB_HID_REPORT_MAX_SIZE];
+    uint32_t start = DWT->CYCCNT;
+    uint32_t len = hid_sched.source(report, false);
+    if (len == 0U)
+    {
+        return;
+    }
+
+    hid_sched.expected_frame = (frame + to_poll) & USB_FRAME_MASK;
+    if (queue_report(report, len, true))
+    {
+        p_stats->sof_builds++;
+    }
+    hid_sched.lead_cycles = MAX(hid_sched.lead_cycles,
+                                (DWT->CYCCNT - start) + USB_HID_SOF_MARGIN_CYCLES);
+}
+
+/**
+ * @brief Report counters.
+ */
+const usb_hid_stats_t *
+usb_hid_get_stats(void)
+{
+    return &hid_queue.stats;
+}
+
+
+/*##########################################################################*/
+/*#                       STATIC (PRIVATE) FUNCTIONS                       #*/
+/*##########################################################################*/
+
+/**
+ * @brief Copy a report into a free slot, starting it if the endpoint is idle.
+ *
+ * @param scheduled Built by the SOF scheduler, checked against its poll.
+ *
+ * @return false if the report was dropped.
+ */
+static bool
+queue_report(const uint8_t *p_report, uint32_t len, bool scheduled)
+{
+    REQUIRE(len <= USB_HID_REPORT_MAX_SIZE);
+    usb_driver_t *p_driver = usb_get_instance();
+    usb_hid_stats_t *p_stats = &hid_queue.stats;
+    bool queued = false;
+
+    uint32_t primask = usb_critical_enter();
+    if ((p_driver->ep_in[USB_HID_REPORT_EP & 0x0FU].state != USB_EP_STATE_DISABLED) &&
+        (p_stats->depth < USB_HID_QUEUE_SLOTS))
+    {
+        uint32_t slot = (hid_queue.head + p_stats->depth) % USB_HID_QUEUE_SLOTS;
+        memcpy(hid_queue.report[slot], p_report, len);
+        hid_queue.len[slot] = len;
+        hid_queue.scheduled[slot] = scheduled;
+        p_stats->depth++;
+        p_stats->queued++;
+        p_stats->depth_high_water = MAX(p_stats->depth_high_water, p_stats->depth);
+        if (p_stats->depth == 1U)
+        {
+            start_report();
+        }
+        queued = true;
+    }
+    else
+    {
+        p_stats->dropped++;
+    }
+    usb_critical_exit(primask);
+
+    if (!queued)
+    {
+        USB_TRACE_ERR(USB_TRACE_EV_HID_REPORT_DROPPED, p_stats->depth, p_stats->dropped);
+    }
+    return queued;
+}
+
+/**
+ * @brief HID class request handler.
+ *        GET/SET_PROTOCOL switch between the boot keyboard report and the
+ *        report protocol one of the report descriptor. SET_IDLE is accepted and
+ *        stored, reports are only ever sent on change. GET_REPORT answers with
+ *        the input report of the current state in the active protocol.
+ *
+ * @return false if the request is not handled.
+ */
+bool
+usb_hid_class_request(usb_driver_t *p_driver, const usb_setup_packet_t *p_setup)
+{
+    (void)p_driver;
+
+    if (p_setup->index != USB_HID_INTERFACE)
+    {
+        return false;
+    }
+
+    switch ((enum usb_hid_request_e)p_setup->request)
+    {
+        case USB_HID_REQUEST_GET_REPORT:
+        {
+            // Input report only, the reports have no report ID
+            if ((hid_sched.source == NULL) ||
+                (p_setup->detailed.value_h != USB_HID_REPORT_TYPE_INPUT) ||
+                (p_setup->detailed.value_l != 0U))
+            {
+                return false;
+            }
+            uint32_t len = hid_sched.source(hid_queue.get_report, true);
+            usb_ep0_transmit(hid_queue.get_report, len, p_setup->length);
+            return true;
+        }
+        case USB_HID_REQUEST_GET_PROTOCOL:
+            usb_ep0_transmit(&hid_queue.protocol, 1, p_setup->length);
+            return true;
+        case USB_HID_REQUEST_SET_PROTOCOL:
+            if (p_setup->value > USB_HID_PROTOCOL_REPORT)
+            {
+                return false;
+            }
+            hid_queue.protocol = (uint8_t)p_setup->value;
+            USB_TRACE_INFO(USB_TRACE_EV_HID_PROTOCOL, hid_queue.protocol, 0);
+            usb_ep0_transmit(NULL, 0, 0);
+            return true;
+        case USB_HID_REQUEST_GET_IDLE:
+            usb_ep0_transmit(&hid_queue.idle_rate, 1, p_setup->length);
+            return true;
+        case USB_HID_REQUEST_SET_IDLE:
+            hid_queue.idle_rate = p_setup->detailed.value_h;
+            usb_ep0_transmit(NULL, 0, 0);
+            return true;
+        default:
+            return false;
+    }
+}
+
+/**
+ * @brief Protocol selected by the host.
+ */
+usb_hid_protocol_t
+usb_hid_get_protocol(void)
+{
+    return (usb_hid_protocol_t)hid_queue.protocol;
+}
+
+/**
+ * @brief Report endpoint callback.
+ *        Retires the report that was on the bus and loads the next one.
+ */
+static void
+report_in_callback(usb_driver_t *p_driver, uint32_t ep_num, uint32_t status)
+{
+    if (!(status & USB_OTG_DIEPINT_XFRC))
+    {
+        return;
+    }
+
+    uint32_t primask = usb_critical_enter();
+    if (hid_queue.stats.depth != 0U)
+    {
+        learn_poll(&p_driver->ep_in[ep_num]);
+        hid_queue.head = (hid_queue.head + 1U) % USB_HID_QUEUE_SLOTS;
+        hid_queue.stats.depth--;
+        hid_queue.stats.sent++;
+        if (hid_queue.stats.depth != 0U)
+        {
+            start_report();
+        }
+    }
+    usb_critical_exit(primask);
+}
+
+/**
+ * @brief Learn the host poll timing from the XFRC of the report at head.
+ *        Only a report loaded in an earlier frame than its XFRC waited for
+ *        the poll, otherwise the XFRC time says more about the load time.
+ *        The period is the shortest gap between two observed polls.
+ */
+static void
+learn_poll(const usb_ep_t *p_ep)
+{
+    usb_hid_stats_t *p_stats = &hid_queue.stats;
+
+    if (hid_queue.scheduled[hid_queue.head] &&
+        (p_ep->xfrc_frame != hid_sched.expected_frame))
+    {
+        // Poll moved, start over
+        p_stats->sof_missed++;
+        p_stats->poll_period = 0;
+        hid_sched.samples = 0;
+        return;
+    }
+    if (p_ep->xfrc_frame == hid_sched.load_frame)
+    {
+        return;
+    }
+
+    if (hid_sched.samples != 0U)
+    {
+        uint32_t gap = (p_ep->xfrc_frame - hid_sched.poll_frame) & USB_FRAME_MASK;
+        if ((gap != 0U) && ((p_stats->poll_period == 0U) || (gap < p_stats->poll_period)))
+        {
+            p_stats->poll_period = gap;
+        }
+        p_stats->poll_offset = (3U * p_stats->poll_offset + p_ep->xfrc_offset) / 4U;
+    }
+    else
+    {
+        p_stats->poll_offset = p_ep->xfrc_offset;
+    }
+    hid_sched.poll_frame = p_ep->xfrc_frame;
+    hid_sched.samples++;
+}
+
+/**
+ * @brief Put the report at head on the bus, has to be called with
+ *        interrupts masked.
+ */
+static void
+start_report(void)
+{
+    hid_sched.load_frame = usb_get_instance()->sof_frame;
+    ALLEGE(usb_ep_transmit(USB_HID_REPORT_EP & 0x0FU, hid_queue.report[hid_queue.head],
+                           hid_queue.len[hid_queue.head], false));
+}
+
+/*** end of file ***/
\ No newline at end of file
@@ -4,35 +4,99 @@
 
 #include "usb.h"
 #include "usb_internal.h"
+#include "usb_reg.h"
+#include "usb_fifo.h"
+#include "usb_hid.h"
+#include "usb_cdc.h"
+#include "usb_stream.h"
 #include "usb_desc.h"
+#include "usb_trace.h"
+#include "usb_capture.h"
 
 #define THIS_FILE__ "usb_isr.c"
 
+static void post_event(usb_driver_t *p_driver, const usb_event_t *p_event);
+static void process_event(usb_driver_t *p_driver, const usb_event_t *p_event);
+static void post_ep_event(usb_driver_t *p_driver, uint32_t ep_num, bool in, uint32_t status);
+static void process_ep_events(usb_driver_t *p_driver);
+static bool event_queue_push(usb_event_queue_t *p_queue, const usb_event_t *p_event);
+static bool event_queue_pop(usb_event_queue_t *p_queue, usb_event_t *p_event);
+
 static void mmis_handler(usb_driver_t *p_driver);
+static void sof_handler(usb_driver_t *p_driver);
+static void usbsusp_handler(usb_driver_t *p_driver);
+static void wkup_handler(usb_driver_t *p_driver);
 static void usbrst_handler(usb_driver_t *p_driver);
 static void enumdne_handler(usb_driver_t *p_driver);
 static void rxflvl_handler(usb_driver_t *p_driver);
-
 static void oepint_handler(usb_driver_t *p_driver);
+static void iepint_handler(usb_driver_t *p_driver);
+
+static void usbrst_process(usb_driver_t *p_driver);
+static void enumdne_process(usb_driver_t *p_driver);
+
+static void oepint_process(usb_driver_t *p_driver, uint32_t ep_num, uint32_t doepint_reg);
 static void oepint_stup_handler(usb_driver_t *p_driver);
 
-static void iepint_handler(usb_driver_t *p_driver);
+static void iepint_process(usb_driver_t *p_driver, uint32_t ep_num, uint32_t diepint_reg);
+
+static bool get_status(usb_driver_t *p_driver, const usb_setup_packet_t *p_setup);
+static bool clear_feature(usb_driver_t *p_driver, const usb_setup_packet_t *p_setup);
+static bool set_feature(usb_driver_t *p_driver, const usb_setup_packet_t *p_setup);
+static bool set_address(usb_driver_t *p_driver, const usb_setup_packet_t *p_setup);
+static bool get_descriptor(usb_driver_t *p_driver, const usb_setup_packet_t *p_setup);
+static bool get_configuration(usb_driver_t *p_driver, const usb_setup_packet_t *p_setup);
+static bool set_configuration(usb_driver_t *p_driver, const usb_setup_packet_t *p_setup);
+static bool get_interface(usb_driver_t *p_driver, const usb_setup_packet_t *p_setup);
+static bool set_interface(usb_driver_t *p_driver, const usb_setup_packet_t *p_setup);
+static bool configure_endpoints(usb_driver_t *p_driver);
 
-static void set_address(uint8_t addr);
-static void get_descriptor(usb_setup_packet_t packet);
+/*
+ * Standard requests by recipient and bRequest, anything left NULL is
+ * STALLed. Class requests go to the handler registered for the interface
+ * in wIndex, vendor requests to the vendor handler. Interface requests for
+ * an interface the configuration does not have are STALLed before that.
+ */
+static const usb_setup_handler_t standard_requests[USB_RECIPIENT_COUNT][USB_BREQUEST_COUNT] = {
+    [USB_RECIPIENT_DEVICE] = {
+        [USB_BREQUEST_GET_STATUS]        = get_status,
+        [USB_BREQUEST_CLEAR_FEATURE]     = clear_feature,
+        [USB_BREQUEST_SET_FEATURE]       = set_feature,
+        [USB_BREQUEST_SET_ADDRESS]       = set_address,
+        [USB_BREQUEST_GET_DESCRIPTOR]    = get_descriptor,
+        [USB_BREQUEST_GET_CONFIGURATION] = get_configuration,
+        [USB_BREQUEST_SET_CONFIGURATION] = set_configuration,
+    },
+    [USB_RECIPIENT_INTERFACE] = {
+        [USB_BREQUEST_GET_STATUS]        = get_status,
+        [USB_BREQUEST_GET_DESCRIPTOR]    = get_descriptor,
+        [USB_BREQUEST_GET_INTERFACE]     = get_interface,
+        [USB_BREQUEST_SET_INTERFACE]     = set_interface,
+    },
+    [USB_RECIPIENT_ENDPOINT] = {
+        [USB_BREQUEST_GET_STATUS]        = get_status,
+        [USB_BREQUEST_CLEAR_FEATURE]     = clear_feature,
+        [USB_BREQUEST_SET_FEATURE]       = set_feature,
+    },
+};
 
-static const void (*gintsts_handlers[])(usb_driver_t *) = {
+static usb_setup_handler_t class_requests[USB_MAX_INTERFACES];
+static usb_setup_handler_t vendor_requests;
+static usb_ep0_rx_handler_t ep0_rx_handler;
+static bool polling;
+
+static void (* const gintsts_handlers[USB_GINTSTS_SOURCES])(usb_driver_t *) = {
     NULL,               /* CMOD */
     mmis_handler,       /* MMIS */
     NULL,               /* OTGINT */
-    NULL,               /* SOF */
+    sof_handler,        /* SOF */
     rxflvl_handler,     /* RXFLVL */
     NULL,               /* NPTXFE */
     NULL,               /* GINNAKEFF */
     NULL,               /* GOUTNAKEFF */
     NULL, NULL,
     NULL,               /* ESUSP */
-    NULL,               /* USBSUSP */
+    usbsusp_handler,    /* USBSUSP */
     usbrst_handler,     /* USBRST */
     enumdne_handler,    /* ENUMDNE */
     NULL,               /* ISOOUTDROP */
@@ -50,13 +114,19 @@ static const void (*gintsts_handlers[])(usb_driver_t *) = {
     NULL,               /* CIDSCHG */
     NULL,               /* DISCINT */
     NULL,               /* SRQINT */
-    NULL                /* WKUINT */
+    wkup_handler        /* WKUINT */
 };
-#define GINTSTS_HANDLERS_SIZE (sizeof(gintsts_handlers) / sizeof(gintsts_handlers[0]))
 
 /**
  * @brief USB interrupt handler.
  *        Detects the source of the interrupt and calls the appropriate handler.
+ *
+ *        Only sources that are both pending and unmasked are visited, lowest
+ *        bit first, by stripping them off one at a time with ctz. Once all
+ *        handlers have run, exactly the visited bits are written back to
+ *        GINTSTS. It is write-1-to-clear, so a read-modify-write would also
+ *        drop events that became pending while we were busy. Read-only bits
+ *        (RXFLVL, IEPINT, OEPINT) ignore the write and clear in their handler.
  */
 void
 usb_irq_handler(void)
@@ -67,34 +137,310 @@ usb_irq_handler(void)
     {
         return;
     }
-    
-    uint32_t gintsts_reg = USB_OTG_FS->GINTSTS;
 
-    for (size_t interrupt = 1; interrupt < GINTSTS_HANDLERS_SIZE; interrupt++)
+    uint32_t pending = USB_REG_RD(USB_OTG_FS, GINTSTS) & USB_SHADOW_RD(GINTMSK);
+    uint32_t serviced = pending;
+
+    p_driver->state_stats.irqs[p_driver->state]++;
+
+    while (pending)
     {
-        if (gintsts_reg & (1 << interrupt))
+        uint32_t interrupt = __builtin_ctz(pending);
+        pending &= (pending - 1U);
+
+        if (gintsts_handlers[interrupt] != NULL)
         {
-            if (gintsts_handlers[interrupt] != NULL)
+            uint32_t start = DWT->CYCCNT;
+            gintsts_handlers[interrupt](p_driver);
+            p_driver->isr_stats.cycles[interrupt] += DWT->CYCCNT - start;
+        }
+        p_driver->isr_stats.count[interrupt]++;
+    }
+
+    usb_reg_ack_gintsts(serviced);
+}
+
+/**
+ * @brief Process events latched by usb_irq_handler.
+ *        Has to be called periodically from the main loop when the driver
+ *        runs with deferred processing, otherwise it returns immediately.
+ *        Queued bus events go first, then the endpoint interrupts latched
+ *        meanwhile, until the interrupt handler left nothing of either.
+ */
+void
+usb_poll(void)
+{
+    usb_driver_t *p_driver = usb_get_instance();
+    usb_event_t event;
+
+    if (p_driver == NULL)
+    {
+        return;
+    }
+
+    uint32_t start = DWT->CYCCNT;
+    bool processed = false;
+    polling = true;
+    for (;;)
+    {
+        if (event_queue_pop(&p_driver->event_queue, &event))
+        {
+            process_event(p_driver, &event);
+        }
+        else if (p_driver->ep_events != 0U)
+        {
+            process_ep_events(p_driver);
+        }
+        else
+        {
+            break;
+        }
+        processed = true;
+    }
+    polling = false;
+    if (processed)
+    {
+        p_driver->isr_stats.poll_cycles += DWT->CYCCNT - start;
+    }
+}
+
+/**
+ * @brief Whether the caller runs inside usb_poll, from a class callback.
+ *        Code that waits for the driver must not call usb_poll from there.
+ */
+bool
+usb_poll_active(void)
+{
+    return polling;
+}
+
+/**
+ * @brief Route class requests addressed to an interface to a class driver.
+ *
+ * @param interface bInterfaceNumber, matched against wIndex.
+ * @param handler   Request handler, NULL to unregister.
+ */
+void
+usb_setup_register_class(uint8_t interface, usb_setup_handler_t handler)
+{
+    REQUIRE(interface < USB_MAX_INTERFACES);
+    class_requests[interface] = handler;
+}
+
+/**
+ * @brief Route vendor requests of any recipient to a handler.
+ */
+void
+usb_setup_register_vendor(usb_setup_handler_t handler)
+{
+    vendor_requests = handler;
+}
+
+/*##########################################################################*/
+/*#                               EVENT QUEUE                              #*/
+/*##########################################################################*/
+
+/**
+ * @brief Hand an event latched by a top half handler to its bottom half.
+ *        With deferred processing the event is queued for usb_poll,
+ *        otherwise it is processed right away in interrupt context.
+ */
+static void
+post_event(usb_driver_t *p_driver, const usb_event_t *p_event)
+{
+    if (!p_driver->deferred_processing)
+    {
+        process_event(p_driver, p_event);
+    }
+    else if (!event_queue_push(&p_driver->event_queue, p_event))
+    {
+        USB_TRACE_ERR(USB_TRACE_EV_EVENT_DROPPED, p_event->type, p_driver->event_queue.dropped);
+    }
+}
+
+/**
+ * @brief Bottom half dispatcher.
+ */
+static void
+process_event(usb_driver_t *p_driver, const usb_event_t *p_event)
+{
+    switch (p_event->type)
+    {
+        case USB_EVENT_USBRST:
+            usbrst_process(p_driver);
+            break;
+        case USB_EVENT_ENUMDNE:
+            enumdne_process(p_driver);
+            break;
+        case USB_EVENT_USBSUSP:
+            usb_set_state(USB_STATE_SUSPENDED);
+            break;
+        case USB_EVENT_WKUP:
+            if (p_driver->state == USB_STATE_SUSPENDED)
             {
-                gintsts_handlers[interrupt](p_driver);
+                usb_set_state(p_driver->resume_state);
             }
-            USB_OTG_FS->GINTSTS |= (1 << interrupt);
+            break;
+        default:
+            ASSERT(0);
+            break;
+    }
+}
+
+/**
+ * @brief Hand the DOEPINT/DIEPINT bits a top half handler acknowledged to
+ *        the bottom half. With deferred processing they are ORed into the
+ *        endpoint and its DAINT bit is set in ep_events, nothing is lost
+ *        however many arrive before usb_poll. A STUP carries the SETUP
+ *        packet rxflvl_handler popped last, a later SETUP does not change
+ *        the one the bottom half gets with it.
+ */
+static void
+post_ep_event(usb_driver_t *p_driver, uint32_t ep_num, bool in, uint32_t status)
+{
+    if (!in && (status & USB_OTG_DOEPINT_STUP))
+    {
+        p_driver->stup_setup[0] = p_driver->rx_setup[0];
+        p_driver->stup_setup[1] = p_driver->rx_setup[1];
+    }
+
+    if (p_driver->deferred_processing)
+    {
+        usb_ep_t *p_ep = in ? &p_driver->ep_in[ep_num] : &p_driver->ep_out[ep_num];
+        p_ep->events |= status;
+        p_driver->ep_events |= in ? (1U << ep_num) : (1U << (ep_num + USB_OTG_DAINT_OEPINT_Pos));
+    }
+    else if (in)
+    {
+        iepint_process(p_driver, ep_num, status);
+    }
+    else
+    {
+        if (status & USB_OTG_DOEPINT_STUP)
+        {
+            p_driver->setup_packet.raw_packet_data[0] = p_driver->stup_setup[0];
+            p_driver->setup_packet.raw_packet_data[1] = p_driver->stup_setup[1];
+        }
+        oepint_process(p_driver, ep_num, status);
+    }
+}
+
+/**
+ * @brief Process the endpoint interrupts latched by post_ep_event, IN
+ *        endpoints first like DAINT orders them. The bits of an endpoint
+ *        are taken with the interrupt masked, together with the SETUP
+ *        packet when they hold a STUP.
+ */
+static void
+process_ep_events(usb_driver_t *p_driver)
+{
+    uint32_t primask = usb_critical_enter();
+    uint32_t pending = p_driver->ep_events;
+    p_driver->ep_events = 0;
+    usb_critical_exit(primask);
+
+    while (pending)
+    {
+        uint32_t bit = __builtin_ctz(pending);
+        pending &= (pending - 1U);
+        bool in = (bit < USB_OTG_DAINT_OEPINT_Pos);
+        uint32_t ep_num = in ? bit : (bit - USB_OTG_DAINT_OEPINT_Pos);
+        usb_ep_t *p_ep = in ? &p_driver->ep_in[ep_num] : &p_driver->ep_out[ep_num];
+
+        primask = usb_critical_enter();
+        uint32_t status = p_ep->events;
+        p_ep->events = 0;
+        if (!in && (status & USB_OTG_DOEPINT_STUP))
+        {
+            p_driver->setup_packet.raw_packet_data[0] = p_driver->stup_setup[0];
+            p_driver->setup_packet.raw_packet_data[1] = p_driver->stup_setup[1];
+        }
+        usb_critical_exit(primask);
+
+        // Nothing left when an earlier round or a bus reset took the bits
+        if (status == 0U)
+        {
+            continue;
+        }
+        if (in)
+        {
+            iepint_process(p_driver, ep_num, status);
+        }
+        else
+        {
+            oepint_process(p_driver, ep_num, status);
         }
     }
+}
 
+/**
+ * @brief Push an event, called only from interrupt context (producer).
+ *
+ * Single producer, single consumer: head is only written here and tail only
+ * in event_queue_pop, both are free running and wrap naturally.
+ *
+ * @return false if the queue is full and the event was dropped.
+ */
+static bool
+event_queue_push(usb_event_queue_t *p_queue, const usb_event_t *p_event)
+{
+    uint32_t head = p_queue->head;
+    uint32_t used = head - __atomic_load_n(&p_queue->tail, __ATOMIC_ACQUIRE);
+
+    if (used >= USB_EVENT_QUEUE_SIZE)
+    {
+        p_queue->dropped++;
+        return false;
+    }
+
+    p_queue->events[head & (USB_EVENT_QUEUE_SIZE - 1U)] = *p_event;
+    __atomic_store_n(&p_queue->head, head + 1U, __ATOMIC_RELEASE);
+
+    if (used + 1U > p_queue->high_water)
+    {
+        p_queue->high_water = used + 1U;
+    }
+    return true;
+}
+
+/**
+ * @brief Pop an event, called only from thread context (consumer).
+ *
+ * @return false if the queue is empty.
+ */
+static bool
+event_queue_pop(usb_event_queue_t *p_queue, usb_event_t *p_event)
+{
+    uint32_t tail = p_queue->tail;
+
+    if (tail == __atomic_load_n(&p_queue->head, __ATOMIC_ACQUIRE))
+    {
+        return false;
+    }
+
+    *p_event = p_queue->events[tail & (USB_EVENT_QUEUE_SIZE - 1U)];
+    __atomic_store_n(&p_queue->tail, tail + 1U, __ATOMIC_RELEASE);
+    return true;
 }
 
 /*##########################################################################*/
-/*#                       GINTSTS INTERRUPT HANDLERS                       #*/
+/*#                  GINTSTS INTERRUPT HANDLERS (TOP HALF)                 #*/
 /*##########################################################################*/
 
+/*
+ * Top half handlers only latch and acknowledge hardware state and post it,
+ * bus events through the event queue, endpoint interrupts latched per
+ * endpoint. They have to stay short and bounded, anything that decodes
+ * requests or touches TX FIFOs belongs to the bottom half.
+ */
+
 /**
  * @brief Mode mismatch interrupt handler.
  */
 static void
 mmis_handler(usb_driver_t *p_driver)
 {
-    printf("MMIS\n");
+    USB_TRACE_ERR(USB_TRACE_EV_MMIS, 0, 0);
     ASSERT(0);
 }
 
@@ -104,32 +450,16 @@ mmis_handler(usb_driver_t *p_driver)
 static void
 usbrst_handler(usb_driver_t *p_driver)
 {
-    printf("USBRST\n");
-    USB_OTG_DEVICE->DCTL &= ~USB_OTG_DCTL_RWUSIG;
-    flush_tx_fifo();
-    USB_EP_IN(0)->DIEPINT = 0xFB7FU;
-    USB_EP_IN(0)->DIEPCTL &= ~(USB_OTG_DIEPCTL_STALL);
-    USB_EP_OUT(0)->DOEPINT = 0xFB7FU;
-    USB_EP_OUT(0)->DOEPCTL &= ~(USB_OTG_DOEPCTL_STALL);
-    USB_EP_OUT(0)->DOEPCTL |= USB_OTG_DOEPCTL_SNAK;
-
-    USB_OTG_DEVICE->DAINTMSK |= 0x10001U;
-
-    USB_OTG_DEVICE->DOEPMSK |= (USB_OTG_DOEPMSK_STUPM    |
-                                USB_OTG_DOEPMSK_XFRCM    |
-                                USB_OTG_DOEPMSK_EPDM     |
-                                USB_OTG_DOEPMSK_OTEPSPRM |
-                                USB_OTG_DOEPMSK_NAKM);
-
-    USB_OTG_DEVICE->DIEPMSK |= (USB_OTG_DIEPMSK_TOM   |
-                                USB_OTG_DIEPMSK_XFRCM |
-                                USB_OTG_DIEPMSK_EPDM);
-
-    USB_OTG_DEVICE->DCFG &= ~(USB_OTG_DCFG_DAD);
+    usb_event_t event = { .type = USB_EVENT_USBRST };
 
-    USB_EP_OUT(0)->DOEPTSIZ |= (USB_OTG_DOEPTSIZ_STUPCNT |
-                                (1 << USB_OTG_DOEPTSIZ_PKTCNT_Pos) |
-                                ((USB_EP0_RX_FIFO_SIZE) << USB_OTG_DOEPTSIZ_XFRSIZ_Pos));
+    // The reset ends every transfer the latched endpoint bits belong to
+    p_driver->ep_events = 0;
+    for (uint32_t ep_num = 0; ep_num < USB_MAX_ENDPOINTS; ep_num++)
+    {
+        p_driver->ep_in[ep_num].events = 0;
+        p_driver->ep_out[ep_num].events = 0;
+    }
+    post_event(p_driver, &event);
 }
 
 /**
@@ -138,284 +468,760 @@ usbrst_handler(usb_driver_t *p_driver)
 static void
 enumdne_handler(usb_driver_t *p_driver)
 {
-    printf("ENUMDNE\n");
-    USB_EP_IN(0)->DIEPCTL &= ~(USB_OTG_DIEPCTL_MPSIZ);
-    USB_EP_OUT(0)->DOEPCTL &= ~(USB_OTG_DOEPCTL_MPSIZ);
-    
-    USB_OTG_DEVICE->DCTL |= USB_OTG_DCTL_CGINAK;
-    USB_OTG_FS->GUSBCFG |= (0x6 << USB_OTG_GUSBCFG_TRDT_Pos);
+    usb_event_t event = { .type = USB_EVENT_ENUMDNE };
+    post_event(p_driver, &event);
+}
 
-    USB_OTG_DEVICE->DAINTMSK = 0x10001U;
+/**
+ * @brief SOF interrupt handler.
+ *        Timestamps the frame and runs the HID report scheduler straight
+ *        from the interrupt, even with deferred processing, since the report
+ *        has to be in the FIFO before the host polls within this frame.
+ */
+static void
+sof_handler(usb_driver_t *p_driver)
+{
+    p_driver->sof_cycles = DWT->CYCCNT;
+    p_driver->sof_frame = ((USB_REG_RD(USB_OTG_DEVICE, DSTS) & USB_OTG_DSTS_FNSOF)
+                            >> USB_OTG_DSTS_FNSOF_Pos) & USB_FRAME_MASK;
+    p_driver->sof_count++;
+    usb_hid_sof(p_driver);
+}
 
-    USB_EP_IN(0)->DIEPCTL |= USB_OTG_DIEPCTL_USBAEP;
-    USB_EP_OUT(0)->DOEPCTL |= USB_OTG_DOEPCTL_USBAEP;
+/**
+ * @brief USBSUSP interrupt handler.
+ */
+static void
+usbsusp_handler(usb_driver_t *p_driver)
+{
+    usb_event_t event = { .type = USB_EVENT_USBSUSP };
+    post_event(p_driver, &event);
+}
 
-    // Clear pending DIEPINT interrupts
-    USB_EP_IN(0)->DIEPINT = 0xFB7FU;
+/**
+ * @brief WKUINT (resume) interrupt handler.
+ */
+static void
+wkup_handler(usb_driver_t *p_driver)
+{
+    usb_event_t event = { .type = USB_EVENT_WKUP };
+    post_event(p_driver, &event);
 }
 
 /**
  * @brief RXFLVL interrupt handler.
- *          TODO: think of adding tx fifo setting here and not in oepint_handler
+ *        Pops the receive status and the packet behind it so the RX FIFO
+ *        is free again before returning: SETUP packets into rx_setup, for
+ *        the STUP that follows, OUT data into the buffer armed on the
+ *        endpoint, or discarded when there is no room for it. Nothing is
+ *        left for the bottom half, the endpoint interrupts that end the
+ *        transfer are what it processes.
  */
 static void
 rxflvl_handler(usb_driver_t *p_driver)
 {
-    printf("RXFLVL\n");
-    USB_OTG_FS->GINTMSK &= ~USB_OTG_GINTMSK_RXFLVLM;
+    USB_SHADOW_CLR(USB_OTG_FS, GINTMSK, USB_OTG_GINTMSK_RXFLVLM);
 
-    uint32_t grxstsp_val = USB_OTG_FS->GRXSTSP;
+    uint32_t grxstsp_reg = USB_REG_RD(USB_OTG_FS, GRXSTSP);
 
-    enum usb_rx_status_e status = (grxstsp_val & USB_OTG_GRXSTSP_PKTSTS)
+    enum usb_rx_status_e status = (grxstsp_reg & USB_OTG_GRXSTSP_PKTSTS)
                                 >> USB_OTG_GRXSTSP_PKTSTS_Pos;
-    uint32_t byte_count = (grxstsp_val & USB_OTG_GRXSTSP_BCNT)
+    uint32_t byte_count = (grxstsp_reg & USB_OTG_GRXSTSP_BCNT)
                             >> USB_OTG_GRXSTSP_BCNT_Pos;
-    uint32_t ep_num = (grxstsp_val & USB_OTG_GRXSTSP_EPNUM)
+    uint32_t ep_num = (grxstsp_reg & USB_OTG_GRXSTSP_EPNUM)
                             >> USB_OTG_GRXSTSP_EPNUM_Pos;
-    uint32_t data_pid = (grxstsp_val & USB_OTG_GRXSTSP_DPID)
-                        >> USB_OTG_GRXSTSP_DPID_Pos;
-    
-    printf("\tstat: %d, b_cnt: %ld, ep: %ld, pid: %ld\n", status, byte_count, ep_num, data_pid);
 
-    
-    uint32_t word_count = (byte_count + 3) / 4;
-    uint32_t *p_data_dst = NULL;
-    switch(status)
+    USB_TRACE_DBG(USB_TRACE_EV_RXFLVL, grxstsp_reg, byte_count);
+
+    if (status == USB_RX_STATUS_SETUP_UPDT)
     {
-        case USB_RX_STATUS_NAK:
-            break;
-        case USB_RX_STATUS_DATA_UPDT:
-            break;
-        case USB_RX_STATUS_XFER_COMP:
-            break;
-        case USB_RX_STATUS_SETUP_COMP:
-            break;
-        case USB_RX_STATUS_SETUP_UPDT:
-            ENSURE((ep_num == 0) && (byte_count == 8));
-            p_data_dst = (uint32_t *)(&p_driver->setup_packet.raw_packet_data);
-            for (uint32_t word = 0; word < word_count; word++)
+        ENSURE((ep_num == 0) && (byte_count == 8));
+        usb_fifo_pop(&USB_OTG_DFIFO(0), (uint8_t *)p_driver->rx_setup, byte_count);
+        USB_CAPTURE_RECORD(USB_CAPTURE_SETUP, 0x00U, (const uint8_t *)p_driver->rx_setup, byte_count);
+    }
+    else if (status == USB_RX_STATUS_DATA_UPDT)
+    {
+        // The packet has to leave the FIFO here, copy it into the receive
+        // buffer of the endpoint if there is one with room, else drop it
+        usb_ep_t *p_ep = &p_driver->ep_out[ep_num];
+        const uint8_t *p_data = NULL;
+        if (byte_count == 0)
+        {
+            // Zero length packet, nothing in the FIFO
+        }
+        else if ((p_ep->p_rx_buf != NULL) &&
+                 ((p_ep->rx_count + byte_count) <= p_ep->rx_len))
+        {
+            p_data = &p_ep->p_rx_buf[p_ep->rx_count];
+            usb_fifo_pop(&USB_OTG_DFIFO(0), &p_ep->p_rx_buf[p_ep->rx_count], byte_count);
+            p_ep->rx_count += byte_count;
+        }
+        else
+        {
+            usb_fifo_discard(&USB_OTG_DFIFO(0), byte_count);
+            p_ep->rx_dropped += byte_count;
+            USB_TRACE_ERR(USB_TRACE_EV_RX_DROPPED, ep_num, byte_count);
+        }
+        USB_CAPTURE_RECORD(USB_CAPTURE_OUT, ep_num, p_data, byte_count);
+    }
+
+    USB_SHADOW_SET(USB_OTG_FS, GINTMSK, USB_OTG_GINTMSK_RXFLVLM);
+}
+
+/**
+ * @brief OEPINT interrupt handler.
+ *        Services every OUT endpoint flagged in DAINT, not just the lowest
+ *        one, so simultaneous completions cost a single interrupt entry.
+ */
+static void
+oepint_handler(usb_driver_t *p_driver)
+{
+    uint32_t daint_reg = USB_REG_RD(USB_OTG_DEVICE, DAINT) & USB_SHADOW_RD(DAINTMSK);
+    uint32_t pending = (daint_reg & USB_OTG_DAINT_OEPINT)
+                        >> (USB_OTG_DAINT_OEPINT_Pos);
+    uint32_t doepmsk_reg = USB_SHADOW_RD(DOEPMSK);
+    uint32_t serviced = 0;
+
+    while (pending)
+    {
+        uint32_t ep_num = __builtin_ctz(pending);
+        pending &= (pending - 1U);
+        REQUIRE(ep_num < USB_MAX_ENDPOINTS);
+
+        uint32_t status = USB_REG_RD(USB_EP_OUT(ep_num), DOEPINT) & doepmsk_reg;
+        usb_reg_ack_doepint(ep_num, status);
+
+        USB_TRACE_DBG(USB_TRACE_EV_OEPINT, ep_num, status);
+        post_ep_event(p_driver, ep_num, false, status);
+        serviced++;
+    }
+    p_driver->isr_stats.oepint_eps_per_entry[serviced]++;
+}
+
+/**
+ * @brief IEPINT interrupt handler.
+ *        Services every IN endpoint flagged in DAINT. TXFE is masked per
+ *        endpoint in DIEPEMPMSK rather than in DIEPMSK.
+ */
+static void
+iepint_handler(usb_driver_t *p_driver)
+{
+    uint32_t daint_reg = USB_REG_RD(USB_OTG_DEVICE, DAINT) & USB_SHADOW_RD(DAINTMSK);
+    uint32_t pending = (daint_reg & USB_OTG_DAINT_IEPINT)
+                        >> (USB_OTG_DAINT_IEPINT_Pos);
+    uint32_t diepmsk_reg = USB_SHADOW_RD(DIEPMSK);
+    uint32_t diepempmsk_reg = USB_SHADOW_RD(DIEPEMPMSK);
+    uint32_t serviced = 0;
+
+    while (pending)
+    {
+        uint32_t ep_num = __builtin_ctz(pending);
+        pending &= (pending - 1U);
+        REQUIRE(ep_num < USB_MAX_ENDPOINTS);
+
+        uint32_t mask = diepmsk_reg;
+        if (diepempmsk_reg & (1U << ep_num))
+        {
+            mask |= USB_OTG_DIEPINT_TXFE;
+        }
+        uint32_t status = USB_REG_RD(USB_EP_IN(ep_num), DIEPINT) & mask;
+        usb_reg_ack_diepint(ep_num, status);
+
+        if (status & USB_OTG_DIEPINT_XFRC)
+        {
+            usb_ep_t *p_ep = &p_driver->ep_in[ep_num];
+            p_ep->xfrc_frame = p_driver->sof_frame;
+            p_ep->xfrc_offset = DWT->CYCCNT - p_driver->sof_cycles;
+
+            // Only the XFRC of the last chunk ends the transfer
+            if ((p_ep->tx_queued >= p_ep->tx_len) && !p_ep->tx_zlp)
             {
-                *p_data_dst = USB_OTG_DFIFO(ep_num);
-                p_data_dst++;
+                USB_CAPTURE_RECORD_SEGS(USB_CAPTURE_IN, 0x80U | ep_num, p_ep->tx_segs, p_ep->tx_len);
             }
-            //flush_rx_fifo();
-            break;
-        default:
-            break;
+        }
+
+        // TXFE is a level, keep it masked until the bottom half refilled
+        // the FIFO or it would fire again as soon as we return
+        if (status & USB_OTG_DIEPINT_TXFE)
+        {
+            USB_SHADOW_CLR(USB_OTG_DEVICE, DIEPEMPMSK, (1U << ep_num));
+        }
+
+        USB_TRACE_DBG(USB_TRACE_EV_IEPINT, ep_num, status);
+        post_ep_event(p_driver, ep_num, true, status);
+        serviced++;
     }
-    USB_OTG_FS->GINTMSK |= USB_OTG_GINTMSK_RXFLVLM;
+    p_driver->isr_stats.iepint_eps_per_entry[serviced]++;
 }
 
 /*##########################################################################*/
-/*#                        OEPINT INTERRUPT HANDLERS                       #*/
+/*#                 GINTSTS EVENT PROCESSING (BOTTOM HALF)                 #*/
 /*##########################################################################*/
 
 /**
- * @brief OEPINT interrupt handler.
+ * @brief USB reset processing.
  */
 static void
-oepint_handler(usb_driver_t *p_driver)
+usbrst_process(usb_driver_t *p_driver)
 {
-    printf("OEPINT\n");
-    uint32_t daint_reg = USB_OTG_DEVICE->DAINT;
-    uint32_t ep_num_one_hot = (daint_reg & USB_OTG_DAINT_OEPINT)
-                               >> (USB_OTG_DAINT_OEPINT_Pos);
-    REQUIRE(ep_num_one_hot != 0);
-    uint32_t ep_num = __builtin_ctz(ep_num_one_hot);
-    uint32_t doepint_reg = USB_EP_OUT(ep_num)->DOEPINT;
+    USB_TRACE_INFO(USB_TRACE_EV_USBRST, 0, 0);
+    for (uint32_t ep_num = 0; ep_num < USB_MAX_ENDPOINTS; ep_num++)
+    {
+        p_driver->ep_in[ep_num].state = USB_EP_STATE_DISABLED;
+        p_driver->ep_out[ep_num].state = USB_EP_STATE_DISABLED;
+    }
+    USB_REG_CLR(USB_OTG_DEVICE, DCTL, USB_OTG_DCTL_RWUSIG);
+    flush_tx_fifo();
+    usb_reg_ack_diepint(0, 0xFB7FU);
+    USB_REG_CLR(USB_EP_IN(0), DIEPCTL, USB_OTG_DIEPCTL_STALL);
+    usb_reg_ack_doepint(0, 0xFB7FU);
+    USB_REG_MOD(USB_EP_OUT(0), DOEPCTL, USB_OTG_DOEPCTL_STALL, USB_OTG_DOEPCTL_SNAK);
+
+    p_driver->device_address = 0;
+    p_driver->configuration = 0;
+    p_driver->remote_wakeup = false;
+    usb_set_state(USB_STATE_RESET);
+
+    USB_REG_CLR(USB_OTG_DEVICE, DCFG, USB_OTG_DCFG_DAD);
 
-    if (doepint_reg & USB_OTG_DOEPINT_XFRC)
+    USB_REG_SET(USB_EP_OUT(0), DOEPTSIZ, (USB_OTG_DOEPTSIZ_STUPCNT |
+                                          (1 << USB_OTG_DOEPTSIZ_PKTCNT_Pos) |
+                                          ((USB_EP0_RX_FIFO_SIZE) << USB_OTG_DOEPTSIZ_XFRSIZ_Pos)));
+}
+
+/**
+ * @brief Enumeration done processing.
+ */
+static void
+enumdne_process(usb_driver_t *p_driver)
+{
+    USB_TRACE_INFO(USB_TRACE_EV_ENUMDNE, 0, 0);
+    // 64 byte packets on EP0, active from here on
+    USB_REG_MOD(USB_EP_IN(0), DIEPCTL, USB_OTG_DIEPCTL_MPSIZ, USB_OTG_DIEPCTL_USBAEP);
+    USB_REG_MOD(USB_EP_OUT(0), DOEPCTL, USB_OTG_DOEPCTL_MPSIZ, USB_OTG_DOEPCTL_USBAEP);
+
+    USB_REG_SET(USB_OTG_DEVICE, DCTL, USB_OTG_DCTL_CGINAK);
+    USB_REG_SET(USB_OTG_FS, GUSBCFG, (0x6 << USB_OTG_GUSBCFG_TRDT_Pos));
+
+    usb_set_state(USB_STATE_DEFAULT);
+
+    for (uint32_t dir = 0; dir < 2U; dir++)
     {
-        printf("\tXFRC out%ld\n", ep_num);
-        USB_EP_OUT(ep_num)->DOEPINT |= USB_OTG_DOEPINT_XFRC;
+        usb_ep_t *p_ep0 = dir ? &p_driver->ep_in[0] : &p_driver->ep_out[0];
+        p_ep0->type = USB_EP_TYPE_CONTROL;
+        p_ep0->max_packet_size = USB_EP0_RX_FIFO_SIZE;
+        p_ep0->state = USB_EP_STATE_IDLE;
     }
-    if (doepint_reg & USB_OTG_DOEPINT_EPDISD)
+
+    // Clear pending DIEPINT interrupts
+    usb_reg_ack_diepint(0, 0xFB7FU);
+}
+
+/*##########################################################################*/
+/*#                         OEPINT EVENT PROCESSING                        #*/
+/*##########################################################################*/
+
+/**
+ * @brief OEPINT event processing.
+ *        An OUT transfer is done with its XFRC, the endpoint is idle again
+ *        before the callback registered for it runs and can re-arm it.
+ */
+static void
+oepint_process(usb_driver_t *p_driver, uint32_t ep_num, uint32_t doepint_reg)
+{
+    usb_ep_t *p_ep = &p_driver->ep_out[ep_num];
+
+    p_ep->irq_count++;
+    if ((ep_num != 0) && (doepint_reg & USB_OTG_DOEPINT_XFRC) &&
+        (p_ep->state == USB_EP_STATE_BUSY))
     {
-        printf("\tEPDISD out%ld\n", ep_num);
-        USB_EP_OUT(ep_num)->DOEPINT |= USB_OTG_DOEPINT_EPDISD;
+        uint8_t *p_buf = p_ep->p_rx_buf;
+        usb_ep_rx_complete_t complete = p_ep->rx_complete;
+
+        // Idle before the callback so that it can arm the next transfer
+        p_ep->state = USB_EP_STATE_IDLE;
+        p_ep->p_rx_buf = NULL;
+        p_ep->rx_complete = NULL;
+        if (complete != NULL)
+        {
+            complete(p_driver, ep_num, p_buf, p_ep->rx_count);
+        }
     }
-    if (doepint_reg & USB_OTG_DOEPINT_STUP)
+    if (p_ep->callback != NULL)
     {
-        ENSURE(ep_num == 0);
-        oepint_stup_handler(p_driver);
-        USB_EP_OUT(ep_num)->DOEPINT |= USB_OTG_DOEPINT_STUP;
+        p_ep->callback(p_driver, ep_num, doepint_reg);
     }
-    if (doepint_reg & USB_OTG_DOEPINT_OTEPDIS)
+}
+
+/**
+ * @brief Take the data stage of a control write.
+ *        Called by a SETUP request handler in place of the status stage.
+ *        The data lands in p_dst, handler runs once it is complete and the
+ *        status stage or a STALL follows from what it returns.
+ *
+ * @param len wLength of the request, at most one packet.
+ */
+void
+usb_ep0_receive(uint8_t *p_dst, size_t len, usb_ep0_rx_handler_t handler)
+{
+    REQUIRE(len <= USB_EP0_RX_FIFO_SIZE);
+    usb_ep_t *p_ep = &usb_get_instance()->ep_out[0];
+
+    p_ep->p_rx_buf = p_dst;
+    p_ep->rx_len = len;
+    p_ep->rx_count = 0;
+    ep0_rx_handler = handler;
+
+    USB_REG_WR(USB_EP_OUT(0), DOEPTSIZ, (USB_OTG_DOEPTSIZ_STUPCNT |
+                                        (1U << USB_OTG_DOEPTSIZ_PKTCNT_Pos) |
+                                        (USB_EP0_RX_FIFO_SIZE << USB_OTG_DOEPTSIZ_XFRSIZ_Pos)));
+    USB_REG_SET(USB_EP_OUT(0), DOEPCTL, (USB_OTG_DOEPCTL_CNAK | USB_OTG_DOEPCTL_EPENA));
+}
+
+/**
+ * @brief EP0 OUT callback.
+ *        Completes a control write data stage taken by usb_ep0_receive,
+ *        the XFRC of every other OUT packet on EP0 is a status stage.
+ */
+void
+usb_ep0_out_callback(usb_driver_t *p_driver, uint32_t ep_num, uint32_t doepint_reg)
+{
+    usb_ep_t *p_ep = &p_driver->ep_out[0];
+
+    if ((doepint_reg & USB_OTG_DOEPINT_XFRC) && (ep0_rx_handler != NULL))
     {
-        printf("\tOTEPDIS out%ld\n", ep_num);
-        USB_EP_OUT(ep_num)->DOEPINT |= USB_OTG_DOEPINT_OTEPDIS;
+        usb_ep0_rx_handler_t handler = ep0_rx_handler;
+        ep0_rx_handler = NULL;
+        p_ep->p_rx_buf = NULL;
+        if (handler(p_driver, p_ep->rx_count))
+        {
+            usb_ep0_transmit(NULL, 0, 0);
+        }
+        else
+        {
+            USB_TRACE_ERR(USB_TRACE_EV_SETUP_UNSUPPORTED,
+                          (p_driver->setup_packet.request_type << 8) | p_driver->setup_packet.request,
+                          p_driver->setup_packet.index);
+            usb_ep0_stall();
+        }
     }
-    if (doepint_reg & USB_OTG_DOEPINT_NAK)
+    if (doepint_reg & USB_OTG_DOEPINT_STUP)
     {
-        printf("\tNAK out%ld\n", ep_num);
-        USB_EP_OUT(ep_num)->DOEPINT |= USB_OTG_DOEPINT_NAK;
+        oepint_stup_handler(p_driver);
     }
 }
 
 /**
  * @brief OEPINT interrupt handler for SETUP packets.
- *        Handles the SETUP packet and sends the appropriate response.
+ *        Looks the request up by type, recipient and bRequest and STALLs it
+ *        when there is no handler or the handler rejects it, so the host
+ *        gets an answer instead of a timeout.
  */
 static void
 oepint_stup_handler(usb_driver_t *p_driver)
 {
-    enum usb_request_e request = (enum usb_request_e)p_driver->setup_packet.request;
+    const usb_setup_packet_t *p_setup = &p_driver->setup_packet;
+    uint32_t type = (p_setup->request_type & USB_BMREQUEST_TYPE_MASK) >> USB_BMREQUEST_TYPE_Pos;
+    uint32_t recipient = p_setup->request_type & USB_BMREQUEST_RECIPIENT_MASK;
+    usb_setup_handler_t handler = NULL;
+
+    // A new SETUP aborts a data stage still in progress
+    ep0_rx_handler = NULL;
+    p_driver->ep_out[0].p_rx_buf = NULL;
+
+    USB_TRACE_INFO(USB_TRACE_EV_SETUP,
+                   (p_setup->request_type << 8) | p_setup->request,
+                   p_setup->value);
 
-    printf("\tstup_req:%d\n", request);
-    switch(request)
+    if ((recipient == USB_RECIPIENT_INTERFACE) && (p_setup->detailed.index_l >= USB_DESC_NUM_INTERFACES))
     {
-        case USB_BREQUEST_GET_STATUS:
-            break;
-        case USB_BREQUEST_CLEAR_FEATURE:
-            break;
-        case USB_BREQUEST_SET_FEATURE:
-            break;
-        case USB_BREQUEST_SET_ADDRESS:
-            set_address(p_driver->setup_packet.value);
-            break;
-        case USB_BREQUEST_GET_DESCRIPTOR:
-            get_descriptor(p_driver->setup_packet);
+        // No function owns the interface, nothing to route to
+        type = USB_REQUEST_TYPE_RESERVED;
+    }
+
+    switch (type)
+    {
+        case USB_REQUEST_TYPE_STANDARD:
+            if ((recipient < USB_RECIPIENT_COUNT) && (p_setup->request < USB_BREQUEST_COUNT))
+            {
+                handler = standard_requests[recipient][p_setup->request];
+            }
             break;
-        case USB_BREQUEST_SET_DESCRIPTOR:
+        case USB_REQUEST_TYPE_CLASS:
+            if (recipient == USB_RECIPIENT_INTERFACE)
+            {
+                handler = class_requests[p_setup->detailed.index_l];
+            }
             break;
-        case USB_BREQUEST_GET_CONFIGURATION:
+        case USB_REQUEST_TYPE_VENDOR:
+            handler = vendor_requests;
             break;
-        case USB_BREQUEST_SET_CONFIGURATION:
+        default:
             break;
-        case USB_BREQUEST_GET_INTERFACE:
+    }
+
+    if ((handler == NULL) || !handler(p_driver, p_setup))
+    {
+        USB_TRACE_ERR(USB_TRACE_EV_SETUP_UNSUPPORTED,
+                      (p_setup->request_type << 8) | p_setup->request, p_setup->index);
+        usb_ep0_stall();
+    }
+}
+
+/**
+ * @brief GET_STATUS request handler.
+ *        Device: self powered and remote wakeup bits, interface: always 0,
+ *        endpoint: halt bit.
+ */
+static bool
+get_status(usb_driver_t *p_driver, const usb_setup_packet_t *p_setup)
+{
+    static uint16_t status;
+    uint32_t ep_num = p_setup->detailed.index_l & 0x0FU;
+
+    switch (p_setup->request_type & USB_BMREQUEST_RECIPIENT_MASK)
+    {
+        case USB_RECIPIENT_DEVICE:
+            // bmAttributes D6: self powered
+            status = ((USB_DESC_CONFIGURATION_ATTRIBUTES & 0x40U) ? 0x01U : 0x00U) |
+                     (p_driver->remote_wakeup ? 0x02U : 0x00U);
             break;
-        case USB_BREQUEST_SET_INTERFACE:
+        case USB_RECIPIENT_INTERFACE:
+            status = 0;
             break;
-        case USB_BREQUEST_SYNCH_FRAME:
+        case USB_RECIPIENT_ENDPOINT:
+            if (ep_num >= USB_MAX_ENDPOINTS)
+            {
+                return false;
+            }
+            status = (((p_setup->detailed.index_l & 0x80U) ? p_driver->ep_in[ep_num].state
+                                                          : p_driver->ep_out[ep_num].state)
+                      == USB_EP_STATE_STALLED) ? 0x01U : 0x00U;
             break;
         default:
-            printf("\tUnknown request or not supported\n");
-            break;
+            return false;
+    }
+    usb_ep0_transmit((const uint8_t *)&status, 2, p_setup->length);
+    return true;
+}
+
+/**
+ * @brief CLEAR_FEATURE request handler.
+ */
+static bool
+clear_feature(usb_driver_t *p_driver, const usb_setup_packet_t *p_setup)
+{
+    uint32_t recipient = p_setup->request_type & USB_BMREQUEST_RECIPIENT_MASK;
+    uint8_t ep_addr = p_setup->detailed.index_l;
+
+    if ((recipient == USB_RECIPIENT_DEVICE) && (p_setup->value == USB_FEATURE_DEVICE_REMOTE_WAKEUP))
+    {
+        p_driver->remote_wakeup = false;
+    }
+    else if ((recipient == USB_RECIPIENT_ENDPOINT) && (p_setup->value == USB_FEATURE_ENDPOINT_HALT) &&
+             ((ep_addr & 0x0FU) != 0U) && ((ep_addr & 0x0FU) < USB_MAX_ENDPOINTS))
+    {
+        usb_ep_stall(ep_addr, false);
     }
+    else if (!((recipient == USB_RECIPIENT_ENDPOINT) && ((ep_addr & 0x0FU) == 0U)))
+    {
+        return false;
+    }
+    usb_ep0_transmit(NULL, 0, 0);
+    return true;
+}
+
+/**
+ * @brief SET_FEATURE request handler.
+ */
+static bool
+set_feature(usb_driver_t *p_driver, const usb_setup_packet_t *p_setup)
+{
+    uint32_t recipient = p_setup->request_type & USB_BMREQUEST_RECIPIENT_MASK;
+    uint8_t ep_addr = p_setup->detailed.index_l;
+
+    if ((recipient == USB_RECIPIENT_DEVICE) && (p_setup->value == USB_FEATURE_DEVICE_REMOTE_WAKEUP))
+    {
+        p_driver->remote_wakeup = true;
+    }
+    else if ((recipient == USB_RECIPIENT_ENDPOINT) && (p_setup->value == USB_FEATURE_ENDPOINT_HALT) &&
+             ((ep_addr & 0x0FU) != 0U) && ((ep_addr & 0x0FU) < USB_MAX_ENDPOINTS))
+    {
+        usb_ep_stall(ep_addr, true);
+    }
+    else
+    {
+        return false;
+    }
+    usb_ep0_transmit(NULL, 0, 0);
+    return true;
 }
 
 /**
  * @brief SET_ADDRESS request handler.
  */
-static void
-set_address(uint8_t addr)
+static bool
+set_address(usb_driver_t *p_driver, const usb_setup_packet_t *p_setup)
 {
-    USB_OTG_DEVICE->DCFG |= (addr << USB_OTG_DCFG_DAD_Pos);
-    usb_write_fifo(NULL, 0);
+    uint8_t addr = p_setup->detailed.value_l & 0x7FU;
+
+    USB_REG_MOD(USB_OTG_DEVICE, DCFG, USB_OTG_DCFG_DAD, (addr << USB_OTG_DCFG_DAD_Pos));
+    p_driver->device_address = addr;
+    usb_set_state((addr != 0U) ? USB_STATE_ADDRESS : USB_STATE_DEFAULT);
+    usb_ep0_transmit(NULL, 0, 0);
+    return true;
 }
 
 /**
- * @brief GET_DESCRIPTOR request handler.
+ * @brief GET_CONFIGURATION request handler.
  */
-static void
-get_descriptor(usb_setup_packet_t packet)
-{
-    const uint8_t *p_descriptor_requested = NULL;
-    enum usb_descriptor_value_e desc_value_type = (enum usb_descriptor_value_e)(packet.detailed.value_h);
-    size_t desc_len = 0;
-    printf("\tdesc_type:%d\n", desc_value_type);
-    
-    switch(desc_value_type)
-    {
-        case USB_DESCRIPTOR_DEVICE:
-            p_descriptor_requested = device_descriptor;
-            desc_len = sizeof(device_descriptor);
-            break;
-        case USB_DESCRIPTOR_CONFIGURATION:
-            p_descriptor_requested = configuraiton_descriptor;
-            desc_len = sizeof(configuraiton_descriptor);
-            break;
-        case USB_DESCRIPTOR_STRING:
-            p_descriptor_requested = string_descriptors[packet.detailed.value_l];
-            desc_len = string_descriptors[packet.detailed.value_l][0];
-            break;
-        case USB_DESCRIPTOR_INTERFACE:
-            break;
-        case USB_DESCRIPTOR_ENDPOINT:
-            break;
-        case USB_DESCRIPTOR_DEVICE_QUALIFIER:
-            break;
-        case USB_DESCRIPTOR_OTHER_SPEED_CONFIGURATION:
-            break;
-        case USB_DESCRIPTOR_INTERFACE_POWER:
-            break;
-        case USB_DESCRIPTOR_OTG:
-            break;
-        case USB_DESCRIPTOR_REPORT:
-            p_descriptor_requested = report_descriptor;
-            desc_len = sizeof(report_descriptor);
-            break;
-        default:
-            ASSERT(0);
-            break;
+static bool
+get_configuration(usb_driver_t *p_driver, const usb_setup_packet_t *p_setup)
+{
+    static uint8_t configuration;
+
+    configuration = (uint8_t)p_driver->configuration;
+    usb_ep0_transmit(&configuration, 1, p_setup->length);
+    return true;
+}
+
+/**
+ * @brief GET_INTERFACE request handler, every interface has only
+ *        alternate setting 0.
+ */
+static bool
+get_interface(usb_driver_t *p_driver, const usb_setup_packet_t *p_setup)
+{
+    static const uint8_t alternate_setting = 0;
+
+    if (p_driver->configuration == 0U)
+    {
+        return false;
     }
-    if (p_descriptor_requested != NULL)
+    usb_ep0_transmit(&alternate_setting, 1, p_setup->length);
+    return true;
+}
+
+/**
+ * @brief SET_INTERFACE request handler, only alternate setting 0 exists.
+ */
+static bool
+set_interface(usb_driver_t *p_driver, const usb_setup_packet_t *p_setup)
+{
+    if ((p_driver->configuration == 0U) || (p_setup->value != 0U))
     {
-        size_t req_len = packet.length;
-        size_t tx_len = (req_len < desc_len) ? req_len : desc_len;
-        usb_write_fifo(p_descriptor_requested, tx_len);
+        return false;
     }
+    usb_ep0_transmit(NULL, 0, 0);
+    return true;
 }
 
-/*##########################################################################*/
-/*#                       IEPINT INTERRUPT HANDLERS                        #*/
-/*##########################################################################*/
+/**
+ * @brief SET_CONFIGURATION request handler.
+ *        Tears down the endpoints of the previous configuration and gives
+ *        their FIFO RAM back before opening the new one.
+ */
+static bool
+set_configuration(usb_driver_t *p_driver, const usb_setup_packet_t *p_setup)
+{
+    uint8_t config = p_setup->detailed.value_l;
+
+    for (uint32_t ep_num = 1; ep_num < USB_MAX_ENDPOINTS; ep_num++)
+    {
+        if (p_driver->ep_in[ep_num].state != USB_EP_STATE_DISABLED)
+        {
+            usb_ep_close(0x80U | ep_num);
+        }
+        if (p_driver->ep_out[ep_num].state != USB_EP_STATE_DISABLED)
+        {
+            usb_ep_close(ep_num);
+        }
+    }
+    usb_fifo_reset(USB_RX_FIFO_WORDS);
+    ALLEGE(usb_fifo_alloc_tx(0, USB_EP0_TX_FIFO_WORDS));
+    p_driver->configuration = 0;
+    p_driver->fifo_report.num_functions = 0;
+
+    if ((config == USB_DESC_CONFIGURATION_VALUE) && configure_endpoints(p_driver))
+    {
+        p_driver->configuration = config;
+        usb_hid_configure(p_driver);
+        usb_cdc_configure(p_driver);
+        usb_stream_configure(p_driver);
+    }
+    usb_set_state((p_driver->configuration != 0U) ? USB_STATE_CONFIGURED : USB_STATE_ADDRESS);
+
+    usb_fifo_report_t *p_report = &p_driver->fifo_report;
+    p_report->rx_words = USB_RX_FIFO_WORDS;
+    p_report->ep0_words = p_driver->ep_in[0].fifo_words;
+    p_report->free_words = usb_fifo_free_words();
+    USB_TRACE_INFO(USB_TRACE_EV_SET_CONFIGURATION, p_driver->configuration,
+                   usb_fifo_free_words());
+    USB_TRACE_INFO(USB_TRACE_EV_FIFO_SHARED, p_report->rx_words, p_report->ep0_words);
+    for (uint32_t i = 0; i < p_report->num_functions; i++)
+    {
+        USB_TRACE_INFO(USB_TRACE_EV_FIFO_FUNCTION, p_report->function[i].first_interface,
+                       p_report->function[i].tx_words);
+    }
+    if (p_driver->configuration != config)
+    {
+        return false;
+    }
+    usb_ep0_transmit(NULL, 0, 0);
+    return true;
+}
 
 /**
- * @brief IEPINT interrupt handler.
+ * @brief Open every endpoint of the configuration descriptor.
+ *        IN endpoints get a double buffered TX FIFO (two max size packets)
+ *        when all of them fit, otherwise a single buffered one. If even that
+ *        overcommits the FIFO RAM no endpoint is opened. The TX FIFOs are
+ *        added up per function for the FIFO report: an IAD starts a
+ *        function, so does an interface outside the previous one.
+ *
+ * @return false if the TX FIFOs do not fit.
  */
-static void
-iepint_handler(usb_driver_t *p_driver)
+static bool
+configure_endpoints(usb_driver_t *p_driver)
 {
-    printf("IEPINT\n");
-    uint32_t daint_reg = USB_OTG_DEVICE->DAINT;
-    uint32_t ep_num_one_hot = (daint_reg & USB_OTG_DAINT_IEPINT)
-                               >> (USB_OTG_DAINT_IEPINT_Pos);
-    uint32_t ep_num = __builtin_ctz(ep_num_one_hot);
+    usb_fifo_report_t *p_report = &p_driver->fifo_report;
+    usb_fifo_function_t *p_function = NULL;
+    uint32_t function_end = 0;
+    const uint8_t *p_start = usb_desc_configuration;
+    const uint8_t *p_end = p_start + USB_DESC_CONFIGURATION_LEN;
+    uint32_t single_words = 0;
+    uint32_t double_words = 0;
+    uint32_t packets;
 
-    uint32_t iepint_reg = USB_EP_IN(ep_num)->DIEPINT;
+    for (const uint8_t *p_desc = p_start; p_desc < p_end; p_desc += p_desc[0])
+    {
+        if ((p_desc[1] == USB_DESCRIPTOR_ENDPOINT) && (p_desc[2] & 0x80U))
+        {
+            uint32_t mps_words = ((p_desc[4] | (p_desc[5] << 8)) + 3U) / 4U;
+            single_words += MAX(mps_words, USB_FIFO_MIN_TX_WORDS);
+            double_words += MAX(2U * mps_words, USB_FIFO_MIN_TX_WORDS);
+        }
+    }
 
-    if (iepint_reg & USB_OTG_DIEPINT_XFRC)
+    if (double_words <= usb_fifo_free_words())
     {
-        printf("XFRC %ld\n", ep_num);
-        // Prepare for next reception
-        USB_EP_OUT(ep_num)->DOEPTSIZ |= (1 << USB_OTG_DOEPTSIZ_PKTCNT_Pos);
-        USB_EP_IN(ep_num)->DIEPINT |= USB_OTG_DIEPINT_XFRC;
+        packets = 2U;
+    }
+    else if (single_words <= usb_fifo_free_words())
+    {
+        packets = 1U;
     }
-    if (iepint_reg & USB_OTG_DIEPINT_EPDISD)
+    else
     {
-        printf("EPDISD %ld\n", ep_num);
-        USB_EP_IN(ep_num)->DIEPINT |= USB_OTG_DIEPINT_EPDISD;
+        USB_TRACE_ERR(USB_TRACE_EV_FIFO_OVERCOMMIT, 0xFFU, usb_fifo_free_words());
+        return false;
     }
-    if (iepint_reg & USB_OTG_DIEPINT_TOC)
+
+    for (const uint8_t *p_desc = p_start; p_desc < p_end; p_desc += p_desc[0])
     {
-        printf("TOC %ld\n", ep_num);
-        USB_EP_IN(ep_num)->DIEPINT |= USB_OTG_DIEPINT_TOC;
+        bool iad = (p_desc[1] == USB_DESCRIPTOR_INTERFACE_ASSOCIATION);
+
+        if (iad || ((p_desc[1] == USB_DESCRIPTOR_INTERFACE) && (p_desc[2] >= function_end)))
+        {
+            ASSERT(p_report->num_functions < USB_MAX_INTERFACES);
+            p_function = &p_report->function[p_report->num_functions++];
+            p_function->first_interface = p_desc[2];
+            p_function->num_interfaces = iad ? p_desc[3] : 1U;
+            p_function->tx_words = 0;
+            function_end = p_function->first_interface + p_function->num_interfaces;
+        }
+        if (p_desc[1] != USB_DESCRIPTOR_ENDPOINT)
+        {
+            continue;
+        }
+        uint8_t ep_addr = p_desc[2];
+        uint16_t mps = p_desc[4] | (p_desc[5] << 8);
+
+        usb_ep_open(ep_addr, (usb_ep_type_t)(p_desc[3] & 0x03U), mps);
+        if (ep_addr & 0x80U)
+        {
+            ALLEGE(usb_fifo_alloc_tx(ep_addr & 0x0FU, packets * ((mps + 3U) / 4U)));
+            p_function->tx_words += p_driver->ep_in[ep_addr & 0x0FU].fifo_words;
+        }
     }
-    if (iepint_reg & USB_OTG_DIEPINT_ITTXFE)
+    return true;
+}
+
+/**
+ * @brief GET_DESCRIPTOR request handler.
+ *        Looks the descriptor up in the generated index, anything not in it
+ *        is STALLed. A full speed only device has no DEVICE_QUALIFIER
+ *        descriptor, the STALL tells the host so.
+ */
+static bool
+get_descriptor(usb_driver_t *p_driver, const usb_setup_packet_t *p_setup)
+{
+    uint8_t desc_type = p_setup->detailed.value_h;
+    uint8_t desc_index = p_setup->detailed.value_l;
+    USB_TRACE_DBG(USB_TRACE_EV_GET_DESCRIPTOR, desc_type, desc_index);
+
+    for (uint32_t i = 0; i < USB_DESC_COUNT; i++)
     {
-        printf("ITTXFE %ld\n", ep_num);
-        USB_EP_IN(ep_num)->DIEPINT |= USB_OTG_DIEPINT_ITTXFE;
+        const usb_desc_t *p_desc = &usb_desc_table[i];
+
+        if ((p_desc->type != desc_type) || (p_desc->index != desc_index))
+        {
+            continue;
+        }
+        if (((desc_type == USB_DESCRIPTOR_HID) || (desc_type == USB_DESCRIPTOR_REPORT)) &&
+            (p_desc->w_index != p_setup->index))
+        {
+            continue;
+        }
+
+        size_t req_len = p_setup->length;
+        size_t tx_len = MIN(req_len, p_desc->length);
+        usb_ep0_transmit(p_desc->p_data, tx_len, req_len);
+        return true;
     }
-    if (iepint_reg & USB_OTG_DIEPINT_INEPNE)
+    return false;
+}
+
+/*##########################################################################*/
+/*#                         IEPINT EVENT PROCESSING                        #*/
+/*##########################################################################*/
+
+/**
+ * @brief IEPINT event processing.
+ *        Runs the IN transfer engine first, FIFO refill on TXFE and the next
+ *        chunk on XFRC, then dispatches to the callback registered for the
+ *        endpoint. XFRC is only passed on once the whole transfer is done.
+ */
+static void
+iepint_process(usb_driver_t *p_driver, uint32_t ep_num, uint32_t diepint_reg)
+{
+    usb_ep_t *p_ep = &p_driver->ep_in[ep_num];
+
+    p_ep->irq_count++;
+    if (diepint_reg & USB_OTG_DIEPINT_TXFE)
     {
-        printf("INEPNE %ld\n", ep_num);
-        USB_EP_IN(ep_num)->DIEPINT |= USB_OTG_DIEPINT_INEPNE;
+        usb_ep_tx_fifo_empty(ep_num);
     }
-    if (iepint_reg & USB_OTG_DIEPINT_TXFE)
+    if ((diepint_reg & USB_OTG_DIEPINT_XFRC) && !usb_ep_tx_complete(ep_num))
     {
-        printf("TXFE %ld\n", ep_num);
-        USB_EP_IN(ep_num)->DIEPINT |= USB_OTG_DIEPINT_TXFE;
+        diepint_reg &= ~USB_OTG_DIEPINT_XFRC;
     }
-    if (iepint_reg & USB_OTG_DIEPINT_PKTDRPSTS)
+    if (p_ep->callback != NULL)
     {
-        printf("PKTDRPSTS %ld\n", ep_num);
-        USB_EP_IN(ep_num)->DIEPINT |= USB_OTG_DIEPINT_PKTDRPSTS;
+        p_ep->callback(p_driver, ep_num, diepint_reg);
     }
-    if (iepint_reg & USB_OTG_DIEPINT_NAK)
+}
+
+/**
+ * @brief EP0 IN callback.
+ */
+void
+usb_ep0_in_callback(usb_driver_t *p_driver, uint32_t ep_num, uint32_t diepint_reg)
+{
+    if (diepint_reg & USB_OTG_DIEPINT_XFRC)
     {
-        printf("NAK %ld\n", ep_num);
-        USB_EP_IN(ep_num)->DIEPINT |= USB_OTG_DIEPINT_NAK;
+        // Prepare for next reception
+        USB_REG_SET(USB_EP_OUT(0), DOEPTSIZ, (1 << USB_OTG_DOEPTSIZ_PKTCNT_Pos));
     }
 }
 
@@ -0,0 +1,253 @@
+/** @file usb_kbd.c
+ *
+ * @brief Keyboard state and report coalescing.
+ *
+ * Key changes only update a 256-bit usage bitmap. usb_kbd_task builds a
+ * report from the bitmap when the previous one has been taken by the host,
+ * so at most one report is queued per poll interval and it always carries
+ * the latest state. Once the HID SOF scheduler knows when the host polls,
+ * it pulls the report through usb_kbd_build_report instead. A key pressed
+ * and released before it was reported is latched so the host still sees
+ * the press.
+ *
+ * The report format follows the protocol selected by the host: the 6 key
+ * array boot report, or in report protocol the N-key rollover bitmap, which
+ * is the state bitmap copied as is. The report protocol layout is packed by
+ * code generated from hidtools_scripts/keyboard_report_desc.wara, so it
+ * always matches the report descriptor. GET_REPORT is answered through the
+ * same build functions with the keys pressed at that moment.
+ */
+
+#include "usb_kbd.h"
+#include "usb_hid.h"
+#include "usb_internal.h"
+
+#define THIS_FILE__ "usb_kbd.c"
+
+#define KBD_BITMAP_WORDS    (256U / 32U)
+
+_Static_assert(sizeof(((usb_report_input_t *)0)->keyboard_00_df) == (USB_KBD_NKRO_USAGES / 8U),
+               "NKRO bitmap of the .wara file does not match USB_KBD_NKRO_USAGES");
+
+/**
+ * @brief Keyboard state.
+ *
+ * pressed is the current state, tapped holds keys released before a report
+ * saw them and reported is the state the last report was built from.
+ */
+typedef struct usb_kbd_s
+{
+    uint32_t pressed[KBD_BITMAP_WORDS];
+    uint32_t tapped[KBD_BITMAP_WORDS];
+    uint32_t reported[KBD_BITMAP_WORDS];
+    volatile bool dirty;
+    usb_hid_protocol_t protocol;
+    usb_kbd_stats_t stats;
+} usb_kbd_t;
+
+static uint32_t build_boot_report(const uint32_t *p_keys, uint8_t *p_report);
+static uint32_t build_nkro_report(const uint32_t *p_keys, uint8_t *p_report);
+
+static usb_kbd_t kbd;
+
+
+/*##########################################################################*/
+/*#                            PUBLIC FUNCTIONS                            #*/
+/*##########################################################################*/
+
+/**
+ * @brief Record a key change, safe to call from interrupts.
+ *
+ * @param usage   Keyboard/Keypad page usage ID.
+ * @param pressed true on press, false on release.
+ */
+void
+usb_kbd_set_key(uint8_t usage, bool pressed)
+{
+    uint32_t word = usage / 32U;
+    uint32_t bit = 1U << (usage % 32U);
+
+    uint32_t primask = usb_critical_enter();
+    if (pressed)
+    {
+        kbd.pressed[word] |= bit;
+    }
+    else
+    {
+        // Press not reported yet, keep it for one report
+        if ((kbd.pressed[word] & bit) && !(kbd.reported[word] & bit))
+        {
+            kbd.tapped[word] |= bit;
+        }
+        kbd.pressed[word] &= ~bit;
+    }
+    kbd.dirty = true;
+    kbd.stats.events++;
+    usb_critical_exit(primask);
+}
+
+/**
+ * @brief Register the keyboard as report source of the HID SOF scheduler.
+ */
+void
+usb_kbd_init(void)
+{
+    usb_hid_set_report_source(usb_kbd_build_report);
+}
+
+/**
+ * @brief Send the key state if it or the protocol changed and the host took
+ *        the last report. Call from the main loop.
+ *        Does nothing once the SOF scheduler has learned the poll timing,
+ *        reports are then built from the SOF interrupt right before the poll.
+ */
+void
+usb_kbd_task(void)
+{
+    if (usb_hid_sof_active() || (usb_hid_get_stats()->depth != 0U))
+    {
+        return;
+    }
+
+    uint8_t report[USB_KBD_REPORT_MAX_SIZE];
+    uint32_t len = usb_kbd_build_report(report, false);
+
+    if ((len != 0U) && !usb_hid_send_report(report, len))
+    {
+        // Not configured, report everything again once we are
+        uint32_t primask = usb_critical_enter();
+        memset(kbd.reported, 0, sizeof(kbd.reported));
+        kbd.dirty = true;
+        usb_critical_exit(primask);
+    }
+}
+
+/**
+ * @brief Build a report of the current key state in the protocol selected by
+ *        the host. The state is taken as reported.
+ *
+ * @param current Build the report for GET_REPORT: the keys pressed right
+ *                now, whether or not they changed, nothing is taken as
+ *                reported.
+ *
+ * @return Report length, 0 if neither the state nor the protocol changed.
+ */
+uint32_t
+usb_kbd_build_report(uint8_t *p_report, bool current)
+{
+    usb_hid_protocol_t protocol = usb_hid_get_protocol();
+    uint32_t keys[KBD_BITMAP_WORDS];
+
+    if (current)
+    {
+        uint32_t primask = usb_critical_enter();
+        memcpy(keys, kbd.pressed, sizeof(keys));
+        usb_critical_exit(primask);
+        return (protocol == USB_HID_PROTOCOL_BOOT) ? build_boot_report(keys, p_report)
+                                                   : build_nkro_report(keys, p_report);
+    }
+
+    if (!kbd.dirty && (protocol == kbd.protocol))
+    {
+        return 0;
+    }
+
+    bool changed = (protocol != kbd.protocol);
+
+    uint32_t primask = usb_critical_enter();
+    for (uint32_t i = 0; i < KBD_BITMAP_WORDS; i++)
+    {
+        keys[i] = kbd.pressed[i] | kbd.tapped[i];
+        changed |= (keys[i] != kbd.reported[i]);
+    }
+    kbd.dirty = false;
+
+    if (changed)
+    {
+        for (uint32_t i = 0; i < KBD_BITMAP_WORDS; i++)
+        {
+            kbd.reported[i] = keys[i];
+            kbd.tapped[i] &= ~keys[i];
+            // A tapped key goes back to released in the next report
+            kbd.dirty |= (kbd.pressed[i] != keys[i]);
+        }
+        kbd.protocol = protocol;
+        kbd.stats.reports++;
+    }
+    usb_critical_exit(primask);
+
+    if (!changed)
+    {
+        return 0;
+    }
+    return (protocol == USB_HID_PROTOCOL_BOOT) ? build_boot_report(keys, p_report)
+                                               : build_nkro_report(keys, p_report);
+}
+
+/**
+ * @brief Keyboard counters.
+ */
+const usb_kbd_stats_t *
+usb_kbd_get_stats(void)
+{
+    return &kbd.stats;
+}
+
+
+/*##########################################################################*/
+/*#                       STATIC (PRIVATE) FUNCTIONS                       #*/
+/*##########################################################################*/
+
+/**
+ * @brief Build a boot protocol report from a usage bitmap.
+ *        Modifier bits, a reserved byte and up to six keys. With more keys
+ *        down every key slot reports ErrorRollOver.
+ *
+ * @return Report length.
+ */
+static uint32_t
+build_boot_report(const uint32_t *p_keys, uint8_t *p_report)
+{
+    memset(p_report, 0, USB_KBD_BOOT_REPORT_SIZE);
+    p_report[0] = (uint8_t)(p_keys[USB_KBD_USAGE_LEFT_CONTROL / 32U] >>
+                            (USB_KBD_USAGE_LEFT_CONTROL % 32U));
+
+    uint32_t count = 0;
+    for (uint32_t word = 0; word < (USB_KBD_NKRO_USAGES / 32U); word++)
+    {
+        uint32_t bits = p_keys[word];
+        while (bits)
+        {
+            uint32_t usage = word * 32U + __builtin_ctz(bits);
+            bits &= (bits - 1U);
+            if (count == USB_KBD_BOOT_KEYS)
+            {
+                memset(&p_report[2], USB_KBD_USAGE_ERROR_ROLLOVER, USB_KBD_BOOT_KEYS);
+                kbd.stats.rollover++;
+                return USB_KBD_BOOT_REPORT_SIZE;
+            }
+            p_report[2U + count++] = (uint8_t)usage;
+        }
+    }
+    return USB_KBD_BOOT_REPORT_SIZE;
+}
+
+/**
+ * @brief Build a report protocol (N-key rollover) report from a usage bitmap.
+ *        Modifier bits followed by one bit per usage 0x00-0xDF, which is the
+ *        little endian layout of the bitmap itself.
+ *
+ * @return Report length.
+ */
+static uint32_t
+build_nkro_report(const uint32_t *p_keys, uint8_t *p_report)
+{
+    usb_report_input_t report;
+
+    report.keyboard_e0_e7 = (uint8_t)(p_keys[USB_KBD_USAGE_LEFT_CONTROL / 32U] >>
+                                      (USB_KBD_USAGE_LEFT_CONTROL % 32U));
+    memcpy(report.keyboard_00_df, p_keys, sizeof(report.keyboard_00_df));
+    return usb_report_input_pack(&report, p_report);
+}
+
+/*** end of file ***/
\ No newline at end of file
@@ -0,0 +1,69 @@
+/** @file usb_reg.c
+ *
+ * @brief OTG_FS register access layer.
+ */
+
+#include <string.h>
+
+#include "usb_reg.h"
+
+#define THIS_FILE__ "usb_reg.c"
+
+_Static_assert(USB_REG_COUNT <= 32U, "USB_REG_W1C is a 32-bit mask");
+
+usb_reg_shadow_t usb_reg_shadow;
+usb_reg_stats_t usb_reg_stats;
+
+const char * const usb_reg_names[USB_REG_COUNT] = {
+    [USB_REG_GUSBCFG]    = "GUSBCFG",
+    [USB_REG_GRSTCTL]    = "GRSTCTL",
+    [USB_REG_GINTSTS]    = "GINTSTS",
+    [USB_REG_GINTMSK]    = "GINTMSK",
+    [USB_REG_GRXSTSP]    = "GRXSTSP",
+    [USB_REG_GRXFSIZ]    = "GRXFSIZ",
+    [USB_REG_DIEPTXF]    = "DIEPTXF",
+    [USB_REG_GCCFG]      = "GCCFG",
+    [USB_REG_GAHBCFG]    = "GAHBCFG",
+    [USB_REG_DCFG]       = "DCFG",
+    [USB_REG_DCTL]       = "DCTL",
+    [USB_REG_DSTS]       = "DSTS",
+    [USB_REG_DIEPMSK]    = "DIEPMSK",
+    [USB_REG_DOEPMSK]    = "DOEPMSK",
+    [USB_REG_DAINT]      = "DAINT",
+    [USB_REG_DAINTMSK]   = "DAINTMSK",
+    [USB_REG_DIEPEMPMSK] = "DIEPEMPMSK",
+    [USB_REG_DIEPCTL]    = "DIEPCTL",
+    [USB_REG_DIEPINT]    = "DIEPINT",
+    [USB_REG_DIEPTSIZ]   = "DIEPTSIZ",
+    [USB_REG_DTXFSTS]    = "DTXFSTS",
+    [USB_REG_DOEPCTL]    = "DOEPCTL",
+    [USB_REG_DOEPINT]    = "DOEPINT",
+    [USB_REG_DOEPTSIZ]   = "DOEPTSIZ",
+    [USB_REG_PCGCCTL]    = "PCGCCTL"
+};
+
+/**
+ * @brief Take the shadowed registers from the hardware.
+ *        Has to run before the driver writes any of them, a soft reset of
+ *        the core leaves them alone, whatever ran before us may not have.
+ */
+void
+usb_reg_shadow_load(void)
+{
+    usb_reg_shadow.GINTMSK = USB_REG_RD(USB_OTG_FS, GINTMSK);
+    usb_reg_shadow.DIEPMSK = USB_REG_RD(USB_OTG_DEVICE, DIEPMSK);
+    usb_reg_shadow.DOEPMSK = USB_REG_RD(USB_OTG_DEVICE, DOEPMSK);
+    usb_reg_shadow.DAINTMSK = USB_REG_RD(USB_OTG_DEVICE, DAINTMSK);
+    usb_reg_shadow.DIEPEMPMSK = USB_REG_RD(USB_OTG_DEVICE, DIEPEMPMSK);
+}
+
+/**
+ * @brief Restart the access counters.
+ */
+void
+usb_reg_stats_clear(void)
+{
+    memset(&usb_reg_stats, 0, sizeof(usb_reg_stats));
+}
+
+/*** end of file ***/
\ No newline at end of file
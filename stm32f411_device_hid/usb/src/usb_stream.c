@@ -0,0 +1,330 @@
+/** @file usb_stream.c
+ *
+ * @brief Bulk streaming on the STREAM_IN/STREAM_OUT endpoint pair.
+ *
+ * The data pipe of whichever interface has the STREAM endpoints in
+ * usb_desc.json: the CDC data interface, or the vendor interface of the
+ * benchmark build.
+ *
+ * IN data goes through a ring buffer. usb_stream_write copies into it and
+ * returns without waiting for the host, the driver sends the oldest data
+ * as one multi-packet transfer, gathered from both ends of the ring when it
+ * wraps, and moves on to the rest from the XFRC callback. A transfer spans many packets, so
+ * the core loads the FIFO from TXFE and the CPU only sees one completion
+ * per transfer. A transfer that empties the ring ends with a short or zero
+ * length packet, so a host read returns as soon as the data stops.
+ *
+ * OUT data is received straight into one of several fixed blocks, each a
+ * whole number of packets. While the application reads one block the next
+ * one is already armed, the endpoint only NAKs when every block is full.
+ */
+
+#include "usb_stream.h"
+#include "usb_internal.h"
+
+#define THIS_FILE__ "usb_stream.c"
+
+#define TX_RING_MASK    (USB_STREAM_TX_RING_SIZE - 1U)
+
+_Static_assert((USB_STREAM_TX_RING_SIZE & TX_RING_MASK) == 0U,
+               "USB_STREAM_TX_RING_SIZE has to be a power of two");
+
+/**
+ * @brief IN ring buffer.
+ *
+ * head, reserved and tail run freely. Writers claim space by advancing
+ * reserved and copy into it, head catches up with reserved when the last
+ * writer still copying is done, only data up to head is sent. tail is
+ * advanced once the transfer of in_flight bytes starting at it completed.
+ * seg describes that transfer to the driver until then.
+ */
+typedef struct usb_stream_tx_s
+{
+    uint8_t ring[USB_STREAM_TX_RING_SIZE] __attribute__((aligned(4)));
+    volatile uint32_t head;
+    volatile uint32_t reserved;
+    volatile uint32_t tail;
+    uint32_t writers;
+    uint32_t in_flight;
+    usb_fifo_seg_t seg[2];
+} usb_stream_tx_t;
+
+/**
+ * @brief OUT receive blocks.
+ *
+ * Blocks head to tail hold data, len[] bytes each, offset is how much of
+ * the block at tail has been read. armed is set while the block at head is
+ * programmed into the endpoint.
+ */
+typedef struct usb_stream_rx_s
+{
+    uint8_t block[USB_STREAM_RX_BLOCKS][USB_STREAM_RX_BLOCK_SIZE] __attribute__((aligned(4)));
+    uint32_t len[USB_STREAM_RX_BLOCKS];
+    volatile uint32_t head;
+    volatile uint32_t tail;
+    uint32_t offset;
+    bool armed;
+} usb_stream_rx_t;
+
+static void start_tx(void);
+static void start_rx(void);
+static void stream_in_callback(usb_driver_t *p_driver, uint32_t ep_num, uint32_t status);
+static void stream_rx_complete(usb_driver_t *p_driver, uint32_t ep_num, uint8_t *p_buf, uint32_t len);
+
+static usb_stream_tx_t stream_tx;
+static usb_stream_rx_t stream_rx;
+static usb_stream_stats_t stream_stats;
+
+
+/*##########################################################################*/
+/*#                            PUBLIC FUNCTIONS                            #*/
+/*##########################################################################*/
+
+/**
+ * @brief Start streaming on a new configuration.
+ *        Called after SET_CONFIGURATION opened the endpoints. Data still in
+ *        the IN ring is kept, a transfer cut short by the reset is not
+ *        repeated. Unread OUT data is dropped.
+ */
+void
+usb_stream_configure(usb_driver_t *p_driver)
+{
+    (void)p_driver;
+
+    usb_ep_set_callback(USB_STREAM_IN_EP, stream_in_callback);
+
+    uint32_t primask = usb_critical_enter();
+    stream_tx.tail += stream_tx.in_flight;
+    stream_tx.in_flight = 0;
+    stream_rx.head = 0;
+    stream_rx.tail = 0;
+    stream_rx.offset = 0;
+    stream_rx.armed = false;
+    start_tx();
+    start_rx();
+    usb_critical_exit(primask);
+}
+
+/**
+ * @brief Queue data for the IN endpoint, never blocks.
+ *        Safe from the main loop and from interrupts at the same time: the
+ *        space is claimed with interrupts masked, the copy runs with them
+ *        enabled. An interrupt writing while the main loop is copying has
+ *        its data sent once that copy is done, in the order claimed.
+ *
+ * @return Number of bytes taken, less than len when the ring is full.
+ */
+uint32_t
+usb_stream_write(const uint8_t *p_src, uint32_t len)
+{
+    uint32_t start = DWT->CYCCNT;
+
+    uint32_t primask = usb_critical_enter();
+    uint32_t head = stream_tx.reserved;
+    uint32_t free = USB_STREAM_TX_RING_SIZE - (head - stream_tx.tail);
+    uint32_t count = MIN(len, free);
+    stream_tx.reserved = head + count;
+    stream_tx.writers++;
+    stream_stats.tx_refused += len - count;
+    usb_critical_exit(primask);
+
+    uint32_t offset = head & TX_RING_MASK;
+    uint32_t first = MIN(count, USB_STREAM_TX_RING_SIZE - offset);
+
+    memcpy(&stream_tx.ring[offset], p_src, first);
+    memcpy(stream_tx.ring, &p_src[first], count - first);
+
+    primask = usb_critical_enter();
+    // Writers nest, the outermost one publishes what all of them claimed
+    if (--stream_tx.writers == 0U)
+    {
+        stream_tx.head = stream_tx.reserved;
+        stream_stats.tx_high_water = MAX(stream_stats.tx_high_water,
+                                         stream_tx.head - stream_tx.tail);
+        if (stream_tx.in_flight == 0U)
+        {
+            start_tx();
+        }
+    }
+    stream_stats.cycles += DWT->CYCCNT - start;
+    usb_critical_exit(primask);
+    return count;
+}
+
+/**
+ * @brief Room left in the IN ring.
+ */
+uint32_t
+usb_stream_write_free(void)
+{
+    return USB_STREAM_TX_RING_SIZE - (stream_tx.reserved - stream_tx.tail);
+}
+
+/**
+ * @brief Take received OUT data, never blocks.
+ *        Every block emptied is handed back to the endpoint right away.
+ *
+ * @return Number of bytes copied, 0 when nothing was received.
+ */
+uint32_t
+usb_stream_read(uint8_t *p_dst, uint32_t len)
+{
+    uint32_t start = DWT->CYCCNT;
+    uint32_t count = 0;
+    uint32_t tail = stream_rx.tail;
+
+    while ((count < len) && (tail != stream_rx.head))
+    {
+        uint32_t slot = tail % USB_STREAM_RX_BLOCKS;
+        uint32_t chunk = MIN(len - count, stream_rx.len[slot] - stream_rx.offset);
+
+        memcpy(&p_dst[count], &stream_rx.block[slot][stream_rx.offset], chunk);
+        count += chunk;
+        stream_rx.offset += chunk;
+        if (stream_rx.offset == stream_rx.len[slot])
+        {
+            stream_rx.offset = 0;
+            tail++;
+        }
+    }
+
+    uint32_t primask = usb_critical_enter();
+    bool freed = (tail != stream_rx.tail);
+    stream_rx.tail = tail;
+    if (freed && !stream_rx.armed)
+    {
+        start_rx();
+    }
+    stream_stats.cycles += DWT->CYCCNT - start;
+    usb_critical_exit(primask);
+    return count;
+}
+
+/**
+ * @brief Bytes received and not read yet.
+ */
+uint32_t
+usb_stream_read_available(void)
+{
+    uint32_t available = 0;
+
+    for (uint32_t block = stream_rx.tail; block != stream_rx.head; block++)
+    {
+        available += stream_rx.len[block % USB_STREAM_RX_BLOCKS];
+    }
+    return available - stream_rx.offset;
+}
+
+/**
+ * @brief Streaming counters.
+ */
+const usb_stream_stats_t *
+usb_stream_get_stats(void)
+{
+    return &stream_stats;
+}
+
+
+/*##########################################################################*/
+/*#                       STATIC (PRIVATE) FUNCTIONS                       #*/
+/*##########################################################################*/
+
+/**
+ * @brief Send the oldest contiguous part of the ring, up to
+ *        USB_STREAM_TX_MAX_TRANSFER bytes. Called with interrupts masked or
+ *        from the bottom half, with no transfer in flight.
+ */
+static void
+start_tx(void)
+{
+    usb_driver_t *p_driver = usb_get_instance();
+    uint32_t used = stream_tx.head - stream_tx.tail;
+
+    if ((used == 0U) ||
+        (p_driver->ep_in[USB_STREAM_IN_EP & 0x0FU].state != USB_EP_STATE_IDLE))
+    {
+        return;
+    }
+
+    uint32_t offset = stream_tx.tail & TX_RING_MASK;
+    uint32_t len = MIN(used, USB_STREAM_TX_MAX_TRANSFER);
+    uint32_t first = MIN(len, USB_STREAM_TX_RING_SIZE - offset);
+
+    // The part past the end of the ring continues at its start
+    stream_tx.seg[0].p_data = &stream_tx.ring[offset];
+    stream_tx.seg[0].len = first;
+    stream_tx.seg[1].p_data = stream_tx.ring;
+    stream_tx.seg[1].len = len - first;
+
+    if (usb_ep_transmit_segs(USB_STREAM_IN_EP & 0x0FU, stream_tx.seg, 2U, (len == used)))
+    {
+        stream_tx.in_flight = len;
+    }
+}
+
+/**
+ * @brief Arm the OUT endpoint with the next free block, if there is one.
+ *        Called with interrupts masked or from the bottom half.
+ */
+static void
+start_rx(void)
+{
+    if ((stream_rx.head - stream_rx.tail) == USB_STREAM_RX_BLOCKS)
+    {
+        stream_stats.rx_stalls++;
+        return;
+    }
+    stream_rx.armed = usb_ep_receive(USB_STREAM_OUT_EP,
+                                     stream_rx.block[stream_rx.head % USB_STREAM_RX_BLOCKS],
+                                     USB_STREAM_RX_BLOCK_SIZE, stream_rx_complete);
+}
+
+/**
+ * @brief IN endpoint callback, releases the data of the finished transfer
+ *        and starts the next one.
+ */
+static void
+stream_in_callback(usb_driver_t *p_driver, uint32_t ep_num, uint32_t status)
+{
+    (void)p_driver;
+    (void)ep_num;
+
+    if (!(status & USB_OTG_DIEPINT_XFRC))
+    {
+        return;
+    }
+
+    uint32_t primask = usb_critical_enter();
+    stream_tx.tail += stream_tx.in_flight;
+    stream_stats.tx_bytes += stream_tx.in_flight;
+    stream_stats.tx_transfers++;
+    stream_tx.in_flight = 0;
+    start_tx();
+    usb_critical_exit(primask);
+}
+
+/**
+ * @brief OUT transfer completion, hands the filled block to the reader and
+ *        arms the next one. A zero length transfer leaves the block free.
+ */
+static void
+stream_rx_complete(usb_driver_t *p_driver, uint32_t ep_num, uint8_t *p_buf, uint32_t received)
+{
+    (void)p_driver;
+    (void)ep_num;
+    (void)p_buf;
+
+    uint32_t primask = usb_critical_enter();
+    if (received != 0U)
+    {
+        stream_rx.len[stream_rx.head % USB_STREAM_RX_BLOCKS] = received;
+        stream_rx.head++;
+        stream_stats.rx_bytes += received;
+        stream_stats.rx_transfers++;
+    }
+    stream_rx.armed = false;
+    start_rx();
+    usb_critical_exit(primask);
+}
+
+/*** end of file ***/
\ No newline at end of file
@@ -0,0 +1,47 @@
+/** @file usb_trace.c
+ *
+ * @brief Binary event trace for the USB driver.
+ */
+
+#include "stm32f411xe.h"
+
+#include "usb_trace.h"
+
+#define THIS_FILE__ "usb_trace.c"
+
+_Static_assert((USB_TRACE_BUF_SIZE & (USB_TRACE_BUF_SIZE - 1U)) == 0U,
+               "USB_TRACE_BUF_SIZE has to be a power of two");
+
+usb_trace_buf_t usb_trace_buf = {
+    .magic = USB_TRACE_MAGIC,
+    .size = USB_TRACE_BUF_SIZE,
+    .head = 0U
+};
+
+/**
+ * @brief Record a trace event.
+ *
+ * Safe to call from any context. The slot is claimed with an atomic
+ * increment of head (LDREX/STREX), so a nested interrupt simply takes the
+ * next slot. seq is written last, the decoder drops any record whose seq does
+ * not match its position, which is how a record torn by the dump is detected.
+ *
+ * @param event Event ID, one of enum usb_trace_event_e.
+ * @param arg0  First event argument.
+ * @param arg1  Second event argument.
+ */
+void
+usb_trace_record(uint32_t event, uint32_t arg0, uint32_t arg1)
+{
+    uint32_t idx = __atomic_fetch_add(&usb_trace_buf.head, 1U, __ATOMIC_RELAXED);
+    usb_trace_entry_t *p_entry = &usb_trace_buf.entries[idx & (USB_TRACE_BUF_SIZE - 1U)];
+
+    p_entry->timestamp = DWT->CYCCNT;
+    p_entry->event = (uint16_t)event;
+    p_entry->arg0 = arg0;
+    p_entry->arg1 = arg1;
+    __atomic_signal_fence(__ATOMIC_RELEASE);
+    p_entry->seq = (uint16_t)idx;
+}
+
+/*** end of file ***/
\ No newline at end of file
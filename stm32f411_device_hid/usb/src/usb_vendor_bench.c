@@ -0,0 +1,236 @@
+/** @file usb_vendor_bench.c
+ *
+ * @brief Throughput and CPU load benchmark of the vendor bulk interface.
+ *
+ * Built in with make BENCH=1, which also puts the vendor interface on the
+ * bulk stream in place of the CDC console. The main loop keeps the IN ring
+ * full of a 32-bit little endian counter and drains OUT, checking that the
+ * host sent the same counter. Every window the byte counters of the vendor interface
+ * and the cycle counters of the driver are turned into bytes/s and CPU load,
+ * the host picks the result up with a vendor request (tools/vendor_bench.py).
+ */
+
+#include "usb_vendor_bench.h"
+#include "usb_stream.h"
+#include "usb_internal.h"
+#include "usb_desc.h"
+
+#ifdef USB_VENDOR_BENCH
+
+#define THIS_FILE__ "usb_vendor_bench.c"
+
+#define BENCH_WINDOW_CYCLES (USB_VENDOR_BENCH_WINDOW_MS * USB_FRAME_CYCLES)
+#define BENCH_CPU_HZ        (1000U * USB_FRAME_CYCLES)
+
+_Static_assert(USB_VENDOR_INTERFACE == USB_DESC_INTERFACE_VENDOR,
+               "USB_VENDOR_INTERFACE does not match usb_desc.json");
+
+/**
+ * @brief Benchmark state.
+ *
+ * tx_pos and rx_pos are the byte positions in the IN and OUT counter
+ * streams. The window_* fields are the counters at the start of the window.
+ */
+typedef struct usb_vendor_bench_s
+{
+    usb_driver_t *p_driver;
+    uint32_t mode;
+    uint32_t tx_pos;
+    uint32_t rx_pos;
+    uint32_t rx_errors;
+    uint32_t window_start;
+    uint32_t window_tx_bytes;
+    uint32_t window_rx_bytes;
+    uint32_t window_busy;
+    uint32_t window_tx_refused;
+    uint32_t window_rx_stalls;
+    usb_vendor_bench_result_t result;
+} usb_vendor_bench_t;
+
+static void produce(void);
+static void consume(void);
+static void end_window(uint32_t now);
+static uint32_t usb_busy_cycles(void);
+static bool bench_request(usb_driver_t *p_driver, const usb_setup_packet_t *p_setup);
+
+static usb_vendor_bench_t bench;
+
+
+/*##########################################################################*/
+/*#                            PUBLIC FUNCTIONS                            #*/
+/*##########################################################################*/
+
+/**
+ * @brief Register the benchmark requests, call after usb_init.
+ *        Nothing is streamed until the host selects a mode.
+ */
+void
+usb_vendor_bench_init(usb_driver_t *p_driver)
+{
+    bench.p_driver = p_driver;
+    bench.window_start = DWT->CYCCNT;
+    usb_setup_register_vendor(bench_request);
+}
+
+/**
+ * @brief Produce and consume one chunk per direction, close the window when
+ *        it is over. Call from the main loop.
+ */
+void
+usb_vendor_bench_task(void)
+{
+    if (bench.mode & USB_VENDOR_BENCH_MODE_IN)
+    {
+        produce();
+    }
+    if (bench.mode & USB_VENDOR_BENCH_MODE_OUT)
+    {
+        consume();
+    }
+
+    uint32_t now = DWT->CYCCNT;
+    if ((now - bench.window_start) >= BENCH_WINDOW_CYCLES)
+    {
+        end_window(now);
+    }
+}
+
+/**
+ * @brief Result of the last complete window.
+ */
+const usb_vendor_bench_result_t *
+usb_vendor_bench_get_result(void)
+{
+    return &bench.result;
+}
+
+
+/*##########################################################################*/
+/*#                       STATIC (PRIVATE) FUNCTIONS                       #*/
+/*##########################################################################*/
+
+/**
+ * @brief Write the next chunk of the counter stream if the ring has room.
+ */
+static void
+produce(void)
+{
+    uint32_t chunk[USB_VENDOR_BENCH_CHUNK / 4U];
+
+    if (usb_stream_write_free() < USB_VENDOR_BENCH_CHUNK)
+    {
+        return;
+    }
+    for (uint32_t i = 0; i < (USB_VENDOR_BENCH_CHUNK / 4U); i++)
+    {
+        chunk[i] = (bench.tx_pos / 4U) + i;
+    }
+    ALLEGE(usb_stream_write((const uint8_t *)chunk, USB_VENDOR_BENCH_CHUNK) == USB_VENDOR_BENCH_CHUNK);
+    bench.tx_pos += USB_VENDOR_BENCH_CHUNK;
+}
+
+/**
+ * @brief Read what the host sent and count the bytes that break the
+ *        counter stream.
+ */
+static void
+consume(void)
+{
+    uint8_t chunk[USB_VENDOR_BENCH_CHUNK];
+    uint32_t len = usb_stream_read(chunk, sizeof(chunk));
+
+    for (uint32_t i = 0; i < len; i++, bench.rx_pos++)
+    {
+        uint8_t expected = (uint8_t)((bench.rx_pos / 4U) >> (8U * (bench.rx_pos % 4U)));
+        if (chunk[i] != expected)
+        {
+            bench.rx_errors++;
+        }
+    }
+}
+
+/**
+ * @brief Turn the counters of the window that just ended into a result.
+ */
+static void
+end_window(uint32_t now)
+{
+    const usb_stream_stats_t *p_stats = usb_stream_get_stats();
+    usb_vendor_bench_result_t *p_result = &bench.result;
+    uint32_t cycles = now - bench.window_start;
+    uint32_t busy = usb_busy_cycles();
+
+    p_result->window_cycles = cycles;
+    p_result->tx_bytes_per_s = (uint32_t)(((uint64_t)(p_stats->tx_bytes - bench.window_tx_bytes) *
+                                           BENCH_CPU_HZ) / cycles);
+    p_result->rx_bytes_per_s = (uint32_t)(((uint64_t)(p_stats->rx_bytes - bench.window_rx_bytes) *
+                                           BENCH_CPU_HZ) / cycles);
+    p_result->usb_load = (uint32_t)(((uint64_t)(busy - bench.window_busy) * 1000U) / cycles);
+    p_result->tx_refused = p_stats->tx_refused - bench.window_tx_refused;
+    p_result->rx_stalls = p_stats->rx_stalls - bench.window_rx_stalls;
+    p_result->rx_errors = bench.rx_errors;
+    p_result->windows++;
+
+    bench.window_start = now;
+    bench.window_tx_bytes = p_stats->tx_bytes;
+    bench.window_rx_bytes = p_stats->rx_bytes;
+    bench.window_busy = busy;
+    bench.window_tx_refused = p_stats->tx_refused;
+    bench.window_rx_stalls = p_stats->rx_stalls;
+}
+
+/**
+ * @brief Cycles spent in the USB driver since reset: interrupt handlers,
+ *        deferred event processing and stream buffer copies.
+ */
+static uint32_t
+usb_busy_cycles(void)
+{
+    const usb_isr_stats_t *p_isr_stats = &bench.p_driver->isr_stats;
+    uint32_t busy = p_isr_stats->poll_cycles + usb_stream_get_stats()->cycles;
+
+    for (uint32_t i = 0; i < USB_GINTSTS_SOURCES; i++)
+    {
+        busy += p_isr_stats->cycles[i];
+    }
+    return busy;
+}
+
+/**
+ * @brief Vendor request handler of the benchmark.
+ *        SET_MODE restarts the OUT counter stream. The IN stream goes on
+ *        where it was, what is still in the ring is sent first, so the host
+ *        takes the first word it reads as the start of the counter.
+ *
+ * @return false if the request is not handled.
+ */
+static bool
+bench_request(usb_driver_t *p_driver, const usb_setup_packet_t *p_setup)
+{
+    (void)p_driver;
+
+    if (p_setup->index != USB_VENDOR_INTERFACE)
+    {
+        return false;
+    }
+
+    switch ((enum usb_vendor_bench_request_e)p_setup->request)
+    {
+        case USB_VENDOR_BENCH_REQUEST_SET_MODE:
+            bench.mode = p_setup->value & (USB_VENDOR_BENCH_MODE_IN | USB_VENDOR_BENCH_MODE_OUT);
+            bench.rx_pos = 0;
+            bench.rx_errors = 0;
+            usb_ep0_transmit(NULL, 0, 0);
+            return true;
+        case USB_VENDOR_BENCH_REQUEST_GET_RESULT:
+            usb_ep0_transmit((const uint8_t *)&bench.result,
+                             MIN(sizeof(bench.result), p_setup->length), p_setup->length);
+            return true;
+        default:
+            return false;
+    }
+}
+
+#endif /* USB_VENDOR_BENCH */
+
+/*** end of file ***/
\ No newline at end of file